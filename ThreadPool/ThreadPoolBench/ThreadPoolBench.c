@@ -0,0 +1,2562 @@
+/*
+ThreadPoolBench.C - Benchmarks for the Thread Pool Lib functions
+Usage: ThreadPoolBench [benchmark name], runs every benchmark when no name is supplied
+Compiled using "cl ThreadPoolBench.c /O2 /Zi"
+*/
+
+#include"ThreadPoolBench.h"
+#pragma comment(lib, "Ws2_32.lib")
+
+//Benchmarks which can be selected on the command line
+BENCH g_Benches[] = {
+	{ "parallelfor", BenchParallelFor, FALSE },
+	{ "forkjoin", BenchForkJoin, FALSE },
+	{ "alloc", BenchAlloc, FALSE },
+	{ "startup", BenchStartup, TRUE },
+	{ "socket", BenchSocket, FALSE },
+	{ "fileio", BenchFileIo, TRUE },
+	{ "wait", BenchWait, TRUE },
+	{ "reserve", BenchReserve, TRUE },
+	{ "blocking", BenchBlocking, TRUE },
+	{ "strand", BenchStrand, FALSE },
+	{ "completion", BenchCompletion, FALSE },
+	{ "profile", BenchProfile, FALSE },
+	{ "coalesce", BenchCoalesce, FALSE },
+	{ "tag", BenchTag, FALSE },
+	{ "workerlocal", BenchWorkerLocal, TRUE },
+	{ "watchdog", BenchWatchdog, TRUE },
+	{ "spill", BenchSpill, TRUE },
+	{ "ring", BenchRing, FALSE },
+	{ "record", BenchRecord, FALSE },
+	{ "pipeline", BenchPipeline, FALSE },
+	{ "yield", BenchYield, TRUE },
+};
+
+int main(int argc, char* argv[])
+{
+	//Loading ThreadPoolLib.dll explicitly and getting the relevant function pointers
+	HMODULE hThreadPoolLib = LoadLibraryExW(L"ThreadPoolLib.dll", NULL, 0);
+	if (hThreadPoolLib == NULL)
+	{
+		printf("Unable to load ThreadPoolLib.dll:%d", GetLastError());
+		return 1;
+	}
+	_CreateTP = (MYPROC)GetProcAddress(hThreadPoolLib, "CreateTP");
+	_CreateWorkItem = (MYPROC1)GetProcAddress(hThreadPoolLib, "CreateWorkItem");
+	_TryInsertWork = (MYPROC2)GetProcAddress(hThreadPoolLib, "TryInsertWork");
+	_IsWorkComplete = (MYPROC2)GetProcAddress(hThreadPoolLib, "IsWorkComplete");
+	_DeleteWorkItem = (MYPROC2)GetProcAddress(hThreadPoolLib, "DeleteWorkItem");
+	_GetTPStats = (MYPROC3)GetProcAddress(hThreadPoolLib, "GetTPStats");
+	_DeleteTPEx = (MYPROC12)GetProcAddress(hThreadPoolLib, "DeleteTPEx");
+	_ParallelFor = (MYPROC5)GetProcAddress(hThreadPoolLib, "ParallelFor");
+	_ParallelReduce = (MYPROC6)GetProcAddress(hThreadPoolLib, "ParallelReduce");
+	_CreateTaskGroup = (MYPROC7)GetProcAddress(hThreadPoolLib, "CreateTaskGroup");
+	_RunInTaskGroup = (MYPROC8)GetProcAddress(hThreadPoolLib, "RunInTaskGroup");
+	_WaitTaskGroup = (MYPROC9)GetProcAddress(hThreadPoolLib, "WaitTaskGroup");
+	_DeleteTaskGroup = (MYPROC9)GetProcAddress(hThreadPoolLib, "DeleteTaskGroup");
+	_InitWorkItem = (MYPROC10)GetProcAddress(hThreadPoolLib, "InitWorkItem");
+	_SetWorkItemInlineParam = (MYPROC11)GetProcAddress(hThreadPoolLib, "SetWorkItemInlineParam");
+	_TPPrewarm = (MYPROC13)GetProcAddress(hThreadPoolLib, "TPPrewarm");
+	_RegisterSocketWork = (MYPROC14)GetProcAddress(hThreadPoolLib, "RegisterSocketWork");
+	_ReArmSocketWork = (MYPROC15)GetProcAddress(hThreadPoolLib, "ReArmSocketWork");
+	_UnregisterSocketWork = (MYPROC15)GetProcAddress(hThreadPoolLib, "UnregisterSocketWork");
+	_TPBindIoHandle = (MYPROC16)GetProcAddress(hThreadPoolLib, "TPBindIoHandle");
+	_TPUnbindIoHandle = (MYPROC17)GetProcAddress(hThreadPoolLib, "TPUnbindIoHandle");
+	_TPReadAsync = (MYPROC18)GetProcAddress(hThreadPoolLib, "TPReadAsync");
+	_RegisterWaitForSignal = (MYPROC19)GetProcAddress(hThreadPoolLib, "RegisterWaitForSignal");
+	_UnregisterWaitForSignal = (MYPROC20)GetProcAddress(hThreadPoolLib, "UnregisterWaitForSignal");
+	_SetTPReservedThreads = (MYPROC21)GetProcAddress(hThreadPoolLib, "SetTPReservedThreads");
+	_SetTPPriorityCap = (MYPROC21)GetProcAddress(hThreadPoolLib, "SetTPPriorityCap");
+	_GetTPQueueWaitPercentile = (MYPROC22)GetProcAddress(hThreadPoolLib, "GetTPQueueWaitPercentile");
+	_TPEnterBlocking = (MYPROC23)GetProcAddress(hThreadPoolLib, "TPEnterBlocking");
+	_TPLeaveBlocking = (MYPROC23)GetProcAddress(hThreadPoolLib, "TPLeaveBlocking");
+	_CreateStrand = (MYPROC24)GetProcAddress(hThreadPoolLib, "CreateStrand");
+	_InsertWorkOnStrand = (MYPROC25)GetProcAddress(hThreadPoolLib, "InsertWorkOnStrand");
+	_DeleteStrand = (MYPROC26)GetProcAddress(hThreadPoolLib, "DeleteStrand");
+	_CreateCompletionQueue = (MYPROC27)GetProcAddress(hThreadPoolLib, "CreateCompletionQueue");
+	_SetWorkItemCompletionQueue = (MYPROC28)GetProcAddress(hThreadPoolLib, "SetWorkItemCompletionQueue");
+	_GetCompletedWorkItems = (MYPROC29)GetProcAddress(hThreadPoolLib, "GetCompletedWorkItems");
+	_DeleteCompletionQueue = (MYPROC30)GetProcAddress(hThreadPoolLib, "DeleteCompletionQueue");
+	_SetTPProfiling = (MYPROC31)GetProcAddress(hThreadPoolLib, "SetTPProfiling");
+	_GetTPProfile = (MYPROC32)GetProcAddress(hThreadPoolLib, "GetTPProfile");
+	_SetWorkItemCoalesceKey = (MYPROC33)GetProcAddress(hThreadPoolLib, "SetWorkItemCoalesceKey");
+	_SetWorkItemTag = (MYPROC34)GetProcAddress(hThreadPoolLib, "SetWorkItemTag");
+	_CancelWorkByTag = (MYPROC35)GetProcAddress(hThreadPoolLib, "CancelWorkByTag");
+	_ReleaseWorkTag = (MYPROC35)GetProcAddress(hThreadPoolLib, "ReleaseWorkTag");
+	_GetWorkTagStats = (MYPROC36)GetProcAddress(hThreadPoolLib, "GetWorkTagStats");
+	_SetTPThreadHooks = (MYPROC37)GetProcAddress(hThreadPoolLib, "SetTPThreadHooks");
+	_TPGetWorkerLocal = (MYPROC38)GetProcAddress(hThreadPoolLib, "TPGetWorkerLocal");
+	_EnumerateRunningWork = (MYPROC39)GetProcAddress(hThreadPoolLib, "EnumerateRunningWork");
+	_SetTPWatchdog = (MYPROC40)GetProcAddress(hThreadPoolLib, "SetTPWatchdog");
+	_SetTPSpill = (MYPROC41)GetProcAddress(hThreadPoolLib, "SetTPSpill");
+	_RegisterSpillCallback = (MYPROC42)GetProcAddress(hThreadPoolLib, "RegisterSpillCallback");
+	_InsertSpillableWork = (MYPROC43)GetProcAddress(hThreadPoolLib, "InsertSpillableWork");
+	_CreateTPRing = (MYPROC44)GetProcAddress(hThreadPoolLib, "CreateTPRing");
+	_RegisterRingCallback = (MYPROC45)GetProcAddress(hThreadPoolLib, "RegisterRingCallback");
+	_DeleteTPRing = (MYPROC46)GetProcAddress(hThreadPoolLib, "DeleteTPRing");
+	_OpenTPRing = (MYPROC47)GetProcAddress(hThreadPoolLib, "OpenTPRing");
+	_SubmitTPRing = (MYPROC48)GetProcAddress(hThreadPoolLib, "SubmitTPRing");
+	_WaitTPRing = (MYPROC49)GetProcAddress(hThreadPoolLib, "WaitTPRing");
+	_CloseTPRing = (MYPROC50)GetProcAddress(hThreadPoolLib, "CloseTPRing");
+	_SetTPRecording = (MYPROC51)GetProcAddress(hThreadPoolLib, "SetTPRecording");
+	_CreatePipeline = (MYPROC52)GetProcAddress(hThreadPoolLib, "CreatePipeline");
+	_AddPipelineStage = (MYPROC53)GetProcAddress(hThreadPoolLib, "AddPipelineStage");
+	_RunPipeline = (MYPROC54)GetProcAddress(hThreadPoolLib, "RunPipeline");
+	_DeletePipeline = (MYPROC54)GetProcAddress(hThreadPoolLib, "DeletePipeline");
+	_TPShouldYield = (MYPROC23)GetProcAddress(hThreadPoolLib, "TPShouldYield");
+	_TPYield = (MYPROC55)GetProcAddress(hThreadPoolLib, "TPYield");
+
+	if (!(_CreateTP && _CreateWorkItem && _TryInsertWork && _IsWorkComplete && _DeleteWorkItem && _GetTPStats && _DeleteTPEx && _ParallelFor && _ParallelReduce
+		&& _CreateTaskGroup && _RunInTaskGroup && _WaitTaskGroup && _DeleteTaskGroup && _InitWorkItem && _SetWorkItemInlineParam && _TPPrewarm
+		&& _RegisterSocketWork && _ReArmSocketWork && _UnregisterSocketWork && _TPBindIoHandle && _TPUnbindIoHandle && _TPReadAsync
+		&& _RegisterWaitForSignal && _UnregisterWaitForSignal && _SetTPReservedThreads && _SetTPPriorityCap && _GetTPQueueWaitPercentile
+		&& _TPEnterBlocking && _TPLeaveBlocking && _CreateStrand && _InsertWorkOnStrand && _DeleteStrand
+		&& _CreateCompletionQueue && _SetWorkItemCompletionQueue && _GetCompletedWorkItems && _DeleteCompletionQueue
+		&& _SetTPProfiling && _GetTPProfile && _SetWorkItemCoalesceKey && _SetWorkItemTag && _CancelWorkByTag && _GetWorkTagStats && _ReleaseWorkTag
+		&& _SetTPThreadHooks && _TPGetWorkerLocal && _EnumerateRunningWork && _SetTPWatchdog
+		&& _SetTPSpill && _RegisterSpillCallback && _InsertSpillableWork
+		&& _CreateTPRing && _RegisterRingCallback && _DeleteTPRing && _OpenTPRing && _SubmitTPRing && _WaitTPRing && _CloseTPRing
+		&& _SetTPRecording && _CreatePipeline && _AddPipelineStage && _RunPipeline && _DeletePipeline
+		&& _TPShouldYield && _TPYield))
+	{
+		printf("Unable to GetProcAddress:%d", GetLastError());
+		FreeLibrary(hThreadPoolLib);
+		return 1;
+	}
+
+	//Producer process started by the ring benchmark, it runs no Thread Pool of its own
+	if ((argc > 3) && !strcmp(argv[1], BENCH_RINGCLIENTARG))
+	{
+		int iClientResult = RunRingClient((DWORD)strtoul(argv[2], NULL, 10), (USHORT)atoi(argv[3])) ? 0 : 1;
+		FreeLibrary(hThreadPoolLib);
+		return iClientResult;
+	}
+
+	//Every benchmark gets a fresh Thread Pool, the teardown time is reported as well
+	int iResult = 0;
+	for (int i = 0; i < _countof(g_Benches); i++)
+	{
+		if ((argc > 1) && strcmp(argv[1], g_Benches[i].pszName))
+			continue;
+		printf("\n************%s*************\n", g_Benches[i].pszName);
+		if (g_Benches[i].bOwnPool)
+		{
+			if (!g_Benches[i].pBench(NULL))
+			{
+				printf("Benchmark %s failed\n", g_Benches[i].pszName);
+				iResult = 1;
+			}
+			continue;
+		}
+		PTP pTP = _CreateTP();
+		if (pTP == NULL)
+		{
+			printf("TP Creation failed\n");
+			iResult = 1;
+			break;
+		}
+		if (!g_Benches[i].pBench(pTP))
+		{
+			printf("Benchmark %s failed\n", g_Benches[i].pszName);
+			iResult = 1;
+		}
+		LARGE_INTEGER liStart;
+		QueryPerformanceCounter(&liStart);
+		if (!_DeleteTPEx(pTP, TPDELETE_DRAIN, INFINITE))
+		{
+			printf("Unable to delete TP\n");
+			iResult = 1;
+			break;
+		}
+		printf("DeleteTPEx(TPDELETE_DRAIN):%.2f ms\n", ElapsedMilliseconds(liStart));
+	}
+	FreeLibrary(hThreadPoolLib);
+	return iResult;
+}
+
+double ElapsedMilliseconds(LARGE_INTEGER liStart)
+{
+	LARGE_INTEGER liFrequency, liNow;
+	QueryPerformanceFrequency(&liFrequency);
+	QueryPerformanceCounter(&liNow);
+	return ((double)(liNow.QuadPart - liStart.QuadPart) * 1000.0) / (double)liFrequency.QuadPart;
+}
+
+/*
+ParallelFor/ParallelReduce against one work item per element
+Reports nanoseconds per iteration for a memory bound and a compute bound loop body
+*/
+BOOL BenchParallelFor(PTP pTP)
+{
+	double* pdArray = (double*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, BENCH_LOOPITERATIONS * sizeof(double));
+	if (pdArray == NULL)
+	{
+		printf("Unable to allocate benchmark array\n");
+		return FALSE;
+	}
+	LARGE_INTEGER liStart;
+	double dMs;
+
+	//Memory bound loop
+	QueryPerformanceCounter(&liStart);
+	if (!_ParallelFor(pTP, 0, BENCH_LOOPITERATIONS, 0, MemoryBoundBody, pdArray))
+		return FALSE;
+	dMs = ElapsedMilliseconds(liStart);
+	printf("ParallelFor memory bound, auto grain:%.2f ns/iteration\n", (dMs * 1000000.0) / BENCH_LOOPITERATIONS);
+	QueryPerformanceCounter(&liStart);
+	if (!_ParallelFor(pTP, 0, BENCH_LOOPITERATIONS, 4096, MemoryBoundBody, pdArray))
+		return FALSE;
+	dMs = ElapsedMilliseconds(liStart);
+	printf("ParallelFor memory bound, grain 4096:%.2f ns/iteration\n", (dMs * 1000000.0) / BENCH_LOOPITERATIONS);
+	dMs = RunPerItemBaseline(pTP, MemoryBoundWork, pdArray, BENCH_PERITEMITERATIONS);
+	printf("Per work item memory bound:%.2f ns/iteration\n", (dMs * 1000000.0) / BENCH_PERITEMITERATIONS);
+
+	//Compute bound loop
+	QueryPerformanceCounter(&liStart);
+	if (!_ParallelFor(pTP, 0, BENCH_LOOPITERATIONS, 0, ComputeBoundBody, pdArray))
+		return FALSE;
+	dMs = ElapsedMilliseconds(liStart);
+	printf("ParallelFor compute bound, auto grain:%.2f ns/iteration\n", (dMs * 1000000.0) / BENCH_LOOPITERATIONS);
+	dMs = RunPerItemBaseline(pTP, ComputeBoundWork, pdArray, BENCH_PERITEMITERATIONS);
+	printf("Per work item compute bound:%.2f ns/iteration\n", (dMs * 1000000.0) / BENCH_PERITEMITERATIONS);
+
+	//Reduction over the array
+	double dIdentity = 0.0, dSum = 0.0;
+	QueryPerformanceCounter(&liStart);
+	if (!_ParallelReduce(pTP, 0, BENCH_LOOPITERATIONS, 0, SumBody, SumCombine, pdArray, &dIdentity, &dSum, sizeof(double)))
+		return FALSE;
+	dMs = ElapsedMilliseconds(liStart);
+	printf("ParallelReduce sum, auto grain:%.2f ns/iteration (sum %f)\n", (dMs * 1000000.0) / BENCH_LOOPITERATIONS, dSum);
+
+	HeapFree(GetProcessHeap(), 0, pdArray);
+	return TRUE;
+}
+
+VOID MemoryBoundBody(PVOID pvCtx, LONG64 iBegin, LONG64 iEnd)
+{
+	double* pdArray = (double*)pvCtx;
+	for (LONG64 i = iBegin; i < iEnd; i++)
+	{
+		pdArray[i] = (pdArray[i] * 0.5) + 1.0;
+	}
+}
+
+VOID ComputeBoundBody(PVOID pvCtx, LONG64 iBegin, LONG64 iEnd)
+{
+	double* pdArray = (double*)pvCtx;
+	for (LONG64 i = iBegin; i < iEnd; i++)
+	{
+		ComputeBoundWork(&pdArray[i]);
+	}
+}
+
+VOID SumBody(PVOID pvCtx, LONG64 iBegin, LONG64 iEnd, PVOID pvAccum)
+{
+	double* pdArray = (double*)pvCtx;
+	double dSum = 0.0;
+	for (LONG64 i = iBegin; i < iEnd; i++)
+	{
+		dSum += pdArray[i];
+	}
+	*(double*)pvAccum += dSum;
+}
+
+VOID SumCombine(PVOID pvCtx, PVOID pvAccum, PVOID pvOther)
+{
+	*(double*)pvAccum += *(double*)pvOther;
+}
+
+PVOID MemoryBoundWork(PVOID pvParam)
+{
+	double* pdElement = (double*)pvParam;
+	*pdElement = (*pdElement * 0.5) + 1.0;
+	return 0;
+}
+
+PVOID ComputeBoundWork(PVOID pvParam)
+{
+	double* pdElement = (double*)pvParam;
+	double dValue = *pdElement;
+	for (int k = 0; k < BENCH_COMPUTEWORK; k++)
+	{
+		dValue = (dValue * 0.999) + 0.5;
+	}
+	*pdElement = dValue;
+	return 0;
+}
+
+/*
+Hand rolled baseline: one work item per element, polled for completion and deleted
+Returns elapsed milliseconds
+*/
+double RunPerItemBaseline(PTP pTP, CALLBACK_INSTANCE pCallback, double* pdArray, int iItems)
+{
+	PWORKITEM* pWork = (PWORKITEM*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, iItems * sizeof(PWORKITEM));
+	if (pWork == NULL)
+	{
+		printf("Unable to allocate work item array\n");
+		return 0.0;
+	}
+	LARGE_INTEGER liStart;
+	QueryPerformanceCounter(&liStart);
+	for (int i = 0; i < iItems; i++)
+	{
+		pWork[i] = _CreateWorkItem(pTP, pCallback, &pdArray[i], WORKITEM_NORMAL);
+		while (!_TryInsertWork(pTP, pWork[i]))
+		{
+			SwitchToThread();
+		}
+	}
+	for (int i = 0; i < iItems; i++)
+	{
+		while (!_IsWorkComplete(pTP, pWork[i]))
+		{
+			SwitchToThread();
+		}
+		_DeleteWorkItem(pTP, pWork[i]);
+	}
+	double dMs = ElapsedMilliseconds(liStart);
+	HeapFree(GetProcessHeap(), 0, pWork);
+	return dMs;
+}
+
+/*
+Recursive fib and quicksort with deeply nested task groups
+Reports elapsed time against the serial version and the number of pool threads before and after
+*/
+BOOL BenchForkJoin(PTP pTP)
+{
+	LARGE_INTEGER liStart;
+	PrintThreadCount(pTP, "before fork/join");
+
+	QueryPerformanceCounter(&liStart);
+	LONG64 iSerial = SerialFib(BENCH_FIBN);
+	printf("Serial fib(%d):%.2f ms\n", BENCH_FIBN, ElapsedMilliseconds(liStart));
+	FIBTASK Fib = { pTP, BENCH_FIBN, 0 };
+	QueryPerformanceCounter(&liStart);
+	FibTask(&Fib);
+	printf("Task Group fib(%d):%.2f ms\n", BENCH_FIBN, ElapsedMilliseconds(liStart));
+	if (Fib.iResult != iSerial)
+	{
+		printf("fib mismatch %lld != %lld\n", Fib.iResult, iSerial);
+		return FALSE;
+	}
+
+	int* piArray = (int*)HeapAlloc(GetProcessHeap(), 0, BENCH_SORTELEMENTS * sizeof(int));
+	int* piCopy = (int*)HeapAlloc(GetProcessHeap(), 0, BENCH_SORTELEMENTS * sizeof(int));
+	if (!(piArray && piCopy))
+	{
+		printf("Unable to allocate sort arrays\n");
+		return FALSE;
+	}
+	unsigned int iSeed = 12345;
+	for (int i = 0; i < BENCH_SORTELEMENTS; i++)
+	{
+		iSeed = (iSeed * 1103515245) + 12345;
+		piArray[i] = piCopy[i] = (int)(iSeed >> 1);
+	}
+	QueryPerformanceCounter(&liStart);
+	qsort(piCopy, BENCH_SORTELEMENTS, sizeof(int), CompareInt);
+	printf("Serial quicksort:%.2f ms\n", ElapsedMilliseconds(liStart));
+	SORTTASK Sort = { pTP, piArray, BENCH_SORTELEMENTS };
+	QueryPerformanceCounter(&liStart);
+	SortTask(&Sort);
+	printf("Task Group quicksort:%.2f ms\n", ElapsedMilliseconds(liStart));
+	BOOL bSorted = (memcmp(piArray, piCopy, BENCH_SORTELEMENTS * sizeof(int)) == 0);
+	HeapFree(GetProcessHeap(), 0, piArray);
+	HeapFree(GetProcessHeap(), 0, piCopy);
+	if (!bSorted)
+	{
+		printf("quicksort result mismatch\n");
+		return FALSE;
+	}
+	PrintThreadCount(pTP, "after fork/join");
+	return TRUE;
+}
+
+LONG64 SerialFib(int n)
+{
+	return (n < 2) ? n : SerialFib(n - 1) + SerialFib(n - 2);
+}
+
+PVOID FibTask(PVOID pvParam)
+{
+	PFIBTASK pTask = (PFIBTASK)pvParam;
+	if (pTask->n < BENCH_FIBCUTOFF)
+	{
+		pTask->iResult = SerialFib(pTask->n);
+		return 0;
+	}
+	FIBTASK Left = { pTask->pTP, pTask->n - 1, 0 };
+	FIBTASK Right = { pTask->pTP, pTask->n - 2, 0 };
+	PTASKGROUP pTaskGroup = _CreateTaskGroup(pTask->pTP);
+	_RunInTaskGroup(pTaskGroup, FibTask, &Left, WORKITEM_NORMAL); //Fork
+	FibTask(&Right);
+	_WaitTaskGroup(pTaskGroup); //Join, helps with queued tasks meanwhile
+	_DeleteTaskGroup(pTaskGroup);
+	pTask->iResult = Left.iResult + Right.iResult;
+	return 0;
+}
+
+PVOID SortTask(PVOID pvParam)
+{
+	PSORTTASK pTask = (PSORTTASK)pvParam;
+	int* piArray = pTask->piArray;
+	if (pTask->iCount < BENCH_SORTCUTOFF)
+	{
+		qsort(piArray, (size_t)pTask->iCount, sizeof(int), CompareInt);
+		return 0;
+	}
+	//Hoare partition around the middle element
+	int iPivot = piArray[pTask->iCount / 2];
+	LONG64 i = -1, j = pTask->iCount;
+	while (TRUE)
+	{
+		do { i++; } while (piArray[i] < iPivot);
+		do { j--; } while (piArray[j] > iPivot);
+		if (i >= j)
+			break;
+		int iTemp = piArray[i];
+		piArray[i] = piArray[j];
+		piArray[j] = iTemp;
+	}
+	SORTTASK Left = { pTask->pTP, piArray, j + 1 };
+	SORTTASK Right = { pTask->pTP, piArray + j + 1, pTask->iCount - (j + 1) };
+	PTASKGROUP pTaskGroup = _CreateTaskGroup(pTask->pTP);
+	_RunInTaskGroup(pTaskGroup, SortTask, &Left, WORKITEM_NORMAL);
+	SortTask(&Right);
+	_WaitTaskGroup(pTaskGroup);
+	_DeleteTaskGroup(pTaskGroup);
+	return 0;
+}
+
+int CompareInt(const void* pvLeft, const void* pvRight)
+{
+	int iLeft = *(const int*)pvLeft, iRight = *(const int*)pvRight;
+	return (iLeft > iRight) - (iLeft < iRight);
+}
+
+VOID PrintThreadCount(PTP pTP, const char* pszWhen)
+{
+	TPSTATS Stats = { 0 };
+	if (_GetTPStats(pTP, &Stats))
+	{
+		printf("Pool threads %s:%d running, %d waiting\n", pszWhen, Stats.iCurrentRunningThreads, Stats.iCurrentWaitingThreads);
+	}
+}
+
+/*
+Heap allocated Work Items with a separately allocated parameter against Work Items embedded in the client request with an inline parameter
+Reports time and Thread Pool Work Item allocations per task
+*/
+BOOL BenchAlloc(PTP pTP)
+{
+	HANDLE hHeap = GetProcessHeap();
+	LARGE_INTEGER liStart;
+	PWORKITEM* pWork = (PWORKITEM*)HeapAlloc(hHeap, HEAP_ZERO_MEMORY, BENCH_ALLOCTASKS * sizeof(PWORKITEM));
+	LONG64** ppiValues = (LONG64**)HeapAlloc(hHeap, HEAP_ZERO_MEMORY, BENCH_ALLOCTASKS * sizeof(LONG64*));
+	PBENCHREQUEST pRequests = (PBENCHREQUEST)HeapAlloc(hHeap, HEAP_ZERO_MEMORY, BENCH_ALLOCTASKS * sizeof(BENCHREQUEST));
+	if (!(pWork && ppiValues && pRequests))
+	{
+		printf("Unable to allocate benchmark arrays\n");
+		return FALSE;
+	}
+
+	//CreateWorkItem plus a heap allocated parameter, two allocations per task
+	int iAllocatedBefore = GetAllocatedWorkItems(pTP);
+	g_iBenchTotal = 0;
+	QueryPerformanceCounter(&liStart);
+	for (int i = 0; i < BENCH_ALLOCTASKS; i++)
+	{
+		ppiValues[i] = (LONG64*)HeapAlloc(hHeap, 0, sizeof(LONG64));
+		*ppiValues[i] = 1;
+		pWork[i] = _CreateWorkItem(pTP, AddValueWork, ppiValues[i], WORKITEM_NORMAL);
+		while (!_TryInsertWork(pTP, pWork[i]))
+		{
+			SwitchToThread();
+		}
+	}
+	for (int i = 0; i < BENCH_ALLOCTASKS; i++)
+	{
+		while (!_IsWorkComplete(pTP, pWork[i]))
+		{
+			SwitchToThread();
+		}
+	}
+	double dMs = ElapsedMilliseconds(liStart);
+	int iAllocated = GetAllocatedWorkItems(pTP) - iAllocatedBefore;
+	printf("Heap Work Items:%.2f us/task, %.2f pool allocations/task (+1 parameter allocation/task), total %lld\n", (dMs * 1000.0) / BENCH_ALLOCTASKS, (double)iAllocated / BENCH_ALLOCTASKS, g_iBenchTotal);
+	for (int i = 0; i < BENCH_ALLOCTASKS; i++)
+	{
+		_DeleteWorkItem(pTP, pWork[i]);
+		HeapFree(hHeap, 0, ppiValues[i]);
+	}
+
+	//Work Items embedded in the request with an inline parameter, no allocation per task
+	iAllocatedBefore = GetAllocatedWorkItems(pTP);
+	g_iBenchTotal = 0;
+	QueryPerformanceCounter(&liStart);
+	for (int i = 0; i < BENCH_ALLOCTASKS; i++)
+	{
+		InitEmbedded(pTP, &(pRequests[i]), AddValueWork, 1);
+		SubmitEmbedded(pTP, &(pRequests[i]));
+	}
+	WaitEmbedded(pTP, pRequests, BENCH_ALLOCTASKS);
+	dMs = ElapsedMilliseconds(liStart);
+	iAllocated = GetAllocatedWorkItems(pTP) - iAllocatedBefore;
+	printf("Embedded Work Items:%.2f us/task, %.2f pool allocations/task, total %lld\n", (dMs * 1000.0) / BENCH_ALLOCTASKS, (double)iAllocated / BENCH_ALLOCTASKS, g_iBenchTotal);
+
+	HeapFree(hHeap, 0, pRequests);
+	HeapFree(hHeap, 0, ppiValues);
+	HeapFree(hHeap, 0, pWork);
+	return (iAllocated == 0);
+}
+
+PVOID AddValueWork(PVOID pvParam)
+{
+	InterlockedAdd64(&g_iBenchTotal, *(LONG64*)pvParam);
+	return 0;
+}
+
+//Sets the payload of a request and inits its embedded Work Item with the payload as inline parameter, returns the Work Item
+PWORKITEM InitEmbedded(PTP pTP, PBENCHREQUEST pRequest, CALLBACK_INSTANCE pCallback, LONG64 iValue)
+{
+	PWORKITEM pEmbedded = (PWORKITEM)&(pRequest->Work);
+	pRequest->iValue = iValue;
+	_InitWorkItem(pEmbedded, pTP, pCallback, NULL, WORKITEM_NORMAL);
+	_SetWorkItemInlineParam(pEmbedded, &(pRequest->iValue), sizeof(LONG64));
+	return pEmbedded;
+}
+
+//Inserts the embedded Work Item of a request, retrying while its Pri queue is full
+VOID SubmitEmbedded(PTP pTP, PBENCHREQUEST pRequest)
+{
+	while (!_TryInsertWork(pTP, (PWORKITEM)&(pRequest->Work)))
+	{
+		SwitchToThread();
+	}
+}
+
+//Waits until the embedded Work Items of iCount requests are complete
+VOID WaitEmbedded(PTP pTP, PBENCHREQUEST pRequests, int iCount)
+{
+	for (int i = 0; i < iCount; i++)
+	{
+		while (!_IsWorkComplete(pTP, (PWORKITEM)&(pRequests[i].Work)))
+		{
+			SwitchToThread();
+		}
+	}
+}
+
+//Allocates iCount requests and runs a benchmark on them without, then with the feature it measures
+BOOL RunRequestModes(PTP pTP, int iCount, BENCHMODE pRunMode)
+{
+	PBENCHREQUEST pRequests = (PBENCHREQUEST)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, iCount * sizeof(BENCHREQUEST));
+	if (pRequests == NULL)
+	{
+		printf("Unable to allocate benchmark arrays\n");
+		return FALSE;
+	}
+	BOOL bResult = pRunMode(pTP, pRequests, FALSE) && pRunMode(pTP, pRequests, TRUE);
+	HeapFree(GetProcessHeap(), 0, pRequests);
+	return bResult;
+}
+
+int GetAllocatedWorkItems(PTP pTP)
+{
+	TPSTATS Stats = { 0 };
+	_GetTPStats(pTP, &Stats);
+	return Stats.iNumWorkItemsAllocated;
+}
+
+/*
+Time from CreateTP to the completion of the first task, with Worker Threads created on demand and with TPPrewarm
+Reports min/avg/max over BENCH_STARTUPRUNS fresh Thread Pools and the teardown time
+*/
+BOOL BenchStartup(PTP pTP)
+{
+	UNREFERENCED_PARAMETER(pTP);
+	return (RunStartupCycles(FALSE) && RunStartupCycles(TRUE));
+}
+
+BOOL RunStartupCycles(BOOL bPrewarm)
+{
+	double dMin = 0, dMax = 0, dTotal = 0, dTeardown = 0;
+	for (int i = 0; i < BENCH_STARTUPRUNS; i++)
+	{
+		WORKITEM_STORAGE Work;
+		LARGE_INTEGER liStart;
+		QueryPerformanceCounter(&liStart);
+		PTP pTP = _CreateTP();
+		if (pTP == NULL)
+		{
+			printf("TP Creation failed\n");
+			return FALSE;
+		}
+		if (bPrewarm)
+		{
+			_TPPrewarm(pTP, MAXLONG);
+		}
+		_InitWorkItem((PWORKITEM)&Work, pTP, NopWork, NULL, WORKITEM_NORMAL);
+		while (!_TryInsertWork(pTP, (PWORKITEM)&Work))
+		{
+			SwitchToThread();
+		}
+		while (!_IsWorkComplete(pTP, (PWORKITEM)&Work))
+		{
+			SwitchToThread();
+		}
+		double dMs = ElapsedMilliseconds(liStart);
+		if (i == 0)
+		{
+			PrintThreadCount(pTP, bPrewarm ? "after first task (prewarmed)" : "after first task (on demand)");
+		}
+		dMin = ((i == 0) || (dMs < dMin)) ? dMs : dMin;
+		dMax = (dMs > dMax) ? dMs : dMax;
+		dTotal += dMs;
+		QueryPerformanceCounter(&liStart);
+		if (!_DeleteTPEx(pTP, TPDELETE_DRAIN, INFINITE))
+		{
+			printf("Unable to delete TP\n");
+			return FALSE;
+		}
+		dTeardown += ElapsedMilliseconds(liStart);
+	}
+	printf("%s:CreateTP to first completion min %.3f ms, avg %.3f ms, max %.3f ms, teardown avg %.3f ms\n", bPrewarm ? "Prewarmed" : "On demand",
+		dMin, dTotal / BENCH_STARTUPRUNS, dMax, dTeardown / BENCH_STARTUPRUNS);
+	return TRUE;
+}
+
+PVOID NopWork(PVOID pvParam)
+{
+	UNREFERENCED_PARAMETER(pvParam);
+	return 0;
+}
+
+/*
+Loopback socket echo, readiness dispatched by the Thread Pool (RegisterSocketWork) against an external event loop thread inserting a Work Item per readable socket
+Reports microseconds per round, every connection echoes one message per round
+*/
+BOOL BenchSocket(PTP pTP)
+{
+	WSADATA WsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &WsaData) != 0)
+	{
+		printf("WSAStartup failed\n");
+		return FALSE;
+	}
+	HANDLE hHeap = GetProcessHeap();
+	PECHOCONN pConns = (PECHOCONN)HeapAlloc(hHeap, HEAP_ZERO_MEMORY, BENCH_ECHOCONNECTIONS * sizeof(ECHOCONN));
+	if (pConns == NULL)
+	{
+		printf("Unable to allocate benchmark arrays\n");
+		WSACleanup();
+		return FALSE;
+	}
+	BOOL bResult = FALSE;
+
+	//Readiness callbacks run on the Worker Thread which observed the socket
+	if (!OpenEchoConnections(pConns, BENCH_ECHOCONNECTIONS))
+		goto BENCHSOCKETCLEANUP;
+	for (int i = 0; i < BENCH_ECHOCONNECTIONS; i++)
+	{
+		pConns[i].pSocketWork = _RegisterSocketWork(pTP, (UINT_PTR)pConns[i].sServer, FD_READ | FD_CLOSE, PoolEchoCallback, NULL);
+		if (pConns[i].pSocketWork == NULL)
+		{
+			printf("Unable to register socket:%d\n", GetLastError());
+			CloseEchoConnections(pConns, BENCH_ECHOCONNECTIONS);
+			goto BENCHSOCKETCLEANUP;
+		}
+	}
+	double dPoolMs = RunEchoRounds(pConns, BENCH_ECHOCONNECTIONS);
+	for (int i = 0; i < BENCH_ECHOCONNECTIONS; i++)
+	{
+		_UnregisterSocketWork(pConns[i].pSocketWork);
+	}
+	CloseEchoConnections(pConns, BENCH_ECHOCONNECTIONS);
+	if (dPoolMs < 0)
+		goto BENCHSOCKETCLEANUP;
+	printf("RegisterSocketWork:%.2f us/round (%d connections)\n", (dPoolMs * 1000.0) / BENCH_ECHOROUNDS, BENCH_ECHOCONNECTIONS);
+
+	//External event loop thread inserting a Work Item per readable socket
+	ZeroMemory(pConns, BENCH_ECHOCONNECTIONS * sizeof(ECHOCONN));
+	if (!OpenEchoConnections(pConns, BENCH_ECHOCONNECTIONS))
+		goto BENCHSOCKETCLEANUP;
+	ECHOLOOP Loop = { pTP, pConns, CreateEvent(NULL, FALSE, FALSE, NULL), FALSE };
+	g_pEchoLoop = &Loop;
+	HANDLE hLoopThread = NULL;
+	for (int i = 0; (i < BENCH_ECHOCONNECTIONS) && Loop.hWakeEvent; i++)
+	{
+		pConns[i].hEvent = WSACreateEvent();
+		WSAEventSelect(pConns[i].sServer, pConns[i].hEvent, FD_READ | FD_CLOSE);
+	}
+	if (Loop.hWakeEvent)
+		hLoopThread = CreateThread(NULL, 0, EchoLoopThreadProc, &Loop, 0, 0);
+	if (hLoopThread == NULL)
+	{
+		printf("Unable to start the event loop thread:%d\n", GetLastError());
+		CloseEchoConnections(pConns, BENCH_ECHOCONNECTIONS);
+		goto BENCHSOCKETCLEANUP;
+	}
+	double dLoopMs = RunEchoRounds(pConns, BENCH_ECHOCONNECTIONS);
+	InterlockedExchange(&(Loop.bStop), TRUE);
+	SetEvent(Loop.hWakeEvent);
+	WaitForSingleObject(hLoopThread, INFINITE);
+	CloseHandle(hLoopThread);
+	for (int i = 0; i < BENCH_ECHOCONNECTIONS; i++) //Echo Work Items still queued or running use the connections
+	{
+		while (pConns[i].bInserted && !_IsWorkComplete(pTP, (PWORKITEM)&(pConns[i].Work)))
+		{
+			SwitchToThread();
+		}
+	}
+	CloseHandle(Loop.hWakeEvent);
+	CloseEchoConnections(pConns, BENCH_ECHOCONNECTIONS);
+	if (dLoopMs < 0)
+		goto BENCHSOCKETCLEANUP;
+	printf("External event loop + InsertWork:%.2f us/round (%d connections)\n", (dLoopMs * 1000.0) / BENCH_ECHOROUNDS, BENCH_ECHOCONNECTIONS);
+	bResult = TRUE;
+
+BENCHSOCKETCLEANUP:
+	HeapFree(hHeap, 0, pConns);
+	WSACleanup();
+	return bResult;
+}
+
+BOOL OpenEchoConnections(PECHOCONN pConns, int iCount)
+{
+	SOCKET sListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sListen == INVALID_SOCKET)
+	{
+		printf("Unable to create socket:%d\n", WSAGetLastError());
+		return FALSE;
+	}
+	struct sockaddr_in Addr = { 0 };
+	int cbAddr = sizeof(Addr);
+	Addr.sin_family = AF_INET;
+	Addr.sin_addr.S_un.S_addr = htonl(INADDR_LOOPBACK);
+	Addr.sin_port = 0;
+	if ((bind(sListen, (SOCKADDR*)&Addr, sizeof(Addr)) == SOCKET_ERROR) || (listen(sListen, SOMAXCONN) == SOCKET_ERROR)
+		|| (getsockname(sListen, (SOCKADDR*)&Addr, &cbAddr) == SOCKET_ERROR))
+	{
+		printf("Unable to listen on loopback:%d\n", WSAGetLastError());
+		closesocket(sListen);
+		return FALSE;
+	}
+	for (int i = 0; i < iCount; i++)
+	{
+		BOOL bNoDelay = TRUE;
+		pConns[i].sClient = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if ((pConns[i].sClient == INVALID_SOCKET) || (connect(pConns[i].sClient, (SOCKADDR*)&Addr, sizeof(Addr)) == SOCKET_ERROR)
+			|| ((pConns[i].sServer = accept(sListen, NULL, NULL)) == INVALID_SOCKET))
+		{
+			printf("Unable to connect on loopback:%d\n", WSAGetLastError());
+			closesocket(sListen);
+			CloseEchoConnections(pConns, i + 1);
+			return FALSE;
+		}
+		setsockopt(pConns[i].sClient, IPPROTO_TCP, TCP_NODELAY, (const char*)&bNoDelay, sizeof(bNoDelay));
+		setsockopt(pConns[i].sServer, IPPROTO_TCP, TCP_NODELAY, (const char*)&bNoDelay, sizeof(bNoDelay));
+	}
+	closesocket(sListen);
+	return TRUE;
+}
+
+VOID CloseEchoConnections(PECHOCONN pConns, int iCount)
+{
+	for (int i = 0; i < iCount; i++)
+	{
+		if (pConns[i].sClient && (pConns[i].sClient != INVALID_SOCKET))
+			closesocket(pConns[i].sClient);
+		if (pConns[i].sServer && (pConns[i].sServer != INVALID_SOCKET))
+			closesocket(pConns[i].sServer);
+		if (pConns[i].hEvent)
+			WSACloseEvent(pConns[i].hEvent);
+	}
+}
+
+//Sends a message on every connection and waits for all of them to be echoed back, BENCH_ECHOROUNDS times, returns the elapsed milliseconds or -1 on error
+double RunEchoRounds(PECHOCONN pConns, int iCount)
+{
+	char Message[BENCH_ECHOMSGSIZE] = { 0 };
+	LARGE_INTEGER liStart;
+	QueryPerformanceCounter(&liStart);
+	for (int iRound = 0; iRound < BENCH_ECHOROUNDS; iRound++)
+	{
+		for (int i = 0; i < iCount; i++)
+		{
+			if (send(pConns[i].sClient, Message, BENCH_ECHOMSGSIZE, 0) != BENCH_ECHOMSGSIZE)
+			{
+				printf("Unable to send:%d\n", WSAGetLastError());
+				return -1;
+			}
+		}
+		for (int i = 0; i < iCount; i++)
+		{
+			int cbReceived = 0;
+			while (cbReceived < BENCH_ECHOMSGSIZE)
+			{
+				int cb = recv(pConns[i].sClient, Message + cbReceived, BENCH_ECHOMSGSIZE - cbReceived, 0);
+				if (cb <= 0)
+				{
+					printf("Unable to receive:%d\n", WSAGetLastError());
+					return -1;
+				}
+				cbReceived += cb;
+			}
+		}
+	}
+	return ElapsedMilliseconds(liStart);
+}
+
+//Echoes everything readable on a non-blocking socket
+VOID EchoSocket(SOCKET s)
+{
+	char Buffer[BENCH_ECHOMSGSIZE * 4];
+	int cbReceived;
+	while ((cbReceived = recv(s, Buffer, sizeof(Buffer), 0)) > 0)
+	{
+		int cbSent = 0;
+		while (cbSent < cbReceived)
+		{
+			int cb = send(s, Buffer + cbSent, cbReceived - cbSent, 0);
+			if (cb > 0)
+				cbSent += cb;
+			else if (WSAGetLastError() == WSAEWOULDBLOCK)
+				SwitchToThread();
+			else
+				return;
+		}
+	}
+}
+
+VOID PoolEchoCallback(PSOCKETWORK pSocketWork, UINT_PTR s, LONG lNetworkEvents, int iError, PVOID pvCtx)
+{
+	UNREFERENCED_PARAMETER(pvCtx);
+	if ((lNetworkEvents & FD_CLOSE) || iError)
+		return;
+	EchoSocket((SOCKET)s);
+	_ReArmSocketWork(pSocketWork);
+}
+
+PVOID LoopEchoWork(PVOID pvParam)
+{
+	PECHOCONN pConn = (PECHOCONN)pvParam;
+	EchoSocket(pConn->sServer);
+	InterlockedExchange(&(pConn->bRearm), TRUE);
+	SetEvent(g_pEchoLoop->hWakeEvent);
+	return 0;
+}
+
+//External event loop, waits on the connections and inserts a Work Item per readable connection
+DWORD WINAPI EchoLoopThreadProc(LPVOID pvParam)
+{
+	PECHOLOOP pLoop = (PECHOLOOP)pvParam;
+	WSAEVENT hEvents[BENCH_ECHOCONNECTIONS + 1];
+	int iConn[BENCH_ECHOCONNECTIONS];
+	BOOL bArmed[BENCH_ECHOCONNECTIONS];
+	for (int i = 0; i < BENCH_ECHOCONNECTIONS; i++)
+	{
+		bArmed[i] = TRUE;
+	}
+	while (!pLoop->bStop)
+	{
+		DWORD dwCount = 0;
+		hEvents[dwCount++] = pLoop->hWakeEvent;
+		for (int i = 0; i < BENCH_ECHOCONNECTIONS; i++)
+		{
+			if (InterlockedExchange(&(pLoop->pConns[i].bRearm), FALSE))
+				bArmed[i] = TRUE;
+			if (bArmed[i])
+			{
+				iConn[dwCount - 1] = i;
+				hEvents[dwCount++] = pLoop->pConns[i].hEvent;
+			}
+		}
+		DWORD dw = WSAWaitForMultipleEvents(dwCount, hEvents, FALSE, WSA_INFINITE, FALSE);
+		if (dw == WSA_WAIT_FAILED)
+		{
+			printf("Event loop wait failed:%d\n", WSAGetLastError());
+			return 1;
+		}
+		if ((dw <= WSA_WAIT_EVENT_0) || (dw >= WSA_WAIT_EVENT_0 + dwCount))
+			continue;
+		PECHOCONN pConn = &(pLoop->pConns[iConn[dw - WSA_WAIT_EVENT_0 - 1]]);
+		WSANETWORKEVENTS NetworkEvents;
+		if ((WSAEnumNetworkEvents(pConn->sServer, pConn->hEvent, &NetworkEvents) == SOCKET_ERROR) || !(NetworkEvents.lNetworkEvents & FD_READ))
+			continue;
+		//Hand the connection to the Thread Pool, it is not waited on until the Work Item echoed it
+		bArmed[iConn[dw - WSA_WAIT_EVENT_0 - 1]] = FALSE;
+		_InitWorkItem((PWORKITEM)&(pConn->Work), pLoop->pTP, LoopEchoWork, pConn, WORKITEM_NORMAL);
+		pConn->bInserted = TRUE;
+		while (!_TryInsertWork(pLoop->pTP, (PWORKITEM)&(pConn->Work)))
+		{
+			SwitchToThread();
+		}
+	}
+	return 0;
+}
+
+/*
+Random BENCH_IOBLOCKSIZE reads over a local file with BENCH_IODEPTH reads in flight
+Reports IOPS and the peak number of Thread Pool threads for TPReadAsync (I/O completion port and blocking fallback) and for blocking reads in Work Items
+Every mode gets a fresh Thread Pool, so that threads injected by an earlier mode do not count
+*/
+BOOL BenchFileIo(PTP pTP)
+{
+	UNREFERENCED_PARAMETER(pTP);
+	WCHAR szTempPath[MAX_PATH], szFile[MAX_PATH];
+	if (!GetTempPathW(MAX_PATH, szTempPath) || !GetTempFileNameW(szTempPath, L"tpb", 0, szFile))
+	{
+		printf("Unable to get a temp file name:%d\n", GetLastError());
+		return FALSE;
+	}
+	//Fill the file, it is read through the file cache afterwards
+	HANDLE hFile = CreateFileW(szFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, NULL);
+	PBYTE pbChunk = (PBYTE)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, 1 << 20);
+	BOOL bResult = (hFile != INVALID_HANDLE_VALUE) && (pbChunk != NULL);
+	for (int i = 0; bResult && (i < (BENCH_IOFILESIZE >> 20)); i++)
+	{
+		DWORD cbWritten;
+		FillMemory(pbChunk, 1 << 20, (BYTE)i);
+		bResult = WriteFile(hFile, pbChunk, 1 << 20, &cbWritten, NULL);
+	}
+	if (hFile != INVALID_HANDLE_VALUE)
+		CloseHandle(hFile);
+	if (pbChunk)
+		HeapFree(GetProcessHeap(), 0, pbChunk);
+	if (!bResult)
+	{
+		printf("Unable to create the benchmark file:%d\n", GetLastError());
+		DeleteFileW(szFile);
+		return FALSE;
+	}
+
+	bResult = RunRandomReads(NULL, szFile, IORUN_OVERLAPPED) && RunRandomReads(NULL, szFile, IORUN_FALLBACK) && RunRandomReads(NULL, szFile, IORUN_BLOCKING);
+	DeleteFileW(szFile);
+	return bResult;
+}
+
+BOOL RunRandomReads(PTP pTP, const WCHAR* pszFile, int iMode)
+{
+	const char* pszMode[3] = { "TPReadAsync (I/O completion port)", "TPReadAsync (blocking I/O threads)", "Blocking ReadFile in Work Items" };
+	IORUN Run = { 0 };
+	IOSLOT Slots[BENCH_IODEPTH];
+	BOOL bResult = FALSE;
+	PBYTE pbBuffers = (PBYTE)HeapAlloc(GetProcessHeap(), 0, BENCH_IODEPTH * BENCH_IOBLOCKSIZE);
+	Run.hFile = CreateFileW(pszFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, (iMode == IORUN_OVERLAPPED) ? FILE_FLAG_OVERLAPPED : FILE_ATTRIBUTE_NORMAL, NULL);
+	Run.hDoneEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	pTP = _CreateTP();
+	if (!(pbBuffers && (Run.hFile != INVALID_HANDLE_VALUE) && Run.hDoneEvent && pTP))
+	{
+		printf("Unable to set up the read run:%d\n", GetLastError());
+		goto RANDOMREADSCLEANUP;
+	}
+	Run.pTP = pTP;
+	if (iMode == IORUN_BLOCKING)
+		Run.pTaskGroup = _CreateTaskGroup(pTP);
+	else
+		Run.pIo = _TPBindIoHandle(pTP, Run.hFile, (iMode == IORUN_OVERLAPPED));
+	if (!(Run.pTaskGroup || Run.pIo))
+	{
+		printf("Unable to set up the read run:%d\n", GetLastError());
+		goto RANDOMREADSCLEANUP;
+	}
+	Run.iRemaining = BENCH_IOREADS;
+	Run.iOutstanding = BENCH_IODEPTH;
+
+	LARGE_INTEGER liStart;
+	QueryPerformanceCounter(&liStart);
+	for (int i = 0; i < BENCH_IODEPTH; i++)
+	{
+		Slots[i].pRun = &Run;
+		Slots[i].pbBuffer = pbBuffers + (i * BENCH_IOBLOCKSIZE);
+		Slots[i].uSeed = 2463534242UL + i;
+		if (Run.pTaskGroup)
+		{
+			_RunInTaskGroup(Run.pTaskGroup, BlockingReadTask, &Slots[i], WORKITEM_NORMAL);
+		}
+		else
+		{
+			SubmitNextRead(&Slots[i]);
+		}
+	}
+	//Sample the number of Thread Pool threads until the reads are done
+	int iPeakThreads = 0;
+	do
+	{
+		TPSTATS Stats = { 0 };
+		_GetTPStats(pTP, &Stats);
+		iPeakThreads = max(iPeakThreads, Stats.iCurrentRunningThreads + Stats.iCurrentWaitingThreads + Stats.iNumIoThreads);
+	} while (WaitForSingleObject(Run.hDoneEvent, BENCH_IOSAMPLEINTERVAL) == WAIT_TIMEOUT);
+	double dMs = ElapsedMilliseconds(liStart);
+	if (Run.pTaskGroup)
+		_WaitTaskGroup(Run.pTaskGroup);
+	printf("%s:%.0f IOPS, peak %d threads, %d failed reads\n", pszMode[iMode], (BENCH_IOREADS * 1000.0) / dMs, iPeakThreads, Run.iFailed);
+	bResult = (Run.iFailed == 0);
+
+RANDOMREADSCLEANUP:
+	if (Run.pTaskGroup)
+		_DeleteTaskGroup(Run.pTaskGroup);
+	if (Run.pIo)
+		_TPUnbindIoHandle(Run.pIo);
+	if (pTP)
+		_DeleteTPEx(pTP, TPDELETE_DRAIN, INFINITE);
+	if (Run.hDoneEvent)
+		CloseHandle(Run.hDoneEvent);
+	if (Run.hFile != INVALID_HANDLE_VALUE)
+		CloseHandle(Run.hFile);
+	if (pbBuffers)
+		HeapFree(GetProcessHeap(), 0, pbBuffers);
+	return bResult;
+}
+
+//xorshift32, picks a block aligned offset within the file
+ULONGLONG NextReadOffset(PIOSLOT pSlot)
+{
+	pSlot->uSeed ^= pSlot->uSeed << 13;
+	pSlot->uSeed ^= pSlot->uSeed >> 17;
+	pSlot->uSeed ^= pSlot->uSeed << 5;
+	return (ULONGLONG)(pSlot->uSeed % (BENCH_IOFILESIZE / BENCH_IOBLOCKSIZE)) * BENCH_IOBLOCKSIZE;
+}
+
+//Submits the next read of the slot, ends the read chain of the slot once BENCH_IOREADS reads were submitted, returns FALSE when the chain ended
+BOOL SubmitNextRead(PIOSLOT pSlot)
+{
+	PIORUN pRun = pSlot->pRun;
+	while (InterlockedDecrement(&(pRun->iRemaining)) >= 0)
+	{
+		if (_TPReadAsync(pRun->pIo, pSlot->pbBuffer, BENCH_IOBLOCKSIZE, NextReadOffset(pSlot), ReadCompleteCallback, pSlot))
+			return TRUE;
+		InterlockedIncrement(&(pRun->iFailed));
+	}
+	if (InterlockedDecrement(&(pRun->iOutstanding)) == 0)
+		SetEvent(pRun->hDoneEvent);
+	return FALSE;
+}
+
+VOID ReadCompleteCallback(PTPIO pIo, PVOID pvCtx, DWORD dwError, DWORD cbTransferred)
+{
+	UNREFERENCED_PARAMETER(pIo);
+	PIOSLOT pSlot = (PIOSLOT)pvCtx;
+	if (dwError || (cbTransferred != BENCH_IOBLOCKSIZE))
+		InterlockedIncrement(&(pSlot->pRun->iFailed));
+	SubmitNextRead(pSlot);
+}
+
+//Status quo, the Work Item does a blocking read and queues the next read of the slot as a new task
+PVOID BlockingReadTask(PVOID pvParam)
+{
+	PIOSLOT pSlot = (PIOSLOT)pvParam;
+	PIORUN pRun = pSlot->pRun;
+	if (InterlockedDecrement(&(pRun->iRemaining)) < 0)
+	{
+		if (InterlockedDecrement(&(pRun->iOutstanding)) == 0)
+			SetEvent(pRun->hDoneEvent);
+		return 0;
+	}
+	OVERLAPPED Overlapped = { 0 };
+	ULONGLONG ullOffset = NextReadOffset(pSlot);
+	DWORD cbRead = 0;
+	Overlapped.Offset = (DWORD)ullOffset;
+	Overlapped.OffsetHigh = (DWORD)(ullOffset >> 32);
+	if (!ReadFile(pRun->hFile, pSlot->pbBuffer, BENCH_IOBLOCKSIZE, &cbRead, &Overlapped) || (cbRead != BENCH_IOBLOCKSIZE))
+		InterlockedIncrement(&(pRun->iFailed));
+	_RunInTaskGroup(pRun->pTaskGroup, BlockingReadTask, pSlot, WORKITEM_NORMAL);
+	return 0;
+}
+
+/*
+BENCH_WAITS objects waited on with RegisterWaitForSignal against Work Items which block in WaitForSingleObject
+Reports the peak number of Thread Pool threads while the objects are unsignalled and the time from signalling them to the last callback
+Every mode gets a fresh Thread Pool, so that threads injected by an earlier mode do not count
+*/
+BOOL BenchWait(PTP pTP)
+{
+	UNREFERENCED_PARAMETER(pTP);
+	WAITRUN Run = { 0 };
+	BOOL bResult = TRUE;
+	Run.hDoneEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	for (int i = 0; i < BENCH_WAITS; i++)
+	{
+		Run.hEvents[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+		bResult = bResult && Run.hEvents[i];
+	}
+	if (!(bResult && Run.hDoneEvent))
+	{
+		printf("Unable to create the wait benchmark events:%d\n", GetLastError());
+		bResult = FALSE;
+	}
+	g_pWaitRun = &Run;
+	bResult = bResult && RunWaits(&Run, TRUE) && RunWaits(&Run, FALSE);
+	for (int i = 0; i < BENCH_WAITS; i++)
+	{
+		if (Run.hEvents[i])
+			CloseHandle(Run.hEvents[i]);
+	}
+	if (Run.hDoneEvent)
+		CloseHandle(Run.hDoneEvent);
+	return bResult;
+}
+
+BOOL RunWaits(PWAITRUN pRun, BOOL bRegisterWait)
+{
+	PWAITWORK pWaits[BENCH_WAITS] = { 0 };
+	PWORKITEM pWork[BENCH_WAITS] = { 0 };
+	PTP pTP = _CreateTP();
+	if (pTP == NULL)
+	{
+		printf("TP Creation failed\n");
+		return FALSE;
+	}
+	BOOL bResult = TRUE;
+	pRun->iRemaining = BENCH_WAITS;
+	ResetEvent(pRun->hDoneEvent);
+	for (int i = 0; bResult && (i < BENCH_WAITS); i++)
+	{
+		if (bRegisterWait)
+		{
+			pWaits[i] = _RegisterWaitForSignal(pTP, pRun->hEvents[i], INFINITE, WaitSignalledCallback, pRun, WAITWORK_ONESHOT);
+			bResult = (pWaits[i] != NULL);
+		}
+		else
+		{
+			pWork[i] = _CreateWorkItem(pTP, BlockingWaitWork, pRun->hEvents[i], WORKITEM_NORMAL);
+			bResult = pWork[i] && _TryInsertWork(pTP, pWork[i]);
+		}
+	}
+	if (!bResult)
+	{
+		printf("Unable to start wait %s:%d\n", bRegisterWait ? "registration" : "Work Item", GetLastError());
+		for (int i = 0; i < BENCH_WAITS; i++) //Release the Work Items already parked
+			SetEvent(pRun->hEvents[i]);
+	}
+	int iPeakThreads = SampleThreadCount(pTP, BENCH_WAITPHASE);
+	LARGE_INTEGER liStart;
+	QueryPerformanceCounter(&liStart);
+	for (int i = 0; bResult && (i < BENCH_WAITS); i++)
+	{
+		SetEvent(pRun->hEvents[i]);
+	}
+	if (bResult)
+	{
+		WaitForSingleObject(pRun->hDoneEvent, INFINITE);
+		printf("%s:peak %d threads while waiting, last callback %.2f ms after signalling\n", bRegisterWait ? "RegisterWaitForSignal" : "Blocking wait in Work Items",
+			iPeakThreads, ElapsedMilliseconds(liStart));
+	}
+	for (int i = 0; i < BENCH_WAITS; i++)
+	{
+		if (pWaits[i])
+			_UnregisterWaitForSignal(pWaits[i]);
+		if (pWork[i])
+		{
+			while (!_IsWorkComplete(pTP, pWork[i]))
+				SwitchToThread();
+			_DeleteWorkItem(pTP, pWork[i]);
+		}
+	}
+	_DeleteTPEx(pTP, TPDELETE_DRAIN, INFINITE);
+	return bResult;
+}
+
+VOID WaitSignalledCallback(PWAITWORK pWait, PVOID pvCtx, BOOL bTimedOut)
+{
+	UNREFERENCED_PARAMETER(pWait);
+	UNREFERENCED_PARAMETER(bTimedOut);
+	if (InterlockedDecrement(&(((PWAITRUN)pvCtx)->iRemaining)) == 0)
+		SetEvent(((PWAITRUN)pvCtx)->hDoneEvent);
+}
+
+//Status quo, the Work Item parks its Worker Thread until the object is signalled
+PVOID BlockingWaitWork(PVOID pvParam)
+{
+	WaitForSingleObject((HANDLE)pvParam, INFINITE);
+	if (InterlockedDecrement(&(g_pWaitRun->iRemaining)) == 0)
+		SetEvent(g_pWaitRun->hDoneEvent);
+	return 0;
+}
+
+//Samples the number of Thread Pool threads for the supplied number of milliseconds and returns the peak
+int SampleThreadCount(PTP pTP, DWORD dwMilliseconds)
+{
+	int iPeakThreads = 0;
+	ULONGLONG ullEnd = GetTickCount64() + dwMilliseconds;
+	while (GetTickCount64() < ullEnd)
+	{
+		TPSTATS Stats = { 0 };
+		_GetTPStats(pTP, &Stats);
+		iPeakThreads = max(iPeakThreads, Stats.iCurrentRunningThreads + Stats.iCurrentWaitingThreads + Stats.iNumIoThreads);
+		Sleep(BENCH_IOSAMPLEINTERVAL);
+	}
+	return iPeakThreads;
+}
+
+/*
+Saturating flood of BENCH_FLOODITEMS spinning low pri Work Items with a high pri Work Item inserted every BENCH_URGENTINTERVAL
+Reports the p50 and p99 queue wait of both priorities, first as is, then with BENCH_RESERVEDTHREADS Worker Threads reserved for high pri Work Items and low pri Work Items capped to the number of processors
+Every mode gets a fresh Thread Pool, so that threads injected by an earlier mode do not count
+*/
+BOOL BenchReserve(PTP pTP)
+{
+	UNREFERENCED_PARAMETER(pTP);
+	return RunPriorityFlood(FALSE) && RunPriorityFlood(TRUE);
+}
+
+BOOL RunPriorityFlood(BOOL bReserve)
+{
+	PWORKITEM pFlood[BENCH_FLOODITEMS] = { 0 };
+	PWORKITEM pUrgent[BENCH_URGENTITEMS] = { 0 };
+	SYSTEM_INFO SystemInfo;
+	GetSystemInfo(&SystemInfo);
+	PTP pTP = _CreateTP();
+	if (pTP == NULL)
+	{
+		printf("TP Creation failed\n");
+		return FALSE;
+	}
+	BOOL bResult = TRUE;
+	if (bReserve)
+	{
+		bResult = _SetTPReservedThreads(pTP, WORKITEM_HIGH, BENCH_RESERVEDTHREADS) && _SetTPPriorityCap(pTP, WORKITEM_LOW, (int)SystemInfo.dwNumberOfProcessors);
+	}
+	for (int i = 0; bResult && (i < BENCH_FLOODITEMS); i++)
+	{
+		pFlood[i] = _CreateWorkItem(pTP, SpinWork, (PVOID)(ULONG_PTR)BENCH_FLOODWORK, WORKITEM_LOW);
+		bResult = pFlood[i] && _TryInsertWork(pTP, pFlood[i]);
+		if (!bResult && pFlood[i])
+		{
+			_DeleteWorkItem(pTP, pFlood[i]); //Not queued, so it is not polled below
+			pFlood[i] = NULL;
+		}
+	}
+	for (int i = 0; bResult && (i < BENCH_URGENTITEMS); i++)
+	{
+		Sleep(BENCH_URGENTINTERVAL);
+		pUrgent[i] = _CreateWorkItem(pTP, NopWork, NULL, WORKITEM_HIGH);
+		bResult = pUrgent[i] && _TryInsertWork(pTP, pUrgent[i]);
+		if (!bResult && pUrgent[i])
+		{
+			_DeleteWorkItem(pTP, pUrgent[i]); //Not queued, so it is not polled below
+			pUrgent[i] = NULL;
+		}
+	}
+	if (!bResult)
+	{
+		printf("Unable to start the flood:%d\n", GetLastError());
+	}
+	//Poll instead of waiting in a Task Group, a helping thread would pick the queued Work Items itself
+	for (int i = 0; i < BENCH_FLOODITEMS; i++)
+	{
+		while (pFlood[i] && !_IsWorkComplete(pTP, pFlood[i]))
+			Sleep(1);
+	}
+	for (int i = 0; i < BENCH_URGENTITEMS; i++)
+	{
+		while (pUrgent[i] && !_IsWorkComplete(pTP, pUrgent[i]))
+			Sleep(1);
+	}
+	if (bResult)
+	{
+		DWORD dwHighP50 = 0, dwHighP99 = 0, dwLowP50 = 0, dwLowP99 = 0;
+		_GetTPQueueWaitPercentile(pTP, WORKITEM_HIGH, 50, &dwHighP50);
+		_GetTPQueueWaitPercentile(pTP, WORKITEM_HIGH, 99, &dwHighP99);
+		_GetTPQueueWaitPercentile(pTP, WORKITEM_LOW, 50, &dwLowP50);
+		_GetTPQueueWaitPercentile(pTP, WORKITEM_LOW, 99, &dwLowP99);
+		printf("%s:high pri queue wait p50 <%lu us p99 <%lu us, low pri queue wait p50 <%lu us p99 <%lu us\n",
+			bReserve ? "Reserved high pri Worker Thread, capped low pri" : "No reservation", dwHighP50, dwHighP99, dwLowP50, dwLowP99);
+	}
+	for (int i = 0; i < BENCH_FLOODITEMS; i++)
+	{
+		if (pFlood[i])
+			_DeleteWorkItem(pTP, pFlood[i]);
+	}
+	for (int i = 0; i < BENCH_URGENTITEMS; i++)
+	{
+		if (pUrgent[i])
+			_DeleteWorkItem(pTP, pUrgent[i]);
+	}
+	_DeleteTPEx(pTP, TPDELETE_DRAIN, INFINITE);
+	return bResult;
+}
+
+//Spins on the Worker Thread for the supplied number of milliseconds, like a CPU bound low pri callback
+PVOID SpinWork(PVOID pvParam)
+{
+	ULONGLONG ullEnd = GetTickCount64() + (ULONG_PTR)pvParam;
+	while (GetTickCount64() < ullEnd)
+	{
+	}
+	return 0;
+}
+
+/*
+BENCH_MIXITEMS Work Items, every BENCH_MIXSLEEPEVERY one sleeps BENCH_MIXSLEEP ms and the others spin BENCH_MIXSPIN ms
+Reports the time to run all of them and the peak number of Thread Pool threads, first as is, then with the sleeps wrapped in TPEnterBlocking/TPLeaveBlocking
+Every mode gets a fresh Thread Pool, so that threads injected by an earlier mode do not count
+*/
+BOOL BenchBlocking(PTP pTP)
+{
+	UNREFERENCED_PARAMETER(pTP);
+	return RunMixedWork(FALSE) && RunMixedWork(TRUE);
+}
+
+BOOL RunMixedWork(BOOL bHint)
+{
+	PWORKITEM pWork[BENCH_MIXITEMS] = { 0 };
+	MIXRUN Run = { 0 };
+	Run.bHint = bHint;
+	Run.iRemaining = BENCH_MIXITEMS;
+	Run.hDoneEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (Run.hDoneEvent == NULL)
+	{
+		printf("Unable to create the blocking hint benchmark event:%d\n", GetLastError());
+		return FALSE;
+	}
+	PTP pTP = _CreateTP();
+	if (pTP == NULL)
+	{
+		printf("TP Creation failed\n");
+		CloseHandle(Run.hDoneEvent);
+		return FALSE;
+	}
+	g_pMixRun = &Run;
+	BOOL bResult = TRUE;
+	LARGE_INTEGER liStart;
+	QueryPerformanceCounter(&liStart);
+	for (int i = 0; bResult && (i < BENCH_MIXITEMS); i++)
+	{
+		pWork[i] = _CreateWorkItem(pTP, MixedWork, (PVOID)(ULONG_PTR)((i % BENCH_MIXSLEEPEVERY) == 0), WORKITEM_NORMAL);
+		bResult = pWork[i] && _TryInsertWork(pTP, pWork[i]);
+		if (!bResult && pWork[i])
+		{
+			_DeleteWorkItem(pTP, pWork[i]); //Not queued, so it is not waited for below
+			pWork[i] = NULL;
+		}
+	}
+	if (bResult)
+	{
+		int iPeakThreads = 0;
+		while (WaitForSingleObject(Run.hDoneEvent, BENCH_IOSAMPLEINTERVAL) == WAIT_TIMEOUT)
+		{
+			TPSTATS Stats = { 0 };
+			_GetTPStats(pTP, &Stats);
+			iPeakThreads = max(iPeakThreads, Stats.iCurrentRunningThreads + Stats.iCurrentWaitingThreads);
+		}
+		printf("%s:%.2f ms, peak %d threads\n", bHint ? "TPEnterBlocking/TPLeaveBlocking around sleeps" : "No blocking hints", ElapsedMilliseconds(liStart), iPeakThreads);
+	}
+	else
+	{
+		printf("Unable to insert mixed Work Items:%d\n", GetLastError());
+	}
+	for (int i = 0; i < BENCH_MIXITEMS; i++)
+	{
+		if (pWork[i])
+		{
+			while (!_IsWorkComplete(pTP, pWork[i]))
+				SwitchToThread();
+			_DeleteWorkItem(pTP, pWork[i]);
+		}
+	}
+	_DeleteTPEx(pTP, TPDELETE_DRAIN, INFINITE);
+	CloseHandle(Run.hDoneEvent);
+	return bResult;
+}
+
+//Sleeps like a callback blocked on I/O or a lock, or spins like a CPU bound callback
+PVOID MixedWork(PVOID pvParam)
+{
+	if (pvParam)
+	{
+		if (g_pMixRun->bHint)
+			_TPEnterBlocking();
+		Sleep(BENCH_MIXSLEEP);
+		if (g_pMixRun->bHint)
+			_TPLeaveBlocking();
+	}
+	else
+	{
+		SpinWork((PVOID)(ULONG_PTR)BENCH_MIXSPIN);
+	}
+	if (InterlockedDecrement(&(g_pMixRun->iRemaining)) == 0)
+		SetEvent(g_pMixRun->hDoneEvent);
+	return 0;
+}
+
+/*
+BENCH_STRANDMSGS messages over BENCH_STRANDCONNS connections, a few connections get most of the messages
+Every message updates the state of its connection, first under a lock per connection, then on a strand per connection
+Reports the time per message, the messages handled out of arrival order and the messages which overlapped another one of their connection
+*/
+BOOL BenchStrand(PTP pTP)
+{
+	HANDLE hHeap = GetProcessHeap();
+	PSTRANDCONN pConns = (PSTRANDCONN)HeapAlloc(hHeap, HEAP_ZERO_MEMORY, BENCH_STRANDCONNS * sizeof(STRANDCONN));
+	PSTRANDMSG pMsgs = (PSTRANDMSG)HeapAlloc(hHeap, HEAP_ZERO_MEMORY, BENCH_STRANDMSGS * sizeof(STRANDMSG));
+	if (!(pConns && pMsgs))
+	{
+		printf("Unable to allocate benchmark arrays\n");
+		return FALSE;
+	}
+	BOOL bResult = RunStrandMessages(pTP, pConns, pMsgs, FALSE) && RunStrandMessages(pTP, pConns, pMsgs, TRUE);
+	HeapFree(hHeap, 0, pMsgs);
+	HeapFree(hHeap, 0, pConns);
+	return bResult;
+}
+
+BOOL RunStrandMessages(PTP pTP, PSTRANDCONN pConns, PSTRANDMSG pMsgs, BOOL bStrand)
+{
+	STRANDRUN Run = { 0 };
+	BOOL bResult = TRUE;
+	ZeroMemory(pConns, BENCH_STRANDCONNS * sizeof(STRANDCONN));
+	for (int i = 0; bResult && (i < BENCH_STRANDCONNS); i++)
+	{
+		InitializeSRWLock(&(pConns[i].Lock));
+		if (bStrand)
+		{
+			pConns[i].pStrand = _CreateStrand(pTP);
+			bResult = (pConns[i].pStrand != NULL);
+		}
+	}
+	g_pStrandRun = &Run;
+	ULONG uSeed = 0x2545F491;
+	int iSubmitted = 0;
+	LARGE_INTEGER liStart;
+	QueryPerformanceCounter(&liStart);
+	for (; bResult && (iSubmitted < BENCH_STRANDMSGS); iSubmitted++)
+	{
+		PSTRANDMSG pMsg = &(pMsgs[iSubmitted]);
+		PWORKITEM pWork = (PWORKITEM)&(pMsg->Work);
+		pMsg->pConn = &(pConns[PickStrandConn(&uSeed)]);
+		pMsg->iSeq = pMsg->pConn->iNextSeq++;
+		_InitWorkItem(pWork, pTP, bStrand ? StrandMsgWork : LockedMsgWork, pMsg, WORKITEM_NORMAL);
+		if (bStrand)
+		{
+			bResult = _InsertWorkOnStrand(pMsg->pConn->pStrand, pWork);
+		}
+		else
+		{
+			while (!(bResult = _TryInsertWork(pTP, pWork)) && (GetLastError() != ERROR_INVALID_STATE))
+				SwitchToThread(); //Pri queue is full
+		}
+	}
+	if (!bResult)
+	{
+		printf("Unable to run strand messages:%d\n", GetLastError());
+		iSubmitted = max(iSubmitted - 1, 0); //The last message was not queued, so it is not waited for below
+	}
+	for (int i = 0; i < iSubmitted; i++)
+	{
+		while (!_IsWorkComplete(pTP, (PWORKITEM)&(pMsgs[i].Work)))
+			SwitchToThread();
+	}
+	double dMs = ElapsedMilliseconds(liStart);
+	if (bResult)
+	{
+		printf("%s:%.2f us/message, %d out of order, %d overlapped\n", bStrand ? "Strand per connection" : "Lock per connection", (dMs * 1000.0) / BENCH_STRANDMSGS, Run.iOutOfOrder, Run.iOverlapped);
+	}
+	for (int i = 0; i < BENCH_STRANDCONNS; i++)
+	{
+		if (pConns[i].pStrand)
+			_DeleteStrand(pConns[i].pStrand);
+	}
+	return bResult && (!bStrand || ((Run.iOutOfOrder == 0) && (Run.iOverlapped == 0)));
+}
+
+//Picks the connection of the next message, the low connection numbers are far more popular (cubed uniform value)
+int PickStrandConn(PULONG puSeed)
+{
+	*puSeed ^= *puSeed << 13;
+	*puSeed ^= *puSeed >> 17;
+	*puSeed ^= *puSeed << 5;
+	double dValue = (double)(*puSeed) / 4294967296.0;
+	return (int)(dValue * dValue * dValue * BENCH_STRANDCONNS);
+}
+
+//Message on a strand, the strand keeps the messages of a connection apart
+PVOID StrandMsgWork(PVOID pvParam)
+{
+	HandleStrandMsg((PSTRANDMSG)pvParam);
+	return 0;
+}
+
+//Message under a lock per connection, messages of a connection exclude each other but may run in any order
+PVOID LockedMsgWork(PVOID pvParam)
+{
+	PSTRANDCONN pConn = ((PSTRANDMSG)pvParam)->pConn;
+	AcquireSRWLockExclusive(&(pConn->Lock));
+	HandleStrandMsg((PSTRANDMSG)pvParam);
+	ReleaseSRWLockExclusive(&(pConn->Lock));
+	return 0;
+}
+
+//Updates the connection state, counting messages which arrive out of order or overlap another message of the connection
+VOID HandleStrandMsg(PSTRANDMSG pMsg)
+{
+	PSTRANDCONN pConn = pMsg->pConn;
+	if (InterlockedExchange(&(pConn->bBusy), 1))
+		InterlockedIncrement(&(g_pStrandRun->iOverlapped));
+	if (pMsg->iSeq != pConn->iExpectedSeq)
+		InterlockedIncrement(&(g_pStrandRun->iOutOfOrder));
+	pConn->iExpectedSeq = pMsg->iSeq + 1;
+	LONG64 iState = pConn->iState;
+	for (int i = 0; i < BENCH_STRANDWORK; i++)
+		iState = (iState * 6364136223846793005LL) + pMsg->iSeq;
+	pConn->iState = iState;
+	InterlockedExchange(&(pConn->bBusy), 0);
+}
+
+/*
+BENCH_CQITEMS tiny Work Items with BENCH_CQOUTSTANDING of them kept in flight, a finished Work Item is resubmitted right away
+Finished Work Items are found by polling every outstanding Work Item with IsWorkComplete, then harvested from a completion queue
+Reports the time per Work Item and the number of IsWorkComplete/GetCompletedWorkItems calls per completion
+*/
+BOOL BenchCompletion(PTP pTP)
+{
+	return RunRequestModes(pTP, BENCH_CQOUTSTANDING, RunHarvest);
+}
+
+BOOL RunHarvest(PTP pTP, PBENCHREQUEST pRequests, BOOL bQueue)
+{
+	PCOMPLETIONQUEUE pCompletionQueue = NULL;
+	if (bQueue)
+	{
+		pCompletionQueue = _CreateCompletionQueue(pTP);
+		if (pCompletionQueue == NULL)
+		{
+			printf("Unable to create completion queue:%d\n", GetLastError());
+			return FALSE;
+		}
+	}
+	BOOL bInFlight[BENCH_CQOUTSTANDING] = { 0 };
+	LONG64 iChecks = 0;
+	int iSubmitted = 0;
+	int iCompleted = 0;
+	g_iBenchTotal = 0;
+	LARGE_INTEGER liStart;
+	QueryPerformanceCounter(&liStart);
+	for (int i = 0; i < BENCH_CQOUTSTANDING; i++, iSubmitted++)
+	{
+		SubmitHarvestItem(pTP, &(pRequests[i]), pCompletionQueue);
+		bInFlight[i] = TRUE;
+	}
+	while (iCompleted < iSubmitted)
+	{
+		if (bQueue)
+		{
+			PWORKITEM pDone[BENCH_CQBATCH];
+			DWORD dwDone = _GetCompletedWorkItems(pCompletionQueue, pDone, BENCH_CQBATCH, INFINITE);
+			iChecks++;
+			if (dwDone == 0)
+			{
+				printf("Unable to get completed Work Items:%d\n", GetLastError());
+				return FALSE; //The completion queue is not deleted, Work Items still in flight are pushed onto it
+			}
+			for (DWORD j = 0; j < dwDone; j++)
+			{
+				iCompleted++;
+				if (iSubmitted < BENCH_CQITEMS)
+				{
+					SubmitHarvestItem(pTP, (PBENCHREQUEST)pDone[j], pCompletionQueue); //Work is the first member of the request
+					iSubmitted++;
+				}
+			}
+		}
+		else
+		{
+			for (int i = 0; i < BENCH_CQOUTSTANDING; i++)
+			{
+				if (!bInFlight[i])
+					continue;
+				iChecks++;
+				if (!_IsWorkComplete(pTP, (PWORKITEM)&(pRequests[i].Work)))
+					continue;
+				iCompleted++;
+				bInFlight[i] = (iSubmitted < BENCH_CQITEMS);
+				if (bInFlight[i])
+				{
+					SubmitHarvestItem(pTP, &(pRequests[i]), NULL);
+					iSubmitted++;
+				}
+			}
+		}
+	}
+	double dMs = ElapsedMilliseconds(liStart);
+	printf("%s:%.2f us/item, %.2f harvest calls/completion, total %lld\n", bQueue ? "GetCompletedWorkItems" : "IsWorkComplete polling", (dMs * 1000.0) / BENCH_CQITEMS, (double)iChecks / iCompleted, g_iBenchTotal);
+	if (pCompletionQueue)
+		_DeleteCompletionQueue(pCompletionQueue);
+	return (g_iBenchTotal == BENCH_CQITEMS);
+}
+
+//Prepares an embedded Work Item adding one to g_iBenchTotal, binds it to the completion queue (if any) and inserts it
+VOID SubmitHarvestItem(PTP pTP, PBENCHREQUEST pRequest, PCOMPLETIONQUEUE pCompletionQueue)
+{
+	PWORKITEM pWork = InitEmbedded(pTP, pRequest, AddValueWork, 1);
+	if (pCompletionQueue)
+		_SetWorkItemCompletionQueue(pWork, pCompletionQueue);
+	SubmitEmbedded(pTP, pRequest);
+}
+
+/*
+BENCH_PROFILEITEMS embedded Work Items spread round robin over three callbacks, first with profiling off, then on
+Reports the time per Work Item of both runs and prints the BENCH_PROFILETOP most expensive callbacks of the profile
+*/
+BOOL BenchProfile(PTP pTP)
+{
+	PBENCHREQUEST pRequests = (PBENCHREQUEST)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, BENCH_PROFILEITEMS * sizeof(BENCHREQUEST));
+	if (pRequests == NULL)
+	{
+		printf("Unable to allocate benchmark arrays\n");
+		return FALSE;
+	}
+	double dOffMs = RunProfiledItems(pTP, pRequests);
+	_SetTPProfiling(pTP, TRUE);
+	double dOnMs = RunProfiledItems(pTP, pRequests);
+	_SetTPProfiling(pTP, FALSE);
+	printf("Profiling off:%.2f us/item, profiling on:%.2f us/item\n", (dOffMs * 1000.0) / BENCH_PROFILEITEMS, (dOnMs * 1000.0) / BENCH_PROFILEITEMS);
+	HeapFree(GetProcessHeap(), 0, pRequests);
+
+	TPPROFILEENTRY Entries[BENCH_PROFILETOP];
+	DWORD dwCount = 0;
+	if (!_GetTPProfile(pTP, Entries, BENCH_PROFILETOP, &dwCount))
+	{
+		printf("Unable to get TP profile:%d\n", GetLastError());
+		return FALSE;
+	}
+	LONG64 iInvocations = 0;
+	for (DWORD i = 0; i < dwCount; i++)
+	{
+		printf("%-40s calls:%lld total:%lld us max:%lld us cycles:%llu queue wait:%lld us\n", Entries[i].szSymbol[0] ? Entries[i].szSymbol : "?", Entries[i].iInvocations, Entries[i].llTotalMicroseconds,
+			Entries[i].llMaxMicroseconds, Entries[i].ullCpuCycles, Entries[i].llQueueWaitMicroseconds);
+		iInvocations += Entries[i].iInvocations;
+	}
+	return (iInvocations == BENCH_PROFILEITEMS);
+}
+
+//Runs the profiler benchmark Work Items once and returns the elapsed milliseconds
+double RunProfiledItems(PTP pTP, PBENCHREQUEST pRequests)
+{
+	CALLBACK_INSTANCE pCallbacks[] = { AddValueWork, NopWork, ComputeBoundWork };
+	LARGE_INTEGER liStart;
+	QueryPerformanceCounter(&liStart);
+	for (int i = 0; i < BENCH_PROFILEITEMS; i++)
+	{
+		InitEmbedded(pTP, &(pRequests[i]), pCallbacks[i % _countof(pCallbacks)], 1); //ComputeBoundWork reads the inline copy as a double
+		SubmitEmbedded(pTP, &(pRequests[i]));
+	}
+	WaitEmbedded(pTP, pRequests, BENCH_PROFILEITEMS);
+	return ElapsedMilliseconds(liStart);
+}
+
+/*
+BENCH_COALESCEITEMS refresh Work Items for BENCH_COALESCEKEYS targets, submitted as fast as possible, first as is, then with the target as coalescing key
+Reports the time to complete all of them, the number of refreshes actually run and the number of Work Items coalesced
+*/
+BOOL BenchCoalesce(PTP pTP)
+{
+	return RunRequestModes(pTP, BENCH_COALESCEITEMS, RunRefreshes);
+}
+
+BOOL RunRefreshes(PTP pTP, PBENCHREQUEST pRequests, BOOL bCoalesce)
+{
+	TPSTATS Stats = { 0 };
+	_GetTPStats(pTP, &Stats);
+	int iCoalescedBefore = Stats.iNumWorkItemsCoalesced;
+	g_iBenchTotal = 0;
+	LARGE_INTEGER liStart;
+	QueryPerformanceCounter(&liStart);
+	for (int i = 0; i < BENCH_COALESCEITEMS; i++)
+	{
+		PWORKITEM pEmbedded = InitEmbedded(pTP, &(pRequests[i]), RefreshWork, i % BENCH_COALESCEKEYS); //Refresh target
+		if (bCoalesce)
+			_SetWorkItemCoalesceKey(pEmbedded, (ULONG_PTR)pRequests[i].iValue);
+		SubmitEmbedded(pTP, &(pRequests[i]));
+	}
+	WaitEmbedded(pTP, pRequests, BENCH_COALESCEITEMS);
+	double dMs = ElapsedMilliseconds(liStart);
+	_GetTPStats(pTP, &Stats);
+	int iCoalesced = Stats.iNumWorkItemsCoalesced - iCoalescedBefore;
+	printf("%s:%.2f ms, %lld refreshes run, %d Work Items coalesced\n", bCoalesce ? "Coalescing key" : "No coalescing", dMs, g_iBenchTotal, iCoalesced);
+	return ((g_iBenchTotal + iCoalesced) == BENCH_COALESCEITEMS);
+}
+
+//Refreshes one target, counting the refreshes run in g_iBenchTotal
+PVOID RefreshWork(PVOID pvParam)
+{
+	LONG64 iState = *(LONG64*)pvParam;
+	for (int i = 0; i < BENCH_COALESCEWORK; i++)
+		iState = (iState * 6364136223846793005LL) + 1442695040888963407LL;
+	*(LONG64*)pvParam = iState; //The inline parameter copy holds the refreshed state
+	InterlockedIncrement64(&g_iBenchTotal);
+	return 0;
+}
+
+/*
+BENCH_TAGITEMS Work Items of one request, each spinning BENCH_TAGWORK ms, are queued and the request is aborted right away
+The request is cancelled with DeleteWorkItem on every Work Item, then with one CancelWorkByTag, its tag is released once it is over
+Reports the time the cancelling thread spent and the number of callbacks which still ran, from the tag counters
+*/
+BOOL BenchTag(PTP pTP)
+{
+	return RunRequestModes(pTP, BENCH_TAGITEMS, RunAbortedRequest);
+}
+
+BOOL RunAbortedRequest(PTP pTP, PBENCHREQUEST pRequests, BOOL bByTag)
+{
+	TPTAGSTATS Before = { 0 };
+	_GetWorkTagStats(pTP, BENCH_TAG, &Before); //Fails until the tag is first used, Before stays zero
+	for (int i = 0; i < BENCH_TAGITEMS; i++)
+	{
+		PWORKITEM pEmbedded = (PWORKITEM)&(pRequests[i].Work);
+		_InitWorkItem(pEmbedded, pTP, SpinWork, (PVOID)(ULONG_PTR)BENCH_TAGWORK, WORKITEM_NORMAL);
+		_SetWorkItemTag(pTP, pEmbedded, BENCH_TAG);
+		SubmitEmbedded(pTP, &(pRequests[i]));
+	}
+	LARGE_INTEGER liStart;
+	QueryPerformanceCounter(&liStart);
+	if (bByTag)
+	{
+		_CancelWorkByTag(pTP, BENCH_TAG);
+	}
+	else
+	{
+		for (int i = 0; i < BENCH_TAGITEMS; i++)
+			_DeleteWorkItem(pTP, (PWORKITEM)&(pRequests[i].Work));
+	}
+	double dMs = ElapsedMilliseconds(liStart);
+	//Wait for the callbacks which were already running and, with CancelWorkByTag, for the threads to drop the queued Work Items
+	//A Work Item a Worker Thread took just before DeleteWorkItem is only counted once it starts, so the Worker Threads have to be idle as well
+	TPTAGSTATS After = { 0 };
+	TPSTATS Stats = { 0 };
+	do
+	{
+		SwitchToThread();
+		_GetWorkTagStats(pTP, BENCH_TAG, &After);
+		_GetTPStats(pTP, &Stats);
+	} while (After.iNumPending || After.iNumRunning || Stats.iCurrentRunningThreads);
+	printf("%s:%.2f us to cancel, %d of %d callbacks ran, %d dropped by the Thread Pool\n", bByTag ? "CancelWorkByTag" : "DeleteWorkItem per Work Item", dMs * 1000.0,
+		After.iNumCompleted - Before.iNumCompleted, BENCH_TAGITEMS, After.iNumCancelled - Before.iNumCancelled);
+	_ReleaseWorkTag(pTP, BENCH_TAG); //The request is over, its tag is freed
+	return TRUE;
+}
+
+/*
+BENCH_SCRATCHITEMS Work Items which each need a BENCH_SCRATCHSIZE scratch buffer
+The buffer is allocated and freed by every Work Item, then allocated once per thread by a start hook and found with TPGetWorkerLocal
+Every mode gets a fresh Thread Pool, the hooks have to be set before it has threads
+Reports the time per Work Item, and checks that every buffer allocated by a start hook was freed by an exit hook once the Thread Pool is deleted
+*/
+BOOL BenchWorkerLocal(PTP pTP)
+{
+	return RunRequestModes(pTP, BENCH_SCRATCHITEMS, RunScratchWork);
+}
+
+BOOL RunScratchWork(PTP pTP, PBENCHREQUEST pRequests, BOOL bWorkerLocal)
+{
+	pTP = _CreateTP(); //Own Thread Pool, the pool passed in is NULL for benchmarks which create theirs
+	if (pTP == NULL)
+	{
+		printf("TP Creation failed\n");
+		return FALSE;
+	}
+	if (bWorkerLocal && !_SetTPThreadHooks(pTP, ScratchThreadStart, ScratchThreadExit, NULL))
+	{
+		printf("Unable to set TP thread hooks:%d\n", GetLastError());
+		_DeleteTPEx(pTP, TPDELETE_DRAIN, INFINITE);
+		return FALSE;
+	}
+	g_iBenchTotal = 0;
+	LARGE_INTEGER liStart;
+	QueryPerformanceCounter(&liStart);
+	for (int i = 0; i < BENCH_SCRATCHITEMS; i++)
+	{
+		InitEmbedded(pTP, &(pRequests[i]), bWorkerLocal ? ScratchLocalWork : ScratchAllocWork, i);
+		SubmitEmbedded(pTP, &(pRequests[i]));
+	}
+	WaitEmbedded(pTP, pRequests, BENCH_SCRATCHITEMS);
+	double dMs = ElapsedMilliseconds(liStart);
+	_DeleteTPEx(pTP, TPDELETE_DRAIN, INFINITE); //Runs the exit hooks
+	printf("%s:%.2f us/item, %lld items used a scratch buffer, %d scratch buffers leaked\n", bWorkerLocal ? "Worker local scratch buffer" : "Scratch buffer per Work Item",
+		(dMs * 1000.0) / BENCH_SCRATCHITEMS, g_iBenchTotal, g_iScratchThreads);
+	return (g_iBenchTotal == BENCH_SCRATCHITEMS) && (g_iScratchThreads == 0);
+}
+
+PVOID ScratchAllocWork(PVOID pvParam)
+{
+	PBYTE pScratch = (PBYTE)HeapAlloc(GetProcessHeap(), 0, BENCH_SCRATCHSIZE);
+	if (pScratch)
+	{
+		UseScratch(pScratch, *(LONG64*)pvParam);
+		HeapFree(GetProcessHeap(), 0, pScratch);
+	}
+	return 0;
+}
+
+PVOID ScratchLocalWork(PVOID pvParam)
+{
+	PVOID* ppvScratch = _TPGetWorkerLocal(BENCH_SCRATCHSLOT);
+	if (ppvScratch && *ppvScratch)
+		UseScratch((PBYTE)*ppvScratch, *(LONG64*)pvParam);
+	return 0;
+}
+
+//Touches every page of the scratch buffer, the way a compression context or row buffer would be used
+VOID UseScratch(PBYTE pScratch, LONG64 iValue)
+{
+	for (int i = 0; i < BENCH_SCRATCHSIZE; i += 4096)
+		pScratch[i] = (BYTE)(iValue + i);
+	InterlockedIncrement64(&g_iBenchTotal);
+}
+
+//Start hook, allocates the scratch buffer of the new thread
+VOID ScratchThreadStart(PTP pTP, PVOID pvCtx)
+{
+	UNREFERENCED_PARAMETER(pTP);
+	UNREFERENCED_PARAMETER(pvCtx);
+	PVOID* ppvScratch = _TPGetWorkerLocal(BENCH_SCRATCHSLOT);
+	if (ppvScratch == NULL)
+		return;
+	*ppvScratch = HeapAlloc(GetProcessHeap(), 0, BENCH_SCRATCHSIZE);
+	if (*ppvScratch)
+		InterlockedIncrement(&g_iScratchThreads);
+}
+
+//Exit hook, frees the scratch buffer of the exiting thread
+VOID ScratchThreadExit(PTP pTP, PVOID pvCtx)
+{
+	UNREFERENCED_PARAMETER(pTP);
+	UNREFERENCED_PARAMETER(pvCtx);
+	PVOID* ppvScratch = _TPGetWorkerLocal(BENCH_SCRATCHSLOT);
+	if (ppvScratch && *ppvScratch)
+	{
+		HeapFree(GetProcessHeap(), 0, *ppvScratch);
+		InterlockedDecrement(&g_iScratchThreads);
+	}
+}
+
+/*
+One runaway Work Item per processor spins BENCH_RUNAWAYWORK ms, then BENCH_STUCKITEMS short Work Items are queued behind them
+Runs with the watchdog only reporting, then with TPWATCHDOG_INJECTWORKER
+Every mode gets a fresh Thread Pool, so that threads injected by an earlier mode do not count
+Reports the time the short Work Items took and the number of callbacks the watchdog reported
+*/
+BOOL BenchWatchdog(PTP pTP)
+{
+	return RunRequestModes(pTP, BENCH_STUCKITEMS + MAXIMUM_PROCESSORS, RunStuckWork);
+}
+
+BOOL RunStuckWork(PTP pTP, PBENCHREQUEST pRequests, BOOL bInject)
+{
+	SYSTEM_INFO SystemInfo;
+	GetSystemInfo(&SystemInfo);
+	int iRunaway = (int)min(SystemInfo.dwNumberOfProcessors, MAXIMUM_PROCESSORS); //EnumerateRunningWork is polled into a MAXIMUM_PROCESSORS array
+	DWORD dwFlags = bInject ? TPWATCHDOG_INJECTWORKER : 0;
+	pTP = _CreateTP(); //Own Thread Pool, the pool passed in is NULL for benchmarks which create theirs
+	if (pTP == NULL)
+	{
+		printf("TP Creation failed\n");
+		return FALSE;
+	}
+	g_iWatchdogReports = 0;
+	if (!_SetTPWatchdog(pTP, BENCH_WATCHDOGBUDGET, WatchdogReport, NULL, dwFlags))
+	{
+		printf("Unable to set TP watchdog:%d\n", GetLastError());
+		_DeleteTPEx(pTP, TPDELETE_DRAIN, INFINITE);
+		return FALSE;
+	}
+	for (int i = 0; i < (BENCH_STUCKITEMS + iRunaway); i++)
+	{
+		PWORKITEM pEmbedded = (PWORKITEM)&(pRequests[i].Work);
+		_InitWorkItem(pEmbedded, pTP, SpinWork, (PVOID)(ULONG_PTR)((i < iRunaway) ? BENCH_RUNAWAYWORK : BENCH_STUCKWORK), WORKITEM_NORMAL);
+		SubmitEmbedded(pTP, &(pRequests[i]));
+		if (i == (iRunaway - 1)) //Let the runaway Work Items take the Worker Threads before the short ones are queued
+		{
+			DWORD dwRunning = 0;
+			TPRUNNINGWORK Running[MAXIMUM_PROCESSORS];
+			ULONGLONG ullEnd = GetTickCount64() + BENCH_WATCHDOGBUDGET;
+			while ((dwRunning < (DWORD)iRunaway) && (GetTickCount64() < ullEnd))
+			{
+				SwitchToThread();
+				_EnumerateRunningWork(pTP, Running, MAXIMUM_PROCESSORS, &dwRunning);
+			}
+			printf("%d of %d runaway Work Items running\n", dwRunning, iRunaway);
+		}
+	}
+	LARGE_INTEGER liStart;
+	QueryPerformanceCounter(&liStart);
+	WaitEmbedded(pTP, pRequests + iRunaway, BENCH_STUCKITEMS);
+	double dMs = ElapsedMilliseconds(liStart);
+	_DeleteTPEx(pTP, TPDELETE_DRAIN, INFINITE); //Waits for the runaway Work Items
+	printf("%s:%.2f ms for the short Work Items, %d callbacks reported over the budget\n", (dwFlags & TPWATCHDOG_INJECTWORKER) ? "Watchdog injecting Worker Threads" : "Watchdog reporting only",
+		dMs, g_iWatchdogReports);
+	return g_iWatchdogReports > 0;
+}
+
+//Watchdog callback, counts the callbacks reported over the budget
+VOID WatchdogReport(PTP pTP, PTPRUNNINGWORK pRunning, PVOID pvCtx)
+{
+	UNREFERENCED_PARAMETER(pTP);
+	UNREFERENCED_PARAMETER(pvCtx);
+	UNREFERENCED_PARAMETER(pRunning);
+	InterlockedIncrement(&g_iWatchdogReports);
+}
+
+/*
+BENCH_SPILLITEMS spillable Work Items with a BENCH_SPILLPARAM byte parameter are inserted as fast as the producer can, with BENCH_SPILLBUDGET of them kept in memory
+The rest goes through the spill log in the temp directory, no insert is turned away
+Reports the insert rate, the rate Work Items were run at while the spill log was read back, and the spill log traffic
+*/
+BOOL BenchSpill(PTP pTP)
+{
+	pTP = _CreateTP(); //Own Thread Pool, the pool passed in is NULL for benchmarks which create theirs
+	if (pTP == NULL)
+	{
+		printf("TP Creation failed\n");
+		return FALSE;
+	}
+	if (!(_SetTPSpill(pTP, NULL, BENCH_SPILLBUDGET) && _RegisterSpillCallback(pTP, BENCH_SPILLCALLBACK, SpillEventWork)))
+	{
+		printf("Unable to set TP spill:%d\n", GetLastError());
+		_DeleteTPEx(pTP, TPDELETE_DRAIN, INFINITE);
+		return FALSE;
+	}
+	g_iBenchTotal = 0;
+	BYTE Param[BENCH_SPILLPARAM] = { 0 };
+	int iFailed = 0;
+	int iPeakBacklog = 0;
+	TPSTATS Stats = { 0 };
+	LARGE_INTEGER liStart;
+	QueryPerformanceCounter(&liStart);
+	for (LONG64 i = 0; i < BENCH_SPILLITEMS; i++)
+	{
+		*(LONG64*)Param = i;
+		if (!_InsertSpillableWork(pTP, BENCH_SPILLCALLBACK, Param, BENCH_SPILLPARAM))
+			iFailed++;
+		if ((i & 0xFFFF) == 0)
+		{
+			_GetTPStats(pTP, &Stats);
+			iPeakBacklog = max(iPeakBacklog, Stats.iNumSpillBacklog);
+		}
+	}
+	double dInsertMs = ElapsedMilliseconds(liStart);
+	while (g_iBenchTotal < (BENCH_SPILLITEMS - iFailed))
+	{
+		Sleep(1);
+	}
+	double dMs = ElapsedMilliseconds(liStart);
+	_GetTPStats(pTP, &Stats);
+	_DeleteTPEx(pTP, TPDELETE_DRAIN, INFINITE);
+	printf("Insert:%.0f items/s, %d failed, peak spill backlog %d items\n", (BENCH_SPILLITEMS * 1000.0) / dInsertMs, iFailed, iPeakBacklog);
+	printf("Run:%.0f items/s, %d spilled, %d refilled, %.1f MB through the spill log\n", (BENCH_SPILLITEMS * 1000.0) / dMs, Stats.iNumWorkItemsSpilled, Stats.iNumWorkItemsRefilled,
+		((double)Stats.iNumWorkItemsSpilled * (BENCH_SPILLPARAM + 8)) / (1 << 20));
+	return (iFailed == 0) && (Stats.iNumWorkItemsSpilled == Stats.iNumWorkItemsRefilled);
+}
+
+//Spillable Work Item callback, hashes its parameter blob like a log shipper or metrics event handler would
+PVOID SpillEventWork(PVOID pvParam)
+{
+	LONG64 iState = *(LONG64*)pvParam;
+	for (int i = 0; i < BENCH_SPILLWORK; i++)
+		iState = (iState * 6364136223846793005LL) + 1442695040888963407LL;
+	InterlockedIncrement64(&g_iBenchTotal);
+	return (PVOID)(ULONG_PTR)(iState & 1);
+}
+
+/*
+Submit to completion latency from another process of the host, through a submission ring against a loopback TCP round trip
+A producer process (this benchmark started with BENCH_RINGCLIENTARG) times BENCH_RINGROUNDS round trips of a BENCH_RINGPAYLOAD byte payload one after the other
+The ring callback runs on a Worker Thread, the socket server thread computes the same checksum inline, so the socket numbers are the transport alone
+Reports the p50/p99/max latency of both, printed by the producer process
+*/
+BOOL BenchRing(PTP pTP)
+{
+	WSADATA WsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &WsaData) != 0)
+	{
+		printf("WSAStartup failed\n");
+		return FALSE;
+	}
+	BOOL bResult = FALSE;
+	WCHAR szRing[TPRING_MAXNAME];
+	swprintf_s(szRing, TPRING_MAXNAME, BENCH_RINGNAMEFORMAT, GetCurrentProcessId());
+	PTPRING pRing = _CreateTPRing(pTP, szRing, BENCH_RINGSLOTS);
+	if (!(pRing && _RegisterRingCallback(pRing, BENCH_RINGCALLBACK, ChecksumPayload)))
+	{
+		printf("Unable to create TP Ring:%d\n", GetLastError());
+		if (pRing)
+			_DeleteTPRing(pRing);
+		WSACleanup();
+		return FALSE;
+	}
+	HANDLE hServerThread = NULL;
+	SOCKET sListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	struct sockaddr_in Addr = { 0 };
+	int cbAddr = sizeof(Addr);
+	Addr.sin_family = AF_INET;
+	Addr.sin_addr.S_un.S_addr = htonl(INADDR_LOOPBACK);
+	if ((sListen == INVALID_SOCKET) || (bind(sListen, (SOCKADDR*)&Addr, sizeof(Addr)) == SOCKET_ERROR) || (listen(sListen, 1) == SOCKET_ERROR)
+		|| (getsockname(sListen, (SOCKADDR*)&Addr, &cbAddr) == SOCKET_ERROR))
+	{
+		printf("Unable to listen on loopback:%d\n", WSAGetLastError());
+		goto BENCHRINGCLEANUP;
+	}
+	hServerThread = CreateThread(NULL, 0, RingSocketServerProc, (LPVOID)sListen, 0, NULL);
+	if (hServerThread == NULL)
+	{
+		printf("Unable to create socket server thread:%d\n", GetLastError());
+		goto BENCHRINGCLEANUP;
+	}
+	//Start the producer process
+	char szModule[MAX_PATH];
+	char szCommandLine[MAX_PATH + 64];
+	STARTUPINFOA StartupInfo = { 0 };
+	PROCESS_INFORMATION ProcessInfo = { 0 };
+	StartupInfo.cb = sizeof(StartupInfo);
+	GetModuleFileNameA(NULL, szModule, MAX_PATH);
+	sprintf_s(szCommandLine, sizeof(szCommandLine), "\"%s\" %s %lu %u", szModule, BENCH_RINGCLIENTARG, GetCurrentProcessId(), ntohs(Addr.sin_port));
+	if (!CreateProcessA(NULL, szCommandLine, NULL, NULL, FALSE, 0, NULL, NULL, &StartupInfo, &ProcessInfo))
+	{
+		printf("Unable to start the producer process:%d\n", GetLastError());
+		goto BENCHRINGCLEANUP;
+	}
+	DWORD dwExitCode = 1;
+	WaitForSingleObject(ProcessInfo.hProcess, INFINITE);
+	GetExitCodeProcess(ProcessInfo.hProcess, &dwExitCode);
+	CloseHandle(ProcessInfo.hThread);
+	CloseHandle(ProcessInfo.hProcess);
+	bResult = (dwExitCode == 0);
+
+BENCHRINGCLEANUP:
+	if (sListen != INVALID_SOCKET)
+		closesocket(sListen); //Fails the accept of the socket server thread if the producer never connected
+	if (hServerThread)
+	{
+		WaitForSingleObject(hServerThread, INFINITE);
+		CloseHandle(hServerThread);
+	}
+	_DeleteTPRing(pRing);
+	WSACleanup();
+	return bResult;
+}
+
+//Socket server thread of the ring benchmark, answers every payload with its checksum until the producer disconnects
+DWORD WINAPI RingSocketServerProc(LPVOID pvParam)
+{
+	SOCKET sServer = accept((SOCKET)pvParam, NULL, NULL);
+	if (sServer == INVALID_SOCKET)
+		return 1;
+	BOOL bNoDelay = TRUE;
+	setsockopt(sServer, IPPROTO_TCP, TCP_NODELAY, (const char*)&bNoDelay, sizeof(bNoDelay));
+	char Payload[BENCH_RINGPAYLOAD];
+	while (RecvAll(sServer, Payload, BENCH_RINGPAYLOAD))
+	{
+		DWORD dwResult = ChecksumPayload(Payload, BENCH_RINGPAYLOAD);
+		if (send(sServer, (const char*)&dwResult, sizeof(dwResult), 0) != sizeof(dwResult))
+			break;
+	}
+	closesocket(sServer);
+	return 0;
+}
+
+//Producer process of the ring benchmark, times the round trips through the ring of the benchmark process and then through its socket server
+BOOL RunRingClient(DWORD dwServerProcessId, USHORT usPort)
+{
+	WCHAR szRing[TPRING_MAXNAME];
+	swprintf_s(szRing, TPRING_MAXNAME, BENCH_RINGNAMEFORMAT, dwServerProcessId);
+	LONG64* piTicks = (LONG64*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, BENCH_RINGROUNDS * sizeof(LONG64));
+	PTPRINGCLIENT pClient = _OpenTPRing(szRing);
+	if (!(piTicks && pClient))
+	{
+		printf("Unable to open TP Ring:%d\n", GetLastError());
+		if (piTicks)
+			HeapFree(GetProcessHeap(), 0, piTicks);
+		return FALSE;
+	}
+	BOOL bResult = TRUE;
+	char Payload[BENCH_RINGPAYLOAD];
+	for (int i = 0; (i < BENCH_RINGROUNDS) && bResult; i++)
+	{
+		DWORD dwTicket, dwResult;
+		*(int*)Payload = i;
+		LARGE_INTEGER liStart, liEnd;
+		QueryPerformanceCounter(&liStart);
+		while (!_SubmitTPRing(pClient, BENCH_RINGCALLBACK, Payload, BENCH_RINGPAYLOAD, &dwTicket))
+		{
+			SwitchToThread();
+		}
+		bResult = _WaitTPRing(pClient, dwTicket, INFINITE, &dwResult) && (dwResult == ChecksumPayload(Payload, BENCH_RINGPAYLOAD));
+		QueryPerformanceCounter(&liEnd);
+		piTicks[i] = liEnd.QuadPart - liStart.QuadPart;
+	}
+	_CloseTPRing(pClient);
+	if (bResult)
+		PrintRingLatency("Shared memory ring", piTicks, BENCH_RINGROUNDS);
+	else
+		printf("Ring round trip failed:%d\n", GetLastError());
+
+	WSADATA WsaData;
+	if (!bResult || (WSAStartup(MAKEWORD(2, 2), &WsaData) != 0))
+	{
+		HeapFree(GetProcessHeap(), 0, piTicks);
+		return FALSE;
+	}
+	SOCKET sClient = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	struct sockaddr_in Addr = { 0 };
+	Addr.sin_family = AF_INET;
+	Addr.sin_addr.S_un.S_addr = htonl(INADDR_LOOPBACK);
+	Addr.sin_port = htons(usPort);
+	if ((sClient == INVALID_SOCKET) || (connect(sClient, (SOCKADDR*)&Addr, sizeof(Addr)) == SOCKET_ERROR))
+	{
+		printf("Unable to connect on loopback:%d\n", WSAGetLastError());
+		bResult = FALSE;
+	}
+	BOOL bNoDelay = TRUE;
+	setsockopt(sClient, IPPROTO_TCP, TCP_NODELAY, (const char*)&bNoDelay, sizeof(bNoDelay));
+	for (int i = 0; (i < BENCH_RINGROUNDS) && bResult; i++)
+	{
+		DWORD dwResult;
+		*(int*)Payload = i;
+		LARGE_INTEGER liStart, liEnd;
+		QueryPerformanceCounter(&liStart);
+		bResult = (send(sClient, Payload, BENCH_RINGPAYLOAD, 0) == BENCH_RINGPAYLOAD) && RecvAll(sClient, (char*)&dwResult, sizeof(dwResult))
+			&& (dwResult == ChecksumPayload(Payload, BENCH_RINGPAYLOAD));
+		QueryPerformanceCounter(&liEnd);
+		piTicks[i] = liEnd.QuadPart - liStart.QuadPart;
+	}
+	if (sClient != INVALID_SOCKET)
+		closesocket(sClient);
+	if (bResult)
+		PrintRingLatency("Loopback TCP", piTicks, BENCH_RINGROUNDS);
+	else
+		printf("Socket round trip failed:%d\n", WSAGetLastError());
+	WSACleanup();
+	HeapFree(GetProcessHeap(), 0, piTicks);
+	return bResult;
+}
+
+//Sorts the round trip times and prints their percentiles in microseconds
+VOID PrintRingLatency(const char* pszMode, LONG64* piTicks, int iCount)
+{
+	LARGE_INTEGER liFrequency;
+	QueryPerformanceFrequency(&liFrequency);
+	qsort(piTicks, iCount, sizeof(LONG64), CompareLongLong);
+	double dToUs = 1000000.0 / (double)liFrequency.QuadPart;
+	printf("%s:p50 %.1f us, p99 %.1f us, max %.1f us per round trip\n", pszMode, piTicks[iCount / 2] * dToUs, piTicks[(iCount * 99) / 100] * dToUs, piTicks[iCount - 1] * dToUs);
+}
+
+//Receives exactly cb bytes, returns FALSE if the connection failed or was closed first
+BOOL RecvAll(SOCKET s, char* pBuffer, int cb)
+{
+	int cbReceived = 0;
+	while (cbReceived < cb)
+	{
+		int cbChunk = recv(s, pBuffer + cbReceived, cb - cbReceived, 0);
+		if (cbChunk <= 0)
+			return FALSE;
+		cbReceived += cbChunk;
+	}
+	return TRUE;
+}
+
+//Ring callback of the ring benchmark, FNV-1a of the payload
+DWORD ChecksumPayload(PVOID pvPayload, DWORD cbPayload)
+{
+	DWORD dwHash = 2166136261UL;
+	for (DWORD i = 0; i < cbPayload; i++)
+		dwHash = (dwHash ^ ((PBYTE)pvPayload)[i]) * 16777619UL;
+	return dwHash;
+}
+
+int CompareLongLong(const void* pvLeft, const void* pvRight)
+{
+	LONG64 iLeft = *(const LONG64*)pvLeft;
+	LONG64 iRight = *(const LONG64*)pvRight;
+	return (iLeft > iRight) - (iLeft < iRight);
+}
+
+/*
+The Work Items of the profiler benchmark, first as is, then while the workload is recorded to BENCH_RECORDFILE in the temp directory
+Reports the recording cost per Work Item and leaves the recording for ThreadPoolReplay
+*/
+BOOL BenchRecord(PTP pTP)
+{
+	WCHAR szFile[MAX_PATH];
+	DWORD dwLen = GetTempPathW(MAX_PATH, szFile);
+	PBENCHREQUEST pRequests = (PBENCHREQUEST)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, BENCH_PROFILEITEMS * sizeof(BENCHREQUEST));
+	if ((dwLen == 0) || (dwLen >= MAX_PATH) || (swprintf_s(szFile + dwLen, MAX_PATH - dwLen, L"%ls", BENCH_RECORDFILE) < 0) || (pRequests == NULL))
+	{
+		printf("Unable to set up the recording benchmark:%d\n", GetLastError());
+		if (pRequests)
+			HeapFree(GetProcessHeap(), 0, pRequests);
+		return FALSE;
+	}
+	double dOffMs = RunProfiledItems(pTP, pRequests);
+	if (!_SetTPRecording(pTP, szFile))
+	{
+		printf("Unable to start recording:%d\n", GetLastError());
+		HeapFree(GetProcessHeap(), 0, pRequests);
+		return FALSE;
+	}
+	double dOnMs = RunProfiledItems(pTP, pRequests);
+	BOOL bResult = _SetTPRecording(pTP, NULL);
+	HeapFree(GetProcessHeap(), 0, pRequests);
+	printf("Recording off:%.2f us/item, recording on:%.2f us/item\n", (dOffMs * 1000.0) / BENCH_PROFILEITEMS, (dOnMs * 1000.0) / BENCH_PROFILEITEMS);
+
+	//Every Work Item completed while recording is in the file
+	TPRECORDHEADER Header = { 0 };
+	DWORD cbRead = 0;
+	HANDLE hFile = CreateFileW(szFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	bResult = bResult && (hFile != INVALID_HANDLE_VALUE) && ReadFile(hFile, &Header, sizeof(Header), &cbRead, NULL) && (cbRead == sizeof(Header)) && (Header.ullRecords == BENCH_PROFILEITEMS);
+	if (hFile != INVALID_HANDLE_VALUE)
+		CloseHandle(hFile);
+	printf("Recorded %llu Work Items of %u callbacks to %ls, replay it with ThreadPoolReplay\n", Header.ullRecords, Header.dwCallbacks, szFile);
+	return bResult;
+}
+
+/*
+A local data file of BENCH_PIPEFILESIZE bytes is read, transformed and written in BENCH_PIPECHUNK chunks, the write being the slowest step
+First by ad-hoc chaining (every transform Work Item inserts the write Work Item of its chunk), then by a read -> transform -> write pipeline with BENCH_PIPETOKENS tokens
+Reports the throughput and the peak number of bytes of chunks in flight, and checks that both output files are the same
+*/
+BOOL BenchPipeline(PTP pTP)
+{
+	WCHAR szTempPath[MAX_PATH], szInput[MAX_PATH], szChained[MAX_PATH], szPipeline[MAX_PATH];
+	if (!GetTempPathW(MAX_PATH, szTempPath) || !GetTempFileNameW(szTempPath, L"tpb", 0, szInput) || !GetTempFileNameW(szTempPath, L"tpb", 0, szChained) || !GetTempFileNameW(szTempPath, L"tpb", 0, szPipeline))
+	{
+		printf("Unable to get a temp file name:%d\n", GetLastError());
+		return FALSE;
+	}
+	//Fill the data file with pseudo random bytes
+	HANDLE hFile = CreateFileW(szInput, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, NULL);
+	PULONG puChunk = (PULONG)HeapAlloc(GetProcessHeap(), 0, 1 << 20);
+	BOOL bResult = (hFile != INVALID_HANDLE_VALUE) && (puChunk != NULL);
+	ULONG uSeed = 2463534242UL;
+	for (int i = 0; bResult && (i < (BENCH_PIPEFILESIZE >> 20)); i++)
+	{
+		DWORD cbWritten;
+		for (int j = 0; j < ((1 << 20) / (int)sizeof(ULONG)); j++)
+		{
+			uSeed ^= uSeed << 13;
+			uSeed ^= uSeed >> 17;
+			uSeed ^= uSeed << 5;
+			puChunk[j] = uSeed;
+		}
+		bResult = WriteFile(hFile, puChunk, 1 << 20, &cbWritten, NULL);
+	}
+	if (hFile != INVALID_HANDLE_VALUE)
+		CloseHandle(hFile);
+	if (puChunk)
+		HeapFree(GetProcessHeap(), 0, puChunk);
+	if (!bResult)
+	{
+		printf("Unable to create the benchmark file:%d\n", GetLastError());
+	}
+
+	bResult = bResult && RunFilePipeline(pTP, szInput, szChained, FALSE) && RunFilePipeline(pTP, szInput, szPipeline, TRUE);
+	if (bResult)
+	{
+		DWORD dwChained = ChecksumFile(szChained), dwPipeline = ChecksumFile(szPipeline);
+		printf("Output checksums:%08lx (ad-hoc chaining), %08lx (pipeline)\n", dwChained, dwPipeline);
+		bResult = (dwChained == dwPipeline);
+	}
+	DeleteFileW(szInput);
+	DeleteFileW(szChained);
+	DeleteFileW(szPipeline);
+	return bResult;
+}
+
+BOOL RunFilePipeline(PTP pTP, const WCHAR* pszInput, const WCHAR* pszOutput, BOOL bPipeline)
+{
+	PIPERUN Run = { 0 };
+	PTPPIPELINE pPipeline = NULL;
+	BOOL bResult = FALSE;
+	Run.pTP = pTP;
+	InitializeSRWLock(&(Run.WriteLock));
+	Run.hInput = CreateFileW(pszInput, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	Run.hOutput = CreateFileW(pszOutput, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, NULL);
+	if ((Run.hInput == INVALID_HANDLE_VALUE) || (Run.hOutput == INVALID_HANDLE_VALUE))
+	{
+		printf("Unable to open the benchmark files:%d\n", GetLastError());
+		goto FILEPIPELINECLEANUP;
+	}
+	if (bPipeline)
+	{
+		pPipeline = _CreatePipeline(pTP, BENCH_PIPETOKENS, &Run);
+		if (!(pPipeline && _AddPipelineStage(pPipeline, TPSTAGE_SERIAL_INORDER, ReadStage) && _AddPipelineStage(pPipeline, TPSTAGE_PARALLEL, TransformStage)
+			&& _AddPipelineStage(pPipeline, TPSTAGE_SERIAL_INORDER, WriteStage)))
+		{
+			printf("Unable to set up the pipeline:%d\n", GetLastError());
+			goto FILEPIPELINECLEANUP;
+		}
+	}
+	else
+	{
+		Run.pTaskGroup = _CreateTaskGroup(pTP);
+		if (Run.pTaskGroup == NULL)
+		{
+			printf("Unable to create Task Group:%d\n", GetLastError());
+			goto FILEPIPELINECLEANUP;
+		}
+	}
+
+	LARGE_INTEGER liStart;
+	QueryPerformanceCounter(&liStart);
+	if (bPipeline)
+	{
+		bResult = _RunPipeline(pPipeline);
+	}
+	else
+	{
+		//Read as fast as the queue takes the transforms, a full queue runs the transform on this thread
+		PPIPECHUNK pChunk;
+		bResult = TRUE;
+		while (bResult && ((pChunk = ReadPipeChunk(&Run)) != NULL))
+		{
+			bResult = _RunInTaskGroup(Run.pTaskGroup, TransformChunkTask, pChunk, WORKITEM_NORMAL);
+		}
+		bResult = _WaitTaskGroup(Run.pTaskGroup) && bResult;
+	}
+	double dMs = ElapsedMilliseconds(liStart);
+	if (!bResult)
+	{
+		printf("Unable to run the %s:%d\n", bPipeline ? "pipeline" : "chained Work Items", GetLastError());
+	}
+	printf("%s:%.0f MB/s, peak %.1f MB of chunks in flight, %d failed chunks\n", bPipeline ? "Pipeline" : "Ad-hoc chaining", (BENCH_PIPEFILESIZE / 1048576.0) * 1000.0 / dMs,
+		Run.iPeakBytes / 1048576.0, Run.iFailed);
+	bResult = bResult && (Run.iFailed == 0);
+
+FILEPIPELINECLEANUP:
+	if (pPipeline)
+		_DeletePipeline(pPipeline);
+	if (Run.pTaskGroup)
+		_DeleteTaskGroup(Run.pTaskGroup);
+	if (Run.hOutput != INVALID_HANDLE_VALUE)
+		CloseHandle(Run.hOutput);
+	if (Run.hInput != INVALID_HANDLE_VALUE)
+		CloseHandle(Run.hInput);
+	return bResult;
+}
+
+//Reads the next chunk of the data file, returns NULL at the end of the file or if the chunk cannot be read
+PPIPECHUNK ReadPipeChunk(PPIPERUN pRun)
+{
+	if (pRun->ullReadOffset >= BENCH_PIPEFILESIZE)
+		return NULL;
+	PPIPECHUNK pChunk = (PPIPECHUNK)HeapAlloc(GetProcessHeap(), 0, sizeof(PIPECHUNK));
+	if ((pChunk == NULL) || !ReadFile(pRun->hInput, pChunk->Data, BENCH_PIPECHUNK, &(pChunk->cbData), NULL) || (pChunk->cbData == 0))
+	{
+		InterlockedIncrement(&(pRun->iFailed));
+		if (pChunk)
+			HeapFree(GetProcessHeap(), 0, pChunk);
+		return NULL;
+	}
+	pChunk->pRun = pRun;
+	pChunk->ullOffset = pRun->ullReadOffset;
+	pRun->ullReadOffset += pChunk->cbData;
+	LONG64 iLive = InterlockedAdd64(&(pRun->iLiveBytes), sizeof(PIPECHUNK));
+	LONG64 iPeak = pRun->iPeakBytes;
+	while ((iLive > iPeak) && (InterlockedCompareExchange64(&(pRun->iPeakBytes), iLive, iPeak) != iPeak))
+		iPeak = pRun->iPeakBytes;
+	return pChunk;
+}
+
+//CPU bound transform of a chunk, in place
+VOID TransformPipeChunk(PPIPECHUNK pChunk)
+{
+	for (int iPass = 0; iPass < BENCH_PIPETRANSFORMPASSES; iPass++)
+	{
+		for (DWORD i = 0; i < pChunk->cbData; i++)
+			pChunk->Data[i] = (BYTE)((pChunk->Data[i] * 31) + 7);
+	}
+}
+
+//Writes a chunk at its offset in the output file and frees it, the checksum passes stand for a slow device
+VOID WritePipeChunk(PPIPECHUNK pChunk)
+{
+	PPIPERUN pRun = pChunk->pRun;
+	OVERLAPPED Ov = { 0 };
+	DWORD cbWritten = 0;
+	Ov.Offset = (DWORD)pChunk->ullOffset;
+	Ov.OffsetHigh = (DWORD)(pChunk->ullOffset >> 32);
+	AcquireSRWLockExclusive(&(pRun->WriteLock));
+	for (int iPass = 0; iPass < BENCH_PIPEWRITEPASSES; iPass++)
+		pRun->dwWriteHash ^= ChecksumPayload(pChunk->Data, pChunk->cbData);
+	if (!WriteFile(pRun->hOutput, pChunk->Data, pChunk->cbData, &cbWritten, &Ov) || (cbWritten != pChunk->cbData))
+		InterlockedIncrement(&(pRun->iFailed));
+	ReleaseSRWLockExclusive(&(pRun->WriteLock));
+	InterlockedAdd64(&(pRun->iLiveBytes), -(LONG64)sizeof(PIPECHUNK));
+	HeapFree(GetProcessHeap(), 0, pChunk);
+}
+
+//First pipeline stage, produces the chunks of the data file in order
+PVOID ReadStage(PVOID pvCtx, PVOID pvItem)
+{
+	UNREFERENCED_PARAMETER(pvItem);
+	return ReadPipeChunk((PPIPERUN)pvCtx);
+}
+
+//Parallel pipeline stage
+PVOID TransformStage(PVOID pvCtx, PVOID pvItem)
+{
+	UNREFERENCED_PARAMETER(pvCtx);
+	TransformPipeChunk((PPIPECHUNK)pvItem);
+	return pvItem;
+}
+
+//Last pipeline stage, serial in order so the output file is written sequentially
+PVOID WriteStage(PVOID pvCtx, PVOID pvItem)
+{
+	UNREFERENCED_PARAMETER(pvCtx);
+	WritePipeChunk((PPIPECHUNK)pvItem);
+	return NULL;
+}
+
+//Ad-hoc chaining, the transform Work Item inserts the write Work Item of its chunk without any flow control
+PVOID TransformChunkTask(PVOID pvParam)
+{
+	PPIPECHUNK pChunk = (PPIPECHUNK)pvParam;
+	TransformPipeChunk(pChunk);
+	if (!_RunInTaskGroup(pChunk->pRun->pTaskGroup, WriteChunkTask, pChunk, WORKITEM_HIGH))
+		WritePipeChunk(pChunk);
+	return 0;
+}
+
+PVOID WriteChunkTask(PVOID pvParam)
+{
+	WritePipeChunk((PPIPECHUNK)pvParam);
+	return 0;
+}
+
+//FNV-1a of every 1MB block of a file folded together, 0 if the file cannot be read
+DWORD ChecksumFile(const WCHAR* pszFile)
+{
+	DWORD dwHash = 0, cbRead = 0;
+	HANDLE hFile = CreateFileW(pszFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	PBYTE pbBlock = (PBYTE)HeapAlloc(GetProcessHeap(), 0, 1 << 20);
+	if ((hFile != INVALID_HANDLE_VALUE) && pbBlock)
+	{
+		while (ReadFile(hFile, pbBlock, 1 << 20, &cbRead, NULL) && (cbRead > 0))
+			dwHash = (dwHash * 16777619UL) ^ ChecksumPayload(pbBlock, cbRead);
+	}
+	if (pbBlock)
+		HeapFree(GetProcessHeap(), 0, pbBlock);
+	if (hFile != INVALID_HANDLE_VALUE)
+		CloseHandle(hFile);
+	return dwHash;
+}
+
+/*
+BENCH_YIELDJOBS low pri batch jobs of BENCH_YIELDUNITS units each keep every Worker Thread busy while BENCH_URGENTITEMS high pri Work Items are inserted every BENCH_URGENTINTERVAL ms
+First the jobs run to the end in one callback, then they check TPShouldYield between units and continue through TPYield
+Reports the high pri queue wait percentiles, the time to finish the batch and the number of yields
+Every mode gets a fresh Thread Pool, so that the queue wait histograms of the modes are apart
+*/
+BOOL BenchYield(PTP pTP)
+{
+	UNREFERENCED_PARAMETER(pTP);
+	return RunBatchJobs(FALSE) && RunBatchJobs(TRUE);
+}
+
+BOOL RunBatchJobs(BOOL bYield)
+{
+	YIELDRUN Run = { 0 };
+	YIELDJOB Jobs[BENCH_YIELDJOBS] = { 0 };
+	PWORKITEM pJobs[BENCH_YIELDJOBS] = { 0 };
+	PWORKITEM pUrgent[BENCH_URGENTITEMS] = { 0 };
+	Run.bYield = bYield;
+	Run.iRemaining = BENCH_YIELDJOBS;
+	Run.hDoneEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	PTP pTP = _CreateTP();
+	if (!(pTP && Run.hDoneEvent))
+	{
+		printf("Unable to set up the batch jobs:%d\n", GetLastError());
+		if (pTP)
+			_DeleteTPEx(pTP, TPDELETE_DRAIN, INFINITE);
+		if (Run.hDoneEvent)
+			CloseHandle(Run.hDoneEvent);
+		return FALSE;
+	}
+	BOOL bResult = TRUE;
+	LARGE_INTEGER liStart;
+	QueryPerformanceCounter(&liStart);
+	int iQueued = 0;
+	for (; bResult && (iQueued < BENCH_YIELDJOBS); iQueued++)
+	{
+		Jobs[iQueued].pRun = &Run;
+		pJobs[iQueued] = _CreateWorkItem(pTP, BatchJobWork, &Jobs[iQueued], WORKITEM_LOW);
+		bResult = pJobs[iQueued] && _TryInsertWork(pTP, pJobs[iQueued]);
+	}
+	if (!bResult)
+	{
+		InterlockedAdd(&(Run.iRemaining), -(BENCH_YIELDJOBS - (iQueued - 1))); //Jobs not queued are not waited for below
+	}
+	for (int i = 0; bResult && (i < BENCH_URGENTITEMS); i++)
+	{
+		Sleep(BENCH_URGENTINTERVAL);
+		pUrgent[i] = _CreateWorkItem(pTP, NopWork, NULL, WORKITEM_HIGH);
+		bResult = pUrgent[i] && _TryInsertWork(pTP, pUrgent[i]);
+		if (!bResult && pUrgent[i])
+		{
+			_DeleteWorkItem(pTP, pUrgent[i]); //Not queued, so it is not polled below
+			pUrgent[i] = NULL;
+		}
+	}
+	if (!bResult)
+	{
+		printf("Unable to run the batch jobs:%d\n", GetLastError());
+	}
+	//The jobs signal the event, the job Work Items complete whenever a callback returns, even when it yielded
+	if (Run.iRemaining > 0)
+		WaitForSingleObject(Run.hDoneEvent, INFINITE);
+	double dMs = ElapsedMilliseconds(liStart);
+	for (int i = 0; i < BENCH_URGENTITEMS; i++)
+	{
+		while (pUrgent[i] && !_IsWorkComplete(pTP, pUrgent[i]))
+			Sleep(1);
+	}
+	if (bResult)
+	{
+		DWORD dwHighP50 = 0, dwHighP99 = 0;
+		_GetTPQueueWaitPercentile(pTP, WORKITEM_HIGH, 50, &dwHighP50);
+		_GetTPQueueWaitPercentile(pTP, WORKITEM_HIGH, 99, &dwHighP99);
+		printf("%s:high pri queue wait p50 <%lu us p99 <%lu us, batch done in %.0f ms, %ld yields\n",
+			bYield ? "TPShouldYield/TPYield" : "Run to completion", dwHighP50, dwHighP99, dMs, Run.iYields);
+	}
+	for (int i = 0; i < BENCH_YIELDJOBS; i++)
+	{
+		if (pJobs[i])
+			_DeleteWorkItem(pTP, pJobs[i]);
+	}
+	for (int i = 0; i < BENCH_URGENTITEMS; i++)
+	{
+		if (pUrgent[i])
+			_DeleteWorkItem(pTP, pUrgent[i]);
+	}
+	_DeleteTPEx(pTP, TPDELETE_DRAIN, INFINITE);
+	CloseHandle(Run.hDoneEvent);
+	return bResult;
+}
+
+//Batch job, runs units of work until the job is done or, in the yield mode, high pri work is waiting for the thread
+PVOID BatchJobWork(PVOID pvParam)
+{
+	PYIELDJOB pJob = (PYIELDJOB)pvParam;
+	PYIELDRUN pRun = pJob->pRun;
+	while (pJob->iNextUnit < BENCH_YIELDUNITS)
+	{
+		LONG64 iState = pJob->iState;
+		for (int i = 0; i < BENCH_YIELDUNITWORK; i++)
+			iState = (iState * 6364136223846793005LL) + pJob->iNextUnit;
+		pJob->iState = iState;
+		pJob->iNextUnit++;
+		//The continuation runs the next units, a continuation which cannot be queued leaves the job to this callback
+		if (pRun->bYield && (pJob->iNextUnit < BENCH_YIELDUNITS) && _TPShouldYield() && _TPYield(BatchJobWork, pJob))
+		{
+			InterlockedIncrement(&(pRun->iYields));
+			return 0;
+		}
+	}
+	if (InterlockedDecrement(&(pRun->iRemaining)) == 0)
+		SetEvent(pRun->hDoneEvent);
+	return 0;
+}
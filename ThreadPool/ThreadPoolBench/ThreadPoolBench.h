@@ -0,0 +1,488 @@
+#pragma once
+#include<WinSock2.h>
+#include<Windows.h>
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include"..\ThreadPoolLib\ThreadPoolLib.h"
+
+#define BENCH_LOOPITERATIONS (1 << 22) //number of loop iterations for the ParallelFor/ParallelReduce benchmarks
+#define BENCH_PERITEMITERATIONS (1 << 16) //number of iterations for the per work item submission baseline
+#define BENCH_COMPUTEWORK 200 //number of inner iterations per element of a compute bound loop
+#define BENCH_FIBN 32 //fib number computed by the fork/join benchmark
+#define BENCH_FIBCUTOFF 16 //fib numbers below this are computed serially
+#define BENCH_SORTELEMENTS (1 << 22) //number of elements sorted by the fork/join quicksort benchmark
+#define BENCH_SORTCUTOFF 4096 //partitions smaller than this are sorted serially
+#define BENCH_ALLOCTASKS 100000 //number of tasks submitted by the allocation benchmark
+#define BENCH_STARTUPRUNS 20 //number of CreateTP/first task/DeleteTP cycles timed by the startup benchmark
+#define BENCH_ECHOCONNECTIONS 16 //number of loopback connections used by the socket echo benchmark
+#define BENCH_ECHOROUNDS 5000 //number of rounds of the socket echo benchmark, every connection echoes one message per round
+#define BENCH_ECHOMSGSIZE 64 //size in bytes of an echoed message
+#define BENCH_IOFILESIZE (64 << 20) //size in bytes of the file read by the async I/O benchmark
+#define BENCH_IOBLOCKSIZE 4096 //size in bytes of a random read
+#define BENCH_IOREADS 200000 //number of random reads per async I/O benchmark mode
+#define BENCH_IODEPTH 64 //number of reads kept in flight
+#define BENCH_IOSAMPLEINTERVAL 10 //number of milliseconds between two samples of the Thread Pool thread count
+#define BENCH_WAITS 400 //number of objects waited on by the wait benchmark, kept below MAXPENDINGWORKITEMS for the blocking Work Item mode
+#define BENCH_WAITPHASE 1000 //number of milliseconds the objects stay unsignalled while the Thread Pool thread count is sampled
+#define BENCH_FLOODITEMS 400 //number of low pri Work Items flooding the Thread Pool, kept below MAXPENDINGWORKITEMS
+#define BENCH_FLOODWORK 10 //number of milliseconds a low pri flood Work Item spins
+#define BENCH_URGENTITEMS 50 //number of high pri Work Items inserted during the flood
+#define BENCH_URGENTINTERVAL 10 //number of milliseconds between two high pri Work Items
+#define BENCH_RESERVEDTHREADS 1 //number of Worker Threads reserved for high pri Work Items
+#define BENCH_MIXITEMS 400 //number of Work Items of the blocking hint benchmark, kept below MAXPENDINGWORKITEMS
+#define BENCH_MIXSLEEPEVERY 4 //every Nth Work Item of the blocking hint benchmark sleeps, the others spin
+#define BENCH_MIXSLEEP 20 //number of milliseconds a sleeping Work Item blocks
+#define BENCH_MIXSPIN 2 //number of milliseconds a CPU bound Work Item spins
+#define BENCH_STRANDCONNS 1000 //number of connections of the strand benchmark, each has a strand or a lock
+#define BENCH_STRANDMSGS 100000 //number of messages of the strand benchmark, spread over the connections with a skewed popularity
+#define BENCH_STRANDWORK 2000 //number of inner iterations a message spends updating its connection state
+#define BENCH_CQITEMS 200000 //number of Work Items harvested by the completion queue benchmark
+#define BENCH_CQOUTSTANDING 400 //number of Work Items kept in flight by the completion queue benchmark, kept below MAXPENDINGWORKITEMS
+#define BENCH_CQBATCH 64 //max number of Work Items harvested by one GetCompletedWorkItems call
+#define BENCH_PROFILEITEMS 100000 //number of Work Items of the profiler benchmark, spread round robin over its callbacks
+#define BENCH_PROFILETOP 5 //number of callbacks printed from the profile
+#define BENCH_RECORDFILE L"ThreadPoolBench.tpr" //workload recording written to the temp directory by the recording benchmark, ThreadPoolReplay reads it
+#define BENCH_COALESCEITEMS 100000 //number of refresh Work Items submitted by the coalescing benchmark
+#define BENCH_COALESCEKEYS 16 //number of distinct refresh targets, the refresh Work Items are spread round robin over them
+#define BENCH_COALESCEWORK 20000 //number of inner iterations of one refresh
+#define BENCH_TAGITEMS 400 //number of Work Items of the aborted request of the tag benchmark, kept below MAXPENDINGWORKITEMS
+#define BENCH_TAGWORK 1 //number of milliseconds a Work Item of the aborted request spins
+#define BENCH_TAG 42 //tag of the aborted request
+#define BENCH_SCRATCHITEMS 100000 //number of Work Items of the worker local storage benchmark
+#define BENCH_SCRATCHSIZE (256 << 10) //size in bytes of the scratch buffer a Work Item of the worker local storage benchmark needs
+#define BENCH_SCRATCHSLOT 0 //TPGetWorkerLocal slot holding the scratch buffer of a thread
+#define BENCH_STUCKITEMS 400 //number of short Work Items queued behind the runaway ones by the watchdog benchmark, kept below MAXPENDINGWORKITEMS
+#define BENCH_STUCKWORK 1 //number of milliseconds a short Work Item of the watchdog benchmark spins
+#define BENCH_RUNAWAYWORK 2000 //number of milliseconds a runaway Work Item of the watchdog benchmark spins
+#define BENCH_WATCHDOGBUDGET 100 //watchdog budget in milliseconds
+#define BENCH_SPILLITEMS 1000000 //number of spillable Work Items inserted by the spill benchmark
+#define BENCH_SPILLBUDGET 256 //number of spillable Work Items the spill benchmark keeps in memory
+#define BENCH_SPILLPARAM 64 //size in bytes of the parameter blob of a spillable Work Item
+#define BENCH_SPILLWORK 2000 //number of inner iterations of a spillable Work Item, so that the producer outruns the Worker Threads
+#define BENCH_SPILLCALLBACK 0 //callback id of the spillable Work Items
+#define BENCH_RINGNAMEFORMAT L"ThreadPoolBench.%lu" //name of the submission ring of the ring benchmark, formatted with the process id of the benchmark
+#define BENCH_RINGCLIENTARG "ringclient" //command line of the producer process started by the ring benchmark: ringclient <benchmark process id> <loopback port>
+#define BENCH_RINGSLOTS 256 //number of slots of the submission ring
+#define BENCH_RINGROUNDS 20000 //number of round trips the producer process times through the ring and through the socket
+#define BENCH_RINGPAYLOAD 64 //size in bytes of the payload of a round trip
+#define BENCH_RINGCALLBACK 0 //callback id of the ring submissions
+#define BENCH_PIPEFILESIZE (64 << 20) //size in bytes of the local data file processed by the pipeline benchmark
+#define BENCH_PIPECHUNK (64 << 10) //size in bytes of a chunk read from the data file
+#define BENCH_PIPETOKENS 16 //number of chunks the pipeline keeps in flight
+#define BENCH_PIPETRANSFORMPASSES 8 //number of passes the parallel transform makes over a chunk
+#define BENCH_PIPEWRITEPASSES 4 //number of checksum passes the serial write makes over a chunk before writing it, so that the write is the slowest stage
+#define BENCH_YIELDJOBS 64 //number of low pri batch jobs of the yield benchmark, kept below MAXPENDINGWORKITEMS
+#define BENCH_YIELDUNITS 1000 //number of units of work of a batch job
+#define BENCH_YIELDUNITWORK 100000 //number of inner iterations of a unit of work, TPShouldYield is checked between two units
+#define IORUN_OVERLAPPED 0 //TPReadAsync on a handle serviced by the I/O completion port
+#define IORUN_FALLBACK 1 //TPReadAsync on a handle serviced by the blocking I/O threads
+#define IORUN_BLOCKING 2 //Blocking ReadFile in Task Group tasks
+
+//Benchmark table entry
+struct _BENCH {
+	const char* pszName; //Name used to select the benchmark on the command line
+	BOOL(*pBench)(PTP); //Benchmark function
+	BOOL bOwnPool; //Benchmark creates and deletes its own Thread Pools, it is passed NULL
+};
+typedef struct _BENCH BENCH;
+
+//Fork/join fib task
+struct _FIBTASK {
+	PTP pTP; //Thread Pool the subtasks are run on
+	int n; //fib number to compute
+	LONG64 iResult; //Computed fib number
+};
+typedef struct _FIBTASK FIBTASK;
+typedef struct _FIBTASK* PFIBTASK;
+
+//Fork/join quicksort task
+struct _SORTTASK {
+	PTP pTP; //Thread Pool the subtasks are run on
+	int* piArray; //Partition to sort
+	LONG64 iCount; //Number of elements in the partition
+};
+typedef struct _SORTTASK SORTTASK;
+typedef struct _SORTTASK* PSORTTASK;
+
+//Client request with the Work Item embedded, it lives for the whole task
+struct _BENCHREQUEST {
+	WORKITEM_STORAGE Work; //Embedded Work Item storage
+	LONG64 iValue; //Request payload
+};
+typedef struct _BENCHREQUEST BENCHREQUEST;
+typedef struct _BENCHREQUEST* PBENCHREQUEST;
+
+//Benchmark run on an array of requests, without (FALSE) or with (TRUE) the feature it measures
+typedef BOOL(*BENCHMODE)(PTP, PBENCHREQUEST, BOOL);
+
+//Loopback connection of the socket echo benchmark
+struct _ECHOCONN {
+	WORKITEM_STORAGE Work; //Embedded Work Item used by the external event loop
+	SOCKET sServer; //Accepted end, echoes what it receives
+	SOCKET sClient; //Connecting end, driven by the benchmark thread
+	WSAEVENT hEvent; //Event the external event loop waits on
+	PSOCKETWORK pSocketWork; //Registration with the Thread Pool
+	volatile LONG bRearm; //Set by the external event loop Work Item once the connection can be waited on again
+	BOOL bInserted; //Set once the external event loop inserted the embedded Work Item
+};
+typedef struct _ECHOCONN ECHOCONN;
+typedef struct _ECHOCONN* PECHOCONN;
+
+//External event loop of the socket echo benchmark
+struct _ECHOLOOP {
+	PTP pTP; //Thread Pool the echo Work Items are inserted to
+	PECHOCONN pConns; //Connections waited on
+	HANDLE hWakeEvent; //Set to make the loop re-arm connections or stop
+	volatile LONG bStop; //Set to stop the loop
+};
+typedef struct _ECHOLOOP ECHOLOOP;
+typedef struct _ECHOLOOP* PECHOLOOP;
+
+//Random read run of the async I/O benchmark
+struct _IORUN {
+	PTP pTP; //Thread Pool the reads are run on
+	PTPIO pIo; //Bound file handle (NULL for blocking reads in Task Group tasks)
+	HANDLE hFile; //File handle
+	PTASKGROUP pTaskGroup; //Task Group running the blocking reads (NULL for async reads)
+	volatile LONG iRemaining; //Number of reads not yet submitted
+	volatile LONG iOutstanding; //Number of read chains still running, one per slot
+	volatile LONG iFailed; //Number of reads which failed or were short
+	HANDLE hDoneEvent; //Set when the last read chain ends
+};
+typedef struct _IORUN IORUN;
+typedef struct _IORUN* PIORUN;
+
+//Read slot, one read of the slot is in flight at a time
+struct _IOSLOT {
+	PIORUN pRun; //Run the slot belongs to
+	PBYTE pbBuffer; //BENCH_IOBLOCKSIZE bytes read buffer
+	ULONG uSeed; //Random offset generator state
+};
+typedef struct _IOSLOT IOSLOT;
+typedef struct _IOSLOT* PIOSLOT;
+
+//Wait benchmark state
+struct _WAITRUN {
+	HANDLE hEvents[BENCH_WAITS]; //Objects waited on
+	volatile LONG iRemaining; //Number of waits whose callback has not run
+	HANDLE hDoneEvent; //Set when the last callback ran
+};
+typedef struct _WAITRUN WAITRUN;
+typedef struct _WAITRUN* PWAITRUN;
+
+//Blocking hint benchmark state
+struct _MIXRUN {
+	BOOL bHint; //Sleeping Work Items call TPEnterBlocking/TPLeaveBlocking around the sleep
+	volatile LONG iRemaining; //Number of Work Items which have not run
+	HANDLE hDoneEvent; //Set when the last Work Item ran
+};
+typedef struct _MIXRUN MIXRUN;
+typedef struct _MIXRUN* PMIXRUN;
+
+//Connection of the strand benchmark, its messages must be handled one at a time in the order they arrived
+struct _STRANDCONN {
+	PSTRAND pStrand; //Strand the messages of the connection are inserted on (NULL for the lock per connection mode)
+	SRWLOCK Lock; //Lock taken by the messages of the connection in the lock per connection mode
+	LONG iNextSeq; //Sequence number of the next message submitted on the connection
+	LONG iExpectedSeq; //Sequence number of the next message expected by the connection state
+	volatile LONG bBusy; //Set while a message of the connection is handled, to detect overlapping messages
+	LONG64 iState; //Connection state updated by every message
+};
+typedef struct _STRANDCONN STRANDCONN;
+typedef struct _STRANDCONN* PSTRANDCONN;
+
+//Message of the strand benchmark, with the Work Item embedded
+struct _STRANDMSG {
+	WORKITEM_STORAGE Work; //Embedded Work Item storage
+	PSTRANDCONN pConn; //Connection the message arrived on
+	LONG iSeq; //Sequence number of the message on its connection
+};
+typedef struct _STRANDMSG STRANDMSG;
+typedef struct _STRANDMSG* PSTRANDMSG;
+
+//Strand benchmark state
+struct _STRANDRUN {
+	volatile LONG iOutOfOrder; //Number of messages handled before an earlier message of their connection
+	volatile LONG iOverlapped; //Number of messages handled while another message of their connection was being handled
+};
+typedef struct _STRANDRUN STRANDRUN;
+typedef struct _STRANDRUN* PSTRANDRUN;
+
+//Yield benchmark state
+struct _YIELDRUN {
+	BOOL bYield; //Batch jobs check TPShouldYield between units and continue through TPYield
+	volatile LONG iRemaining; //Number of batch jobs not yet done
+	volatile LONG iYields; //Number of times a batch job yielded
+	HANDLE hDoneEvent; //Set when the last batch job is done
+};
+typedef struct _YIELDRUN YIELDRUN;
+typedef struct _YIELDRUN* PYIELDRUN;
+
+//Low pri batch job of the yield benchmark, it keeps its progress so that a continuation picks up where the callback yielded
+struct _YIELDJOB {
+	PYIELDRUN pRun; //Run the job belongs to
+	int iNextUnit; //First unit of work not yet done
+	LONG64 iState; //State updated by every unit
+};
+typedef struct _YIELDJOB YIELDJOB;
+typedef struct _YIELDJOB* PYIELDJOB;
+
+//File processing run of the pipeline benchmark, read -> transform -> write of the data file in BENCH_PIPECHUNK chunks
+struct _PIPERUN {
+	PTP pTP; //Thread Pool the chunks are processed on
+	PTASKGROUP pTaskGroup; //Task Group of the transform and write Work Items (NULL for the pipeline mode)
+	HANDLE hInput; //Data file
+	HANDLE hOutput; //Output file, every chunk is written at the offset it was read from
+	ULONGLONG ullReadOffset; //Offset of the next chunk read, only the reading thread accesses it
+	SRWLOCK WriteLock; //Serializes the writes of the ad-hoc chaining mode, the pipeline write stage is serial already
+	DWORD dwWriteHash; //Checksum folded by the write passes, under WriteLock
+	volatile LONG64 iLiveBytes; //Bytes of chunks read and not yet written
+	volatile LONG64 iPeakBytes; //Highest iLiveBytes seen
+	volatile LONG iFailed; //Number of chunks which could not be read or written
+};
+typedef struct _PIPERUN PIPERUN;
+typedef struct _PIPERUN* PPIPERUN;
+
+//Chunk of the data file in flight
+struct _PIPECHUNK {
+	PPIPERUN pRun; //Run the chunk belongs to
+	ULONGLONG ullOffset; //Offset of the chunk in the data and output files
+	DWORD cbData; //Number of bytes read
+	BYTE Data[BENCH_PIPECHUNK]; //Chunk data
+};
+typedef struct _PIPECHUNK PIPECHUNK;
+typedef struct _PIPECHUNK* PPIPECHUNK;
+
+//Function declarations
+double ElapsedMilliseconds(LARGE_INTEGER); //Milliseconds since the supplied QueryPerformanceCounter value
+BOOL BenchParallelFor(PTP);
+VOID MemoryBoundBody(PVOID, LONG64, LONG64);
+VOID ComputeBoundBody(PVOID, LONG64, LONG64);
+VOID SumBody(PVOID, LONG64, LONG64, PVOID);
+VOID SumCombine(PVOID, PVOID, PVOID);
+PVOID MemoryBoundWork(PVOID);
+PVOID ComputeBoundWork(PVOID);
+double RunPerItemBaseline(PTP, CALLBACK_INSTANCE, double*, int);
+BOOL BenchForkJoin(PTP);
+LONG64 SerialFib(int);
+PVOID FibTask(PVOID);
+PVOID SortTask(PVOID);
+int CompareInt(const void*, const void*);
+VOID PrintThreadCount(PTP, const char*);
+BOOL BenchAlloc(PTP);
+PVOID AddValueWork(PVOID);
+PWORKITEM InitEmbedded(PTP, PBENCHREQUEST, CALLBACK_INSTANCE, LONG64);
+VOID SubmitEmbedded(PTP, PBENCHREQUEST);
+VOID WaitEmbedded(PTP, PBENCHREQUEST, int);
+BOOL RunRequestModes(PTP, int, BENCHMODE);
+int GetAllocatedWorkItems(PTP);
+BOOL BenchStartup(PTP);
+BOOL RunStartupCycles(BOOL);
+PVOID NopWork(PVOID);
+BOOL BenchSocket(PTP);
+BOOL OpenEchoConnections(PECHOCONN, int);
+VOID CloseEchoConnections(PECHOCONN, int);
+double RunEchoRounds(PECHOCONN, int);
+VOID EchoSocket(SOCKET);
+VOID PoolEchoCallback(PSOCKETWORK, UINT_PTR, LONG, int, PVOID);
+PVOID LoopEchoWork(PVOID);
+DWORD WINAPI EchoLoopThreadProc(LPVOID);
+BOOL BenchFileIo(PTP);
+BOOL RunRandomReads(PTP, const WCHAR*, int);
+ULONGLONG NextReadOffset(PIOSLOT);
+BOOL SubmitNextRead(PIOSLOT);
+VOID ReadCompleteCallback(PTPIO, PVOID, DWORD, DWORD);
+PVOID BlockingReadTask(PVOID);
+BOOL BenchWait(PTP);
+BOOL RunWaits(PWAITRUN, BOOL);
+VOID WaitSignalledCallback(PWAITWORK, PVOID, BOOL);
+PVOID BlockingWaitWork(PVOID);
+int SampleThreadCount(PTP, DWORD);
+BOOL BenchReserve(PTP);
+BOOL RunPriorityFlood(BOOL);
+PVOID SpinWork(PVOID);
+BOOL BenchBlocking(PTP);
+BOOL RunMixedWork(BOOL);
+PVOID MixedWork(PVOID);
+BOOL BenchStrand(PTP);
+BOOL RunStrandMessages(PTP, PSTRANDCONN, PSTRANDMSG, BOOL);
+int PickStrandConn(PULONG);
+PVOID StrandMsgWork(PVOID);
+PVOID LockedMsgWork(PVOID);
+VOID HandleStrandMsg(PSTRANDMSG);
+BOOL BenchCompletion(PTP);
+BOOL RunHarvest(PTP, PBENCHREQUEST, BOOL);
+VOID SubmitHarvestItem(PTP, PBENCHREQUEST, PCOMPLETIONQUEUE);
+BOOL BenchProfile(PTP);
+double RunProfiledItems(PTP, PBENCHREQUEST);
+BOOL BenchCoalesce(PTP);
+BOOL RunRefreshes(PTP, PBENCHREQUEST, BOOL);
+PVOID RefreshWork(PVOID);
+BOOL BenchTag(PTP);
+BOOL RunAbortedRequest(PTP, PBENCHREQUEST, BOOL);
+BOOL BenchWorkerLocal(PTP);
+BOOL RunScratchWork(PTP, PBENCHREQUEST, BOOL);
+PVOID ScratchAllocWork(PVOID);
+PVOID ScratchLocalWork(PVOID);
+VOID UseScratch(PBYTE, LONG64);
+VOID ScratchThreadStart(PTP, PVOID);
+VOID ScratchThreadExit(PTP, PVOID);
+BOOL BenchWatchdog(PTP);
+BOOL RunStuckWork(PTP, PBENCHREQUEST, BOOL);
+VOID WatchdogReport(PTP, PTPRUNNINGWORK, PVOID);
+BOOL BenchSpill(PTP);
+BOOL BenchRing(PTP);
+BOOL BenchRecord(PTP);
+BOOL BenchPipeline(PTP);
+BOOL RunFilePipeline(PTP, const WCHAR*, const WCHAR*, BOOL);
+PPIPECHUNK ReadPipeChunk(PPIPERUN);
+VOID TransformPipeChunk(PPIPECHUNK);
+VOID WritePipeChunk(PPIPECHUNK);
+PVOID ReadStage(PVOID, PVOID);
+PVOID TransformStage(PVOID, PVOID);
+PVOID WriteStage(PVOID, PVOID);
+PVOID TransformChunkTask(PVOID);
+PVOID WriteChunkTask(PVOID);
+DWORD ChecksumFile(const WCHAR*);
+BOOL BenchYield(PTP);
+BOOL RunBatchJobs(BOOL);
+PVOID BatchJobWork(PVOID);
+DWORD WINAPI RingSocketServerProc(LPVOID);
+BOOL RunRingClient(DWORD, USHORT);
+VOID PrintRingLatency(const char*, LONG64*, int);
+BOOL RecvAll(SOCKET, char*, int);
+DWORD ChecksumPayload(PVOID, DWORD);
+int CompareLongLong(const void*, const void*);
+PVOID SpillEventWork(PVOID);
+
+//Typedefs for importing various functions from ThreadPoolLib.dll
+typedef PTP(*MYPROC)();
+typedef PWORKITEM(*MYPROC1)(PTP, CALLBACK_INSTANCE, PVOID, DWORD);
+typedef BOOL(*MYPROC2)(PTP, PWORKITEM);
+typedef BOOL(*MYPROC3)(PTP, PTPSTATS);
+typedef BOOL(*MYPROC5)(PTP, LONG64, LONG64, LONG64, PARALLELFOR_BODY, PVOID);
+typedef BOOL(*MYPROC6)(PTP, LONG64, LONG64, LONG64, PARALLELREDUCE_BODY, PARALLELREDUCE_COMBINE, PVOID, PVOID, PVOID, SIZE_T);
+typedef PTASKGROUP(*MYPROC7)(PTP);
+typedef BOOL(*MYPROC8)(PTASKGROUP, CALLBACK_INSTANCE, PVOID, DWORD);
+typedef BOOL(*MYPROC9)(PTASKGROUP);
+typedef BOOL(*MYPROC10)(PWORKITEM, PTP, CALLBACK_INSTANCE, PVOID, DWORD);
+typedef BOOL(*MYPROC11)(PWORKITEM, LPCVOID, SIZE_T);
+typedef BOOL(*MYPROC12)(PTP, DWORD, DWORD);
+typedef BOOL(*MYPROC13)(PTP, int);
+typedef PSOCKETWORK(*MYPROC14)(PTP, UINT_PTR, LONG, SOCKETWORK_CALLBACK, PVOID);
+typedef BOOL(*MYPROC15)(PSOCKETWORK);
+typedef PTPIO(*MYPROC16)(PTP, HANDLE, BOOL);
+typedef BOOL(*MYPROC17)(PTPIO);
+typedef BOOL(*MYPROC18)(PTPIO, PVOID, DWORD, ULONGLONG, TPIO_CALLBACK, PVOID);
+typedef PWAITWORK(*MYPROC19)(PTP, HANDLE, DWORD, WAITWORK_CALLBACK, PVOID, DWORD);
+typedef BOOL(*MYPROC20)(PWAITWORK);
+typedef BOOL(*MYPROC21)(PTP, DWORD, int);
+typedef BOOL(*MYPROC22)(PTP, DWORD, DWORD, PDWORD);
+typedef BOOL(*MYPROC23)();
+typedef PSTRAND(*MYPROC24)(PTP);
+typedef BOOL(*MYPROC25)(PSTRAND, PWORKITEM);
+typedef BOOL(*MYPROC26)(PSTRAND);
+typedef PCOMPLETIONQUEUE(*MYPROC27)(PTP);
+typedef BOOL(*MYPROC28)(PWORKITEM, PCOMPLETIONQUEUE);
+typedef DWORD(*MYPROC29)(PCOMPLETIONQUEUE, PWORKITEM*, DWORD, DWORD);
+typedef BOOL(*MYPROC30)(PCOMPLETIONQUEUE);
+typedef BOOL(*MYPROC31)(PTP, BOOL);
+typedef BOOL(*MYPROC32)(PTP, PTPPROFILEENTRY, DWORD, PDWORD);
+typedef BOOL(*MYPROC33)(PWORKITEM, ULONG_PTR);
+typedef BOOL(*MYPROC34)(PTP, PWORKITEM, ULONG_PTR);
+typedef BOOL(*MYPROC35)(PTP, ULONG_PTR);
+typedef BOOL(*MYPROC36)(PTP, ULONG_PTR, PTPTAGSTATS);
+typedef BOOL(*MYPROC37)(PTP, TPTHREAD_HOOK, TPTHREAD_HOOK, PVOID);
+typedef PVOID*(*MYPROC38)(DWORD);
+typedef BOOL(*MYPROC39)(PTP, PTPRUNNINGWORK, DWORD, PDWORD);
+typedef BOOL(*MYPROC40)(PTP, DWORD, TPWATCHDOG_CALLBACK, PVOID, DWORD);
+typedef BOOL(*MYPROC41)(PTP, LPCWSTR, int);
+typedef BOOL(*MYPROC42)(PTP, DWORD, CALLBACK_INSTANCE);
+typedef BOOL(*MYPROC43)(PTP, DWORD, LPCVOID, DWORD);
+typedef PTPRING(*MYPROC44)(PTP, LPCWSTR, DWORD);
+typedef BOOL(*MYPROC45)(PTPRING, DWORD, TPRING_CALLBACK);
+typedef BOOL(*MYPROC46)(PTPRING);
+typedef PTPRINGCLIENT(*MYPROC47)(LPCWSTR);
+typedef BOOL(*MYPROC48)(PTPRINGCLIENT, DWORD, LPCVOID, DWORD, PDWORD);
+typedef BOOL(*MYPROC49)(PTPRINGCLIENT, DWORD, DWORD, PDWORD);
+typedef BOOL(*MYPROC50)(PTPRINGCLIENT);
+typedef BOOL(*MYPROC51)(PTP, LPCWSTR);
+typedef PTPPIPELINE(*MYPROC52)(PTP, DWORD, PVOID);
+typedef BOOL(*MYPROC53)(PTPPIPELINE, DWORD, TPSTAGE_CALLBACK);
+typedef BOOL(*MYPROC54)(PTPPIPELINE);
+typedef BOOL(*MYPROC55)(CALLBACK_INSTANCE, PVOID);
+
+volatile LONG64 g_iBenchTotal; //Sum accumulated by AddValueWork
+PECHOLOOP g_pEchoLoop; //External event loop, the echo Work Items notify it
+PWAITRUN g_pWaitRun; //Wait benchmark state, the blocking wait Work Items use it
+PMIXRUN g_pMixRun; //Blocking hint benchmark state, its Work Items use it
+PSTRANDRUN g_pStrandRun; //Strand benchmark state, its messages use it
+volatile LONG g_iScratchThreads; //Number of threads whose start hook allocated a scratch buffer and whose exit hook has not freed it yet
+volatile LONG g_iWatchdogReports; //Number of callbacks the watchdog reported
+
+//Declaration of the ThreadPoolLib function pointers
+MYPROC _CreateTP;
+MYPROC1 _CreateWorkItem;
+MYPROC2 _TryInsertWork;
+MYPROC2 _IsWorkComplete;
+MYPROC2 _DeleteWorkItem;
+MYPROC3 _GetTPStats;
+MYPROC5 _ParallelFor;
+MYPROC6 _ParallelReduce;
+MYPROC7 _CreateTaskGroup;
+MYPROC8 _RunInTaskGroup;
+MYPROC9 _WaitTaskGroup;
+MYPROC9 _DeleteTaskGroup;
+MYPROC10 _InitWorkItem;
+MYPROC11 _SetWorkItemInlineParam;
+MYPROC12 _DeleteTPEx;
+MYPROC13 _TPPrewarm;
+MYPROC14 _RegisterSocketWork;
+MYPROC15 _ReArmSocketWork;
+MYPROC15 _UnregisterSocketWork;
+MYPROC16 _TPBindIoHandle;
+MYPROC17 _TPUnbindIoHandle;
+MYPROC18 _TPReadAsync;
+MYPROC19 _RegisterWaitForSignal;
+MYPROC20 _UnregisterWaitForSignal;
+MYPROC21 _SetTPReservedThreads;
+MYPROC21 _SetTPPriorityCap;
+MYPROC22 _GetTPQueueWaitPercentile;
+MYPROC23 _TPEnterBlocking;
+MYPROC23 _TPLeaveBlocking;
+MYPROC24 _CreateStrand;
+MYPROC25 _InsertWorkOnStrand;
+MYPROC26 _DeleteStrand;
+MYPROC27 _CreateCompletionQueue;
+MYPROC28 _SetWorkItemCompletionQueue;
+MYPROC29 _GetCompletedWorkItems;
+MYPROC30 _DeleteCompletionQueue;
+MYPROC31 _SetTPProfiling;
+MYPROC32 _GetTPProfile;
+MYPROC33 _SetWorkItemCoalesceKey;
+MYPROC34 _SetWorkItemTag;
+MYPROC35 _CancelWorkByTag;
+MYPROC35 _ReleaseWorkTag;
+MYPROC36 _GetWorkTagStats;
+MYPROC37 _SetTPThreadHooks;
+MYPROC38 _TPGetWorkerLocal;
+MYPROC39 _EnumerateRunningWork;
+MYPROC40 _SetTPWatchdog;
+MYPROC41 _SetTPSpill;
+MYPROC42 _RegisterSpillCallback;
+MYPROC43 _InsertSpillableWork;
+MYPROC44 _CreateTPRing;
+MYPROC45 _RegisterRingCallback;
+MYPROC46 _DeleteTPRing;
+MYPROC47 _OpenTPRing;
+MYPROC48 _SubmitTPRing;
+MYPROC49 _WaitTPRing;
+MYPROC50 _CloseTPRing;
+MYPROC51 _SetTPRecording;
+MYPROC52 _CreatePipeline;
+MYPROC53 _AddPipelineStage;
+MYPROC54 _RunPipeline;
+MYPROC54 _DeletePipeline;
+MYPROC23 _TPShouldYield;
+MYPROC55 _TPYield;
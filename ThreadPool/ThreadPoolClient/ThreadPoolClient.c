@@ -56,15 +56,15 @@ int main()
 		printf("\n************Thread Pool Stats*************\n");
 		printf("Current No. of Running Threads:%d\n", pMyTPStats->iCurrentRunningThreads);
 		printf("Current No. of Waiting Threads:%d\n", pMyTPStats->iCurrentWaitingThreads);
-		printf("No. of HighPri Work Items Added:%d\n", pMyTPStats->iNumWorkItemsAdded_high);
-		printf("No. of NormalPri Work Items Added:%d\n", pMyTPStats->iNumWorkItemsAdded_normal);
-		printf("No. of LowPri Work Items Added:%d\n", pMyTPStats->iNumWorkItemsAdded_low);
-		printf("No. of HighPri Work Items Handled:%d\n", pMyTPStats->iNumWorkItemsHandled_high);
-		printf("No. of NormalPri Work Items Handled:%d\n", pMyTPStats->iNumWorkItemsHandled_normal);
-		printf("No. of LowPri Work Items Handled:%d\n", pMyTPStats->iNumWorkItemsHandled_low);
-		printf("No. of HighPri Work Items Pending:%d\n", pMyTPStats->iNumWorkItemsPending_high);
-		printf("No. of NormalPri Work Items Pending:%d\n", pMyTPStats->iNumWorkItemsPending_normal);
-		printf("No. of LowPri Work Items Pending:%d\n", pMyTPStats->iNumWorkItemsPending_low);
+		printf("No. of HighPri Work Items Added:%d\n", pMyTPStats->iNumWorkItemsAdded[WORKITEM_HIGH]);
+		printf("No. of NormalPri Work Items Added:%d\n", pMyTPStats->iNumWorkItemsAdded[WORKITEM_NORMAL]);
+		printf("No. of LowPri Work Items Added:%d\n", pMyTPStats->iNumWorkItemsAdded[WORKITEM_LOW]);
+		printf("No. of HighPri Work Items Handled:%d\n", pMyTPStats->iNumWorkItemsHandled[WORKITEM_HIGH]);
+		printf("No. of NormalPri Work Items Handled:%d\n", pMyTPStats->iNumWorkItemsHandled[WORKITEM_NORMAL]);
+		printf("No. of LowPri Work Items Handled:%d\n", pMyTPStats->iNumWorkItemsHandled[WORKITEM_LOW]);
+		printf("No. of HighPri Work Items Pending:%d\n", pMyTPStats->iNumWorkItemsPending[WORKITEM_HIGH]);
+		printf("No. of NormalPri Work Items Pending:%d\n", pMyTPStats->iNumWorkItemsPending[WORKITEM_NORMAL]);
+		printf("No. of LowPri Work Items Pending:%d\n", pMyTPStats->iNumWorkItemsPending[WORKITEM_LOW]);
 	}
 
 	if (!_DeleteTP(pMyTPQ))
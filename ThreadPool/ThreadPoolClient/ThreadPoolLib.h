@@ -1,49 +1,292 @@
 #pragma once
 #include"c:\Users\ashokh\source\repos\Dll_LinkedList\Dll_LinkedList\Dll_LinkedList.h"
 
+#define WORKITEM_NUMPRIORITIES 32 //Number of Work Item priorities, any value from 0 (lowest) to WORKITEM_NUMPRIORITIES - 1 (highest) can be used
 #define WORKITEM_LOW 0 //Low Pri Work Item
-#define WORKITEM_NORMAL 1 //Normal Pri Work Item
-#define WORKITEM_HIGH 2 //High Pri Work Item
+#define WORKITEM_NORMAL 16 //Normal Pri Work Item
+#define WORKITEM_HIGH (WORKITEM_NUMPRIORITIES - 1) //High Pri Work Item
+#define WORKITEM_LONGRUNNING 0x100 //OR'd into the priority of CreateWorkItem/InitWorkItem/RunInTaskGroup, the Work Item runs on a dedicated Long Running Thread outside the Worker Threads
 #define WORK_NOTCOMPLETE 0 //Work Item Not Complete Status
 #define WORK_COMPLETE 1 //Work Item Complete Status
+#define WORK_CANCELLED 2 //Work Item dropped from the queue by DeleteTPEx Status
+#define TPDELETE_DRAIN 1 //DeleteTPEx runs queued work items before deleting the Thread Pool
+#define TPDELETE_CANCEL 2 //DeleteTPEx drops queued work items and waits for running ones
+#define TPDELETE_ABORT 3 //DeleteTPEx drops queued work items and waits for running ones until the timeout
+#define WORKITEM_INLINEPARAM_SIZE 32 //Max size in bytes of a parameter copied into the Work Item itself
+#define WORKITEM_STORAGE_SIZE 192 //Size in bytes of caller supplied storage for a Work Item
+#define WAITWORK_ONESHOT 0x0 //RegisterWaitForSignal callback runs once, when the object is signalled or the wait times out
+#define WAITWORK_REPEAT 0x1 //RegisterWaitForSignal callback runs every time the object is signalled or the wait times out
+#define TPWORKERLOCAL_SLOTS 16 //Number of per thread storage slots TPGetWorkerLocal gives access to
+#define TPSPILL_MAXCALLBACKS 64 //Number of callback ids of spillable Work Items, RegisterSpillCallback accepts 0 to TPSPILL_MAXCALLBACKS - 1
+#define TPSPILL_MAXPARAM 4096 //Max size in bytes of the parameter blob of a spillable Work Item
+#define TPRING_MAXCALLBACKS 64 //Number of callback ids of ring submissions, RegisterRingCallback accepts 0 to TPRING_MAXCALLBACKS - 1
+#define TPRING_MAXPAYLOAD 224 //Max size in bytes of the inline payload of a ring submission
+#define TPRING_MAXSLOTS 4096 //Max number of slots of a submission ring
+#define TPRING_MAXNAME 64 //Max number of characters of the name of a submission ring, including the terminating null
+#define TPRING_NAMEFORMAT L"Local\\ThreadPool.Ring.%ls" //Name of the file mapping holding a submission ring, formatted with the name passed to CreateTPRing
+#define TPPIPELINE_MAXSTAGES 16 //Max number of stages of a pipeline
+#define TPSTAGE_PARALLEL 0 //Pipeline stage kind, the stage runs any number of tokens at once
+#define TPSTAGE_SERIAL_INORDER 1 //Pipeline stage kind, the stage runs one token at a time in the order the first stage produced them
+#define TPSTAGE_SERIAL_OUTOFORDER 2 //Pipeline stage kind, the stage runs one token at a time in any order
+#define TPRECORD_MAGIC 0x52525054 //First DWORD of a workload recording file ("TPRR")
+#define TPRECORD_VERSION 1 //Layout version of a workload recording file, incremented whenever TPRECORDHEADER, TPRECORD or TPRECORDCALLBACK change
+#define TPRECORD_MAXCALLBACKS 1024 //Max number of distinct callbacks of a recording, the Work Items of the callbacks seen after that get TPRECORD_OTHERCALLBACK
+#define TPRECORD_OTHERCALLBACK 0xFFFF //Callback id of the Work Items whose callback did not fit in the callback table of the recording
+#define TPRECORD_LONGRUNNING 0x1 //TPRECORD flag, the Work Item was inserted with WORKITEM_LONGRUNNING
+#define TPWATCHDOG_INJECTWORKER 0x1 //SetTPWatchdog flag, a Worker Thread stuck over the budget does not count against the ideal number of Worker Threads, one more is created for the queued work
+#define TPSTATS_SEGMENT_MAGIC 0x53535054 //First DWORD of a stats segment ("TPSS")
+#define TPSTATS_SEGMENT_VERSION 3 //Layout version of TPSTATSSEGMENT, incremented whenever TPSTATS or TPSTATSSEGMENT change
+#define TPSTATS_SEGMENT_NAMEFORMAT L"Local\\ThreadPool.%lu.%ls" //Name of the file mapping holding a stats segment, formatted with the process id and the name passed to PublishTPStats
+#define TPPROFILE_MAXSYMBOL 128 //Max number of characters of a callback symbol reported by GetTPProfile, including the terminating null
+#define TPSTATS_SEGMENT_MAXNAME 64 //Max number of characters of the name passed to PublishTPStats, including the terminating null
 
 typedef LINK TPQ;
 typedef PLINK PTPQ;
 typedef PVOID(*CALLBACK_INSTANCE)(PVOID); //Client function callback prototype
+typedef VOID(*PARALLELFOR_BODY)(PVOID, LONG64, LONG64); //ParallelFor loop body prototype, called with the client context and a [begin,end) index range
+typedef VOID(*PARALLELREDUCE_BODY)(PVOID, LONG64, LONG64, PVOID); //ParallelReduce loop body prototype, accumulates a [begin,end) index range into the supplied accumulator
+typedef VOID(*PARALLELREDUCE_COMBINE)(PVOID, PVOID, PVOID); //ParallelReduce combine prototype, folds the second accumulator into the first
 
 //WorkItem structure typedefs
 typedef struct _WORKITEM WORKITEM;
 typedef struct _WORKITEM* PWORKITEM;
 
+//Caller supplied storage for a Work Item embedded in a client structure, prepared with InitWorkItem and cast to PWORKITEM
+typedef union _WORKITEM_STORAGE {
+	ULONGLONG Alignment; //Aligns the storage for the Work Item members
+	BYTE Reserved[WORKITEM_STORAGE_SIZE];
+} WORKITEM_STORAGE;
+
 //Thread Pool Structure typedefs
 typedef struct _TP TP;
 typedef struct _TP* PTP;
+typedef VOID(*TPTHREAD_HOOK)(PTP, PVOID); //Thread start/exit hook prototype, called on the Worker or Long Running Thread with its Thread Pool and the client context
+
+//Task Group structure typedefs
+typedef struct _TASKGROUP TASKGROUP;
+typedef struct _TASKGROUP* PTASKGROUP;
+
+//Socket Work structure typedefs
+typedef struct _SOCKETWORK SOCKETWORK;
+typedef struct _SOCKETWORK* PSOCKETWORK;
+typedef VOID(*SOCKETWORK_CALLBACK)(PSOCKETWORK, UINT_PTR, LONG, int, PVOID); //Socket readiness callback prototype, called with the registration, the SOCKET, the FD_ network events which fired, their first error code and the client context
+
+//Async I/O handle typedefs
+typedef struct _TPIO TPIO;
+typedef struct _TPIO* PTPIO;
+typedef VOID(*TPIO_CALLBACK)(PTPIO, PVOID, DWORD, DWORD); //Async I/O completion callback prototype, called on a Worker Thread with the bound handle, the client context, the Win32 error code and the number of bytes transferred
+
+//Wait Work structure typedefs
+typedef struct _WAITWORK WAITWORK;
+typedef struct _WAITWORK* PWAITWORK;
+typedef VOID(*WAITWORK_CALLBACK)(PWAITWORK, PVOID, BOOL); //Wait callback prototype, called on a Worker Thread with the registration, the client context and whether the wait timed out
+
+//Strand structure typedefs
+typedef struct _STRAND STRAND;
+typedef struct _STRAND* PSTRAND;
+
+//Completion queue structure typedefs
+typedef struct _COMPLETIONQUEUE COMPLETIONQUEUE;
+typedef struct _COMPLETIONQUEUE* PCOMPLETIONQUEUE;
+
+//Pipeline typedefs
+typedef struct _TPPIPELINE TPPIPELINE;
+typedef struct _TPPIPELINE* PTPPIPELINE;
+typedef PVOID(*TPSTAGE_CALLBACK)(PVOID, PVOID); //Pipeline stage prototype, called with the client context and the item returned by the previous stage, returns the item passed to the next stage (the first stage is called with NULL and returns NULL at the end of the input)
+
+//Submission ring typedefs, a shared memory ring the other processes of the host submit work to
+typedef struct _TPRING TPRING;
+typedef struct _TPRING* PTPRING;
+typedef struct _TPRINGCLIENT TPRINGCLIENT;
+typedef struct _TPRINGCLIENT* PTPRINGCLIENT;
+typedef DWORD(*TPRING_CALLBACK)(PVOID, DWORD); //Ring callback prototype, called on a Worker Thread with the payload in the ring slot and its size, returns the result passed back to the submitting process
+
+//Work Item running on a Thread Pool thread, returned by EnumerateRunningWork and passed to the watchdog callback
+struct _TPRUNNINGWORK {
+	PWORKITEM pWork; //Running Work Item, only for identification, it may be complete and freed by the time it is looked at
+	CALLBACK_INSTANCE pCallback; //Callback function being run
+	DWORD dwThreadId; //Thread running the callback
+	DWORD dwRunningMs; //Number of milliseconds the callback has been running
+	BOOL bLongRunning; //Run by a Long Running Thread, the watchdog does not report these
+};
+typedef struct _TPRUNNINGWORK TPRUNNINGWORK;
+typedef struct _TPRUNNINGWORK* PTPRUNNINGWORK;
+typedef VOID(*TPWATCHDOG_CALLBACK)(PTP, PTPRUNNINGWORK, PVOID); //Watchdog callback prototype, called on the Control Thread with the Thread Pool, the Work Item over the budget and the client context
+
+//Per tag Work Item counters, returned by GetWorkTagStats
+struct _TPTAGSTATS {
+	int iNumPending; //Num of tagged Work Items inserted and not yet started, including cancelled ones not yet reached by a thread
+	int iNumRunning; //Num of tagged Work Items whose callback is running
+	int iNumCompleted; //Num of tagged Work Items completed
+	int iNumCancelled; //Num of tagged Work Items dropped by CancelWorkByTag or DeleteTPEx without calling their callback
+};
+typedef struct _TPTAGSTATS TPTAGSTATS;
+typedef struct _TPTAGSTATS* PTPTAGSTATS;
 
 //Thread Pool Statistics structure
 struct _TPSTATS {
 	int iCurrentRunningThreads; //Num Of Threads Running in the Thread Pool
 	int iCurrentWaitingThreads; //Num of Threads Waiting in the Thread Pool
-	int iNumWorkItemsAdded_low; //Num of Low Pri Work Items Added
-	int iNumWorkItemsPending_low; //Num of Low Pri Work Items Pending
-	int iNumWorkItemsHandled_low; //Num of Low Pri Work Items Handled
-	int iNumWorkItemsAdded_normal; //Num of Normal Pri Work Items Added
-	int iNumWorkItemsPending_normal; //Num of Normal Pri Work Items Pending
-	int iNumWorkItemsHandled_normal; //Num of Normal Pri Work Items Handled
-	int iNumWorkItemsAdded_high; //Num of High Pri Work Items Added
-	int iNumWorkItemsPending_high; //Num of High Pri Work Items Pending
-	int iNumWorkItemsHandled_high; //Num of High Pri Work Items Handled
+	int iCurrentBlockedThreads; //Num of running Threads inside a TPEnterBlocking/TPLeaveBlocking region
+	int iNumWorkItemsAdded[WORKITEM_NUMPRIORITIES]; //Num of Work Items Added, per priority
+	int iNumWorkItemsPending[WORKITEM_NUMPRIORITIES]; //Num of Work Items Pending, per priority
+	int iNumWorkItemsHandled[WORKITEM_NUMPRIORITIES]; //Num of Work Items Handled, per priority
+	DWORD dwQueueWaitP99[WORKITEM_NUMPRIORITIES]; //99th percentile of the time Work Items waited in the queue in microseconds (upper bound of a power of 2 bucket), per priority
+	int iNumWorkItemsAllocated; //Num of Work Items allocated from the heap by the Thread Pool
+	int iNumIoPending; //Num of async I/O requests whose callback has not completed
+	int iNumIoThreads; //Num of I/O Completion and blocking I/O threads
+	int iNumLongRunningThreads; //Num of Long Running Threads
+	int iNumLongRunningActive; //Num of WORKITEM_LONGRUNNING Work Items Running
+	int iNumLongRunningAdded; //Num of WORKITEM_LONGRUNNING Work Items Added
+	int iNumLongRunningPending; //Num of WORKITEM_LONGRUNNING Work Items Pending
+	int iNumLongRunningHandled; //Num of WORKITEM_LONGRUNNING Work Items Handled
+	LONG64 llLongRunningTotalMs; //Total run time of the handled WORKITEM_LONGRUNNING Work Items in milliseconds
+	LONG64 llLongRunningMaxMs; //Longest run time of a handled WORKITEM_LONGRUNNING Work Item in milliseconds
+	int iNumWorkItemsCoalesced; //Num of Work Items merged into a pending Work Item with the same coalescing key instead of being queued
+	int iNumWorkItemsSpilled; //Num of spillable Work Items written to the spill log because the memory budget was used up
+	int iNumWorkItemsRefilled; //Num of spillable Work Items read back from the spill log into the low pri queue
+	int iNumSpillBacklog; //Num of spillable Work Items in the spill log waiting to be refilled
 };
 typedef struct _TPSTATS TPSTATS;
 typedef struct _TPSTATS* PTPSTATS;
 
+/*Thread Pool Statistics segment, a named file mapping the Control Thread refreshes with PublishTPStats
+Readers in other processes open it with OpenFileMapping and copy Stats while lSequence is even and unchanged (seqlock)*/
+struct _TPSTATSSEGMENT {
+	DWORD dwMagic; //TPSTATS_SEGMENT_MAGIC
+	DWORD dwVersion; //TPSTATS_SEGMENT_VERSION the segment was written with, readers must check it before using the other members
+	DWORD cbSize; //Size in bytes of the segment structure
+	DWORD dwProcessId; //Process the Thread Pool runs in
+	DWORD dwPublishInterval; //Number of milliseconds between two updates
+	volatile LONG lSequence; //Seqlock sequence, odd while the Control Thread updates the segment
+	ULONGLONG ullTimestamp; //GetTickCount64 value of the last update, readers compute rates from it
+	ULONGLONG ullUpdates; //Number of updates since the segment was published
+	WCHAR szName[TPSTATS_SEGMENT_MAXNAME]; //Name passed to PublishTPStats
+	TPSTATS Stats; //Thread Pool Statistics as returned by GetTPStats
+};
+typedef struct _TPSTATSSEGMENT TPSTATSSEGMENT;
+typedef struct _TPSTATSSEGMENT* PTPSTATSSEGMENT;
+
+/*Workload recording file written by SetTPRecording: a TPRECORDHEADER, ullRecords TPRECORD in completion order, then dwCallbacks TPRECORDCALLBACK
+The header is rewritten with the counts when the recording stops, a file whose dwCallbacks and ullRecords are 0 was not stopped cleanly*/
+struct _TPRECORDHEADER {
+	DWORD dwMagic; //TPRECORD_MAGIC
+	DWORD dwVersion; //TPRECORD_VERSION the file was written with, readers must check it before using the other members
+	DWORD cbHeader; //Size in bytes of the header structure
+	DWORD cbRecord; //Size in bytes of a TPRECORD
+	ULONGLONG ullRecords; //Number of records following the header
+	DWORD dwCallbacks; //Number of TPRECORDCALLBACK following the records
+	DWORD dwIdealThreads; //Ideal number of Worker Threads of the recorded Thread Pool
+	DWORD dwMaxThreads; //Max number of additional Worker Threads of the recorded Thread Pool (SetTPLimits)
+	DWORD dwMaxPending; //Max number of pending Work Items per priority of the recorded Thread Pool (SetTPLimits)
+	ULONGLONG ullDurationMicroseconds; //Time between the start and the stop of the recording
+	FILETIME ftStart; //System time the recording started
+};
+typedef struct _TPRECORDHEADER TPRECORDHEADER;
+typedef struct _TPRECORDHEADER* PTPRECORDHEADER;
+
+//One executed Work Item of a workload recording
+struct _TPRECORD {
+	ULONGLONG ullSubmitMicroseconds; //Time the Work Item was queued, from the start of the recording
+	DWORD dwRunMicroseconds; //Wall clock run time of the callback
+	WORD wCallbackId; //Index of the callback in the callback table of the recording, or TPRECORD_OTHERCALLBACK
+	BYTE bPriority; //Priority of the Work Item
+	BYTE bFlags; //TPRECORD_ flags
+};
+typedef struct _TPRECORD TPRECORD;
+typedef struct _TPRECORD* PTPRECORD;
+
+//Callback table entry of a workload recording, indexed by callback id
+struct _TPRECORDCALLBACK {
+	ULONGLONG ullAddress; //Address of the callback function in the recorded process
+	char szSymbol[TPPROFILE_MAXSYMBOL]; //module!function+offset of the callback, empty if no symbol could be resolved
+};
+typedef struct _TPRECORDCALLBACK TPRECORDCALLBACK;
+typedef struct _TPRECORDCALLBACK* PTPRECORDCALLBACK;
+
+//Thread Pool profile of one callback function, returned by GetTPProfile
+struct _TPPROFILEENTRY {
+	CALLBACK_INSTANCE pCallback; //Callback function of the Work Items
+	LONG64 iInvocations; //Num of times the callback was called
+	LONG64 llTotalMicroseconds; //Total wall clock run time of the callback
+	LONG64 llMaxMicroseconds; //Longest wall clock run time of one call
+	ULONG64 ullCpuCycles; //Total CPU cycles the calling threads spent in the callback (QueryThreadCycleTime)
+	LONG64 llQueueWaitMicroseconds; //Total time the Work Items waited in the queue before the callback was called
+	char szSymbol[TPPROFILE_MAXSYMBOL]; //module!function+offset of the callback, empty if no symbol could be resolved
+};
+typedef struct _TPPROFILEENTRY TPPROFILEENTRY;
+typedef struct _TPPROFILEENTRY* PTPPROFILEENTRY;
+
 //Thread Pool public function declarations
 PTP CreateTP();
 PWORKITEM CreateWorkItem(PTP, CALLBACK_INSTANCE, PVOID, DWORD);
+BOOL InitWorkItem(PWORKITEM, PTP, CALLBACK_INSTANCE, PVOID, DWORD);
+BOOL SetWorkItemInlineParam(PWORKITEM, LPCVOID, SIZE_T);
+BOOL SetWorkItemCoalesceKey(PWORKITEM, ULONG_PTR);
+BOOL SetWorkItemTag(PTP, PWORKITEM, ULONG_PTR);
+BOOL CancelWorkByTag(PTP, ULONG_PTR);
+BOOL GetWorkTagStats(PTP, ULONG_PTR, PTPTAGSTATS);
+BOOL ReleaseWorkTag(PTP, ULONG_PTR);
 BOOL CanInsertWork(PTP, PWORKITEM);
 BOOL InsertWork(PTP, PWORKITEM);
 BOOL TryInsertWork(PTP, PWORKITEM);
 BOOL IsWorkComplete(PTP, PWORKITEM);
 BOOL DeleteWorkItem(PTP, PWORKITEM);
 BOOL GetTPStats(PTP, PTPSTATS);
+BOOL PublishTPStats(PTP, LPCWSTR, DWORD);
+BOOL SetTPProfiling(PTP, BOOL);
+BOOL GetTPProfile(PTP, PTPPROFILEENTRY, DWORD, PDWORD);
+BOOL SetTPRecording(PTP, LPCWSTR);
+BOOL SetTPLimits(PTP, int, int);
 BOOL DeleteTP(PTP);
+BOOL DeleteTPEx(PTP, DWORD, DWORD);
+BOOL TPPrewarm(PTP, int);
+BOOL SetTPReservedThreads(PTP, DWORD, int);
+BOOL SetTPPriorityCap(PTP, DWORD, int);
+BOOL GetTPQueueWaitPercentile(PTP, DWORD, DWORD, PDWORD);
+BOOL TPEnterBlocking();
+BOOL TPLeaveBlocking();
+BOOL TPShouldYield();
+BOOL TPYield(CALLBACK_INSTANCE, PVOID);
+BOOL SetTPThreadHooks(PTP, TPTHREAD_HOOK, TPTHREAD_HOOK, PVOID);
+PVOID* TPGetWorkerLocal(DWORD);
+BOOL EnumerateRunningWork(PTP, PTPRUNNINGWORK, DWORD, PDWORD);
+BOOL SetTPWatchdog(PTP, DWORD, TPWATCHDOG_CALLBACK, PVOID, DWORD);
+BOOL SetTPSpill(PTP, LPCWSTR, int);
+BOOL RegisterSpillCallback(PTP, DWORD, CALLBACK_INSTANCE);
+BOOL InsertSpillableWork(PTP, DWORD, LPCVOID, DWORD);
+PTPRING CreateTPRing(PTP, LPCWSTR, DWORD);
+BOOL RegisterRingCallback(PTPRING, DWORD, TPRING_CALLBACK);
+BOOL DeleteTPRing(PTPRING);
+PTPRINGCLIENT OpenTPRing(LPCWSTR);
+BOOL SubmitTPRing(PTPRINGCLIENT, DWORD, LPCVOID, DWORD, PDWORD);
+BOOL WaitTPRing(PTPRINGCLIENT, DWORD, DWORD, PDWORD);
+BOOL CloseTPRing(PTPRINGCLIENT);
+PSOCKETWORK RegisterSocketWork(PTP, UINT_PTR, LONG, SOCKETWORK_CALLBACK, PVOID);
+BOOL ReArmSocketWork(PSOCKETWORK);
+BOOL UnregisterSocketWork(PSOCKETWORK);
+PTPIO TPBindIoHandle(PTP, HANDLE, BOOL);
+BOOL TPUnbindIoHandle(PTPIO);
+BOOL TPReadAsync(PTPIO, PVOID, DWORD, ULONGLONG, TPIO_CALLBACK, PVOID);
+BOOL TPWriteAsync(PTPIO, LPCVOID, DWORD, ULONGLONG, TPIO_CALLBACK, PVOID);
+BOOL TPFsyncAsync(PTPIO, TPIO_CALLBACK, PVOID);
+PWAITWORK RegisterWaitForSignal(PTP, HANDLE, DWORD, WAITWORK_CALLBACK, PVOID, DWORD);
+BOOL UnregisterWaitForSignal(PWAITWORK);
+BOOL ParallelFor(PTP, LONG64, LONG64, LONG64, PARALLELFOR_BODY, PVOID);
+BOOL ParallelReduce(PTP, LONG64, LONG64, LONG64, PARALLELREDUCE_BODY, PARALLELREDUCE_COMBINE, PVOID, PVOID, PVOID, SIZE_T);
+PTASKGROUP CreateTaskGroup(PTP);
+BOOL RunInTaskGroup(PTASKGROUP, CALLBACK_INSTANCE, PVOID, DWORD);
+BOOL WaitTaskGroup(PTASKGROUP);
+BOOL DeleteTaskGroup(PTASKGROUP);
+PTPPIPELINE CreatePipeline(PTP, DWORD, PVOID);
+BOOL AddPipelineStage(PTPPIPELINE, DWORD, TPSTAGE_CALLBACK);
+BOOL RunPipeline(PTPPIPELINE);
+BOOL DeletePipeline(PTPPIPELINE);
+PSTRAND CreateStrand(PTP);
+BOOL InsertWorkOnStrand(PSTRAND, PWORKITEM);
+BOOL DeleteStrand(PSTRAND);
+PCOMPLETIONQUEUE CreateCompletionQueue(PTP);
+BOOL SetWorkItemCompletionQueue(PWORKITEM, PCOMPLETIONQUEUE);
+DWORD GetCompletedWorkItems(PCOMPLETIONQUEUE, PWORKITEM*, DWORD, DWORD);
+BOOL DeleteCompletionQueue(PCOMPLETIONQUEUE);
 
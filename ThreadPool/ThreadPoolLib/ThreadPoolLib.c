@@ -8,13 +8,24 @@ Compiled using "cl ThreadPoolLib.c ThreadPoolLib.def /LD /Zi"
 #include"ThreadPoolLib_Private.h"
 #include"ThreadPoolLib.h"
 #include"ThreadPoolLib_Debug.h"
+#pragma comment(lib, "Ws2_32.lib")
+#pragma comment(lib, "Dbghelp.lib")
+
+C_ASSERT(sizeof(WORKITEM) <= WORKITEM_STORAGE_SIZE); //Caller supplied WORKITEM_STORAGE must be able to hold a Work Item
 
 /*
 This API creates the main Thread Pool structure and initializes its members
 The API does not accept any arguements and returns pointer to TP upon success, else return NULL
+It fails with ERROR_BUSY while a Thread Pool whose TPDELETE_ABORT timed out has not been deleted again, its threads still wait on the process wide events
 */
 PTP CreateTP()
 {
+	if (g_lTimedOutTPs > 0)
+	{
+		SetLastError(ERROR_BUSY);
+		LOG_ERROR("Unable to create TP, a timed out TP is not deleted yet:%d", GetLastError());
+		return NULL;
+	}
 	//Get Default Process Heap Handle
 	HANDLE hDefaultHeap = GetProcessHeap();
 	if (hDefaultHeap == NULL) //if it fails return NULL
@@ -50,44 +61,93 @@ PTP CreateTP()
 		return NULL;
 	}
 	MYPROC InitializeQueue = (MYPROC)GetProcAddress(hDll_LinkedList, "InitializeListHead");
-	if (!InitializeQueue)
+	pTP->pInitializeQueue = InitializeQueue;
+	pTP->pEnqueue = (MYPROC1)GetProcAddress(hDll_LinkedList, "InsertHeadList");
+	pTP->pDequeue = (MYPROC2)GetProcAddress(hDll_LinkedList, "RemoveTailList");
+	pTP->pFindEntry = (MYPROC1)GetProcAddress(hDll_LinkedList, "FindEntry");
+	pTP->pRemoveEntry = (MYPROC1)GetProcAddress(hDll_LinkedList, "RemoveEntry");
+	pTP->pDeleteQueue = (MYPROC3)GetProcAddress(hDll_LinkedList, "DeleteList");
+	if (!(InitializeQueue && pTP->pEnqueue && pTP->pDequeue && pTP->pFindEntry && pTP->pRemoveEntry && pTP->pDeleteQueue))
 	{
 		LOG_ERROR("Unable to GetProcAddress:%d", GetLastError());
 		return NULL;
 	}
 
-	//Initialize the 3 Pri queues
-	pTP->pTPQ_low = InitializeQueue();
-	pTP->pTPQ_normal = InitializeQueue();
-	pTP->pTPQ_high = InitializeQueue();
-	if (!(pTP->pTPQ_low && pTP->pTPQ_normal && pTP->pTPQ_high))
+	//Initialize the Pri queues, one per Work Item priority
+	for (int i = 0; i < WORKITEM_NUMPRIORITIES; i++)
+	{
+		pTP->pTPQ[i] = InitializeQueue();
+		if (pTP->pTPQ[i] == NULL)
+		{
+			SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+			LOG_ERROR("Unable to Initialize Pri Queue:%d", GetLastError());
+			return NULL;
+		}
+	}
+
+	//Initialize the long running Work Items queue, it is served by the Long Running Threads
+	pTP->pLongRunningQ = InitializeQueue();
+	if (pTP->pLongRunningQ == NULL)
 	{
 		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
-		LOG_ERROR("Unable to Initialize Pri Queue:%d", GetLastError());
+		LOG_ERROR("Unable to Initialize Long Running queue:%d", GetLastError());
 		return NULL;
 	}
 
-	FreeLibrary(hDll_LinkedList);
+	//Keep DLL_LinkedList.dll loaded for the lifetime of the TP, the list functions resolved above are used without loading it again
+	pTP->hDll_LinkedList = hDll_LinkedList;
 
-	//Initialise the SRWLocks to synchronize access to each of the 3 Pri queues
-	InitializeSRWLock(&gSRWLock_TPQlow);
-	InitializeSRWLock(&gSRWLock_TPQnormal);
-	InitializeSRWLock(&gSRWLock_TPQhigh);
+	//Initialise the SRWLocks to synchronize access to each of the Pri queues
+	for (int i = 0; i < WORKITEM_NUMPRIORITIES; i++)
+		InitializeSRWLock(&gSRWLock_TPQ[i]);
+	InitializeSRWLock(&(pTP->WorkerThreadsLock));
 
 	//Set initial TP parameters
 	pTP->iIdealThreads = pSystemInfo->dwNumberOfProcessors; //Ideal Worker threads is NumofProcs
 	pTP->iMaxThreads = MAXTHREADS; //Max Worker threads is obtained from the MAXTHREADS macro(can be modified)
+	pTP->iMaxPending = MAXPENDINGWORKITEMS; //Max pending Work Items per Pri queue is obtained from the MAXPENDINGWORKITEMS macro (can be modified by SetTPLimits)
 	pTP->iCRWThreads = 0; //Current Running Worker Threads is 0
-	pTP->iCWWThreads = pSystemInfo->dwNumberOfProcessors; //Current Waiting Worker Threads is Ideal Threads
-	pTP->iNumWorkItemsAdded_low = 0; //Number of Work Items Added to the Low Priority queue
-	pTP->iNumWorkItemsPending_low = 0;//Number of Work Items Pending in the Low Priority queue
-	pTP->iNumWorkItemsHandled_low = 0;//Number of Work Items Handled in the Low Priority queue
-	pTP->iNumWorkItemsAdded_normal = 0;//Number of Work Items Added to the Normal Priority queue
-	pTP->iNumWorkItemsPending_normal = 0;//Number of Work Items Pending in the Normal Priority queue
-	pTP->iNumWorkItemsHandled_normal = 0;//Number of Work Items Handled in the Normal Priority queue
-	pTP->iNumWorkItemsAdded_high = 0;//Number of Work Items Added to the High Priority queue
-	pTP->iNumWorkItemsPending_high = 0;//Number of Work Items Pending in the High Priority queue
-	pTP->iNumWorkItemsHandled_high = 0;//Number of Work Items Handled in the High Priority queue
+	pTP->iCWWThreads = 0; //Current Waiting Worker Threads is 0, Worker Threads are created as work arrives
+	pTP->iWorkerThreads = 0; //Number of Worker Threads created and not yet terminated
+	pTP->iNumWorkItemsPendingTotal = 0; //Per priority Added, Pending and Handled counters are zeroed by HEAP_ZERO_MEMORY
+	pTP->lReadyMask = 0; //No Pri queue holds Work Items
+	pTP->lReserved = RESERVED_PACK(0, 0); //No Worker Threads are reserved for high pri Work Items until SetTPReservedThreads is called
+	pTP->iCappedPri = -1; //No priority is capped until SetTPPriorityCap is called
+	LARGE_INTEGER liFrequency;
+	QueryPerformanceFrequency(&liFrequency);
+	pTP->llQpcFrequency = liFrequency.QuadPart;
+	pTP->lProfileId = InterlockedIncrement(&g_lProfileIds); //Profiling is off until SetTPProfiling is called
+
+	pTP->iShutdownMode = 0; //Thread Pool accepts work until DeleteTPEx is called
+	InitializeSRWLock(&(pTP->SocketWorkLock));
+	InitializeSRWLock(&(pTP->IoLock)); //I/O ports and threads are created by the first TPBindIoHandle
+	InitializeSRWLock(&(pTP->WaitersLock)); //Waiter Threads are created by RegisterWaitForSignal
+	InitializeSRWLock(&(pTP->LongRunningLock)); //Long Running Threads are created as WORKITEM_LONGRUNNING Work Items arrive
+	InitializeSRWLock(&(pTP->RecordLock)); //Recording is off until SetTPRecording is called
+	InitializeSRWLock(&(pTP->RecordWriteLock));
+	for (int i = 0; i < COALESCE_BUCKETS; i++)
+		InitializeSRWLock(&(pTP->CoalesceBuckets[i].Lock)); //Coalescing index starts empty
+	for (int i = 0; i < TAG_BUCKETS; i++)
+		InitializeSRWLock(&(pTP->TagBuckets[i].Lock)); //Tag table starts empty
+
+	//Worker Thread handles are kept so that DeleteTPEx can join the threads, one slot per thread the pool can have at a time
+	pTP->iWorkerThreadSlots = pTP->iIdealThreads + MAXTHREADS;
+	pTP->phWorkerThreads = (PHANDLE)HeapAlloc(hDefaultHeap, HEAP_ZERO_MEMORY, pTP->iWorkerThreadSlots * sizeof(HANDLE));
+	if (pTP->phWorkerThreads == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to allocate Worker Thread handles:%d", GetLastError());
+		return NULL;
+	}
+	//Running Work Item slots, claimed by the Worker and Long Running Threads as they start
+	pTP->iRunningSlots = pTP->iWorkerThreadSlots + LONGRUNNING_MAXTHREADS;
+	pTP->pRunningSlots = (PRUNNINGSLOT)HeapAlloc(hDefaultHeap, HEAP_ZERO_MEMORY, pTP->iRunningSlots * sizeof(RUNNINGSLOT));
+	if (pTP->pRunningSlots == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to allocate running Work Item slots:%d", GetLastError());
+		return NULL;
+	}
 
 	//Free the SystemInfo structure as we are done with it
 	if (HeapFree(hDefaultHeap, 0, pSystemInfo) == 0)
@@ -130,23 +190,53 @@ PTP CreateTP()
 	//Create Delete Thread Pool event
 	g_hDeleteTPEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 
-	//Create Control Thread which monitors number of available Worker Threads and creates new Worker Threads as required
-	if (CreateThread(NULL, 0, ControlThreadProc, (LPVOID)pTP, 0, 0) == NULL)
+	/*Create Event to notify DeleteTPEx when a Worker Thread finishes running work items
+	This is a Auto Reset Event and initial state is not signalled, Worker Threads only set it while the Thread Pool is being deleted*/
+	pTP->hWorkerIdleEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (pTP->hWorkerIdleEvent == NULL) //if it fails return NULL
 	{
-		LOG_ERROR("Unable to Create Control Thread:%d", GetLastError());
+		LOG_ERROR("Unable to Create Worker Idle Event:%d", GetLastError());
 		return NULL;
 	}
 
-	//Create Worker Threads upto iIdealThreads, Worker Threads call WorkerThreadProc and wait on g_hWIAvailableEvent event
-	for (int i = 1; i <= pTP->iIdealThreads; i++)
+	/*Create Events for sockets registered with RegisterSocketWork, initial state is not signalled
+	hSocketChangedEvent makes the leader Worker Thread rebuild its wait set, hSocketPromoteEvent wakes one Worker Thread to become the leader, both are Auto Reset Events
+	hSocketRebuiltEvent is a Manual Reset Event UnregisterSocketWork waits on until the leader no longer waits on the socket*/
+	pTP->hSocketChangedEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	pTP->hSocketPromoteEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	pTP->hSocketRebuiltEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if ((pTP->hSocketChangedEvent == NULL) || (pTP->hSocketPromoteEvent == NULL) || (pTP->hSocketRebuiltEvent == NULL)) //if it fails return NULL
 	{
-		if (CreateThread(NULL, 0, WorkerThreadProc, (LPVOID)pTP, 0, 0) == NULL)
-		{
-			LOG_ERROR("Unable to Create Worker Thread:%d", GetLastError());
-			return NULL;
-		}
+		LOG_ERROR("Unable to Create Socket Events:%d", GetLastError());
+		return NULL;
+	}
+
+	//Create Semaphore the Long Running Threads wait on, released once per queued long running Work Item
+	pTP->hLongRunningSemaphore = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+	if (pTP->hLongRunningSemaphore == NULL) //if it fails return NULL
+	{
+		LOG_ERROR("Unable to Create Long Running Semaphore:%d", GetLastError());
+		return NULL;
+	}
+
+	//Create Event to make the Control Thread refresh the stats segment, Auto Reset Event and initial state is not signalled
+	pTP->hStatsPublishEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (pTP->hStatsPublishEvent == NULL) //if it fails return NULL
+	{
+		LOG_ERROR("Unable to Create Stats Publish Event:%d", GetLastError());
+		return NULL;
+	}
+
+	//Create Control Thread which monitors number of available Worker Threads and creates new Worker Threads as required
+	pTP->hControlThread = CreateThread(NULL, 0, ControlThreadProc, (LPVOID)pTP, 0, 0);
+	if (pTP->hControlThread == NULL)
+	{
+		LOG_ERROR("Unable to Create Control Thread:%d", GetLastError());
+		return NULL;
 	}
 
+	/*Worker Threads are not created here, InsertWork creates them on demand upto iIdealThreads as work arrives
+	Clients which want the threads running before traffic arrives call TPPrewarm*/
 	return pTP;
 }
 
@@ -167,31 +257,20 @@ DWORD WINAPI WorkerThreadProc(LPVOID pTP)
 		return 1;
 	}
 
-	//Loading DLL_Linkedlist.dll explicitly and getting the relevant functions
-	HMODULE hDll_LinkedList = LoadLibraryExW(L"DLL_LinkedList.dll", NULL, 0);
-	if (hDll_LinkedList == NULL)
-	{
-		LOG_ERROR("Unable to load DLL_LinkedList.dll:%d", GetLastError());
-		InterlockedDecrement(&(((PTP)pTP)->iCWWThreads));
-		return 1;
-	}
-	MYPROC2 Dequeue = (MYPROC2)GetProcAddress(hDll_LinkedList, "RemoveTailList");
-	if (!Dequeue)
-	{
-		LOG_ERROR("Unable to GetProcAddress:%d", GetLastError());
-		goto WORKERTHREADCLEANUP;
-	}
+	MYPROC2 Dequeue = ((PTP)pTP)->pDequeue;
 
 	DWORD iWorkerThreadId = GetThreadId(GetCurrentThread());
 	if (iWorkerThreadId == 0)
 		LOG_ERROR("Invalid WorkerThreadId:%d", GetLastError());
 	LOG_INFO("Starting Worker Thread %d\n", iWorkerThreadId);
+	g_pWorkerTP = (PTP)pTP; //Lets callbacks tell a Worker Thread of their Thread Pool from a Long Running Thread, see TPEnterBlocking
+	StartPoolThread((PTP)pTP);
 
-	HANDLE hWorkerThreadEvents[3] = { g_hDeleteTPEvent,g_hKillWorkerThreadTimer,g_hWIAvailableEvent };
+	HANDLE hWorkerThreadEvents[4] = { g_hDeleteTPEvent,g_hKillWorkerThreadTimer,g_hWIAvailableEvent,((PTP)pTP)->hSocketPromoteEvent };
 	while (TRUE)
 	{
 		//If work items are available in queue, explicitly set g_hWIAvailableEvent event as there is a possibility of the event getting reset and work items are still available
-		if ((((PTP)pTP)->iNumWorkItemsPending_high || ((PTP)pTP)->iNumWorkItemsPending_normal || ((PTP)pTP)->iNumWorkItemsPending_low))
+		if (((PTP)pTP)->lReadyMask & GetAdmittedMask((PTP)pTP)) //Work Items held back by the reservation or cap are picked by the Worker Thread releasing the slot
 		{
 			LOG_INFO("Work Items are available\n");
 			if (!(SetEvent(g_hWIAvailableEvent)))
@@ -200,13 +279,25 @@ DWORD WINAPI WorkerThreadProc(LPVOID pTP)
 				goto WORKERTHREADCLEANUP;
 			}
 		}
-		LOG_INFO("Worker Thread %d waiting for Work Item\n", iWorkerThreadId);
-		if (!(SetWaitableTimer(g_hKillWorkerThreadTimer, &liKillWorkerThreadTime, 0, NULL, NULL, 0)))//Start WORKERTHREADIDLETIMEOUT Timer
+		DWORD dw;
+		//Leader/follower, one waiting Worker Thread waits on the registered sockets and runs the ready callback itself
+		if ((((PTP)pTP)->iNumSocketWork > 0) && (InterlockedCompareExchange(&(((PTP)pTP)->iSocketLeader), 1, 0) == 0))
 		{
-			LOG_ERROR("Unable to Set Timer:%d", GetLastError());
-			goto WORKERTHREADCLEANUP;
+			LOG_INFO("Worker Thread %d waiting on sockets\n", iWorkerThreadId);
+			dw = LeadSocketWait((PTP)pTP); //Returns WAIT_TIMEOUT once it ran a socket callback or has no sockets left to wait on
+			if (dw == WAIT_TIMEOUT)
+				continue;
+		}
+		else
+		{
+			LOG_INFO("Worker Thread %d waiting for Work Item\n", iWorkerThreadId);
+			if (!(SetWaitableTimer(g_hKillWorkerThreadTimer, &liKillWorkerThreadTime, 0, NULL, NULL, 0)))//Start WORKERTHREADIDLETIMEOUT Timer
+			{
+				LOG_ERROR("Unable to Set Timer:%d", GetLastError());
+				goto WORKERTHREADCLEANUP;
+			}
+			dw = WaitForMultipleObjects(4, hWorkerThreadEvents, FALSE, INFINITE); //Wait on Delete TP event or WORKERTHREADIDLETIMEOUT timer or work item to be available or socket leader promotion
 		}
-		DWORD dw = WaitForMultipleObjects(3, hWorkerThreadEvents, FALSE, INFINITE); //Wait on Delete TP event or WORKERTHREADIDLETIMEOUT timer or work item to be available
 		switch (dw)
 		{
 		case WAIT_FAILED: //Wait failed
@@ -215,18 +306,21 @@ DWORD WINAPI WorkerThreadProc(LPVOID pTP)
 
 		case WAIT_OBJECT_0 + 0: //Delete TP
 			LOG_INFO("Worker Thread %d terminating due to Thread Pool deletion\n", iWorkerThreadId);
-			FreeLibrary(hDll_LinkedList);
+			ExitPoolThread((PTP)pTP);
 			InterlockedDecrement(&(((PTP)pTP)->iCWWThreads));
+			InterlockedDecrement(&(((PTP)pTP)->iWorkerThreads));
 			return 0;
 
 		case WAIT_OBJECT_0 + 1: //WORKERTHREADIDLETIMEOUT timer fired
 			LOG_INFO("Worker Thread %d idle timeout\n", iWorkerThreadId);
 			//if worker threads is more than ideal threads terminate
-			if ((((PTP)pTP)->iCWWThreads + ((PTP)pTP)->iCRWThreads) > ((PTP)pTP)->iIdealThreads)
+			if ((((PTP)pTP)->iCWWThreads + ((PTP)pTP)->iCRWThreads) > (((PTP)pTP)->iIdealThreads + RESERVED_THREADS(((PTP)pTP)->lReserved) + ((PTP)pTP)->iBlockedThreads + ((PTP)pTP)->iStuckThreads))
 			{
+				RetireCompensatingWorker((PTP)pTP); //This may be a compensating Worker Thread nobody retired yet
 				LOG_INFO("Worker Thread %d terminating due to idle timeout\n", iWorkerThreadId);
-				FreeLibrary(hDll_LinkedList);
+				ExitPoolThread((PTP)pTP);
 				InterlockedDecrement(&(((PTP)pTP)->iCWWThreads));
+				InterlockedDecrement(&(((PTP)pTP)->iWorkerThreads));
 				return 0;
 			}
 			//else remain alive
@@ -236,102 +330,49 @@ DWORD WINAPI WorkerThreadProc(LPVOID pTP)
 				break;
 			}
 
+		case WAIT_OBJECT_0 + 3: //Socket leader promotion, try to become the leader on the next iteration
+			LOG_INFO("Worker Thread %d promoted to wait on sockets\n", iWorkerThreadId);
+			break;
+
 		case WAIT_OBJECT_0 + 2: //Work Item Available
 		{
 			LOG_INFO("Worker Thread %d woken due to WI available\n", iWorkerThreadId);
-			if (((PTP)pTP)->iNumWorkItemsPending_high > 0) //First handle the High Pri work item
-			{
-				InterlockedDecrement(&(((PTP)pTP)->iCWWThreads));
-				InterlockedIncrement(&(((PTP)pTP)->iCRWThreads));
-				while (((PTP)pTP)->iNumWorkItemsPending_high > 0)
-				{
-					InterlockedDecrement(&(((PTP)pTP)->iNumWorkItemsPending_high));
-					AcquireSRWLockExclusive(&gSRWLock_TPQhigh);
-					PLINK pTemp = Dequeue(((PTP)(pTP))->pTPQ_high); //Get work item from queue
-					ReleaseSRWLockExclusive(&gSRWLock_TPQhigh);
-					if (pTemp)
-					{
-						LOG_INFO("Worker Thread %d done with removing high pri work from list\n", iWorkerThreadId);
-						PWORKITEM pWork = ADDR_BASE(pTemp, WORKITEM, list_entry);
-						LOG_INFO("Worker Thread %d calling high pri Work callback function\n", iWorkerThreadId);
-						pWork->pCallback(pWork->pvParam); //Call client callback function
-						pWork->iCompletionStatus = WORK_COMPLETE; //update work item completion status
-						InterlockedIncrement(&(((PTP)pTP)->iNumWorkItemsHandled_high));
-					}
-					else
-					{
-						InterlockedIncrement(&(((PTP)pTP)->iNumWorkItemsPending_high));
-						LOG_INFO("Worker Thread %d Unable to remove high low pri work from list\n", iWorkerThreadId);
-					}
-				}
-				InterlockedIncrement(&(((PTP)pTP)->iCWWThreads));
-				InterlockedDecrement(&(((PTP)pTP)->iCRWThreads));
-				break;
-			}
-			else if (((PTP)pTP)->iNumWorkItemsPending_normal > 0) //Next handle the normal pri work items
-			{
-				InterlockedDecrement(&(((PTP)pTP)->iCWWThreads));
-				InterlockedIncrement(&(((PTP)pTP)->iCRWThreads));
-				while ((((PTP)pTP)->iNumWorkItemsPending_high == 0) && (((PTP)pTP)->iNumWorkItemsPending_normal > 0))
-				{
-					InterlockedDecrement(&(((PTP)pTP)->iNumWorkItemsPending_normal));
-					AcquireSRWLockExclusive(&gSRWLock_TPQnormal);
-					PLINK pTemp = Dequeue(((PTP)(pTP))->pTPQ_normal); //Get work item from queue
-					ReleaseSRWLockExclusive(&gSRWLock_TPQnormal);
-					if (pTemp)
-					{
-						LOG_INFO("Worker Thread %d done with removing normal pri work from list\n", iWorkerThreadId);
-						PWORKITEM pWork = ADDR_BASE(pTemp, WORKITEM, list_entry);
-						LOG_INFO("Worker Thread %d calling normal pri work callback function\n", iWorkerThreadId);
-						pWork->pCallback(pWork->pvParam); //Call client callback function
-						pWork->iCompletionStatus = WORK_COMPLETE; //update work item completion status
-						InterlockedIncrement(&(((PTP)pTP)->iNumWorkItemsHandled_normal));
-					}
-					else
-					{
-						InterlockedIncrement(&(((PTP)pTP)->iNumWorkItemsPending_normal));
-						LOG_INFO("Worker Thread %d unable to remove normal pri work from list\n", iWorkerThreadId);
-					}
-				}
-				InterlockedIncrement(&(((PTP)pTP)->iCWWThreads));
-				InterlockedDecrement(&(((PTP)pTP)->iCRWThreads));
+			if ((((PTP)pTP)->lReadyMask & GetAdmittedMask((PTP)pTP)) == 0) //Work Item already picked by another thread, or held back by the reservation or cap
 				break;
-			}
-			else if (((PTP)pTP)->iNumWorkItemsPending_low > 0) //lastly handle the low priority work items
+			InterlockedDecrement(&(((PTP)pTP)->iCWWThreads));
+			InterlockedIncrement(&(((PTP)pTP)->iCRWThreads));
+			PWORKITEM pWork;
+			DWORD dwClaims;
+			while ((pWork = DequeueAdmittedWorkItem((PTP)pTP, Dequeue, &dwClaims)) != NULL) //Always handle the highest priority work item first
 			{
-				InterlockedDecrement(&(((PTP)pTP)->iCWWThreads));
-				InterlockedIncrement(&(((PTP)pTP)->iCRWThreads));
-				while ((((PTP)pTP)->iNumWorkItemsPending_high == 0) && (((PTP)pTP)->iNumWorkItemsPending_normal == 0) && (((PTP)pTP)->iNumWorkItemsPending_low > 0))
+				LOG_INFO("Worker Thread %d calling pri %d Work callback function\n", iWorkerThreadId, pWork->iPri);
+				g_dwHeldClaims = dwClaims; //A callback helping while it waits runs Work Items of its own levels on these slots
+				ExecuteWorkItem((PTP)pTP, pWork); //Call client callback function and complete the work item
+				g_dwHeldClaims = 0;
+				ReleasePriorityLimits((PTP)pTP, dwClaims);
+				if (RetireCompensatingWorker((PTP)pTP)) //Blocked Worker Threads are running again, keep the runnable Worker Threads at the ideal count
 				{
-					InterlockedDecrement(&(((PTP)pTP)->iNumWorkItemsPending_low));
-					AcquireSRWLockExclusive(&gSRWLock_TPQlow);
-					PLINK pTemp = Dequeue(((PTP)(pTP))->pTPQ_low); //Get work item from queue
-					ReleaseSRWLockExclusive(&gSRWLock_TPQlow);
-					if (pTemp)
-					{
-						LOG_INFO("Worker Thread %d done with removing low pri work from list\n", iWorkerThreadId);
-						PWORKITEM pWork = ADDR_BASE(pTemp, WORKITEM, list_entry);
-						LOG_INFO("Worker Thread %d calling low pri work callback function\n", iWorkerThreadId);
-						pWork->pCallback(pWork->pvParam); //Call client callback function
-						pWork->iCompletionStatus = WORK_COMPLETE; //update work item completion status
-						InterlockedIncrement(&(((PTP)pTP)->iNumWorkItemsHandled_low));
-					}
-					else
-					{
-						InterlockedIncrement(&(((PTP)pTP)->iNumWorkItemsPending_low));
-						LOG_INFO("Worker Thread %d unable to remove low pri work from list\n", iWorkerThreadId);
-					}
+					LOG_INFO("Worker Thread %d retiring as surplus compensating thread\n", iWorkerThreadId);
+					ExitPoolThread((PTP)pTP);
+					InterlockedDecrement(&(((PTP)pTP)->iCRWThreads));
+					InterlockedDecrement(&(((PTP)pTP)->iWorkerThreads));
+					if (((PTP)pTP)->iShutdownMode) //DeleteTPEx waits for running work items to finish
+						SetEvent(((PTP)pTP)->hWorkerIdleEvent);
+					return 0;
 				}
-				InterlockedIncrement(&(((PTP)pTP)->iCWWThreads));
-				InterlockedDecrement(&(((PTP)pTP)->iCRWThreads));
-				break;
 			}
+			InterlockedIncrement(&(((PTP)pTP)->iCWWThreads));
+			InterlockedDecrement(&(((PTP)pTP)->iCRWThreads));
+			if (((PTP)pTP)->iShutdownMode) //DeleteTPEx waits for running work items to finish
+				SetEvent(((PTP)pTP)->hWorkerIdleEvent);
+			break;
 		}
 		}
 	}
 WORKERTHREADCLEANUP:
-	FreeLibrary(hDll_LinkedList);
+	ExitPoolThread((PTP)pTP);
 	InterlockedDecrement(&(((PTP)pTP)->iCWWThreads));
+	InterlockedDecrement(&(((PTP)pTP)->iWorkerThreads));
 	return 1;
 }
 
@@ -350,13 +391,37 @@ DWORD WINAPI ControlThreadProc(LPVOID pTP)
 		LOG_ERROR("Invalid Thread Pool:%d", GetLastError());
 		return 1;
 	}
-	HANDLE hControlThreadEvents[2] = { g_hDeleteTPEvent,g_hControlThreadEvent };
+	HANDLE hControlThreadEvents[3] = { g_hDeleteTPEvent,g_hControlThreadEvent,((PTP)pTP)->hStatsPublishEvent };
+	ULONGLONG ullNextPublish = 0;
+	ULONGLONG ullNextWatchdog = 0;
 	LOG_INFO("Starting Control Thread \n");
 	while (TRUE)
 	{
 		volatile int iSleepCounter = 0;
+		DWORD dwTimeout = INFINITE;
+		if (((PTP)pTP)->pStatsSegment) //Refresh the stats segment once per publish interval
+		{
+			ULONGLONG ullNow = GetTickCount64();
+			if (ullNow >= ullNextPublish)
+			{
+				UpdateStatsSegment((PTP)pTP);
+				ullNextPublish = ullNow + ((PTP)pTP)->pStatsSegment->dwPublishInterval;
+			}
+			dwTimeout = (DWORD)(ullNextPublish - ullNow);
+		}
+		DWORD dwBudget = ((PTP)pTP)->dwWatchdogBudget;
+		if (dwBudget) //Scan the running Work Items several times per budget
+		{
+			ULONGLONG ullNow = GetTickCount64();
+			if (ullNow >= ullNextWatchdog)
+			{
+				RunWatchdog((PTP)pTP);
+				ullNextWatchdog = ullNow + max(dwBudget / WATCHDOG_CHECKSPERBUDGET, 1);
+			}
+			dwTimeout = min(dwTimeout, (DWORD)(ullNextWatchdog - ullNow));
+		}
 		LOG_INFO("Control Thread waiting for CWWT to become zero\n");
-		DWORD dw = WaitForMultipleObjects(2, hControlThreadEvents, FALSE, INFINITE);
+		DWORD dw = WaitForMultipleObjects(3, hControlThreadEvents, FALSE, dwTimeout);
 		switch (dw)
 		{
 		case WAIT_FAILED: //Wait failed
@@ -367,11 +432,15 @@ DWORD WINAPI ControlThreadProc(LPVOID pTP)
 			LOG_INFO("Control Thread terminating due to thread pool deletion\n");
 			return 0;
 
+		case WAIT_OBJECT_0 + 2: //Stats segment was published or the watchdog was set, the timeout is recomputed at the top of the loop
+		case WAIT_TIMEOUT: //Publish interval or watchdog interval elapsed
+			break;
+
 		case WAIT_OBJECT_0 + 1: //CWWT threads is zero
-		CHECKCWT:if (((PTP)pTP)->iCWWThreads == 0) //Check if CWWT is 0
+		CHECKCWT:if ((((PTP)pTP)->iCWWThreads == 0) && (((PTP)pTP)->iCHWThreads == 0)) //Check if CWWT is 0, threads helping while they wait still drain the queues
 		{
 			LOG_INFO("CWWT is zero\n");
-			if (((PTP)pTP)->iCRWThreads < MAXTHREADS) //Check if CRWT is < MAXTHREADS, only then create more worker threads
+			if (((PTP)pTP)->iCRWThreads < ((PTP)pTP)->iMaxThreads) //Check if CRWT is < iMaxThreads, only then create more worker threads
 			{
 				LOG_INFO("CRWT is less than Max Threads\n");
 				if (iSleepCounter == 0)
@@ -384,12 +453,11 @@ DWORD WINAPI ControlThreadProc(LPVOID pTP)
 				else
 				{
 					LOG_INFO("Additional Worker Thread creation\n");
-					if (CreateThread(NULL, 0, WorkerThreadProc, (LPVOID)pTP, 0, 0) == NULL) //Create Additional Worker Thread post delay
+					if (!CreateWorkerThread((PTP)pTP, ((PTP)pTP)->iIdealThreads + ((PTP)pTP)->iMaxThreads)) //Create Additional Worker Thread post delay
 					{
 						LOG_ERROR("Unable to Create Additional Worker Threads:%d", GetLastError());
 						return 1;
 					}
-					InterlockedIncrement(&(((PTP)pTP)->iCWWThreads));
 				}
 			}
 			else
@@ -407,13 +475,13 @@ Accepts 4 arguments:
 a.Pointer to ThreadPool
 b.Client Callback Function of type CALLBACK_INSTANCE
 c.Void pointer to parameters to be passed to the callback function
-d.Priority of the work (one of WORKITEM_HIGH, WORKITEM_NORMAL or WORKITEM_LOW)
+d.Priority of the work (WORKITEM_LOW to WORKITEM_HIGH, WORKITEM_NUMPRIORITIES levels), optionally OR'd with WORKITEM_LONGRUNNING
 Return pointer to workitem upon success, else returns NULL
 */
 PWORKITEM CreateWorkItem(PTP pTP, CALLBACK_INSTANCE pCallback, PVOID pvParam, DWORD iPri)
 {
 	//Parameter Validation
-	if ((!(pTP && pCallback && pvParam)) && ((iPri < 0) || (iPri > 2)))
+	if (!(pTP && pCallback) || ((iPri & ~WORKITEM_LONGRUNNING) >= WORKITEM_NUMPRIORITIES))
 	{
 		SetLastError(ERROR_INVALID_PARAMETER);
 		LOG_ERROR("Unable to Create Work Item:%d", GetLastError());
@@ -436,348 +504,430 @@ PWORKITEM CreateWorkItem(PTP pTP, CALLBACK_INSTANCE pCallback, PVOID pvParam, DW
 	}
 	pWorkItem->pCallback = pCallback;
 	pWorkItem->pvParam = pvParam;
-	pWorkItem->iPri = iPri;
+	pWorkItem->iPri = iPri & ~WORKITEM_LONGRUNNING;
+	pWorkItem->dwFlags = (iPri & WORKITEM_LONGRUNNING) ? WORKITEM_DEDICATED : 0; //Long running Work Items are run by the Long Running Threads
 	pWorkItem->iCompletionStatus = WORK_NOTCOMPLETE; //To being with Work item is not complete
+	InterlockedIncrement(&(pTP->iNumWorkItemsAllocated));
 	return pWorkItem;
 }
 
 /*
-This function checks if work item can be inserted to the queue or not
-Accepts pointers to ThreadPool and pointer to WorkItem as arguements
-Returns TRUE if work item can be inserted , else returns false
+This API prepares a Work Item embedded in a client structure, so that submitting it needs no heap allocation
+Accepts 5 arguments:
+a.Pointer to caller owned storage for the Work Item (a WORKITEM_STORAGE cast to PWORKITEM)
+b.Pointer to ThreadPool
+c.Client Callback Function of type CALLBACK_INSTANCE
+d.Void pointer to parameters to be passed to the callback function
+e.Priority of the work (WORKITEM_LOW to WORKITEM_HIGH, WORKITEM_NUMPRIORITIES levels), optionally OR'd with WORKITEM_LONGRUNNING
+The Thread Pool never frees caller owned Work Items, the storage must stay valid until the work is complete or deleted
+A completed Work Item can be prepared again with InitWorkItem and resubmitted
+Returns TRUE upon success, else returns FALSE
 */
-BOOL CanInsertWork(PTP pTP, PWORKITEM pWk)
+BOOL InitWorkItem(PWORKITEM pWk, PTP pTP, CALLBACK_INSTANCE pCallback, PVOID pvParam, DWORD iPri)
 {
-	//Parameter validation
-	if (!(pTP && pWk))
+	//Parameter Validation
+	if (!(pWk && pTP && pCallback) || ((iPri & ~WORKITEM_LONGRUNNING) >= WORKITEM_NUMPRIORITIES))
 	{
 		SetLastError(ERROR_INVALID_PARAMETER);
-		LOG_ERROR("Cant insert work:%d", GetLastError());
+		LOG_ERROR("Unable to Init Work Item:%d", GetLastError());
 		return FALSE;
 	}
-	//if Current Waiting Worker Threads is 0, notify Control Thread for new Worker Thread Creation
-	if (((PTP)pTP)->iCWWThreads == 0)
-	{
-		if (!(SetEvent(g_hControlThreadEvent)))
-		{
-			LOG_ERROR("Unable to Set g_hControlThreadEvent:%d", GetLastError());
-			return FALSE;
-		}
-	}
-	switch (pWk->iPri)
-	{
-	case WORKITEM_LOW:
-	{
-		//if Number of Work Items in Low Pri queue has reached MAXPENDINGWORKITEMS cant insert more work
-		if (pTP->iNumWorkItemsPending_low == MAXPENDINGWORKITEMS)
-			return FALSE;
-		else
-			return TRUE;
-	}
-
-	case WORKITEM_NORMAL:
-	{
-		//if Number of Work Items in Normal Pri queue has reached MAXPENDINGWORKITEMS cant insert more work
-		if (pTP->iNumWorkItemsPending_normal == MAXPENDINGWORKITEMS)
-			return FALSE;
-		else
-			return TRUE;
-	}
+	ZeroMemory(pWk, sizeof(WORKITEM));
+	pWk->pCallback = pCallback;
+	pWk->pvParam = pvParam;
+	pWk->iPri = iPri & ~WORKITEM_LONGRUNNING;
+	pWk->dwFlags = WORKITEM_CALLEROWNED | ((iPri & WORKITEM_LONGRUNNING) ? WORKITEM_DEDICATED : 0);
+	pWk->iCompletionStatus = WORK_NOTCOMPLETE;
+	return TRUE;
+}
 
-	case WORKITEM_HIGH:
+/*
+This API copies a small parameter into the Work Item itself and makes it the parameter passed to the callback function
+Accepts pointer to Work Item, pointer to the parameter data and its size (at most WORKITEM_INLINEPARAM_SIZE bytes) as arguements
+Must be called before the Work Item is inserted, the callback receives a pointer to the copy inside the Work Item
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL SetWorkItemInlineParam(PWORKITEM pWk, LPCVOID pvData, SIZE_T cbData)
+{
+	//Parameter Validation
+	if (!(pWk && pvData) || (cbData > WORKITEM_INLINEPARAM_SIZE))
 	{
-		//if Number of Work Items in High Pri queue has reached MAXPENDINGWORKITEMS cant insert more work
-		if (pTP->iNumWorkItemsPending_high == MAXPENDINGWORKITEMS)
-			return FALSE;
-		else
-			return TRUE;
-	}
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Set Work Item inline parameter:%d", GetLastError());
+		return FALSE;
 	}
+	CopyMemory(pWk->InlineParam, pvData, cbData);
+	pWk->pvParam = pWk->InlineParam;
+	return TRUE;
 }
 
 /*
-This API Inserts work to the respective Pri queue
-Accepts pointer to Thread Pool and pointer to work item as arguements
-Returns True upon succesful insertion, else return False
+This API sets the coalescing key of a Work Item, so that duplicate submissions of the same work are run once
+Accepts pointer to Work Item (created with CreateWorkItem or InitWorkItem) and the client chosen key as arguements
+Must be called before the Work Item is inserted, WORKITEM_LONGRUNNING Work Items cannot be coalesced
+While a Work Item with the same key and callback is pending in the Pri queues, inserting this one merges it into the pending one instead of queueing it
+A pending Work Item of a lower priority is requeued at the priority of the Work Item merged into it
+The callback is called once with the parameter of the pending Work Item, the merged Work Items complete (or are cancelled) together with it
+Once the callback has started, a new insert is queued again so that its changes are not missed
+Returns TRUE upon success, else returns FALSE
 */
-BOOL InsertWork(PTP pTP, PWORKITEM pWk)
+BOOL SetWorkItemCoalesceKey(PWORKITEM pWk, ULONG_PTR uKey)
 {
-	//Parameter validation
-	if (!(pTP && pWk))
+	//Parameter Validation
+	if ((pWk == NULL) || (pWk->dwFlags & (WORKITEM_DEDICATED | WORKITEM_FREEONCOMPLETE)) || pWk->pTaskGroup)
 	{
 		SetLastError(ERROR_INVALID_PARAMETER);
-		LOG_ERROR("Cant insert work:%d", GetLastError());
+		LOG_ERROR("Unable to Set Work Item coalescing key:%d", GetLastError());
 		return FALSE;
 	}
-	//Loading DLL_Linkedlist.dll explicitly and getting the relevant functions
-	HMODULE hDll_LinkedList = LoadLibraryExW(L"DLL_LinkedList.dll", NULL, 0);
-	if (hDll_LinkedList == NULL)
+	pWk->uCoalesceKey = uKey;
+	pWk->dwFlags |= WORKITEM_COALESCE;
+	return TRUE;
+}
+
+/*
+This API tags a Work Item, so that it is counted in the counters of its tag and can be cancelled with the other Work Items of the tag
+Accepts pointer to Thread Pool, pointer to Work Item (created with CreateWorkItem or InitWorkItem) and the client chosen tag (0 removes the tag) as arguements
+Must be called before the Work Item is inserted, the tag is created on first use and lives until ReleaseWorkTag is called and its last Work Item completes
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL SetWorkItemTag(PTP pTP, PWORKITEM pWk, ULONG_PTR uTag)
+{
+	//Parameter Validation
+	if (!(pTP && pWk) || (pWk->dwFlags & WORKITEM_FREEONCOMPLETE) || pWk->pTaskGroup)
 	{
-		LOG_ERROR("Unable to load DLL_LinkedList.dll:%d", GetLastError());
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Set Work Item tag:%d", GetLastError());
 		return FALSE;
 	}
-	MYPROC1 Enqueue = (MYPROC1)GetProcAddress(hDll_LinkedList, "InsertHeadList");
-	if (!Enqueue)
+	if (uTag == 0)
 	{
-		LOG_ERROR("Unable to GetProcAddress:%d", GetLastError());
-		FreeLibrary(hDll_LinkedList);
-		return FALSE;
+		pWk->pTag = NULL;
+		return TRUE;
 	}
-	switch (pWk->iPri)
+	PTAGBUCKET pBucket = GetTagBucket(pTP, uTag);
+	AcquireSRWLockExclusive(&(pBucket->Lock));
+	PTAGENTRY pTag = FindWorkTag(pBucket, uTag);
+	if (pTag == NULL)
 	{
-	case WORKITEM_HIGH: //High Pri Work Item
-		AcquireSRWLockExclusive(&gSRWLock_TPQhigh); //Get exclusive SRW lock
-		LOG_INFO("Inserting High pri Work to queue\n");
-		if (Enqueue(pTP->pTPQ_high, &(pWk->list_entry))) //Queue the work item
-		{
-			ReleaseSRWLockExclusive(&gSRWLock_TPQhigh); //Release exclusive SRW lock
-			InterlockedIncrement(&(pTP->iNumWorkItemsAdded_high)); //Update TP parameters
-			InterlockedIncrement(&(pTP->iNumWorkItemsPending_high));
-			LOG_INFO("Waking Worker Thread for high pri Work\n");
-			if (!SetEvent(g_hWIAvailableEvent)) //Notify Worker Thread
-			{
-				LOG_ERROR("Unable to set g_hWIAvailableEvent[1]:%d", GetLastError());
-				FreeLibrary(hDll_LinkedList);
-				return FALSE;
-			}
-			FreeLibrary(hDll_LinkedList);
-			return TRUE;
-		}
-		else
-		{
-			LOG_ERROR("Unable to Insert High pri Work to queue\n");
-			ReleaseSRWLockExclusive(&gSRWLock_TPQhigh);
-			FreeLibrary(hDll_LinkedList);
-			return FALSE;
-		}
-
-	case WORKITEM_NORMAL: //Normal Pri Work Item (same steps as above)
-		AcquireSRWLockExclusive(&gSRWLock_TPQnormal);
-		LOG_INFO("Inserting Normal pri Work to queue\n");
-		if (Enqueue(pTP->pTPQ_normal, &(pWk->list_entry)))
-		{
-			ReleaseSRWLockExclusive(&gSRWLock_TPQnormal);
-			InterlockedIncrement(&(pTP->iNumWorkItemsAdded_normal));
-			InterlockedIncrement(&(pTP->iNumWorkItemsPending_normal));
-			LOG_INFO("Waking Worker Thread for normal pri Work\n");
-			if (!SetEvent(g_hWIAvailableEvent))
-			{
-				LOG_ERROR("Unable to set g_hWIAvailableEvent[1]:%d", GetLastError());
-				FreeLibrary(hDll_LinkedList);
-				return FALSE;
-			}
-			FreeLibrary(hDll_LinkedList);
-			return TRUE;
-		}
-		else
-		{
-			LOG_INFO("Unable to Insert Normal pri Work to queue\n");
-			ReleaseSRWLockExclusive(&gSRWLock_TPQnormal);
-			FreeLibrary(hDll_LinkedList);
-			return FALSE;
-		}
-
-	case WORKITEM_LOW: //Low Pri Work Item (same steps as above)
-		AcquireSRWLockExclusive(&gSRWLock_TPQlow);
-		LOG_INFO("Inserting low pri Work to queue\n");
-		if (Enqueue(pTP->pTPQ_low, &(pWk->list_entry)))
-		{
-			ReleaseSRWLockExclusive(&gSRWLock_TPQlow);
-			InterlockedIncrement(&(pTP->iNumWorkItemsAdded_low));
-			InterlockedIncrement(&(pTP->iNumWorkItemsPending_low));
-			LOG_INFO("Waking Worker Thread for low pri Work\n");
-			if (!SetEvent(g_hWIAvailableEvent)) //Notify Worker Thread
-			{
-				LOG_ERROR("Unable to set g_hWIAvailableEvent[1]:%d", GetLastError());
-				FreeLibrary(hDll_LinkedList);
-				return FALSE;
-			}
-			FreeLibrary(hDll_LinkedList);
-			return TRUE;
-		}
-		else
+		pTag = (PTAGENTRY)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(TAGENTRY));
+		if (pTag == NULL)
 		{
-			LOG_INFO("Unable to Insert Low pri Work to queue\n");
-			ReleaseSRWLockExclusive(&gSRWLock_TPQlow);
-			FreeLibrary(hDll_LinkedList);
+			ReleaseSRWLockExclusive(&(pBucket->Lock));
+			SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+			LOG_ERROR("Unable to create Work Item tag:%d", GetLastError());
 			return FALSE;
 		}
+		pTag->uTag = uTag;
+		pTag->pTP = pTP;
+		pTag->pNext = pBucket->pHead;
+		pBucket->pHead = pTag;
 	}
+	if (!pTag->bHeld) //New tag, or released while its Work Items still ran, the client holds it again
+	{
+		pTag->bHeld = TRUE;
+		InterlockedIncrement(&(pTag->lRefs));
+	}
+	ReleaseSRWLockExclusive(&(pBucket->Lock));
+	pWk->pTag = pTag;
+	return TRUE;
 }
 
 /*
-This routine checks if a work item can be inserted first
-If so it inserts the work item
-Accepts pointer to Thread Pool and pointer to WorkItem as arguements
-Returns TRUE if work item is inserted, else returns FALSE
+This API releases a tag once the client tags no more Work Items with it, so that tags used per request or per client do not pile up
+Accepts pointer to Thread Pool and the tag as arguements
+The tag is freed once none of its Work Items is queued or running, its counters are lost then and GetWorkTagStats fails with ERROR_NOT_FOUND
+Work Items tagged with it must not be inserted again unless SetWorkItemTag is called on them again
+Returns TRUE upon success, else returns FALSE (tag never used or already released)
 */
-BOOL TryInsertWork(PTP pTP, PWORKITEM pWk)
+BOOL ReleaseWorkTag(PTP pTP, ULONG_PTR uTag)
 {
 	//Parameter validation
-	if (!(pTP && pWk))
+	if (!pTP || (uTag == 0))
 	{
 		SetLastError(ERROR_INVALID_PARAMETER);
-		LOG_ERROR("Cant insert work:%d", GetLastError());
+		LOG_ERROR("Unable to Release Work tag:%d", GetLastError());
 		return FALSE;
 	}
-	if (CanInsertWork(pTP, pWk))
+	PTAGBUCKET pBucket = GetTagBucket(pTP, uTag);
+	AcquireSRWLockExclusive(&(pBucket->Lock));
+	PTAGENTRY pTag = FindWorkTag(pBucket, uTag);
+	if ((pTag == NULL) || !pTag->bHeld)
 	{
-		if (InsertWork(pTP, pWk))
+		ReleaseSRWLockExclusive(&(pBucket->Lock));
+		SetLastError(ERROR_NOT_FOUND);
+		return FALSE;
+	}
+	pTag->bHeld = FALSE;
+	if (InterlockedDecrement(&(pTag->lRefs)) == 0) //No Work Item of the tag is queued or running, unlink it under the lock
+	{
+		for (PTAGENTRY* ppTag = &(pBucket->pHead); *ppTag; ppTag = &((*ppTag)->pNext))
 		{
-			return TRUE;
+			if (*ppTag == pTag)
+			{
+				*ppTag = pTag->pNext;
+				break;
+			}
 		}
+		HeapFree(GetProcessHeap(), 0, pTag);
 	}
-	LOG_ERROR("Cant insert work\n");
-	return FALSE;
+	ReleaseSRWLockExclusive(&(pBucket->Lock));
+	return TRUE;
 }
 
 /*
-This API checks if the submitted work is complete or not
-Accepts pointer to Thread Pool and pointer to Work Item as input
-Return TRUE is work is done, else returns FALSE
+This API cancels every queued Work Item of a tag in O(1)
+Accepts pointer to Thread Pool and the tag as arguements
+The tag's cancel generation is advanced, a Work Item inserted before is dropped without calling its callback when a thread reaches it
+Dropped Work Items get WORK_CANCELLED and are pushed to their completion queue, running callbacks are not interrupted and Work Items inserted afterwards run as usual
+Returns TRUE upon success, else returns FALSE (tag never used or freed after ReleaseWorkTag)
 */
-BOOL IsWorkComplete(PTP pTP, PWORKITEM pWk)
+BOOL CancelWorkByTag(PTP pTP, ULONG_PTR uTag)
 {
 	//Parameter validation
-	if (!(pTP && pWk))
+	if (!pTP || (uTag == 0))
 	{
 		SetLastError(ERROR_INVALID_PARAMETER);
-		LOG_ERROR("Cant check if work is complete:%d", GetLastError());
+		LOG_ERROR("Unable to Cancel Work by tag:%d", GetLastError());
 		return FALSE;
 	}
-	if (pWk->iCompletionStatus == WORK_COMPLETE) //if work is complete, return TRUE
-	{
-		return TRUE;
-	}
-	else if (pWk->iCompletionStatus == WORK_NOTCOMPLETE) //else return FALSE
+	PTAGBUCKET pBucket = GetTagBucket(pTP, uTag);
+	AcquireSRWLockShared(&(pBucket->Lock));
+	PTAGENTRY pTag = FindWorkTag(pBucket, uTag);
+	if (pTag == NULL)
 	{
+		ReleaseSRWLockShared(&(pBucket->Lock));
+		SetLastError(ERROR_NOT_FOUND);
 		return FALSE;
 	}
+	InterlockedIncrement(&(pTag->lCancelGeneration));
+	ReleaseSRWLockShared(&(pBucket->Lock));
+	LOG_INFO("Cancelled queued Work Items of tag %llu\n", (ULONGLONG)uTag);
+	return TRUE;
 }
 
 /*
-This API deletes the work item
-Accepts pointer to Thread Pool and pointer to Work Item as arguements
-Returns TRUE if work item is successfully deleted, else returns FALSE
-Note:
-The work item to be deleted may be in any of the states - Work Complete, Work Not Complete, Work Running
-It is recommended to only Delete Work Item once it is complete
+This API returns the pending, running, completed and cancelled counters of a tag
+Accepts pointer to Thread Pool, the tag and pointer to a structure where the counters need to be written to as arguements
+Returns TRUE upon success, else returns FALSE (tag never used or freed after ReleaseWorkTag)
 */
-BOOL DeleteWorkItem(PTP pTP, PWORKITEM pWk)
+BOOL GetWorkTagStats(PTP pTP, ULONG_PTR uTag, PTPTAGSTATS pTagStats)
 {
 	//Parameter validation
-	if (!(pTP && pWk))
+	if (!(pTP && pTagStats) || (uTag == 0))
 	{
 		SetLastError(ERROR_INVALID_PARAMETER);
-		LOG_ERROR("Cant delete work:%d", GetLastError());
+		LOG_ERROR("Unable to Get Work tag stats:%d", GetLastError());
 		return FALSE;
 	}
-	//Loading DLL_Linkedlist.dll explicitly and getting the relevant functions
-	HMODULE hDll_LinkedList = LoadLibraryExW(L"DLL_LinkedList.dll", NULL, 0);
-	if (hDll_LinkedList == NULL)
+	PTAGBUCKET pBucket = GetTagBucket(pTP, uTag);
+	AcquireSRWLockShared(&(pBucket->Lock));
+	PTAGENTRY pTag = FindWorkTag(pBucket, uTag);
+	if (pTag == NULL)
 	{
-		LOG_ERROR("Unable to load DLL_LinkedList.dll:%d", GetLastError());
+		ReleaseSRWLockShared(&(pBucket->Lock));
+		SetLastError(ERROR_NOT_FOUND);
 		return FALSE;
 	}
-	MYPROC1 FindWorkItem = (MYPROC1)GetProcAddress(hDll_LinkedList, "FindEntry");
-	MYPROC1 RemoveWorkItem = (MYPROC1)GetProcAddress(hDll_LinkedList, "RemoveEntry");
-	if (!(FindWorkItem && RemoveWorkItem))
+	pTagStats->iNumPending = pTag->iPending;
+	pTagStats->iNumRunning = pTag->iRunning;
+	pTagStats->iNumCompleted = pTag->iCompleted;
+	pTagStats->iNumCancelled = pTag->iCancelled;
+	ReleaseSRWLockShared(&(pBucket->Lock));
+	return TRUE;
+}
+
+/*
+This function checks if work item can be inserted to the queue or not
+Accepts pointers to ThreadPool and pointer to WorkItem as arguements
+Returns TRUE if work item can be inserted , else returns false
+*/
+BOOL CanInsertWork(PTP pTP, PWORKITEM pWk)
+{
+	//Parameter validation
+	if (!(pTP && pWk) || (pWk->iPri >= WORKITEM_NUMPRIORITIES))
 	{
-		LOG_ERROR("Unable to GetProcAddress:%d", GetLastError());
-		FreeLibrary(hDll_LinkedList);
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant insert work:%d", GetLastError());
 		return FALSE;
 	}
-	//Get Default Process Heap Handle
-	HANDLE hDefaultHeap = GetProcessHeap();
-	if (hDefaultHeap == NULL)
+	//Thread Pool is being deleted, no new work is accepted
+	if (pTP->iShutdownMode)
 	{
-		LOG_ERROR("Unable to get handle to Default Process Heap:%d", GetLastError());
-		FreeLibrary(hDll_LinkedList);
+		SetLastError(ERROR_INVALID_STATE);
 		return FALSE;
 	}
-	if (pWk->iCompletionStatus == WORK_COMPLETE) //Work is complete, so it is already dequeued, free it
+	//Long running Work Items do not take a Worker Thread, they are only limited by the number of pending long running Work Items
+	if (pWk->dwFlags & WORKITEM_DEDICATED)
+		return (pTP->iNumLongRunningPending < pTP->iMaxPending);
+	//if Current Waiting Worker Threads is 0, notify Control Thread for new Worker Thread Creation
+	if (((PTP)pTP)->iCWWThreads == 0)
 	{
-		if (HeapFree(hDefaultHeap, 0, pWk) == 0)
+		if (!(SetEvent(g_hControlThreadEvent)))
 		{
-			LOG_ERROR("Unable to free WorkItem:%d", GetLastError());
-			FreeLibrary(hDll_LinkedList);
+			LOG_ERROR("Unable to Set g_hControlThreadEvent:%d", GetLastError());
 			return FALSE;
 		}
-		FreeLibrary(hDll_LinkedList);
+	}
+	//if Number of Work Items in the Pri queue of the Work Item has reached iMaxPending cant insert more work
+	if (pTP->iNumWorkItemsPending[pWk->iPri] >= pTP->iMaxPending)
+		return FALSE;
+	else
 		return TRUE;
+}
+
+/*
+This API Inserts work to the respective Pri queue
+Accepts pointer to Thread Pool and pointer to work item as arguements
+Returns True upon succesful insertion, else return False
+*/
+BOOL InsertWork(PTP pTP, PWORKITEM pWk)
+{
+	//Parameter validation
+	if (!(pTP && pWk) || (pWk->iPri >= WORKITEM_NUMPRIORITIES))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant insert work:%d", GetLastError());
+		return FALSE;
 	}
-	//Work is not complete, so it may or may not be dequeued, also work may be in running phase, not recommended to remove
-	else if (pWk->iCompletionStatus == WORK_NOTCOMPLETE)
+	//Thread Pool is being deleted, no new work is accepted
+	if (pTP->iShutdownMode)
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("Cant insert work, Thread Pool is being deleted:%d", GetLastError());
+		return FALSE;
+	}
+	MYPROC1 Enqueue = pTP->pEnqueue;
+	if (pWk->dwFlags & WORKITEM_DEDICATED) //Long running Work Item, keep it off the Worker Threads
+		return InsertLongRunningWork(pTP, pWk, Enqueue);
+	LOG_INFO("Inserting pri %d Work to queue\n", pWk->iPri);
+	if (pWk->dwFlags & WORKITEM_COALESCE) //Keyed Work Item, merge it into the pending one of its key or queue it as the pending one
 	{
-		switch (pWk->iPri)
+		DWORD dwCoalesce = InsertCoalescedWorkItem(pTP, pWk, Enqueue);
+		if (dwCoalesce == COALESCE_MERGED) //A Worker Thread was already woken for the pending Work Item
 		{
-		case WORKITEM_HIGH: // High pri work item
-			AcquireSRWLockShared(&gSRWLock_TPQhigh);
-			if (FindWorkItem(pTP->pTPQ_high, &(pWk->list_entry)))
-			{
-				ReleaseSRWLockShared(&gSRWLock_TPQhigh);
-				AcquireSRWLockExclusive(&gSRWLock_TPQhigh);
-				if (RemoveWorkItem(pTP->pTPQ_high, &(pWk->list_entry))) //Remove work item from queue
-				{
-					InterlockedDecrement(&(pTP->iNumWorkItemsPending_high));
-					LOG_INFO("Removed Work Item from queue\n");
-				}
-				ReleaseSRWLockExclusive(&gSRWLock_TPQhigh);
-			}
-			if (HeapFree(hDefaultHeap, 0, pWk) == 0) // free it
-			{
-				LOG_ERROR("Unable to free WorkItem:%d", GetLastError());
-				FreeLibrary(hDll_LinkedList);
-				return FALSE;
-			}
-			FreeLibrary(hDll_LinkedList);
+			LOG_INFO("Coalesced pri %d Work into a pending Work Item\n", pWk->iPri);
 			return TRUE;
+		}
+		if (dwCoalesce != COALESCE_QUEUED)
+		{
+			LOG_ERROR("Unable to Insert pri %d Work to queue\n", pWk->iPri);
+			return FALSE;
+		}
+	}
+	else if (!EnqueueWorkItem(pTP, pWk, Enqueue)) //Queue the work item and update TP parameters
+	{
+		LOG_ERROR("Unable to Insert pri %d Work to queue\n", pWk->iPri);
+		return FALSE;
+	}
+	LOG_INFO("Waking Worker Thread for pri %d Work\n", pWk->iPri);
+	if (!SetEvent(g_hWIAvailableEvent)) //Notify Worker Thread
+	{
+		LOG_ERROR("Unable to set g_hWIAvailableEvent[1]:%d", GetLastError());
+		return FALSE;
+	}
+	SpawnWorkerOnDemand(pTP); //Create a Worker Thread if there are not enough waiting for the queued work
+	return TRUE;
+}
 
-		case WORKITEM_NORMAL: //same as above
-			AcquireSRWLockShared(&gSRWLock_TPQnormal);
-			if (FindWorkItem(pTP->pTPQ_normal, &(pWk->list_entry)))
-			{
-				ReleaseSRWLockShared(&gSRWLock_TPQnormal);
-				AcquireSRWLockExclusive(&gSRWLock_TPQnormal);
-				if (RemoveWorkItem(pTP->pTPQ_normal, &(pWk->list_entry))) //Remove work item from queue
-				{
-					InterlockedDecrement(&(pTP->iNumWorkItemsPending_normal));
-					LOG_INFO("Removed Work Item from queue\n");
-				}
-				ReleaseSRWLockExclusive(&gSRWLock_TPQnormal);
-			}
-			if (HeapFree(hDefaultHeap, 0, pWk) == 0)
-			{
-				LOG_ERROR("Unable to free WorkItem:%d", GetLastError());
-				FreeLibrary(hDll_LinkedList);
-				return FALSE;
-			}
-			FreeLibrary(hDll_LinkedList);
+/*
+This routine checks if a work item can be inserted first
+If so it inserts the work item
+Accepts pointer to Thread Pool and pointer to WorkItem as arguements
+Returns TRUE if work item is inserted, else returns FALSE
+*/
+BOOL TryInsertWork(PTP pTP, PWORKITEM pWk)
+{
+	//Parameter validation
+	if (!(pTP && pWk) || (pWk->iPri >= WORKITEM_NUMPRIORITIES))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant insert work:%d", GetLastError());
+		return FALSE;
+	}
+	//A duplicate of a pending Work Item takes no queue slot, so it is merged even when the Pri queue is full
+	if ((pWk->dwFlags & WORKITEM_COALESCE) && !pTP->iShutdownMode && (InsertCoalescedWorkItem(pTP, pWk, NULL) == COALESCE_MERGED))
+		return TRUE;
+	if (CanInsertWork(pTP, pWk))
+	{
+		if (InsertWork(pTP, pWk))
+		{
 			return TRUE;
+		}
+	}
+	LOG_ERROR("Cant insert work\n");
+	return FALSE;
+}
 
-		case WORKITEM_LOW: //same as above
-			AcquireSRWLockShared(&gSRWLock_TPQlow);
-			if (FindWorkItem(pTP->pTPQ_low, &(pWk->list_entry)))
-			{
-				ReleaseSRWLockShared(&gSRWLock_TPQlow);
-				AcquireSRWLockExclusive(&gSRWLock_TPQlow);
-				if (RemoveWorkItem(pTP->pTPQ_low, &(pWk->list_entry))) //Remove work item from queue
-				{
-					InterlockedDecrement(&(pTP->iNumWorkItemsPending_low));
-					LOG_INFO("Removed Work Item from queue\n");
-				}
-				ReleaseSRWLockExclusive(&gSRWLock_TPQlow);
-			}
-			if (HeapFree(hDefaultHeap, 0, pWk) == 0)
-			{
-				LOG_ERROR("Unable to free WorkItem:%d", GetLastError());
-				FreeLibrary(hDll_LinkedList);
-				return FALSE;
-			}
-			FreeLibrary(hDll_LinkedList);
-			return TRUE;
+/*
+This API checks if the submitted work is complete or not
+Accepts pointer to Thread Pool and pointer to Work Item as input
+Return TRUE is work is done, else returns FALSE
+*/
+BOOL IsWorkComplete(PTP pTP, PWORKITEM pWk)
+{
+	//Parameter validation
+	if (!(pTP && pWk))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant check if work is complete:%d", GetLastError());
+		return FALSE;
+	}
+	if (pWk->iCompletionStatus == WORK_COMPLETE) //if work is complete, return TRUE
+	{
+		return TRUE;
+	}
+	else //Work not complete or cancelled, return FALSE
+	{
+		return FALSE;
+	}
+}
+
+/*
+This API deletes the work item
+Accepts pointer to Thread Pool and pointer to Work Item as arguements
+Returns TRUE if work item is successfully deleted, else returns FALSE
+Note:
+The work item to be deleted may be in any of the states - Work Complete, Work Not Complete, Work Running
+It is recommended to only Delete Work Item once it is complete
+*/
+BOOL DeleteWorkItem(PTP pTP, PWORKITEM pWk)
+{
+	//Parameter validation
+	if (!(pTP && pWk))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant delete work:%d", GetLastError());
+		return FALSE;
+	}
+	//Get Default Process Heap Handle
+	HANDLE hDefaultHeap = GetProcessHeap();
+	if (hDefaultHeap == NULL)
+	{
+		LOG_ERROR("Unable to get handle to Default Process Heap:%d", GetLastError());
+		return FALSE;
+	}
+	//Work is not complete, so it may or may not be dequeued, also work may be in running phase, not recommended to remove
+	if (pWk->iCompletionStatus == WORK_NOTCOMPLETE)
+	{
+		if (RemoveQueuedWorkItem(pTP, pWk)) //Remove work item from its Pri queue if it is still queued
+			LOG_INFO("Removed Work Item from queue\n");
+		if (ClearTaggedWorkPending(pWk)) //A Work Item a thread already took has been counted as started, the thread drops its tag reference
+			ReleaseTaggedWork(pWk);
+		if (pWk->dwFlags & WORKITEM_COALESCE) //Remove it from the coalescing index, the Work Items merged into it are queued on their own
+		{
+			PWORKITEM pMerged = UnlinkCoalescedWorkItem(pTP, pWk);
+			if (pMerged && !InsertWork(pTP, pMerged))
+				CompleteCoalescedWorkItems(pMerged, WORK_CANCELLED);
 		}
 	}
+	//Work is complete, cancelled or dequeued above, free it unless the caller owns the storage
+	if (!(pWk->dwFlags & WORKITEM_CALLEROWNED) && (HeapFree(hDefaultHeap, 0, pWk) == 0))
+	{
+		LOG_ERROR("Unable to free WorkItem:%d", GetLastError());
+		return FALSE;
+	}
+	return TRUE;
 }
 
 /*
@@ -791,24 +941,116 @@ BOOL GetTPStats(PTP pTP, PTPSTATS pTPStats)
 	{
 		pTPStats->iCurrentRunningThreads = pTP->iCRWThreads;
 		pTPStats->iCurrentWaitingThreads = pTP->iCWWThreads;
-		pTPStats->iNumWorkItemsAdded_high = pTP->iNumWorkItemsAdded_high;
-		pTPStats->iNumWorkItemsAdded_low = pTP->iNumWorkItemsAdded_low;
-		pTPStats->iNumWorkItemsAdded_normal = pTP->iNumWorkItemsAdded_normal;
-		pTPStats->iNumWorkItemsHandled_high = pTP->iNumWorkItemsHandled_high;
-		pTPStats->iNumWorkItemsHandled_low = pTP->iNumWorkItemsHandled_low;
-		pTPStats->iNumWorkItemsHandled_normal = pTP->iNumWorkItemsHandled_normal;
-		pTPStats->iNumWorkItemsPending_high = pTP->iNumWorkItemsPending_high;
-		pTPStats->iNumWorkItemsPending_low = pTP->iNumWorkItemsPending_low;
-		pTPStats->iNumWorkItemsPending_normal = pTP->iNumWorkItemsPending_normal;
+		pTPStats->iCurrentBlockedThreads = pTP->iBlockedThreads;
+		for (int i = 0; i < WORKITEM_NUMPRIORITIES; i++)
+		{
+			pTPStats->iNumWorkItemsAdded[i] = pTP->iNumWorkItemsAdded[i];
+			pTPStats->iNumWorkItemsPending[i] = pTP->iNumWorkItemsPending[i];
+			pTPStats->iNumWorkItemsHandled[i] = pTP->iNumWorkItemsHandled[i];
+			pTPStats->dwQueueWaitP99[i] = QueueWaitPercentile(pTP, i, 99);
+		}
+		pTPStats->iNumWorkItemsAllocated = pTP->iNumWorkItemsAllocated;
+		pTPStats->iNumIoPending = pTP->iIoPending;
+		pTPStats->iNumIoThreads = (pTP->hIoThread ? 1 : 0) + pTP->iBlockingIoThreads;
+		pTPStats->iNumLongRunningThreads = pTP->iLongRunningThreads;
+		pTPStats->iNumLongRunningActive = pTP->iLongRunningActive;
+		pTPStats->iNumLongRunningAdded = pTP->iNumLongRunningAdded;
+		pTPStats->iNumLongRunningPending = pTP->iNumLongRunningPending;
+		pTPStats->iNumLongRunningHandled = pTP->iNumLongRunningHandled;
+		pTPStats->llLongRunningTotalMs = pTP->llLongRunningTotalMs;
+		pTPStats->llLongRunningMaxMs = pTP->llLongRunningMaxMs;
+		pTPStats->iNumWorkItemsCoalesced = pTP->iNumWorkItemsCoalesced;
+		pTPStats->iNumWorkItemsSpilled = pTP->iNumWorkItemsSpilled;
+		pTPStats->iNumWorkItemsRefilled = pTP->iNumWorkItemsRefilled;
+		pTPStats->iNumSpillBacklog = pTP->iSpillBacklog;
 
 		return TRUE;
 	}
 	return FALSE;
 }
 
+/*
+This API publishes the Thread Pool Statistics in a named shared memory segment, so that monitoring tools in other processes can read them
+Accepts 3 arguments:
+a.Pointer to Thread Pool
+b.Name of the Thread Pool (less than TPSTATS_SEGMENT_MAXNAME characters), the segment is named TPSTATS_SEGMENT_NAMEFORMAT with the process id and this name
+c.Number of milliseconds between two updates (0 for TPSTATS_PUBLISHINTERVAL)
+The Control Thread copies GetTPStats into the segment once per interval under a seqlock, readers never block the Thread Pool
+The segment is removed by DeleteTPEx
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL PublishTPStats(PTP pTP, LPCWSTR pszName, DWORD dwInterval)
+{
+	//Parameter validation
+	if (!(pTP && pszName && pszName[0]) || (lstrlenW(pszName) >= TPSTATS_SEGMENT_MAXNAME))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Publish TP Stats:%d", GetLastError());
+		return FALSE;
+	}
+	if (pTP->hStatsMapping)
+	{
+		SetLastError(ERROR_ALREADY_EXISTS);
+		LOG_ERROR("TP Stats are already published:%d", GetLastError());
+		return FALSE;
+	}
+	WCHAR szMapping[MAX_PATH];
+	swprintf_s(szMapping, MAX_PATH, TPSTATS_SEGMENT_NAMEFORMAT, GetCurrentProcessId(), pszName);
+	HANDLE hMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(TPSTATSSEGMENT), szMapping);
+	if (hMapping == NULL)
+	{
+		LOG_ERROR("Unable to create stats segment:%d", GetLastError());
+		return FALSE;
+	}
+	if (GetLastError() == ERROR_ALREADY_EXISTS) //Another Thread Pool of the process published under the same name
+	{
+		CloseHandle(hMapping);
+		SetLastError(ERROR_ALREADY_EXISTS);
+		LOG_ERROR("Stats segment name is in use:%d", GetLastError());
+		return FALSE;
+	}
+	PTPSTATSSEGMENT pSegment = (PTPSTATSSEGMENT)MapViewOfFile(hMapping, FILE_MAP_WRITE, 0, 0, sizeof(TPSTATSSEGMENT));
+	if (pSegment == NULL)
+	{
+		LOG_ERROR("Unable to map stats segment:%d", GetLastError());
+		CloseHandle(hMapping);
+		return FALSE;
+	}
+	pSegment->dwVersion = TPSTATS_SEGMENT_VERSION;
+	pSegment->cbSize = sizeof(TPSTATSSEGMENT);
+	pSegment->dwProcessId = GetCurrentProcessId();
+	pSegment->dwPublishInterval = dwInterval ? dwInterval : TPSTATS_PUBLISHINTERVAL;
+	lstrcpynW(pSegment->szName, pszName, TPSTATS_SEGMENT_MAXNAME);
+	InterlockedExchange((volatile LONG*)&(pSegment->dwMagic), TPSTATS_SEGMENT_MAGIC); //Readers check the magic last, the header is complete once it is set
+	pTP->hStatsMapping = hMapping;
+	pTP->pStatsSegment = pSegment;
+	if (!SetEvent(pTP->hStatsPublishEvent)) //Control Thread writes the first update right away
+	{
+		LOG_ERROR("Unable to Set hStatsPublishEvent:%d", GetLastError());
+	}
+	return TRUE;
+}
+
+/*
+This routine copies the Thread Pool Statistics into the stats segment, called by the Control Thread
+Accepts pointer to Thread Pool as arguement
+The sequence is odd while the copy is in progress, the interlocked increments are full barriers so a reader which sees the same even sequence before and after its copy has a consistent snapshot
+*/
+VOID UpdateStatsSegment(PTP pTP)
+{
+	TPSTATS Stats = { 0 };
+	GetTPStats(pTP, &Stats); //Collected before the seqlock is taken, so readers retry for as short as possible
+	PTPSTATSSEGMENT pSegment = pTP->pStatsSegment;
+	InterlockedIncrement(&(pSegment->lSequence));
+	CopyMemory(&(pSegment->Stats), &Stats, sizeof(TPSTATS));
+	pSegment->ullTimestamp = GetTickCount64();
+	pSegment->ullUpdates++;
+	InterlockedIncrement(&(pSegment->lSequence));
+}
+
 /*
 This routine Deletes the TP
-It is recommended that the client calls this only after all the work items are completed and freed, else the behaviour is undefined
+It is equivalent to DeleteTPEx with TPDELETE_DRAIN, queued work items are run before the Thread Pool is deleted
 Accepts pointer to Thread pool as arguement
 Returns TRUE upon successful deletion of TP, else return FALSE
 If Deletion of TP fails, the state of the TP is undefined and client should no longer use the TP
@@ -816,64 +1058,5391 @@ It can either create a new TP or terminate
 */
 BOOL DeleteTP(PTP pTP)
 {
-	//Set g_hDeleteTPEvent, this notifies all Worker Threads and Control Thread to terminate
-	if (!SetEvent(g_hDeleteTPEvent))
+	return DeleteTPEx(pTP, TPDELETE_DRAIN, INFINITE);
+}
+
+/*
+This routine Deletes the TP, handling queued work items according to the mode
+Accepts 3 arguments:
+a.Pointer to Thread pool
+b.Delete mode, one of:
+  TPDELETE_DRAIN - no new work is accepted, queued work items are run (the calling thread helps) and then the threads are joined
+  TPDELETE_CANCEL - queued work items are dropped (status WORK_CANCELLED), running work items are waited for and then the threads are joined
+  TPDELETE_ABORT - same as TPDELETE_CANCEL, but the routine gives up once the timeout expires
+c.Timeout in milliseconds for TPDELETE_ABORT (ignored for other modes)
+Cancelled Task Group tasks count as done for their group, cancelled client Work Items must still be freed with DeleteWorkItem
+Must not be called from a Work Item callback, strands, pipelines and submission rings of the TP must be deleted first
+Returns TRUE upon successful deletion of TP, else return FALSE (ERROR_INVALID_STATE while a strand, pipeline or submission ring is left)
+If TPDELETE_ABORT times out, it returns FALSE with ERROR_TIMEOUT, the remaining threads exit once their callbacks return and the TP is not freed
+DeleteTPEx must then be called again to finish the teardown, it carries on in TPDELETE_ABORT mode with the timeout passed if dwMode is TPDELETE_ABORT, else it waits for the threads
+Until then CreateTP fails with ERROR_BUSY, as the remaining threads still wait on the process wide events
+*/
+BOOL DeleteTPEx(PTP pTP, DWORD dwMode, DWORD dwTimeout)
+{
+	//Parameter validation
+	if ((pTP == NULL) || (dwMode < TPDELETE_DRAIN) || (dwMode > TPDELETE_ABORT))
 	{
-		LOG_ERROR("Unable to Set g_hDeleteTPEvent:%d\n", GetLastError());
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant delete TP:%d", GetLastError());
+		return FALSE;
+	}
+	//Their Work Items and callbacks use the TP, they would be left pointing to freed memory
+	if (pTP->lLiveObjects > 0)
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("Cant delete TP, %d strands, pipelines or submission rings are left:%d", pTP->lLiveObjects, GetLastError());
 		return FALSE;
 	}
+	ULONGLONG ullDeadline = ((dwMode == TPDELETE_ABORT) && (dwTimeout != INFINITE)) ? (GetTickCount64() + dwTimeout) : 0;
+	//Stop accepting work, only one caller may delete the TP, unless a timed out TPDELETE_ABORT left the teardown to a later call
+	BOOL bResumed = FALSE;
+	if (InterlockedCompareExchange(&(pTP->iShutdownMode), dwMode, 0) != 0)
+	{
+		if (InterlockedCompareExchange(&(pTP->bDeleteTimedOut), 0, 1) != 1)
+		{
+			SetLastError(ERROR_INVALID_STATE);
+			LOG_ERROR("TP is already being deleted:%d", GetLastError());
+			return FALSE;
+		}
+		bResumed = TRUE;
+		dwMode = TPDELETE_ABORT; //Queued Work Items are still dropped
+	}
 	HANDLE hDefaultHeap = GetProcessHeap();
 	if (hDefaultHeap == NULL) //if it fails return NULL
 	{
 		LOG_ERROR("Unable to get handle to Default Process Heap:%d", GetLastError());
 		return FALSE;
 	}
-	//Wait for Control and Worker Threads to terminate
-	while ((pTP->iCRWThreads) || (pTP->iCWWThreads))
+	MYPROC3 DeleteQueue = pTP->pDeleteQueue;
+	MYPROC2 Dequeue = pTP->pDequeue;
+
+	//No wait fires from here on, callbacks already queued are drained or dropped below
+	if (!bResumed)
+		StopWaiters(pTP);
+
+	//Drain or drop the queued work items and wait for the running ones and the async I/O in flight, Worker Threads set hWorkerIdleEvent when they finish a batch
+	//The spill log is drained too, cancelled spillable Work Items drop it
+	while ((pTP->iCRWThreads > 0) || (pTP->iNumWorkItemsPendingTotal > 0) || (pTP->iIoPending > 0) || (pTP->iNumLongRunningPending > 0) || (pTP->iLongRunningActive > 0)
+		|| ((dwMode == TPDELETE_DRAIN) && (pTP->iSpillBacklog > 0)))
+	{
+		if (dwMode == TPDELETE_DRAIN)
+		{
+			if (ExecutePendingWorkItem(pTP, Dequeue)) //Calling thread helps the Worker Threads drain the queues
+				continue;
+			if (pTP->iSpillBacklog > 0) //Read the spill log back, SpillWorkProc does it as well once the spillable Work Items run
+			{
+				AcquireSRWLockExclusive(&(pTP->SpillLock));
+				int iRefilled = RefillSpilledWork(pTP, pTP->pEnqueue);
+				ReleaseSRWLockExclusive(&(pTP->SpillLock));
+				if (iRefilled)
+					continue;
+			}
+		}
+		else
+		{
+			CancelQueuedWorkItems(pTP, Dequeue);
+		}
+		DWORD dwWait = ((pTP->iNumWorkItemsPendingTotal > 0) || (pTP->iIoPending > 0) || (pTP->iNumLongRunningPending > 0) || (pTP->iSpillBacklog > 0)) ? HELPWAITINTERVAL : INFINITE;
+		if (ullDeadline)
+		{
+			ULONGLONG ullNow = GetTickCount64();
+			if (ullNow >= ullDeadline)
+			{
+				//Running callbacks did not finish in time, let the threads exit once they return and leave the TP allocated for them until DeleteTPEx is called again
+				SetEvent(g_hDeleteTPEvent);
+				if (!bResumed)
+					InterlockedIncrement(&g_lTimedOutTPs);
+				InterlockedExchange(&(pTP->bDeleteTimedOut), 1);
+				SetLastError(ERROR_TIMEOUT);
+				LOG_ERROR("TP abort timed out with %d running Worker Threads:%d\n", pTP->iCRWThreads, GetLastError());
+				return FALSE;
+			}
+			dwWait = (DWORD)min((ULONGLONG)dwWait, ullDeadline - ullNow);
+		}
+		if (WaitForSingleObject(pTP->hWorkerIdleEvent, dwWait) == WAIT_FAILED)
+		{
+			LOG_ERROR("DeleteTPEx Wait failed:%d\n", GetLastError());
+			return FALSE;
+		}
+	}
+	LOG_INFO("No work items queued or running\n");
+
+	//Set g_hDeleteTPEvent, this notifies all Worker Threads and Control Thread to terminate
+	if (!SetEvent(g_hDeleteTPEvent))
+	{
+		LOG_ERROR("Unable to Set g_hDeleteTPEvent:%d\n", GetLastError());
+		return FALSE;
+	}
+	//Join the Control Thread first, it is the only thread which creates Worker Threads
+	if (WaitForSingleObject(pTP->hControlThread, INFINITE) == WAIT_FAILED)
+	{
+		LOG_ERROR("Unable to join Control Thread:%d\n", GetLastError());
+		return FALSE;
+	}
+	CloseHandle(pTP->hControlThread);
+	//Join the Worker Threads, at most MAXIMUM_WAIT_OBJECTS at a time
+	AcquireSRWLockExclusive(&(pTP->WorkerThreadsLock));
+	HANDLE hJoin[MAXIMUM_WAIT_OBJECTS];
+	DWORD dwJoin = 0;
+	for (int i = 0; i < pTP->iWorkerThreadSlots; i++)
+	{
+		if (pTP->phWorkerThreads[i] != NULL)
+		{
+			hJoin[dwJoin++] = pTP->phWorkerThreads[i];
+		}
+		if ((dwJoin == MAXIMUM_WAIT_OBJECTS) || ((i == pTP->iWorkerThreadSlots - 1) && dwJoin))
+		{
+			if (WaitForMultipleObjects(dwJoin, hJoin, TRUE, INFINITE) == WAIT_FAILED)
+			{
+				LOG_ERROR("Unable to join Worker Threads:%d\n", GetLastError());
+			}
+			for (DWORD j = 0; j < dwJoin; j++)
+			{
+				CloseHandle(hJoin[j]);
+			}
+			dwJoin = 0;
+		}
+	}
+	ReleaseSRWLockExclusive(&(pTP->WorkerThreadsLock));
+	//Join the Long Running Threads, they terminate on g_hDeleteTPEvent once the long running Work Items are done
+	for (int i = 0; i < LONGRUNNING_MAXTHREADS; i++)
 	{
-		Sleep(1000);
+		if (pTP->hLongRunningThreads[i] != NULL)
+		{
+			WaitForSingleObject(pTP->hLongRunningThreads[i], INFINITE);
+			CloseHandle(pTP->hLongRunningThreads[i]);
+		}
 	}
 	LOG_INFO("Closed all TP threads\n");
+	if (bResumed) //No thread of the TP waits on the process wide events any more
+		InterlockedDecrement(&g_lTimedOutTPs);
+
+	StopIoThreads(pTP);
+	FreeWaiters(pTP);
+
+	//Free the sockets which are still registered, no Worker Thread is left to wait on them
+	for (int i = 0; i < pTP->iNumSocketWork; i++)
+	{
+		FreeSocketWork(pTP->pSocketWork[i]);
+	}
+	pTP->iNumSocketWork = 0;
+
+	//Free the tags, no Work Item can reach them any more
+	for (int i = 0; i < TAG_BUCKETS; i++)
+	{
+		PTAGENTRY pTag = pTP->TagBuckets[i].pHead;
+		while (pTag)
+		{
+			PTAGENTRY pNext = pTag->pNext;
+			HeapFree(hDefaultHeap, 0, pTag);
+			pTag = pNext;
+		}
+	}
+
+	//Remove the spill log, closing the segments deletes their files
+	while (pTP->pSpillHead)
+	{
+		PSPILLSEGMENT pNext = pTP->pSpillHead->pNext;
+		FreeSpillSegment(pTP->pSpillHead);
+		pTP->pSpillHead = pNext;
+	}
+	if (pTP->pSpillSpare)
+		FreeSpillSegment(pTP->pSpillSpare);
+
+	//Stop the recording, every Work Item it could see has run
+	AcquireSRWLockExclusive(&(pTP->RecordLock));
+	if (pTP->hRecordFile)
+		StopRecording(pTP);
+	ReleaseSRWLockExclusive(&(pTP->RecordLock));
+	if (pTP->pRecordBuffer)
+		HeapFree(hDefaultHeap, 0, pTP->pRecordBuffer);
+	if (pTP->pRecordSpare)
+		HeapFree(hDefaultHeap, 0, pTP->pRecordSpare);
+
+	//Free the profile tables, every thread which recorded into them is gone
+	PPROFILETABLE pTable = pTP->pProfileTables;
+	while (pTable)
+	{
+		PPROFILETABLE pNext = pTable->pNext;
+		HeapFree(hDefaultHeap, 0, pTable);
+		pTable = pNext;
+	}
+
+	//Remove the stats segment, readers which still have it mapped keep the last update
+	if (pTP->pStatsSegment)
+	{
+		UnmapViewOfFile(pTP->pStatsSegment);
+		CloseHandle(pTP->hStatsMapping);
+	}
+
 	//Close all the Events created
-	if (!(CloseHandle(g_hControlThreadEvent) && CloseHandle(g_hWIAvailableEvent) && CloseHandle(g_hKillWorkerThreadTimer) && CloseHandle(g_hDeleteTPEvent)))
+	if (!(CloseHandle(g_hControlThreadEvent) && CloseHandle(g_hWIAvailableEvent) && CloseHandle(g_hKillWorkerThreadTimer) && CloseHandle(g_hDeleteTPEvent) && CloseHandle(pTP->hWorkerIdleEvent)
+		&& CloseHandle(pTP->hSocketChangedEvent) && CloseHandle(pTP->hSocketPromoteEvent) && CloseHandle(pTP->hSocketRebuiltEvent) && CloseHandle(pTP->hLongRunningSemaphore) && CloseHandle(pTP->hStatsPublishEvent)))
 	{
 		LOG_ERROR("Unable to Close handle to one or more Events:%d\n", GetLastError());
 		return FALSE;
 	}
 	LOG_INFO("Successfully closed all Event handles\n");
 
-	//Loading DLL_Linkedlist.dll explicitly and getting the relevant functions
-	HMODULE hDll_LinkedList = LoadLibraryExW(L"DLL_LinkedList.dll", NULL, 0);
-	if (hDll_LinkedList == NULL)
-	{
-		LOG_ERROR("Unable to load DLL_LinkedList.dll:%d", GetLastError());
-		return FALSE;
-	}
-	MYPROC3 DeleteQueue = (MYPROC3)GetProcAddress(hDll_LinkedList, "DeleteList");
-	if (!DeleteQueue)
+	//Free the pri queues
+	for (int i = 0; i < WORKITEM_NUMPRIORITIES; i++)
 	{
-		LOG_ERROR("Unable to GetProcAddress:%d", GetLastError());
-		FreeLibrary(hDll_LinkedList);
-		return FALSE;
+		if (!DeleteQueue(pTP->pTPQ[i]))
+		{
+			LOG_ERROR("Unable to Free Pri queues\n");
+			return FALSE;
+		}
 	}
-	//Free the 3 pri queues
-	if (!(DeleteQueue(pTP->pTPQ_high) && DeleteQueue(pTP->pTPQ_normal) && DeleteQueue(pTP->pTPQ_low)))
+	if (!DeleteQueue(pTP->pLongRunningQ))
 	{
-		LOG_ERROR("Unable to Free Pri queues\n");
-		FreeLibrary(hDll_LinkedList);
+		LOG_ERROR("Unable to Free Long Running queue\n");
 		return FALSE;
 	}
 	LOG_INFO("Successfully closed all Pri Queues\n");
 
-	if (HeapFree(hDefaultHeap, 0, pTP) == 0)
+	FreeLibrary(pTP->hDll_LinkedList); //Release the reference taken by CreateTP, the list functions are not used from here on
+	if ((HeapFree(hDefaultHeap, 0, pTP->phWorkerThreads) == 0) || (HeapFree(hDefaultHeap, 0, pTP->pRunningSlots) == 0) || (HeapFree(hDefaultHeap, 0, pTP) == 0))
 	{
 		LOG_ERROR("Unable to free pTP:%d", GetLastError());
-		FreeLibrary(hDll_LinkedList);
 		return FALSE;
 	}
 	LOG_INFO("Successfully deleted TP\n");
-	FreeLibrary(hDll_LinkedList);
 	return TRUE;
 }
 
+/*
+This routine creates a Worker Thread and records its handle so that DeleteTPEx can join it
+Accepts pointer to Thread Pool and the max number of Worker Threads the pool may have as arguements
+The thread is counted as a waiting Worker Thread before it starts, a slot is reused once the thread recorded in it has exited (idle timeout)
+Returns TRUE if the Worker Thread was created, else returns FALSE (limit reached or creation failed)
+*/
+BOOL CreateWorkerThread(PTP pTP, int iMaxWorkers)
+{
+	//Reserve a Worker Thread below the limit, concurrent callers cannot overshoot it
+	int iWorkers = pTP->iWorkerThreads;
+	while (TRUE)
+	{
+		if (iWorkers >= iMaxWorkers)
+		{
+			return FALSE;
+		}
+		int iPrevious = InterlockedCompareExchange(&(pTP->iWorkerThreads), iWorkers + 1, iWorkers);
+		if (iPrevious == iWorkers)
+		{
+			break;
+		}
+		iWorkers = iPrevious;
+	}
+	InterlockedIncrement(&(pTP->iCWWThreads));
+	HANDLE hThread = CreateThread(NULL, 0, WorkerThreadProc, (LPVOID)pTP, 0, 0);
+	if (hThread == NULL)
+	{
+		LOG_ERROR("Unable to Create Worker Thread:%d", GetLastError());
+		InterlockedDecrement(&(pTP->iCWWThreads));
+		InterlockedDecrement(&(pTP->iWorkerThreads));
+		return FALSE;
+	}
+	BOOL bRecorded = FALSE;
+	AcquireSRWLockExclusive(&(pTP->WorkerThreadsLock));
+	for (int i = 0; i < pTP->iWorkerThreadSlots; i++)
+	{
+		if (pTP->phWorkerThreads[i] == NULL)
+		{
+			pTP->phWorkerThreads[i] = hThread;
+			bRecorded = TRUE;
+			break;
+		}
+		if (WaitForSingleObject(pTP->phWorkerThreads[i], 0) == WAIT_OBJECT_0) //Thread has exited, reuse its slot
+		{
+			CloseHandle(pTP->phWorkerThreads[i]);
+			pTP->phWorkerThreads[i] = hThread;
+			bRecorded = TRUE;
+			break;
+		}
+	}
+	ReleaseSRWLockExclusive(&(pTP->WorkerThreadsLock));
+	if (!bRecorded)
+	{
+		//Cannot happen while thread creation respects iWorkerThreadSlots, the thread still runs but is not joined
+		LOG_ERROR("No free Worker Thread slot\n");
+		CloseHandle(hThread);
+	}
+	return TRUE;
+}
+
+/*
+This routine creates a Worker Thread when more work items are queued than there are waiting Worker Threads
+Accepts pointer to Thread Pool as arguement
+Registered sockets without a leader count as one more queued work item, RegisterSocketWork relies on it for the first socket
+Worker Threads are only created upto iIdealThreads plus the reserved and blocked Worker Threads here, the Control Thread adds more when all of them are busy
+Returns TRUE if a Worker Thread was created, else returns FALSE
+*/
+BOOL SpawnWorkerOnDemand(PTP pTP)
+{
+	int iMaxWorkers = min(pTP->iIdealThreads + RESERVED_THREADS(pTP->lReserved) + pTP->iBlockedThreads, pTP->iWorkerThreadSlots); //Blocked Worker Threads do not count
+	if ((pTP->iWorkerThreads >= iMaxWorkers) || (pTP->iShutdownMode))
+	{
+		return FALSE;
+	}
+	int iPending = pTP->iNumWorkItemsPendingTotal;
+	if ((pTP->iNumSocketWork > 0) && !pTP->iSocketLeader) //Registered sockets need a waiting Worker Thread to lead their wait
+		iPending++;
+	if (iPending <= (pTP->iCWWThreads - RESERVED_THREADS(pTP->lReserved))) //Enough waiting Worker Threads to pick the queued work, not counting the reserved ones
+	{
+		return FALSE;
+	}
+	LOG_INFO("Creating Worker Thread on demand\n");
+	return CreateWorkerThread(pTP, iMaxWorkers);
+}
+
+/*
+This API creates Worker Threads ahead of traffic, so that the first work items do not pay for thread creation
+Accepts pointer to Thread Pool and the number of Worker Threads wanted as arguements
+The number of Worker Threads is capped to iIdealThreads plus the reserved Worker Threads, as threads above it terminate on WORKERTHREADIDLETIMEOUT
+Returns TRUE if the Thread Pool has at least the wanted (capped) number of Worker Threads, else returns FALSE
+*/
+BOOL TPPrewarm(PTP pTP, int iThreads)
+{
+	//Parameter validation
+	if ((pTP == NULL) || (iThreads < 0))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant prewarm TP:%d", GetLastError());
+		return FALSE;
+	}
+	int iTarget = min(iThreads, pTP->iIdealThreads + RESERVED_THREADS(pTP->lReserved));
+	while (CreateWorkerThread(pTP, iTarget))
+	{
+	}
+	LOG_INFO("TP prewarmed to %d Worker Threads\n", pTP->iWorkerThreads);
+	return (pTP->iWorkerThreads >= iTarget);
+}
+
+/*
+This API reserves Worker Threads for high pri Work Items, so they do not wait behind long low pri callbacks
+Accepts pointer to Thread Pool, the lowest priority the reserved Worker Threads take and the number of Worker Threads to reserve (0 removes the reservation)
+Work Items below the priority only start while iThreads Worker Threads stay free for Work Items of the priority or above
+The reserved Worker Threads are created here, iThreads beyond the Worker Threads the pool already has and upto iIdealThreads + iThreads in all, as SpawnWorkerOnDemand caps them
+Returns TRUE upon success, else returns FALSE (also when the reserved Worker Threads could not all be created)
+*/
+BOOL SetTPReservedThreads(PTP pTP, DWORD iPri, int iThreads)
+{
+	//Parameter validation
+	if ((pTP == NULL) || (iPri >= WORKITEM_NUMPRIORITIES) || (iThreads < 0) || (iThreads > MAXTHREADS))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant reserve Worker Threads:%d", GetLastError());
+		return FALSE;
+	}
+	//Thread Pool is being deleted, no new Worker Threads are created
+	if (pTP->iShutdownMode)
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("Cant reserve Worker Threads, Thread Pool is being deleted:%d", GetLastError());
+		return FALSE;
+	}
+	InterlockedExchange(&(pTP->lReserved), RESERVED_PACK(iThreads, (iThreads > 0) ? iPri : 0)); //One store, readers never see the count of one reservation with the priority of another
+	//Create the reserved Worker Threads on top of the existing ones, the Worker Threads created on demand then run the lower pri Work Items
+	int iMaxWorkers = min(pTP->iIdealThreads + iThreads + pTP->iBlockedThreads, pTP->iWorkerThreadSlots);
+	int iTarget = min(pTP->iWorkerThreads + iThreads, iMaxWorkers);
+	for (int i = 0; (i < iThreads) && CreateWorkerThread(pTP, iTarget); i++)
+	{
+	}
+	LOG_INFO("Reserved %d Worker Threads for pri %d Work and above\n", iThreads, iPri);
+	return (pTP->iWorkerThreads >= iTarget);
+}
+
+/*
+This API caps the number of Worker Threads low pri Work Items may occupy at once
+Accepts pointer to Thread Pool, the priority and the max number of Worker Threads (0 removes the cap)
+Work Items of the priority or below only start while fewer than iMaxThreads Worker Threads run such Work Items, the others stay queued
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL SetTPPriorityCap(PTP pTP, DWORD iPri, int iMaxThreads)
+{
+	//Parameter validation
+	if ((pTP == NULL) || (iPri >= WORKITEM_NUMPRIORITIES) || (iMaxThreads < 0))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant cap Worker Threads:%d", GetLastError());
+		return FALSE;
+	}
+	pTP->iMaxCappedThreads = iMaxThreads;
+	pTP->iCappedPri = (iMaxThreads > 0) ? (int)iPri : -1;
+	SetEvent(g_hWIAvailableEvent); //Work Items held back by a lower cap may start now
+	LOG_INFO("Capped pri %d Work and below to %d Worker Threads\n", iPri, iMaxThreads);
+	return TRUE;
+}
+
+/*
+This API changes the thread and queue limits of a Thread Pool
+Accepts 3 arguments:
+a.Pointer to Thread Pool
+b.Max number of Worker Threads the Control Thread creates beyond the ideal number when every Worker Thread is busy (0 to MAXTHREADS)
+c.Max number of pending Work Items per Pri queue, CanInsertWork and TryInsertWork refuse more (at least 1)
+Lowering a limit does not retire Worker Threads or drop queued Work Items, it only holds back new ones
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL SetTPLimits(PTP pTP, int iMaxThreads, int iMaxPending)
+{
+	//Parameter validation
+	if ((pTP == NULL) || (iMaxThreads < 0) || (iMaxThreads > MAXTHREADS) || (iMaxPending < 1))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Set TP Limits:%d", GetLastError());
+		return FALSE;
+	}
+	InterlockedExchange((volatile LONG*)&(pTP->iMaxThreads), iMaxThreads);
+	InterlockedExchange((volatile LONG*)&(pTP->iMaxPending), iMaxPending);
+	LOG_INFO("Limited TP to %d additional Worker Threads and %d pending Work Items per pri\n", iMaxThreads, iMaxPending);
+	return TRUE;
+}
+
+/*
+This API returns a percentile of the time Work Items of one priority waited in the queue before a thread picked them
+Accepts pointer to Thread Pool, the priority, the percentile (1 to 100) and pointer to where the wait in microseconds is written to
+Waits are kept in power of 2 buckets, the upper bound of the bucket holding the percentile is returned
+Returns TRUE upon success, else returns FALSE (no Work Item of the priority was dequeued yet)
+*/
+BOOL GetTPQueueWaitPercentile(PTP pTP, DWORD iPri, DWORD dwPercentile, PDWORD pdwMicroseconds)
+{
+	//Parameter validation
+	if ((pTP == NULL) || (iPri >= WORKITEM_NUMPRIORITIES) || (dwPercentile == 0) || (dwPercentile > 100) || (pdwMicroseconds == NULL))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant get queue wait percentile:%d", GetLastError());
+		return FALSE;
+	}
+	*pdwMicroseconds = QueueWaitPercentile(pTP, iPri, dwPercentile);
+	return (*pdwMicroseconds != 0);
+}
+
+/*
+This API tells the Thread Pool that the calling callback is about to block, on I/O or a lock
+Accepts no arguements, it must be called from inside a Work Item callback and paired with TPLeaveBlocking, calls can be nested
+The blocked Worker Thread no longer counts against iIdealThreads, if admitted Work Items are queued and no Worker Thread is waiting for them a compensating Worker Thread is created right away
+A Long Running Thread (or a thread running the Work Item of another Thread Pool) does not count against iIdealThreads, the call only opens the region
+An unbalanced region is closed once the callback returns
+Returns TRUE upon success, else returns FALSE (not called from inside a callback)
+*/
+BOOL TPEnterBlocking()
+{
+	PTP pTP = g_pRunningTP;
+	if (pTP == NULL)
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("TPEnterBlocking not called from inside a callback:%d", GetLastError());
+		return FALSE;
+	}
+	if (g_iBlockingDepth++ > 0) //Already inside a blocking region
+		return TRUE;
+	if (g_pWorkerTP != pTP) //Long Running Thread, nothing to compensate
+		return TRUE;
+	g_pBlockedTP = pTP;
+	InterlockedIncrement(&(pTP->iBlockedThreads));
+	if (pTP->iShutdownMode || ((pTP->lReadyMask & GetAdmittedMask(pTP)) == 0))
+		return TRUE;
+	//Waiting Worker Threads, not counting the reserved ones, pick the queued work, else compensate for the blocked Worker Thread now instead of waiting for the Control Thread
+	if (pTP->iNumWorkItemsPendingTotal > (pTP->iCWWThreads - RESERVED_THREADS(pTP->lReserved)))
+	{
+		int iMaxWorkers = min(pTP->iIdealThreads + RESERVED_THREADS(pTP->lReserved) + pTP->iBlockedThreads, pTP->iWorkerThreadSlots);
+		if (CreateWorkerThread(pTP, iMaxWorkers))
+		{
+			InterlockedIncrement(&(pTP->iCompensatingThreads));
+			LOG_INFO("Created compensating Worker Thread\n");
+		}
+	}
+	else
+	{
+		SetEvent(g_hWIAvailableEvent);
+	}
+	return TRUE;
+}
+
+/*
+This API tells the Thread Pool that the calling callback no longer blocks
+Accepts no arguements, it must be called from inside the callback which called TPEnterBlocking
+Compensating Worker Threads created while the callback was blocked retire once they finish their current Work Item
+Returns TRUE upon success, else returns FALSE (not inside TPEnterBlocking)
+*/
+BOOL TPLeaveBlocking()
+{
+	if (g_iBlockingDepth == 0)
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("TPLeaveBlocking not paired with TPEnterBlocking:%d", GetLastError());
+		return FALSE;
+	}
+	if (--g_iBlockingDepth > 0) //Still inside an outer blocking region
+		return TRUE;
+	LeaveBlockingRegion();
+	return TRUE;
+}
+
+/*
+This routine stops counting the calling thread as blocked, once its outermost blocking region is closed
+Accepts no arguements
+Returns nothing
+*/
+VOID LeaveBlockingRegion()
+{
+	PTP pTP = g_pBlockedTP;
+	if (pTP == NULL) //Long Running Thread
+		return;
+	g_pBlockedTP = NULL;
+	InterlockedDecrement(&(pTP->iBlockedThreads));
+}
+
+/*
+This API tells a long callback whether higher priority work is waiting for its thread
+Accepts no arguements, it is meant to be called often from inside a Work Item callback, it only reads lReadyMask and the waiting Worker Thread count
+Higher priority Work Items held back by the reservation or cap, or which a waiting Worker Thread is about to pick, do not count
+Returns TRUE if the callback should return soon (see TPYield), else returns FALSE (also outside callbacks and for long running Work Items)
+*/
+BOOL TPShouldYield()
+{
+	PWORKITEM pWork = g_pRunningWork;
+	if ((pWork == NULL) || (pWork->dwFlags & WORKITEM_DEDICATED))
+		return FALSE;
+	PTP pTP = g_pRunningTP;
+	LONG lHigher = pTP->lReadyMask & ~(LONG)((2ULL << pWork->iPri) - 1); //Ready Pri queues above the priority of the Work Item
+	if (lHigher == 0)
+		return FALSE;
+	return (pTP->iCWWThreads <= 0) && ((lHigher & GetAdmittedMask(pTP)) != 0);
+}
+
+/*
+This API queues the rest of the work of the running callback as a continuation, so that the callback can return and let higher priority work run
+Accepts the continuation callback and its parameter as arguements, it must be called from inside a Work Item callback which returns right after
+The continuation is queued behind the Work Items of the same priority, a continuation of a Task Group task joins its group so that WaitTaskGroup waits for it
+The continuation takes the tag of the yielding Work Item, so CancelWorkByTag drops it while it is queued, the tag counters count it as a Work Item of its own
+The continuation is freed by the Thread Pool once it has run, the yielding Work Item itself is complete when its callback returns
+Work Items run on a strand or bound to a completion queue cannot yield, the continuation would run out of strand order or after the Work Item was harvested
+Returns TRUE if the continuation is queued, else returns FALSE (queue is full, Thread Pool is being deleted or the Work Item cannot yield, the callback should then carry on itself)
+*/
+BOOL TPYield(CALLBACK_INSTANCE pContinuation, PVOID pvParam)
+{
+	//Parameter validation
+	if (pContinuation == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to yield:%d", GetLastError());
+		return FALSE;
+	}
+	PWORKITEM pWork = g_pRunningWork;
+	if (pWork == NULL)
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("TPYield not called from a Work Item callback:%d", GetLastError());
+		return FALSE;
+	}
+	if ((pWork == g_pStrandWork) || pWork->pCompletionQueue)
+	{
+		SetLastError(ERROR_NOT_SUPPORTED);
+		LOG_ERROR("Unable to yield a strand or completion queue Work Item:%d", GetLastError());
+		return FALSE;
+	}
+	PTP pTP = g_pRunningTP;
+	PWORKITEM pContinuationWork = (PWORKITEM)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(WORKITEM));
+	if (pContinuationWork == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to allocate continuation WorkItem:%d", GetLastError());
+		return FALSE;
+	}
+	InterlockedIncrement(&(pTP->iNumWorkItemsAllocated));
+	InitWorkItem(pContinuationWork, pTP, pContinuation, pvParam, pWork->iPri);
+	pContinuationWork->dwFlags &= ~WORKITEM_CALLEROWNED; //Heap storage owned by the Thread Pool, not by the caller of InitWorkItem
+	pContinuationWork->dwFlags |= pWork->dwFlags & WORKITEM_DEDICATED; //A long running Work Item continues on the Long Running Threads
+	pContinuationWork->pTag = pWork->pTag; //Counted as pending and stamped with the cancel generation when it is queued
+	PTASKGROUP pTaskGroup = pWork->pTaskGroup;
+	if (pTaskGroup)
+	{
+		pContinuationWork->pTaskGroup = pTaskGroup; //Freed by ExecuteWorkItem with the Task Group Work Items
+		InterlockedIncrement(&(pTaskGroup->iPendingTasks));
+	}
+	else
+	{
+		pContinuationWork->dwFlags |= WORKITEM_FREEONCOMPLETE;
+	}
+	if (!TryInsertWork(pTP, pContinuationWork))
+	{
+		if (pTaskGroup)
+			InterlockedDecrement(&(pTaskGroup->iPendingTasks)); //The yielding task is still pending, the count does not drop to zero here
+		HeapFree(GetProcessHeap(), 0, pContinuationWork);
+		LOG_INFO("Unable to queue continuation, callback carries on\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+This API registers hooks which run on every Worker and Long Running Thread of a Thread Pool, so that per thread state can be set up once instead of per Work Item
+Accepts pointer to Thread Pool, the thread start hook, the thread exit hook (either may be NULL) and a client context passed to both as arguements
+The start hook runs on the new thread before its first Work Item, the exit hook runs on the thread when it exits (idle timeout or DeleteTPEx)
+Both typically fill and free the slots returned by TPGetWorkerLocal, the exit hook runs before DeleteTPEx returns
+Must be called while the Thread Pool has no threads, before the first Work Item is inserted (or TPPrewarm is called)
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL SetTPThreadHooks(PTP pTP, TPTHREAD_HOOK pStartHook, TPTHREAD_HOOK pExitHook, PVOID pvCtx)
+{
+	//Parameter validation
+	if (pTP == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Set TP thread hooks:%d", GetLastError());
+		return FALSE;
+	}
+	//Threads already running would never run the start hook
+	if (pTP->iShutdownMode || (pTP->iWorkerThreads > 0) || (pTP->iLongRunningThreads > 0))
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("Unable to Set TP thread hooks, Thread Pool has threads:%d", GetLastError());
+		return FALSE;
+	}
+	pTP->pvThreadHookCtx = pvCtx;
+	pTP->pThreadExitHook = pExitHook;
+	pTP->pThreadStartHook = pStartHook;
+	return TRUE;
+}
+
+/*
+This API returns the per thread storage slot of the calling Worker or Long Running Thread
+Accepts the slot number (0 to TPWORKERLOCAL_SLOTS - 1) as arguement
+The slots start NULL and are cleared once the thread exit hook returns, access is a thread local array lookup
+Returns pointer to the slot, NULL if not called on a Worker or Long Running Thread or the slot is out of range
+*/
+PVOID* TPGetWorkerLocal(DWORD dwSlot)
+{
+	if (dwSlot >= TPWORKERLOCAL_SLOTS)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return NULL;
+	}
+	if (g_pPoolThreadTP == NULL)
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		return NULL;
+	}
+	return &(g_pvWorkerLocal[dwSlot]);
+}
+
+/*
+This API returns the Work Items whose callback is running on the Worker and Long Running Threads of a Thread Pool
+Accepts 4 arguments:
+a.Pointer to Thread Pool
+b.Pointer to an array receiving the running Work Items
+c.Max number of Work Items to return (size of the array)
+d.Pointer receiving the number of Work Items returned
+Every thread publishes its running Work Item in its own slot without a lock, the slots are read with a seqlock so the dispatch path is never blocked
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL EnumerateRunningWork(PTP pTP, PTPRUNNINGWORK pRunning, DWORD dwMax, PDWORD pdwCount)
+{
+	//Parameter validation
+	if (!(pTP && pRunning && pdwCount))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Enumerate Running Work:%d", GetLastError());
+		return FALSE;
+	}
+	DWORD dwCount = 0;
+	ULONGLONG ullNow = GetTickCount64();
+	for (int i = 0; (i < pTP->iRunningSlots) && (dwCount < dwMax); i++)
+	{
+		LONG lSequence;
+		if (ReadRunningSlot(&(pTP->pRunningSlots[i]), ullNow, &(pRunning[dwCount]), &lSequence))
+			dwCount++;
+	}
+	*pdwCount = dwCount;
+	return TRUE;
+}
+
+/*
+This API sets the watchdog of a Thread Pool, which reports callbacks running longer than a budget
+Accepts 5 arguments:
+a.Pointer to Thread Pool
+b.Budget in milliseconds (0 turns the watchdog off)
+c.Callback called on the Control Thread once for every callback run over the budget (may be NULL), it must return quickly
+d.Client context passed to the callback
+e.TPWATCHDOG_INJECTWORKER to create a Worker Thread for the queued work in place of every stuck one, or 0
+The Control Thread scans the running Work Item slots WATCHDOG_CHECKSPERBUDGET times per budget, Long Running Threads are not watched
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL SetTPWatchdog(PTP pTP, DWORD dwBudgetMs, TPWATCHDOG_CALLBACK pCallback, PVOID pvCtx, DWORD dwFlags)
+{
+	//Parameter validation
+	if ((pTP == NULL) || (dwFlags & ~TPWATCHDOG_INJECTWORKER))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Set TP Watchdog:%d", GetLastError());
+		return FALSE;
+	}
+	InterlockedExchange((volatile LONG*)&(pTP->dwWatchdogBudget), 0); //The Control Thread does not scan while the settings change
+	pTP->pWatchdogCallback = pCallback;
+	pTP->pvWatchdogCtx = pvCtx;
+	pTP->dwWatchdogFlags = dwFlags;
+	InterlockedExchange(&(pTP->iStuckThreads), 0);
+	InterlockedExchange((volatile LONG*)&(pTP->dwWatchdogBudget), dwBudgetMs);
+	if (!SetEvent(pTP->hStatsPublishEvent)) //Wake the Control Thread so that it starts scanning
+	{
+		LOG_ERROR("Unable to Set hStatsPublishEvent:%d", GetLastError());
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+This routine copies the running Work Item of a slot
+Accepts pointer to the slot, the current GetTickCount64 value, pointer to where the Work Item is copied to and pointer to where the slot sequence is written to
+The copy is retried if the thread moved to another Work Item while it was made
+Returns TRUE if the slot holds a running Work Item, else returns FALSE (slot unused or idle)
+*/
+BOOL ReadRunningSlot(PRUNNINGSLOT pSlot, ULONGLONG ullNow, PTPRUNNINGWORK pRunning, PLONG plSequence)
+{
+	while (pSlot->bInUse)
+	{
+		LONG lSequence = pSlot->lSequence;
+		if ((lSequence & 1) == 0) //Idle
+			return FALSE;
+		pRunning->pWork = pSlot->pWork;
+		pRunning->pCallback = pSlot->pCallback;
+		ULONGLONG ullStart = pSlot->ullStartTick;
+		pRunning->dwThreadId = pSlot->dwThreadId;
+		pRunning->bLongRunning = pSlot->bLongRunning;
+		MemoryBarrier();
+		if (pSlot->lSequence != lSequence) //Another Work Item started meanwhile
+			continue;
+		pRunning->dwRunningMs = (ullNow > ullStart) ? (DWORD)(ullNow - ullStart) : 0;
+		*plSequence = lSequence;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+This routine is run by the Control Thread while the watchdog is on
+Accepts pointer to Thread Pool as arguement
+Every callback run over the budget is reported once, with TPWATCHDOG_INJECTWORKER the stuck Worker Threads stop counting against the ideal number
+of Worker Threads and one more Worker Thread is created if queued work has no waiting Worker Thread, it retires once the stuck ones return
+*/
+VOID RunWatchdog(PTP pTP)
+{
+	DWORD dwBudget = pTP->dwWatchdogBudget;
+	ULONGLONG ullNow = GetTickCount64();
+	int iStuck = 0;
+	for (int i = 0; i < pTP->iRunningSlots; i++)
+	{
+		PRUNNINGSLOT pSlot = &(pTP->pRunningSlots[i]);
+		TPRUNNINGWORK Running;
+		LONG lSequence;
+		if (!ReadRunningSlot(pSlot, ullNow, &Running, &lSequence) || Running.bLongRunning || (Running.dwRunningMs <= dwBudget))
+			continue;
+		iStuck++;
+		if (pSlot->lReportedSequence == lSequence) //Already reported
+			continue;
+		pSlot->lReportedSequence = lSequence;
+		LOG_INFO("Watchdog: callback on thread %d running for %d ms\n", Running.dwThreadId, Running.dwRunningMs);
+		if (pTP->pWatchdogCallback)
+			pTP->pWatchdogCallback(pTP, &Running, pTP->pvWatchdogCtx);
+	}
+	if (!(pTP->dwWatchdogFlags & TPWATCHDOG_INJECTWORKER))
+		return;
+	InterlockedExchange(&(pTP->iStuckThreads), iStuck);
+	if ((iStuck > 0) && (pTP->iNumWorkItemsPendingTotal > 0) && (pTP->iCWWThreads == 0) && !pTP->iShutdownMode)
+	{
+		int iMaxWorkers = min(pTP->iIdealThreads + RESERVED_THREADS(pTP->lReserved) + pTP->iBlockedThreads + iStuck, pTP->iWorkerThreadSlots);
+		if (CreateWorkerThread(pTP, iMaxWorkers))
+		{
+			InterlockedIncrement(&(pTP->iCompensatingThreads));
+			LOG_INFO("Watchdog created compensating Worker Thread\n");
+		}
+	}
+}
+
+/*
+This routine is called by a new Worker or Long Running Thread before it waits for work
+Accepts pointer to Thread Pool as arguement
+*/
+VOID StartPoolThread(PTP pTP)
+{
+	//Claim a running Work Item slot, there is one for every thread the pool can have at a time
+	for (int i = 0; i < pTP->iRunningSlots; i++)
+	{
+		PRUNNINGSLOT pSlot = &(pTP->pRunningSlots[i]);
+		if ((pSlot->bInUse == 0) && (InterlockedCompareExchange(&(pSlot->bInUse), 1, 0) == 0))
+		{
+			pSlot->dwThreadId = GetCurrentThreadId();
+			pSlot->bLongRunning = (g_pWorkerTP != pTP);
+			g_pRunningSlot = pSlot;
+			break;
+		}
+	}
+	g_pPoolThreadTP = pTP;
+	if (pTP->pThreadStartHook)
+		pTP->pThreadStartHook(pTP, pTP->pvThreadHookCtx);
+}
+
+/*
+This routine is called by a Worker or Long Running Thread on every exit path
+Accepts pointer to Thread Pool as arguement
+The exit hook only runs if the thread got as far as StartPoolThread, the worker local slots are cleared afterwards
+*/
+VOID ExitPoolThread(PTP pTP)
+{
+	if (g_pPoolThreadTP == pTP)
+	{
+		if (pTP->pThreadExitHook)
+			pTP->pThreadExitHook(pTP, pTP->pvThreadHookCtx);
+		ZeroMemory(g_pvWorkerLocal, sizeof(g_pvWorkerLocal));
+		g_pPoolThreadTP = NULL;
+	}
+	if (g_pRunningSlot)
+	{
+		InterlockedExchange(&(g_pRunningSlot->bInUse), 0);
+		g_pRunningSlot = NULL;
+	}
+	ReleaseProfileTable(pTP);
+}
+
+/*
+This routine drops every queued Work Item, used by DeleteTPEx in TPDELETE_CANCEL and TPDELETE_ABORT modes
+Accepts pointer to Thread Pool and the RemoveTailList function of DLL_LinkedList.dll as arguements
+Returns the number of Work Items dropped
+*/
+int CancelQueuedWorkItems(PTP pTP, MYPROC2 Dequeue)
+{
+	int iCancelled = 0;
+	PWORKITEM pWork;
+	while ((pWork = DequeueHighestWorkItem(pTP, Dequeue)) != NULL)
+	{
+		CancelWorkItem(pTP, pWork);
+		iCancelled++;
+	}
+	while (pTP->iNumLongRunningPending > 0) //Long running Work Items not yet picked by a Long Running Thread
+	{
+		AcquireSRWLockExclusive(&(pTP->LongRunningLock));
+		PLINK pTemp = Dequeue(pTP->pLongRunningQ);
+		if (pTemp)
+			InterlockedDecrement(&(pTP->iNumLongRunningPending));
+		ReleaseSRWLockExclusive(&(pTP->LongRunningLock));
+		if (pTemp == NULL)
+			break;
+		CancelWorkItem(pTP, ADDR_BASE(pTemp, WORKITEM, list_entry));
+		iCancelled++;
+	}
+	LOG_INFO("Cancelled %d queued work items\n", iCancelled);
+	return iCancelled;
+}
+
+/*
+This routine completes a dequeued Work Item without calling its client callback
+Accepts pointer to Thread Pool and pointer to Work Item as arguements
+Internal Work Items which a caller waits on (WORKITEM_RUNONCANCEL) are run instead, Task Group Work Items are freed and count as done for their group
+*/
+VOID CancelWorkItem(PTP pTP, PWORKITEM pWork)
+{
+	if (pWork->dwFlags & WORKITEM_RUNONCANCEL)
+	{
+		ExecuteWorkItem(pTP, pWork);
+		return;
+	}
+	if (pWork->pTag)
+	{
+		ClearTaggedWorkPending(pWork);
+		InterlockedIncrement(&(pWork->pTag->iCancelled));
+		ReleaseTaggedWork(pWork);
+	}
+	PTASKGROUP pTaskGroup = pWork->pTaskGroup;
+	if (pTaskGroup)
+	{
+		HeapFree(GetProcessHeap(), 0, pWork);
+		if (InterlockedDecrement(&(pTaskGroup->iPendingTasks)) == 0)
+		{
+			SetEvent(pTaskGroup->hTasksDoneEvent);
+		}
+		return;
+	}
+	if (pWork->dwFlags & WORKITEM_FREEONCOMPLETE) //Internal Work Item not run on cancel (TPYield continuation), nothing waits for it
+	{
+		HeapFree(GetProcessHeap(), 0, pWork);
+		return;
+	}
+	PWORKITEM pMerged = (pWork->dwFlags & WORKITEM_COALESCE) ? UnlinkCoalescedWorkItem(pTP, pWork) : NULL;
+	PublishCompletionStatus(pWork, WORK_CANCELLED); //Cancelled Work Items are harvested too, so that the caller can delete them
+	CompleteCoalescedWorkItems(pMerged, WORK_CANCELLED);
+}
+
+/*
+This API runs a loop body over the index range [iBegin,iEnd) using the Thread Pool
+Accepts 6 arguments:
+a.Pointer to ThreadPool
+b.Begin of the index range
+c.End of the index range (exclusive)
+d.Grain size, the number of iterations handed to the loop body at a time (0 picks the grain size from the observed per iteration cost)
+e.Client loop body of type PARALLELFOR_BODY
+f.Void pointer to client context passed to the loop body
+The calling thread executes chunks of the range along with the Worker Threads instead of blocking
+Returns TRUE once every iteration of the range has been executed, else returns FALSE
+*/
+BOOL ParallelFor(PTP pTP, LONG64 iBegin, LONG64 iEnd, LONG64 iGrain, PARALLELFOR_BODY pBody, PVOID pvCtx)
+{
+	//Parameter validation
+	if (!(pTP && pBody) || (iGrain < 0))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant run ParallelFor:%d", GetLastError());
+		return FALSE;
+	}
+	if (iBegin >= iEnd) //Nothing to do
+	{
+		return TRUE;
+	}
+	PFRANGE Range = { 0 };
+	Range.iGrain = iGrain;
+	Range.pBody = pBody;
+	Range.pvCtx = pvCtx;
+	return RunParallelRange(pTP, &Range, iBegin, iEnd);
+}
+
+/*
+This API runs a reduction over the index range [iBegin,iEnd) using the Thread Pool
+Accepts 10 arguments:
+a.Pointer to ThreadPool
+b.Begin of the index range
+c.End of the index range (exclusive)
+d.Grain size, the number of iterations handed to the loop body at a time (0 picks the grain size from the observed per iteration cost)
+e.Client loop body of type PARALLELREDUCE_BODY, which accumulates a range into the accumulator it is handed
+f.Client combine function of type PARALLELREDUCE_COMBINE, which folds the second accumulator into the first
+g.Void pointer to client context passed to the loop body and combine function
+h.Pointer to the identity value every per thread accumulator starts from
+i.Pointer to the result, it holds the initial value on entry and the combined value on return
+j.Size of an accumulator in bytes
+Every participating thread accumulates into its own cache line aligned accumulator, so the loop body needs no synchronization
+Returns TRUE once every iteration of the range has been accumulated into the result, else returns FALSE
+*/
+BOOL ParallelReduce(PTP pTP, LONG64 iBegin, LONG64 iEnd, LONG64 iGrain, PARALLELREDUCE_BODY pBody, PARALLELREDUCE_COMBINE pCombine, PVOID pvCtx, PVOID pvIdentity, PVOID pvResult, SIZE_T cbAccum)
+{
+	//Parameter validation
+	if (!(pTP && pBody && pCombine && pvIdentity && pvResult && cbAccum) || (iGrain < 0))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant run ParallelReduce:%d", GetLastError());
+		return FALSE;
+	}
+	if (iBegin >= iEnd) //Nothing to do
+	{
+		return TRUE;
+	}
+	//Get Default Process Heap Handle
+	HANDLE hDefaultHeap = GetProcessHeap();
+	if (hDefaultHeap == NULL)
+	{
+		LOG_ERROR("Unable to get handle to Default Process Heap:%d", GetLastError());
+		return FALSE;
+	}
+	PFRANGE Range = { 0 };
+	Range.iGrain = iGrain;
+	Range.pReduceBody = pBody;
+	Range.pvCtx = pvCtx;
+	//One accumulator slot per possible participant, each starting from the identity value
+	Range.cbAccumStride = (cbAccum + CACHELINESIZE - 1) & ~((SIZE_T)CACHELINESIZE - 1);
+	Range.pbAccum = (PBYTE)HeapAlloc(hDefaultHeap, 0, Range.cbAccumStride * pTP->iIdealThreads);
+	if (Range.pbAccum == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to allocate ParallelReduce accumulators:%d", GetLastError());
+		return FALSE;
+	}
+	for (int i = 0; i < pTP->iIdealThreads; i++)
+	{
+		CopyMemory(Range.pbAccum + (i * Range.cbAccumStride), pvIdentity, cbAccum);
+	}
+	BOOL bResult = RunParallelRange(pTP, &Range, iBegin, iEnd);
+	if (bResult)
+	{
+		//Fold every per thread accumulator into the result
+		for (int i = 0; i < pTP->iIdealThreads; i++)
+		{
+			pCombine(pvCtx, pvResult, Range.pbAccum + (i * Range.cbAccumStride));
+		}
+	}
+	if (HeapFree(hDefaultHeap, 0, Range.pbAccum) == 0)
+	{
+		LOG_ERROR("Unable to free ParallelReduce accumulators:%d", GetLastError());
+	}
+	return bResult;
+}
+
+/*
+This routine runs a ParallelFor/ParallelReduce range with the calling thread participating
+Accepts pointer to Thread Pool, pointer to the range and the [iBegin,iEnd) bounds as arguements
+If the range has no grain size, the calling thread times the first PARALLELFOR_PROBEITERATIONS iterations and sizes chunks to PARALLELFOR_TARGETCHUNKTIME
+Helper work items are submitted for at most iIdealThreads-1 other threads, helpers which are still queued once the range is exhausted are retracted
+The helpers are bound to a completion queue, so that the calling thread blocks until the Worker Threads are done with them instead of polling them
+Returns TRUE once every iteration has been executed, else returns FALSE
+*/
+BOOL RunParallelRange(PTP pTP, PPFRANGE pRange, LONG64 iBegin, LONG64 iEnd)
+{
+	pRange->iNext = iBegin;
+	pRange->iEnd = iEnd;
+	if (pRange->iGrain == 0)
+	{
+		//Time a few iterations on the calling thread to estimate the per iteration cost
+		LONG64 iProbeEnd = ((iEnd - iBegin) > PARALLELFOR_PROBEITERATIONS) ? (iBegin + PARALLELFOR_PROBEITERATIONS) : iEnd;
+		LARGE_INTEGER liFrequency, liStart, liStop;
+		QueryPerformanceFrequency(&liFrequency);
+		QueryPerformanceCounter(&liStart);
+		pRange->iNext = iProbeEnd;
+		if (pRange->pReduceBody)
+			pRange->pReduceBody(pRange->pvCtx, iBegin, iProbeEnd, pRange->pbAccum);
+		else
+			pRange->pBody(pRange->pvCtx, iBegin, iProbeEnd);
+		QueryPerformanceCounter(&liStop);
+		LONG64 iElapsed = max(liStop.QuadPart - liStart.QuadPart, 1);
+		LONG64 iTargetTicks = (liFrequency.QuadPart * PARALLELFOR_TARGETCHUNKTIME) / 1000000;
+		pRange->iGrain = max(((iProbeEnd - iBegin) * iTargetTicks) / iElapsed, 1);
+		//Cheap iterations would otherwise end up in a handful of huge chunks, keep enough chunks per thread to balance the load
+		LONG64 iMaxGrain = max((iEnd - iProbeEnd) / ((LONG64)pTP->iIdealThreads * PARALLELFOR_CHUNKSPERTHREAD), 1);
+		pRange->iGrain = min(pRange->iGrain, iMaxGrain);
+		LOG_INFO("ParallelFor picked grain size %lld\n", pRange->iGrain);
+	}
+	if (pRange->iNext >= iEnd) //Probe covered the whole range
+	{
+		return TRUE;
+	}
+
+	//One helper per other participating thread, but never more helpers than remaining chunks
+	LONG64 iChunks = ((iEnd - pRange->iNext) + pRange->iGrain - 1) / pRange->iGrain;
+	int iHelpers = (int)min(iChunks - 1, (LONG64)pTP->iIdealThreads - 1);
+	if (iHelpers <= 0)
+	{
+		ExecuteParallelChunks(pRange, 0);
+		return TRUE;
+	}
+	HANDLE hDefaultHeap = GetProcessHeap();
+	if (hDefaultHeap == NULL)
+	{
+		LOG_ERROR("Unable to get handle to Default Process Heap:%d", GetLastError());
+		ExecuteParallelChunks(pRange, 0); //Run the range on the calling thread alone
+		return TRUE;
+	}
+	PPFHELPER pHelpers = (PPFHELPER)HeapAlloc(hDefaultHeap, HEAP_ZERO_MEMORY, iHelpers * sizeof(PFHELPER));
+	if (pHelpers == NULL)
+	{
+		LOG_ERROR("Unable to allocate ParallelFor helpers, running range on calling thread\n");
+		ExecuteParallelChunks(pRange, 0);
+		return TRUE;
+	}
+	pRange->hHelpersDoneEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (pRange->hHelpersDoneEvent == NULL)
+	{
+		LOG_ERROR("Unable to Create ParallelFor Helpers Done Event:%d", GetLastError());
+		HeapFree(hDefaultHeap, 0, pHelpers);
+		ExecuteParallelChunks(pRange, 0);
+		return TRUE;
+	}
+	PCOMPLETIONQUEUE pCompletionQueue = CreateCompletionQueue(pTP);
+	if (pCompletionQueue == NULL)
+	{
+		CloseHandle(pRange->hHelpersDoneEvent);
+		HeapFree(hDefaultHeap, 0, pHelpers);
+		ExecuteParallelChunks(pRange, 0);
+		return TRUE;
+	}
+
+	//Submit the helpers, the calling thread holds one reference so that the event is only set after it stops submitting
+	pRange->iOutstandingHelpers = 1;
+	int iSubmitted = 0;
+	for (; iSubmitted < iHelpers; iSubmitted++)
+	{
+		pHelpers[iSubmitted].pRange = pRange;
+		pHelpers[iSubmitted].iSlot = iSubmitted + 1;
+		InitWorkItem(&(pHelpers[iSubmitted].Work), pTP, ParallelHelperProc, &pHelpers[iSubmitted], WORKITEM_NORMAL); //Embedded Work Item, no allocation per helper
+		pHelpers[iSubmitted].Work.dwFlags |= WORKITEM_RUNONCANCEL; //The calling thread waits for every helper, so DeleteTPEx must not drop them
+		SetWorkItemCompletionQueue(&(pHelpers[iSubmitted].Work), pCompletionQueue);
+		InterlockedIncrement(&(pRange->iOutstandingHelpers));
+		if (!TryInsertWork(pTP, &(pHelpers[iSubmitted].Work))) //Queue is full, the participants already submitted share the range
+		{
+			InterlockedDecrement(&(pRange->iOutstandingHelpers));
+			break;
+		}
+	}
+	LOG_INFO("ParallelFor submitted %d helpers\n", iSubmitted);
+
+	//Calling thread participates instead of blocking
+	ExecuteParallelChunks(pRange, 0);
+
+	//Range is exhausted, helpers which no Worker Thread picked yet have nothing left to do
+	int iPicked = iSubmitted;
+	for (int i = 0; i < iSubmitted; i++)
+	{
+		if (RemoveQueuedWorkItem(pTP, &(pHelpers[i].Work))) //Retracted, never pushed onto the completion queue
+		{
+			iPicked--;
+			InterlockedDecrement(&(pRange->iOutstandingHelpers));
+		}
+	}
+	if (InterlockedDecrement(&(pRange->iOutstandingHelpers)) != 0)
+	{
+		//Helpers still running a last chunk, execute other queued work meanwhile instead of holding the thread
+		if (!HelpWhileWaiting(pTP, &(pRange->iOutstandingHelpers), pRange->hHelpersDoneEvent))
+		{
+			LOG_ERROR("ParallelFor Wait failed:%d", GetLastError());
+		}
+	}
+	//The last helper sets the event from inside its callback, wait for the Worker Threads to push the Work Items complete before freeing them
+	PWORKITEM pHarvested[PARALLELFOR_HARVESTBATCH];
+	while (iPicked > 0)
+	{
+		DWORD dwHarvested = GetCompletedWorkItems(pCompletionQueue, pHarvested, PARALLELFOR_HARVESTBATCH, INFINITE);
+		if (dwHarvested == 0) //Wait failed, keep polling, the helpers must not be freed while a Worker Thread holds them
+			SwitchToThread();
+		iPicked -= (int)dwHarvested;
+	}
+	DeleteCompletionQueue(pCompletionQueue);
+	CloseHandle(pRange->hHelpersDoneEvent);
+	if (HeapFree(hDefaultHeap, 0, pHelpers) == 0)
+	{
+		LOG_ERROR("Unable to free ParallelFor helpers:%d", GetLastError());
+	}
+	return TRUE;
+}
+
+/*
+This routine claims chunks of iGrain iterations from a ParallelFor/ParallelReduce range and executes them until the range is exhausted
+Accepts pointer to the range and the accumulator slot of the calling participant as arguements
+*/
+VOID ExecuteParallelChunks(PPFRANGE pRange, DWORD iSlot)
+{
+	while (TRUE)
+	{
+		LONG64 iChunkBegin = InterlockedExchangeAdd64(&(pRange->iNext), pRange->iGrain);
+		if (iChunkBegin >= pRange->iEnd)
+		{
+			return;
+		}
+		LONG64 iChunkEnd = ((pRange->iEnd - iChunkBegin) > pRange->iGrain) ? (iChunkBegin + pRange->iGrain) : pRange->iEnd;
+		if (pRange->pReduceBody)
+			pRange->pReduceBody(pRange->pvCtx, iChunkBegin, iChunkEnd, pRange->pbAccum + (iSlot * pRange->cbAccumStride));
+		else
+			pRange->pBody(pRange->pvCtx, iChunkBegin, iChunkEnd);
+	}
+}
+
+/*
+This is the Work Item callback for ParallelFor/ParallelReduce helpers
+Accepts pointer to the helper as arguement, executes chunks until the range is exhausted and sets the done event if it is the last outstanding helper
+*/
+PVOID ParallelHelperProc(PVOID pvParam)
+{
+	PPFHELPER pHelper = (PPFHELPER)pvParam;
+	PPFRANGE pRange = pHelper->pRange;
+	ExecuteParallelChunks(pRange, pHelper->iSlot);
+	if (InterlockedDecrement(&(pRange->iOutstandingHelpers)) == 0)
+	{
+		if (!SetEvent(pRange->hHelpersDoneEvent))
+		{
+			LOG_ERROR("Unable to Set hHelpersDoneEvent:%d", GetLastError());
+		}
+	}
+	return 0;
+}
+
+/*
+This routine removes a Work Item which has not yet been picked by a Worker Thread from its Pri queue
+Accepts pointer to Thread Pool and pointer to Work Item as arguements
+Returns TRUE if the Work Item was found and removed, else returns FALSE (Work Item is running, complete or was never queued)
+*/
+BOOL RemoveQueuedWorkItem(PTP pTP, PWORKITEM pWk)
+{
+	if (pWk->iPri >= WORKITEM_NUMPRIORITIES)
+		return FALSE;
+	DWORD iPri = pWk->iPri;
+	MYPROC1 FindWorkItem = pTP->pFindEntry;
+	MYPROC1 RemoveWorkItem = pTP->pRemoveEntry;
+	BOOL bRemoved = FALSE;
+	if (pWk->dwFlags & WORKITEM_DEDICATED) //Long running Work Item, remove it from the long running queue
+	{
+		AcquireSRWLockExclusive(&(pTP->LongRunningLock));
+		if (FindWorkItem(pTP->pLongRunningQ, &(pWk->list_entry)) && RemoveWorkItem(pTP->pLongRunningQ, &(pWk->list_entry)))
+		{
+			InterlockedDecrement(&(pTP->iNumLongRunningPending)); //Its semaphore release is consumed by a Long Running Thread finding the queue empty
+			bRemoved = TRUE;
+		}
+		ReleaseSRWLockExclusive(&(pTP->LongRunningLock));
+		return bRemoved;
+	}
+	//Find and remove under one exclusive acquisition, so a Worker Thread cannot dequeue the item in between
+	AcquireSRWLockExclusive(&gSRWLock_TPQ[iPri]);
+	if (FindWorkItem(pTP->pTPQ[iPri], &(pWk->list_entry)) && RemoveWorkItem(pTP->pTPQ[iPri], &(pWk->list_entry)))
+	{
+		InterlockedDecrement(&(pTP->iNumWorkItemsPendingTotal));
+		if (InterlockedDecrement(&(pTP->iNumWorkItemsPending[iPri])) == 0)
+			InterlockedAnd(&(pTP->lReadyMask), ~(LONG)(1UL << iPri)); //Pri queue is empty
+		bRemoved = TRUE;
+	}
+	ReleaseSRWLockExclusive(&gSRWLock_TPQ[iPri]);
+	return bRemoved;
+}
+
+/*
+This API creates a Task Group, tasks run in the group can be waited for together
+Accepts pointer to Thread Pool as arguement
+Returns pointer to Task Group upon success, else returns NULL
+*/
+PTASKGROUP CreateTaskGroup(PTP pTP)
+{
+	//Parameter validation
+	if (pTP == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Create Task Group:%d", GetLastError());
+		return NULL;
+	}
+	//Get Default Process Heap Handle
+	HANDLE hDefaultHeap = GetProcessHeap();
+	if (hDefaultHeap == NULL)
+	{
+		LOG_ERROR("Unable to get handle to Default Process Heap:%d", GetLastError());
+		return NULL;
+	}
+	PTASKGROUP pTaskGroup = (PTASKGROUP)HeapAlloc(hDefaultHeap, HEAP_ZERO_MEMORY, sizeof(TASKGROUP));
+	if (pTaskGroup == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to create Task Group structure:%d", GetLastError());
+		return NULL;
+	}
+	//Auto Reset event set by the task which brings iPendingTasks to zero
+	pTaskGroup->hTasksDoneEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (pTaskGroup->hTasksDoneEvent == NULL)
+	{
+		LOG_ERROR("Unable to Create Task Group Event:%d", GetLastError());
+		HeapFree(hDefaultHeap, 0, pTaskGroup);
+		return NULL;
+	}
+	pTaskGroup->pTP = pTP;
+	pTaskGroup->iPendingTasks = 0;
+	return pTaskGroup;
+}
+
+/*
+This API runs a task in a Task Group
+Accepts 4 arguments:
+a.Pointer to Task Group
+b.Client Callback Function of type CALLBACK_INSTANCE
+c.Void pointer to parameters to be passed to the callback function
+d.Priority of the task (WORKITEM_LOW to WORKITEM_HIGH, WORKITEM_NUMPRIORITIES levels), optionally OR'd with WORKITEM_LONGRUNNING
+The Work Item is owned by the Thread Pool and freed once the task completes
+If the Pri queue is full the task is run on the calling thread before returning
+Returns TRUE if the task was queued or run, else returns FALSE
+*/
+BOOL RunInTaskGroup(PTASKGROUP pTaskGroup, CALLBACK_INSTANCE pCallback, PVOID pvParam, DWORD iPri)
+{
+	//Parameter validation
+	if (!(pTaskGroup && pCallback) || ((iPri & ~WORKITEM_LONGRUNNING) >= WORKITEM_NUMPRIORITIES))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant run work in Task Group:%d", GetLastError());
+		return FALSE;
+	}
+	PWORKITEM pWork = CreateWorkItem(pTaskGroup->pTP, pCallback, pvParam, iPri);
+	if (pWork == NULL)
+	{
+		LOG_ERROR("Unable to create Task Group Work Item\n");
+		return FALSE;
+	}
+	pWork->pTaskGroup = pTaskGroup;
+	InterlockedIncrement(&(pTaskGroup->iPendingTasks));
+	if (!TryInsertWork(pTaskGroup->pTP, pWork))
+	{
+		//Queue is full, run the task on the calling thread instead of failing the fork
+		LOG_INFO("Running Task Group work on calling thread\n");
+		pWork->pTaskGroup = NULL;
+		PWORKITEM pOuterWork = g_pRunningWork;
+		g_pRunningWork = NULL; //TPYield cannot tie a continuation to a task run inline, the task carries on instead
+		pCallback(pvParam);
+		g_pRunningWork = pOuterWork;
+		DeleteWorkItem(pTaskGroup->pTP, pWork);
+		if (InterlockedDecrement(&(pTaskGroup->iPendingTasks)) == 0)
+		{
+			SetEvent(pTaskGroup->hTasksDoneEvent);
+		}
+	}
+	return TRUE;
+}
+
+/*
+This API waits for every task run in a Task Group to complete
+Accepts pointer to Task Group as arguement
+The calling thread (which may be a Worker Thread) executes pending Work Items from the Thread Pool while it waits, so nested fork/join does not need more threads
+Returns TRUE once all the tasks of the group are complete, else returns FALSE
+*/
+BOOL WaitTaskGroup(PTASKGROUP pTaskGroup)
+{
+	//Parameter validation
+	if (pTaskGroup == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant wait for Task Group:%d", GetLastError());
+		return FALSE;
+	}
+	return HelpWhileWaiting(pTaskGroup->pTP, &(pTaskGroup->iPendingTasks), pTaskGroup->hTasksDoneEvent);
+}
+
+/*
+This API deletes a Task Group
+Accepts pointer to Task Group as arguement
+The group must not have pending tasks, call WaitTaskGroup first
+Returns TRUE if the Task Group is deleted, else returns FALSE
+*/
+BOOL DeleteTaskGroup(PTASKGROUP pTaskGroup)
+{
+	//Parameter validation
+	if (pTaskGroup == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant delete Task Group:%d", GetLastError());
+		return FALSE;
+	}
+	if (pTaskGroup->iPendingTasks != 0)
+	{
+		SetLastError(ERROR_BUSY);
+		LOG_ERROR("Cant delete Task Group with pending tasks:%d", GetLastError());
+		return FALSE;
+	}
+	CloseHandle(pTaskGroup->hTasksDoneEvent);
+	if (HeapFree(GetProcessHeap(), 0, pTaskGroup) == 0)
+	{
+		LOG_ERROR("Unable to free Task Group:%d", GetLastError());
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+This routine calls the client callback of a dequeued Work Item and completes it
+Accepts pointer to Thread Pool and pointer to Work Item as arguements
+Task Group Work Items are owned by the Thread Pool, they are freed here and their group is signalled when its last task completes
+*/
+VOID ExecuteWorkItem(PTP pTP, PWORKITEM pWork)
+{
+	PTAGENTRY pTag = pWork->pTag;
+	if (pTag)
+	{
+		ClearTaggedWorkPending(pWork);
+		if (pWork->lTagGeneration != pTag->lCancelGeneration) //Tag was cancelled after the Work Item was inserted
+		{
+			CancelWorkItem(pTP, pWork);
+			return;
+		}
+		InterlockedIncrement(&(pTag->iRunning));
+	}
+	//Keyed Work Item, take the Work Items merged into it before the callback starts, later inserts of the key are queued again
+	PWORKITEM pMerged = (pWork->dwFlags & WORKITEM_COALESCE) ? UnlinkCoalescedWorkItem(pTP, pWork) : NULL;
+	//Publish the running Work Item in the slot of the calling thread, a Work Item run by a callback helping while it waits stays accounted to that callback
+	PRUNNINGSLOT pSlot = (g_iRunningDepth++ == 0) ? g_pRunningSlot : NULL;
+	if (pSlot)
+	{
+		pSlot->pWork = pWork;
+		pSlot->pCallback = pWork->pCallback;
+		pSlot->ullStartTick = GetTickCount64();
+		InterlockedIncrement(&(pSlot->lSequence)); //Odd, the slot holds a running Work Item
+	}
+	//Work Item TPShouldYield and TPYield apply to, the Work Item the calling thread was running (if it helps while waiting) is restored once the callback returns
+	PWORKITEM pOuterWork = g_pRunningWork;
+	PTP pOuterTP = g_pRunningTP;
+	int iOuterBlockingDepth = g_iBlockingDepth;
+	g_pRunningWork = pWork;
+	g_pRunningTP = pTP;
+	//A recorded Work Item keeps its submission time, a callback may queue the same Work Item again before it returns
+	LONGLONG llSubmit = pWork->llQueuedTime;
+	BOOL bRecording = pTP->bRecording;
+	LARGE_INTEGER liStart = { 0 }, liEnd;
+	if (bRecording)
+		QueryPerformanceCounter(&liStart);
+	if (pTP->bProfiling)
+		ProfileWorkItem(pTP, pWork); //Call client callback function and record its cost
+	else
+		pWork->pCallback(pWork->pvParam); //Call client callback function
+	if (g_iBlockingDepth > iOuterBlockingDepth) //The callback returned without TPLeaveBlocking, close its regions
+	{
+		LOG_ERROR("Callback returned inside TPEnterBlocking:%d", g_iBlockingDepth - iOuterBlockingDepth);
+		g_iBlockingDepth = iOuterBlockingDepth;
+		if (g_iBlockingDepth == 0)
+			LeaveBlockingRegion();
+	}
+	g_pRunningWork = pOuterWork;
+	g_pRunningTP = pOuterTP;
+	if (bRecording)
+	{
+		QueryPerformanceCounter(&liEnd);
+		RecordWorkItem(pTP, pWork, llSubmit ? llSubmit : liStart.QuadPart, liStart.QuadPart, liEnd.QuadPart); //Work Items run without being queued were submitted when they started
+	}
+	if (pSlot)
+		InterlockedIncrement(&(pSlot->lSequence)); //Even, the slot is idle
+	g_iRunningDepth--;
+	if (pWork->dwFlags & WORKITEM_DEDICATED)
+		InterlockedIncrement(&(pTP->iNumLongRunningHandled)); //Long running Work Items are reported separately
+	else
+		InterlockedIncrement(&(pTP->iNumWorkItemsHandled[pWork->iPri]));
+	if (pTag) //Before the internal Work Items are freed, a TPYield continuation carries the tag of the yielding Work Item
+	{
+		InterlockedIncrement(&(pTag->iCompleted));
+		InterlockedDecrement(&(pTag->iRunning));
+		ReleaseTaggedWork(pWork);
+	}
+	PTASKGROUP pTaskGroup = pWork->pTaskGroup;
+	if (pTaskGroup)
+	{
+		if (HeapFree(GetProcessHeap(), 0, pWork) == 0)
+		{
+			LOG_ERROR("Unable to free Task Group WorkItem:%d", GetLastError());
+		}
+		if (InterlockedDecrement(&(pTaskGroup->iPendingTasks)) == 0)
+		{
+			if (!SetEvent(pTaskGroup->hTasksDoneEvent))
+			{
+				LOG_ERROR("Unable to Set hTasksDoneEvent:%d", GetLastError());
+			}
+		}
+		return;
+	}
+	if (pWork->dwFlags & WORKITEM_FREEONCOMPLETE) //Internal Work Item, freed together with the request it starts
+	{
+		if (HeapFree(GetProcessHeap(), 0, pWork) == 0)
+		{
+			LOG_ERROR("Unable to free internal WorkItem:%d", GetLastError());
+		}
+		return;
+	}
+	PublishCompletionStatus(pWork, WORK_COMPLETE); //update work item completion status, pWork may be freed from here on
+	CompleteCoalescedWorkItems(pMerged, WORK_COMPLETE);
+}
+
+/*
+This routine dequeues the highest priority pending Work Item admitted by the reservation and cap and executes it on the calling thread
+Accepts pointer to Thread Pool and the RemoveTailList function of DLL_LinkedList.dll as arguements
+A callback helping while it waits keeps the slots of its own Work Item, nested Work Items only claim the slots it does not hold
+Returns TRUE if a Work Item was executed, else returns FALSE (no admitted Work Item pending)
+*/
+BOOL ExecutePendingWorkItem(PTP pTP, MYPROC2 Dequeue)
+{
+	DWORD dwClaims;
+	PWORKITEM pWork = DequeueAdmittedWorkItem(pTP, Dequeue, &dwClaims); //Get work item from queue
+	if (pWork == NULL)
+		return FALSE;
+	DWORD dwOuterClaims = g_dwHeldClaims;
+	g_dwHeldClaims = GetHeldClaims(pTP) | dwClaims;
+	ExecuteWorkItem(pTP, pWork);
+	g_dwHeldClaims = dwOuterClaims;
+	ReleasePriorityLimits(pTP, dwClaims);
+	return TRUE;
+}
+
+/*
+This routine queues a Work Item to the Pri queue of its priority
+Accepts pointer to Thread Pool, pointer to Work Item and the InsertHeadList function of DLL_LinkedList.dll as arguements
+The ready bit of the Pri queue is set under the queue lock, so it is never clear while the queue holds Work Items
+Returns TRUE if the Work Item is queued, else returns FALSE
+*/
+BOOL EnqueueWorkItem(PTP pTP, PWORKITEM pWk, MYPROC1 Enqueue)
+{
+	DWORD iPri = pWk->iPri;
+	LARGE_INTEGER liNow;
+	QueryPerformanceCounter(&liNow);
+	pWk->llQueuedTime = liNow.QuadPart; //Start of the queue wait
+	MarkTaggedWorkPending(pWk); //Before it is queued, so that a thread taking it right away finds it counted
+	AcquireSRWLockExclusive(&gSRWLock_TPQ[iPri]); //Get exclusive SRW lock
+	if (!Enqueue(pTP->pTPQ[iPri], &(pWk->list_entry))) //Queue the work item
+	{
+		ReleaseSRWLockExclusive(&gSRWLock_TPQ[iPri]);
+		ClearTaggedWorkPending(pWk);
+		ReleaseTaggedWork(pWk);
+		return FALSE;
+	}
+	InterlockedIncrement(&(pTP->iNumWorkItemsAdded[iPri])); //Update TP parameters
+	InterlockedIncrement(&(pTP->iNumWorkItemsPending[iPri]));
+	InterlockedIncrement(&(pTP->iNumWorkItemsPendingTotal));
+	InterlockedOr(&(pTP->lReadyMask), (LONG)(1UL << iPri)); //Mark the Pri queue ready
+	ReleaseSRWLockExclusive(&gSRWLock_TPQ[iPri]); //Release exclusive SRW lock
+	return TRUE;
+}
+
+/*
+This routine dequeues a Work Item from one Pri queue
+Accepts pointer to Thread Pool, the priority and the RemoveTailList function of DLL_LinkedList.dll as arguements
+The ready bit of the Pri queue is cleared under the queue lock when its last Work Item is dequeued
+Returns pointer to the Work Item, or NULL if the Pri queue is empty
+*/
+PWORKITEM DequeueWorkItem(PTP pTP, DWORD iPri, MYPROC2 Dequeue)
+{
+	PWORKITEM pWork = NULL;
+	AcquireSRWLockExclusive(&gSRWLock_TPQ[iPri]);
+	if (pTP->iNumWorkItemsPending[iPri] > 0)
+	{
+		PLINK pTemp = Dequeue(pTP->pTPQ[iPri]);
+		if (pTemp)
+		{
+			pWork = ADDR_BASE(pTemp, WORKITEM, list_entry);
+			InterlockedDecrement(&(pTP->iNumWorkItemsPendingTotal));
+			InterlockedDecrement(&(pTP->iNumWorkItemsPending[iPri]));
+		}
+	}
+	if (pTP->iNumWorkItemsPending[iPri] == 0)
+		InterlockedAnd(&(pTP->lReadyMask), ~(LONG)(1UL << iPri)); //Pri queue is empty
+	ReleaseSRWLockExclusive(&gSRWLock_TPQ[iPri]);
+	if (pWork)
+		RecordQueueWait(pTP, pWork);
+	return pWork;
+}
+
+/*
+This routine dequeues a Work Item from the highest priority non empty Pri queue
+Accepts pointer to Thread Pool and the RemoveTailList function of DLL_LinkedList.dll as arguements
+The highest ready Pri queue is found with a single bit scan of lReadyMask, if another thread empties it first the scan is repeated
+Returns pointer to the Work Item, or NULL if no Work Item is pending
+*/
+PWORKITEM DequeueHighestWorkItem(PTP pTP, MYPROC2 Dequeue)
+{
+	DWORD iPri;
+	while (BitScanReverse(&iPri, (DWORD)pTP->lReadyMask))
+	{
+		PWORKITEM pWork = DequeueWorkItem(pTP, iPri, Dequeue);
+		if (pWork)
+			return pWork;
+	}
+	return NULL;
+}
+
+/*
+This routine returns the reservation and cap slots the calling thread holds in a Thread Pool
+Accepts pointer to Thread Pool as arguement
+Returns the PRILIMIT_ flags of the Work Item the calling thread runs, 0 outside callbacks of the Thread Pool
+*/
+DWORD GetHeldClaims(PTP pTP)
+{
+	return (g_pRunningTP == pTP) ? g_dwHeldClaims : 0;
+}
+
+/*
+This routine returns the Pri queues a Worker Thread may start a Work Item from
+Accepts pointer to Thread Pool as arguement
+Levels below the reserved priority are left out while they would take one of the reserved Worker Threads, levels upto iCappedPri are left out while iMaxCappedThreads Worker Threads run them
+A level is not left out for a slot the calling thread already holds, it helps on that slot while its callback waits
+Returns the mask of admitted levels, bit n for level n
+*/
+LONG GetAdmittedMask(PTP pTP)
+{
+	LONG lMask = -1;
+	LONG lReserved = pTP->lReserved;
+	DWORD dwHeld = GetHeldClaims(pTP);
+	if (!(dwHeld & PRILIMIT_UNRESERVED) && (RESERVED_THREADS(lReserved) > 0) && (pTP->iRunningUnreserved >= (pTP->iWorkerThreads - RESERVED_THREADS(lReserved))))
+		lMask &= ~(LONG)((1ULL << RESERVED_PRI(lReserved)) - 1);
+	if (!(dwHeld & PRILIMIT_CAPPED) && (pTP->iCappedPri >= 0) && (pTP->iRunningCapped >= pTP->iMaxCappedThreads))
+		lMask &= ~(LONG)((2ULL << pTP->iCappedPri) - 1);
+	return lMask;
+}
+
+/*
+This routine dequeues the highest priority Work Item a Worker Thread may start under the reservation and cap
+Accepts pointer to Thread Pool, the RemoveTailList function of DLL_LinkedList.dll and pointer to the claimed slots as arguements
+The reservation and cap slots are claimed before the Work Item is dequeued, so concurrent Worker Threads cannot overshoot them
+Slots the calling thread already holds (see GetHeldClaims) are not claimed again
+The claimed slots (PRILIMIT_ flags) are returned in pdwClaims and must be released with ReleasePriorityLimits once the Work Item is executed
+Returns pointer to the Work Item, or NULL if no admitted Work Item is pending
+*/
+PWORKITEM DequeueAdmittedWorkItem(PTP pTP, MYPROC2 Dequeue, PDWORD pdwClaims)
+{
+	DWORD iPri;
+	while (BitScanReverse(&iPri, (DWORD)(pTP->lReadyMask & GetAdmittedMask(pTP))))
+	{
+		DWORD dwClaims = 0;
+		LONG lReserved = pTP->lReserved;
+		DWORD dwHeld = GetHeldClaims(pTP);
+		if (((int)iPri < RESERVED_PRI(lReserved)) && !(dwHeld & PRILIMIT_UNRESERVED))
+		{
+			dwClaims |= PRILIMIT_UNRESERVED;
+			if (InterlockedIncrement(&(pTP->iRunningUnreserved)) > (pTP->iWorkerThreads - RESERVED_THREADS(lReserved)))
+			{
+				ReleasePriorityLimits(pTP, dwClaims); //Another Worker Thread took the last unreserved slot
+				continue;
+			}
+		}
+		if (((int)iPri <= pTP->iCappedPri) && !(dwHeld & PRILIMIT_CAPPED))
+		{
+			dwClaims |= PRILIMIT_CAPPED;
+			if (InterlockedIncrement(&(pTP->iRunningCapped)) > pTP->iMaxCappedThreads)
+			{
+				ReleasePriorityLimits(pTP, dwClaims); //Another Worker Thread took the last capped slot
+				continue;
+			}
+		}
+		PWORKITEM pWork = DequeueWorkItem(pTP, iPri, Dequeue);
+		if (pWork)
+		{
+			*pdwClaims = dwClaims;
+			return pWork;
+		}
+		ReleasePriorityLimits(pTP, dwClaims); //Pri queue emptied by another thread
+	}
+	return NULL;
+}
+
+/*
+This routine releases the reservation and cap slots claimed by DequeueAdmittedWorkItem
+Accepts pointer to Thread Pool and the claimed slots (PRILIMIT_ flags) as arguements
+*/
+VOID ReleasePriorityLimits(PTP pTP, DWORD dwClaims)
+{
+	if (dwClaims & PRILIMIT_UNRESERVED)
+		InterlockedDecrement(&(pTP->iRunningUnreserved));
+	if (dwClaims & PRILIMIT_CAPPED)
+		InterlockedDecrement(&(pTP->iRunningCapped));
+}
+
+/*
+This routine takes one compensating Worker Thread off the count once there are more of them than blocked Worker Threads
+Accepts pointer to Thread Pool as arguement
+Returns TRUE if the calling Worker Thread should retire, else returns FALSE
+*/
+BOOL RetireCompensatingWorker(PTP pTP)
+{
+	int iCompensating = pTP->iCompensatingThreads;
+	while (iCompensating > (pTP->iBlockedThreads + pTP->iStuckThreads))
+	{
+		int iPrevious = InterlockedCompareExchange(&(pTP->iCompensatingThreads), iCompensating - 1, iCompensating);
+		if (iPrevious == iCompensating)
+			return TRUE;
+		iCompensating = iPrevious;
+	}
+	return FALSE;
+}
+
+/*
+This routine queues a WORKITEM_LONGRUNNING Work Item to the Long Running Threads
+Accepts pointer to Thread Pool, pointer to Work Item and the InsertHeadList function of DLL_LinkedList.dll as arguements
+A Long Running Thread is created unless enough of them are idle, so long running Work Items never wait for each other or take a Worker Thread
+Returns TRUE if the Work Item is queued, else returns FALSE
+*/
+BOOL InsertLongRunningWork(PTP pTP, PWORKITEM pWk, MYPROC1 Enqueue)
+{
+	LARGE_INTEGER liNow;
+	QueryPerformanceCounter(&liNow);
+	pWk->llQueuedTime = liNow.QuadPart; //Start of the queue wait
+	MarkTaggedWorkPending(pWk);
+	AcquireSRWLockExclusive(&(pTP->LongRunningLock));
+	if (!Enqueue(pTP->pLongRunningQ, &(pWk->list_entry))) //Queue the work item
+	{
+		ReleaseSRWLockExclusive(&(pTP->LongRunningLock));
+		ClearTaggedWorkPending(pWk);
+		ReleaseTaggedWork(pWk);
+		LOG_ERROR("Unable to Insert long running Work to queue\n");
+		return FALSE;
+	}
+	InterlockedIncrement(&(pTP->iNumLongRunningAdded)); //Update TP parameters
+	InterlockedIncrement(&(pTP->iNumLongRunningPending));
+	ReleaseSRWLockExclusive(&(pTP->LongRunningLock));
+	if (!ReleaseSemaphore(pTP->hLongRunningSemaphore, 1, NULL)) //Notify a Long Running Thread
+	{
+		LOG_ERROR("Unable to release hLongRunningSemaphore:%d", GetLastError());
+	}
+	//Idle Long Running Threads decrement iLongRunningIdle before they look at the queue one last time, so either they or this check see the Work Item
+	if (pTP->iNumLongRunningPending > pTP->iLongRunningIdle)
+	{
+		CreateLongRunningThread(pTP);
+	}
+	return TRUE;
+}
+
+/*
+This routine creates a Long Running Thread
+Accepts pointer to Thread Pool as arguement
+The thread is reserved against LONGRUNNING_MAXTHREADS before it is created, so concurrent callers cannot overshoot it, and its handle is recorded for DeleteTPEx
+Returns TRUE if a Long Running Thread was created, else returns FALSE
+*/
+BOOL CreateLongRunningThread(PTP pTP)
+{
+	int iThreads = pTP->iLongRunningThreads;
+	while (TRUE)
+	{
+		if (iThreads >= LONGRUNNING_MAXTHREADS)
+		{
+			LOG_INFO("Long Running Threads at LONGRUNNING_MAXTHREADS, Work Item waits for one\n");
+			return FALSE;
+		}
+		int iPrevious = InterlockedCompareExchange(&(pTP->iLongRunningThreads), iThreads + 1, iThreads);
+		if (iPrevious == iThreads)
+		{
+			break;
+		}
+		iThreads = iPrevious;
+	}
+	InterlockedIncrement(&(pTP->iLongRunningIdle));
+	HANDLE hThread = CreateThread(NULL, 0, LongRunningThreadProc, (LPVOID)pTP, 0, 0);
+	if (hThread == NULL)
+	{
+		LOG_ERROR("Unable to Create Long Running Thread:%d", GetLastError());
+		InterlockedDecrement(&(pTP->iLongRunningIdle));
+		InterlockedDecrement(&(pTP->iLongRunningThreads));
+		return FALSE;
+	}
+	BOOL bRecorded = FALSE;
+	AcquireSRWLockExclusive(&(pTP->LongRunningLock));
+	for (int i = 0; i < LONGRUNNING_MAXTHREADS; i++)
+	{
+		if (pTP->hLongRunningThreads[i] == NULL)
+		{
+			pTP->hLongRunningThreads[i] = hThread;
+			bRecorded = TRUE;
+			break;
+		}
+		if (WaitForSingleObject(pTP->hLongRunningThreads[i], 0) == WAIT_OBJECT_0) //Thread has exited, reuse its slot
+		{
+			CloseHandle(pTP->hLongRunningThreads[i]);
+			pTP->hLongRunningThreads[i] = hThread;
+			bRecorded = TRUE;
+			break;
+		}
+	}
+	ReleaseSRWLockExclusive(&(pTP->LongRunningLock));
+	if (!bRecorded)
+	{
+		//Cannot happen while thread creation respects LONGRUNNING_MAXTHREADS, the thread still runs but is not joined
+		LOG_ERROR("No free Long Running Thread slot\n");
+		CloseHandle(hThread);
+	}
+	return TRUE;
+}
+
+/*
+This API is the Long Running Thread Function. Accepts pointer to Thread Pool as arguement and returns 0 or 1 upon termination
+The Long Running Thread runs WORKITEM_LONGRUNNING Work Items one at a time in FIFO order and records their run time
+If no Work Item arrives for LONGRUNNINGTHREADIDLETIMEOUT it terminates, it also terminates on g_hDeleteTPEvent
+*/
+DWORD WINAPI LongRunningThreadProc(LPVOID pTP)
+{
+	MYPROC2 Dequeue = ((PTP)pTP)->pDequeue;
+	StartPoolThread((PTP)pTP);
+	HANDLE hLongRunningThreadEvents[2] = { g_hDeleteTPEvent, ((PTP)pTP)->hLongRunningSemaphore };
+	while (TRUE)
+	{
+		DWORD dw = WaitForMultipleObjects(2, hLongRunningThreadEvents, FALSE, LONGRUNNINGTHREADIDLETIMEOUT);
+		if (dw == WAIT_TIMEOUT)
+		{
+			InterlockedDecrement(&(((PTP)pTP)->iLongRunningIdle));
+			if (((PTP)pTP)->iNumLongRunningPending > 0) //A Work Item arrived while this thread was still counted as idle
+			{
+				InterlockedIncrement(&(((PTP)pTP)->iLongRunningIdle));
+				continue;
+			}
+			LOG_INFO("Long Running Thread terminating due to idle timeout\n");
+			break;
+		}
+		if (dw != (WAIT_OBJECT_0 + 1)) //Delete TP or wait failed
+		{
+			InterlockedDecrement(&(((PTP)pTP)->iLongRunningIdle));
+			break;
+		}
+		AcquireSRWLockExclusive(&(((PTP)pTP)->LongRunningLock));
+		PLINK pTemp = Dequeue(((PTP)pTP)->pLongRunningQ); //Get work item from queue
+		if (pTemp)
+			InterlockedDecrement(&(((PTP)pTP)->iNumLongRunningPending));
+		ReleaseSRWLockExclusive(&(((PTP)pTP)->LongRunningLock));
+		if (pTemp == NULL) //Work Item was deleted or cancelled before this thread got to it
+			continue;
+		InterlockedDecrement(&(((PTP)pTP)->iLongRunningIdle));
+		InterlockedIncrement(&(((PTP)pTP)->iLongRunningActive));
+		ULONGLONG ullStart = GetTickCount64();
+		ExecuteWorkItem((PTP)pTP, ADDR_BASE(pTemp, WORKITEM, list_entry)); //Call client callback function and complete the work item
+		LONG64 llElapsed = (LONG64)(GetTickCount64() - ullStart);
+		InterlockedAdd64(&(((PTP)pTP)->llLongRunningTotalMs), llElapsed);
+		LONG64 llMax = ((PTP)pTP)->llLongRunningMaxMs;
+		while (llElapsed > llMax)
+		{
+			LONG64 llPrevious = InterlockedCompareExchange64(&(((PTP)pTP)->llLongRunningMaxMs), llElapsed, llMax);
+			if (llPrevious == llMax)
+				break;
+			llMax = llPrevious;
+		}
+		InterlockedIncrement(&(((PTP)pTP)->iLongRunningIdle));
+		InterlockedDecrement(&(((PTP)pTP)->iLongRunningActive));
+		if (((PTP)pTP)->iShutdownMode) //DeleteTPEx waits for running work items to finish
+			SetEvent(((PTP)pTP)->hWorkerIdleEvent);
+	}
+	ExitPoolThread((PTP)pTP);
+	InterlockedDecrement(&(((PTP)pTP)->iLongRunningThreads));
+	return 0;
+}
+
+/*
+This routine adds the time a dequeued Work Item waited in its Pri queue to the queue wait histogram of its priority
+Accepts pointer to Thread Pool and pointer to Work Item as arguements
+Bucket 0 counts waits below 1 microsecond, bucket n counts waits from 2^(n-1) upto 2^n microseconds, the last bucket also counts longer waits
+*/
+VOID RecordQueueWait(PTP pTP, PWORKITEM pWork)
+{
+	LARGE_INTEGER liNow;
+	QueryPerformanceCounter(&liNow);
+	ULONGLONG ullMicroseconds = (ULONGLONG)(liNow.QuadPart - pWork->llQueuedTime) * 1000000 / pTP->llQpcFrequency;
+	DWORD iBucket = 0;
+	if (ullMicroseconds > 0)
+	{
+		BitScanReverse64(&iBucket, ullMicroseconds);
+		iBucket = min(iBucket + 1, QUEUEWAIT_BUCKETS - 1);
+	}
+	InterlockedIncrement(&(pTP->iQueueWaitHistogram[pWork->iPri][iBucket]));
+}
+
+/*
+This routine computes a queue wait percentile of one priority from its histogram
+Accepts pointer to Thread Pool, the priority and the percentile (1 to 100) as arguements
+Returns the upper bound in microseconds of the bucket holding the percentile, or 0 if no Work Item of the priority was dequeued
+*/
+DWORD QueueWaitPercentile(PTP pTP, DWORD iPri, DWORD dwPercentile)
+{
+	LONGLONG llTotal = 0;
+	for (int i = 0; i < QUEUEWAIT_BUCKETS; i++)
+		llTotal += pTP->iQueueWaitHistogram[iPri][i];
+	if (llTotal == 0)
+		return 0;
+	LONGLONG llRank = (llTotal * dwPercentile + 99) / 100; //Number of samples at or below the percentile, rounded up
+	LONGLONG llSeen = 0;
+	for (int i = 0; i < QUEUEWAIT_BUCKETS; i++)
+	{
+		llSeen += pTP->iQueueWaitHistogram[iPri][i];
+		if (llSeen >= llRank)
+			return (i == (QUEUEWAIT_BUCKETS - 1)) ? MAXDWORD : (1UL << i);
+	}
+	return MAXDWORD;
+}
+
+/*
+This routine executes pending Work Items on the calling thread until the outstanding count drops to zero
+Accepts pointer to Thread Pool, pointer to the outstanding count and the event set when it reaches zero as arguements
+When no Work Item is pending, the calling thread waits on the event for HELPWAITINTERVAL and checks the queues again
+Returns TRUE once the outstanding count is zero, else returns FALSE
+*/
+BOOL HelpWhileWaiting(PTP pTP, volatile int* piOutstanding, HANDLE hDoneEvent)
+{
+	MYPROC2 Dequeue = pTP->pDequeue;
+	BOOL bResult = TRUE;
+	InterlockedIncrement(&(pTP->iCHWThreads));
+	while (*piOutstanding > 0)
+	{
+		if (ExecutePendingWorkItem(pTP, Dequeue))
+		{
+			continue;
+		}
+		if (WaitForSingleObject(hDoneEvent, HELPWAITINTERVAL) == WAIT_FAILED)
+		{
+			LOG_ERROR("Helping Thread Wait failed:%d", GetLastError());
+			bResult = FALSE;
+			break;
+		}
+	}
+	InterlockedDecrement(&(pTP->iCHWThreads));
+	return bResult;
+}
+
+/*
+This API registers a socket whose readiness is dispatched on the Thread Pool
+Accepts pointer to Thread Pool, the SOCKET, the FD_ network events of interest (eg FD_READ | FD_CLOSE), the callback function and a client context as arguements
+One waiting Worker Thread (the leader) waits on the registered sockets, when a socket is ready it hands the wait over to another Worker Thread and runs the callback itself
+Registration is one-shot, the socket is not waited on again until ReArmSocketWork is called (typically at the end of the callback)
+The socket is put in non-blocking mode by WSAEventSelect, the client must have called WSAStartup, at most SOCKETWORK_MAX sockets can be registered
+Returns pointer to the registration upon success, else returns NULL
+*/
+PSOCKETWORK RegisterSocketWork(PTP pTP, UINT_PTR s, LONG lNetworkEvents, SOCKETWORK_CALLBACK pCallback, PVOID pvCtx)
+{
+	//Parameter Validation
+	if (!(pTP && pCallback && lNetworkEvents) || ((SOCKET)s == INVALID_SOCKET))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Register Socket Work:%d", GetLastError());
+		return NULL;
+	}
+	if (pTP->iShutdownMode)
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("Thread Pool is being deleted:%d", GetLastError());
+		return NULL;
+	}
+	//Get Default Process Heap Handle
+	HANDLE hDefaultHeap = GetProcessHeap();
+	if (hDefaultHeap == NULL)
+	{
+		LOG_ERROR("Unable to get handle to Default Process Heap:%d", GetLastError());
+		return NULL;
+	}
+	PSOCKETWORK pSocketWork = (PSOCKETWORK)HeapAlloc(hDefaultHeap, HEAP_ZERO_MEMORY, sizeof(SOCKETWORK));
+	if (pSocketWork == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to allocate Socket Work:%d", GetLastError());
+		return NULL;
+	}
+	pSocketWork->pTP = pTP;
+	pSocketWork->s = (SOCKET)s;
+	pSocketWork->lNetworkEvents = lNetworkEvents;
+	pSocketWork->pCallback = pCallback;
+	pSocketWork->pvCtx = pvCtx;
+	pSocketWork->bArmed = TRUE;
+	pSocketWork->bRegistered = TRUE;
+	pSocketWork->hEvent = WSACreateEvent();
+	if (pSocketWork->hEvent == WSA_INVALID_EVENT)
+	{
+		LOG_ERROR("Unable to Create Socket Event:%d", WSAGetLastError());
+		HeapFree(hDefaultHeap, 0, pSocketWork);
+		return NULL;
+	}
+	if (WSAEventSelect(pSocketWork->s, pSocketWork->hEvent, lNetworkEvents) == SOCKET_ERROR)
+	{
+		LOG_ERROR("Unable to associate the Socket Event:%d", WSAGetLastError());
+		WSACloseEvent(pSocketWork->hEvent);
+		HeapFree(hDefaultHeap, 0, pSocketWork);
+		return NULL;
+	}
+
+	AcquireSRWLockExclusive(&(pTP->SocketWorkLock));
+	if (pTP->iNumSocketWork == SOCKETWORK_MAX)
+	{
+		ReleaseSRWLockExclusive(&(pTP->SocketWorkLock));
+		SetLastError(ERROR_NOT_ENOUGH_QUOTA);
+		LOG_ERROR("Max number of sockets registered:%d", GetLastError());
+		FreeSocketWork(pSocketWork);
+		return NULL;
+	}
+	pTP->pSocketWork[pTP->iNumSocketWork] = pSocketWork;
+	InterlockedIncrement(&(pTP->iNumSocketWork));
+	InterlockedIncrement(&(pTP->iSocketGeneration));
+	ReleaseSRWLockExclusive(&(pTP->SocketWorkLock));
+
+	//Let the leader add the socket to its wait set, or wake a waiting Worker Thread to become the leader
+	SetEvent(pTP->hSocketChangedEvent);
+	SetEvent(pTP->hSocketPromoteEvent);
+	SpawnWorkerOnDemand(pTP); //Create a Worker Thread if none is left to wait on the sockets
+	LOG_INFO("Registered Socket Work\n");
+	return pSocketWork;
+}
+
+/*
+This API re-arms a socket registered with RegisterSocketWork, so that its next readiness is dispatched again
+Accepts pointer to the registration as arguement, can be called from the callback function
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL ReArmSocketWork(PSOCKETWORK pSocketWork)
+{
+	//Parameter Validation
+	if (pSocketWork == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Re-Arm Socket Work:%d", GetLastError());
+		return FALSE;
+	}
+	PTP pTP = pSocketWork->pTP;
+	AcquireSRWLockShared(&(pTP->SocketWorkLock));
+	if (!pSocketWork->bRegistered)
+	{
+		ReleaseSRWLockShared(&(pTP->SocketWorkLock));
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("Socket Work is not registered:%d", GetLastError());
+		return FALSE;
+	}
+	InterlockedExchange(&(pSocketWork->bArmed), TRUE);
+	InterlockedIncrement(&(pTP->iSocketGeneration));
+	ReleaseSRWLockShared(&(pTP->SocketWorkLock));
+	SetEvent(pTP->hSocketChangedEvent); //Leader adds the socket back to its wait set
+	return TRUE;
+}
+
+/*
+This API unregisters a socket registered with RegisterSocketWork and frees the registration
+Accepts pointer to the registration as arguement
+Waits until the leader Worker Thread no longer waits on the socket and its callback is not running, unless called from that callback
+The calling thread blocks on hSocketRebuiltEvent and on an event of the registration set when its callback returns
+The socket itself is not closed, it is left in non-blocking mode
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL UnregisterSocketWork(PSOCKETWORK pSocketWork)
+{
+	//Parameter Validation
+	if (pSocketWork == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Unregister Socket Work:%d", GetLastError());
+		return FALSE;
+	}
+	PTP pTP = pSocketWork->pTP;
+	AcquireSRWLockExclusive(&(pTP->SocketWorkLock));
+	if (!pSocketWork->bRegistered)
+	{
+		ReleaseSRWLockExclusive(&(pTP->SocketWorkLock));
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("Socket Work is not registered:%d", GetLastError());
+		return FALSE;
+	}
+	for (int i = 0; i < pTP->iNumSocketWork; i++)
+	{
+		if (pTP->pSocketWork[i] == pSocketWork) //Move the last registration into the freed slot
+		{
+			pTP->pSocketWork[i] = pTP->pSocketWork[pTP->iNumSocketWork - 1];
+			InterlockedDecrement(&(pTP->iNumSocketWork));
+			break;
+		}
+	}
+	pSocketWork->bRegistered = FALSE;
+	LONG iGeneration = InterlockedIncrement(&(pTP->iSocketGeneration));
+	if (pTP->iSocketLeader) //The leader sets hSocketRebuiltEvent under SocketWorkLock, so only a rebuild which sees iGeneration or a hand over sets it from here on
+		ResetEvent(pTP->hSocketRebuiltEvent);
+	BOOL bFromCallback = (pSocketWork->iCallbackRunning && (pSocketWork->dwCallbackThreadId == GetCurrentThreadId()));
+	ReleaseSRWLockExclusive(&(pTP->SocketWorkLock));
+	SetEvent(pTP->hSocketChangedEvent);
+
+	//Wait for the leader to drop the socket from its wait set, a leader which already picked the socket has set iCallbackRunning
+	while (pTP->iSocketLeader && ((pTP->iSocketLeaderGeneration - iGeneration) < 0))
+	{
+		if (WaitForSingleObject(pTP->hSocketRebuiltEvent, INFINITE) == WAIT_FAILED)
+		{
+			LOG_ERROR("Unable to wait for the leader Worker Thread:%d", GetLastError());
+			return FALSE;
+		}
+	}
+	if (bFromCallback) //Worker Thread frees the registration once the callback returns
+	{
+		pSocketWork->bFreeAfterCallback = TRUE;
+		return TRUE;
+	}
+	//EndSocketCallback sets the event under SocketWorkLock when it clears iCallbackRunning
+	AcquireSRWLockExclusive(&(pTP->SocketWorkLock));
+	HANDLE hCallbackDoneEvent = NULL;
+	if (pSocketWork->iCallbackRunning)
+	{
+		hCallbackDoneEvent = CreateEvent(NULL, TRUE, FALSE, NULL); //Manual Reset Event, initial state is not signalled
+		pSocketWork->hCallbackDoneEvent = hCallbackDoneEvent;
+	}
+	ReleaseSRWLockExclusive(&(pTP->SocketWorkLock));
+	if (hCallbackDoneEvent)
+	{
+		DWORD dwWait = WaitForSingleObject(hCallbackDoneEvent, INFINITE);
+		CloseHandle(hCallbackDoneEvent);
+		if (dwWait == WAIT_FAILED)
+		{
+			LOG_ERROR("Unable to wait for the Socket Work callback:%d", GetLastError());
+			return FALSE;
+		}
+	}
+	else
+	{
+		while (pSocketWork->iCallbackRunning) //Out of event handles, fall back to polling the callback
+		{
+			Sleep(HELPWAITINTERVAL);
+		}
+	}
+	FreeSocketWork(pSocketWork);
+	LOG_INFO("Unregistered Socket Work\n");
+	return TRUE;
+}
+
+/*
+This routine is run by the leader Worker Thread, it waits on the registered sockets, the Delete TP event and the Work Item available event
+Accepts pointer to Thread Pool as arguement
+When a socket is ready the leadership is handed over to another waiting Worker Thread and the callback is run on this thread
+Returns WAIT_TIMEOUT after running a callback or when no socket is left, WAIT_OBJECT_0 + 0 on Delete TP, WAIT_OBJECT_0 + 2 when Work Items are available, WAIT_FAILED on error
+*/
+DWORD LeadSocketWait(PTP pTP)
+{
+	HANDLE hEvents[MAXIMUM_WAIT_OBJECTS] = { g_hDeleteTPEvent,g_hWIAvailableEvent,pTP->hSocketChangedEvent };
+	PSOCKETWORK pArmed[SOCKETWORK_MAX];
+	while (TRUE)
+	{
+		//Build the wait set from the armed sockets
+		DWORD dwArmed = 0;
+		AcquireSRWLockShared(&(pTP->SocketWorkLock));
+		int iNumSocketWork = pTP->iNumSocketWork;
+		for (int i = 0; i < iNumSocketWork; i++)
+		{
+			if (pTP->pSocketWork[i]->bArmed)
+			{
+				pArmed[dwArmed] = pTP->pSocketWork[i];
+				hEvents[3 + dwArmed] = pTP->pSocketWork[i]->hEvent;
+				dwArmed++;
+			}
+		}
+		InterlockedExchange(&(pTP->iSocketLeaderGeneration), pTP->iSocketGeneration);
+		SetEvent(pTP->hSocketRebuiltEvent); //Under the lock, so it is never set after UnregisterSocketWork reset it for a later generation
+		ReleaseSRWLockShared(&(pTP->SocketWorkLock));
+		if (iNumSocketWork == 0)
+		{
+			ReleaseSocketLeadership(pTP);
+			return WAIT_TIMEOUT;
+		}
+
+		DWORD dw = WaitForMultipleObjects(3 + dwArmed, hEvents, FALSE, INFINITE);
+		if (dw == WAIT_OBJECT_0 + 2) //Sockets registered, re-armed or unregistered
+		{
+			continue;
+		}
+		if ((dw >= WAIT_OBJECT_0 + 3) && (dw < WAIT_OBJECT_0 + 3 + dwArmed))
+		{
+			PSOCKETWORK pSocketWork = pArmed[dw - WAIT_OBJECT_0 - 3];
+			//The socket could have been unregistered after the wait set was built
+			AcquireSRWLockShared(&(pTP->SocketWorkLock));
+			BOOL bRegistered = pSocketWork->bRegistered;
+			if (bRegistered)
+			{
+				pSocketWork->dwCallbackThreadId = GetCurrentThreadId();
+				InterlockedExchange(&(pSocketWork->iCallbackRunning), 1);
+			}
+			ReleaseSRWLockShared(&(pTP->SocketWorkLock));
+			if (!bRegistered)
+			{
+				continue;
+			}
+			WSANETWORKEVENTS NetworkEvents;
+			if ((WSAEnumNetworkEvents(pSocketWork->s, pSocketWork->hEvent, &NetworkEvents) == SOCKET_ERROR) || (NetworkEvents.lNetworkEvents == 0)) //Also resets the event
+			{
+				EndSocketCallback(pTP, pSocketWork); //Readiness was already consumed, keep waiting
+				continue;
+			}
+			int iError = 0;
+			for (int i = 0; i < FD_MAX_EVENTS; i++)
+			{
+				if ((NetworkEvents.lNetworkEvents & (1 << i)) && NetworkEvents.iErrorCode[i])
+				{
+					iError = NetworkEvents.iErrorCode[i];
+					break;
+				}
+			}
+			InterlockedExchange(&(pSocketWork->bArmed), FALSE); //One-shot, the client re-arms the socket
+			ReleaseSocketLeadership(pTP);
+
+			//Run the callback on this Worker Thread
+			InterlockedDecrement(&(pTP->iCWWThreads));
+			InterlockedIncrement(&(pTP->iCRWThreads));
+			LOG_INFO("Calling Socket Work callback function\n");
+			pSocketWork->pCallback(pSocketWork, (UINT_PTR)pSocketWork->s, NetworkEvents.lNetworkEvents, iError, pSocketWork->pvCtx);
+			if (pSocketWork->bFreeAfterCallback)
+			{
+				FreeSocketWork(pSocketWork);
+			}
+			else
+			{
+				EndSocketCallback(pTP, pSocketWork);
+			}
+			InterlockedIncrement(&(pTP->iCWWThreads));
+			InterlockedDecrement(&(pTP->iCRWThreads));
+			if (pTP->iShutdownMode) //DeleteTPEx waits for running work items to finish
+				SetEvent(pTP->hWorkerIdleEvent);
+			return WAIT_TIMEOUT;
+		}
+		//Delete TP, Work Items available or wait failed, hand the sockets over to another Worker Thread
+		ReleaseSocketLeadership(pTP);
+		if (dw == WAIT_OBJECT_0 + 1)
+		{
+			return WAIT_OBJECT_0 + 2;
+		}
+		if (dw == WAIT_FAILED)
+		{
+			LOG_ERROR("Socket Wait failed:%d", GetLastError());
+		}
+		return dw;
+	}
+}
+
+/*
+This routine hands the registered sockets over to another waiting Worker Thread
+Accepts pointer to Thread Pool as arguement
+UnregisterSocketWork no longer waits for this leader, a new leader waits on the sockets as they are registered then
+*/
+VOID ReleaseSocketLeadership(PTP pTP)
+{
+	AcquireSRWLockShared(&(pTP->SocketWorkLock));
+	InterlockedExchange(&(pTP->iSocketLeader), 0);
+	SetEvent(pTP->hSocketRebuiltEvent);
+	ReleaseSRWLockShared(&(pTP->SocketWorkLock));
+	SetEvent(pTP->hSocketPromoteEvent);
+}
+
+/*
+This routine clears iCallbackRunning of a socket once its callback returned or was not run
+Accepts pointer to Thread Pool and pointer to the registration as arguements
+An UnregisterSocketWork waiting for the callback is woken, it can free the registration once SocketWorkLock is released
+*/
+VOID EndSocketCallback(PTP pTP, PSOCKETWORK pSocketWork)
+{
+	AcquireSRWLockShared(&(pTP->SocketWorkLock));
+	InterlockedExchange(&(pSocketWork->iCallbackRunning), 0);
+	if (pSocketWork->hCallbackDoneEvent)
+		SetEvent(pSocketWork->hCallbackDoneEvent);
+	ReleaseSRWLockShared(&(pTP->SocketWorkLock));
+}
+
+/*
+This routine detaches the event from the socket and frees the registration
+Accepts pointer to the registration as arguement
+*/
+VOID FreeSocketWork(PSOCKETWORK pSocketWork)
+{
+	WSAEventSelect(pSocketWork->s, NULL, 0);
+	WSACloseEvent(pSocketWork->hEvent);
+	if (HeapFree(GetProcessHeap(), 0, pSocketWork) == 0)
+	{
+		LOG_ERROR("Unable to free Socket Work:%d", GetLastError());
+	}
+}
+
+/*
+This API binds a file handle to the Thread Pool for TPReadAsync, TPWriteAsync and TPFsyncAsync
+Accepts pointer to Thread Pool, the file handle and whether it was opened with FILE_FLAG_OVERLAPPED as arguements
+Overlapped handles are associated with the I/O completion port of the Thread Pool, the association lasts until the handle is closed
+Other handles, and overlapped handles which cannot be associated, are serviced by at most TPIO_MAXBLOCKINGTHREADS blocking I/O threads
+Returns pointer to the bound handle upon success, else returns NULL
+*/
+PTPIO TPBindIoHandle(PTP pTP, HANDLE hFile, BOOL bOverlapped)
+{
+	//Parameter Validation
+	if (!pTP || (hFile == NULL) || (hFile == INVALID_HANDLE_VALUE))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Bind I/O handle:%d", GetLastError());
+		return NULL;
+	}
+	if (pTP->iShutdownMode)
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("Thread Pool is being deleted:%d", GetLastError());
+		return NULL;
+	}
+	PTPIO pIo = (PTPIO)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(TPIO));
+	if (pIo == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to allocate I/O handle:%d", GetLastError());
+		return NULL;
+	}
+	pIo->hIdleEvent = CreateEvent(NULL, TRUE, FALSE, NULL); //Manual Reset Event, initial state is not signalled
+	if (pIo->hIdleEvent == NULL)
+	{
+		LOG_ERROR("Unable to Create I/O handle Idle Event:%d", GetLastError());
+		HeapFree(GetProcessHeap(), 0, pIo);
+		return NULL;
+	}
+	pIo->pTP = pTP;
+	pIo->hFile = hFile;
+	pIo->iPending = 1; //Held by the binding, the last request to complete after TPUnbindIoHandle dropped it sets hIdleEvent
+	if (bOverlapped && StartIoPort(pTP, FALSE))
+	{
+		if (CreateIoCompletionPort(hFile, pTP->hIoPort, 0, 0) != NULL)
+		{
+			pIo->bOverlapped = TRUE;
+		}
+		else
+		{
+			LOG_INFO("Unable to associate handle with the I/O completion port, using blocking I/O threads:%d\n", GetLastError());
+		}
+	}
+	LOG_INFO("Bound I/O handle, %s\n", pIo->bOverlapped ? "overlapped" : "blocking");
+	return pIo;
+}
+
+/*
+This API unbinds a handle bound with TPBindIoHandle and frees it
+Accepts pointer to the bound handle as arguement, waits until the callbacks of the requests submitted on it have completed
+The binding drops its own pending count, the callback of the last request then sets hIdleEvent
+The file handle itself is not closed, it must not be bound to another Thread Pool
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL TPUnbindIoHandle(PTPIO pIo)
+{
+	//Parameter Validation
+	if (pIo == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Unbind I/O handle:%d", GetLastError());
+		return FALSE;
+	}
+	if (InterlockedDecrement(&(pIo->iPending)) != 0)
+	{
+		if (WaitForSingleObject(pIo->hIdleEvent, INFINITE) == WAIT_FAILED)
+		{
+			LOG_ERROR("Unable to wait for the I/O requests:%d", GetLastError());
+			return FALSE;
+		}
+	}
+	CloseHandle(pIo->hIdleEvent);
+	if (HeapFree(GetProcessHeap(), 0, pIo) == 0)
+	{
+		LOG_ERROR("Unable to free I/O handle:%d", GetLastError());
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+This API reads from a bound handle asynchronously
+Accepts pointer to the bound handle, the buffer, the number of bytes to read, the file offset, the callback function and a client context as arguements
+The callback is run on a Worker Thread as a normal pri Work Item once the read completes, the buffer must stay valid until then
+Returns TRUE if the read was submitted (the callback is always called), else returns FALSE
+*/
+BOOL TPReadAsync(PTPIO pIo, PVOID pvBuffer, DWORD cbBuffer, ULONGLONG ullOffset, TPIO_CALLBACK pCallback, PVOID pvCtx)
+{
+	return SubmitIo(pIo, TPIO_READ, pvBuffer, cbBuffer, ullOffset, pCallback, pvCtx);
+}
+
+/*
+This API writes to a bound handle asynchronously
+Accepts pointer to the bound handle, the buffer, the number of bytes to write, the file offset, the callback function and a client context as arguements
+The callback is run on a Worker Thread as a normal pri Work Item once the write completes, the buffer must stay valid until then
+Returns TRUE if the write was submitted (the callback is always called), else returns FALSE
+*/
+BOOL TPWriteAsync(PTPIO pIo, LPCVOID pvBuffer, DWORD cbBuffer, ULONGLONG ullOffset, TPIO_CALLBACK pCallback, PVOID pvCtx)
+{
+	return SubmitIo(pIo, TPIO_WRITE, (PVOID)pvBuffer, cbBuffer, ullOffset, pCallback, pvCtx);
+}
+
+/*
+This API flushes the buffers of a bound handle to disk asynchronously
+Accepts pointer to the bound handle, the callback function and a client context as arguements
+FlushFileBuffers has no overlapped form, the flush is always done by a blocking I/O thread
+Returns TRUE if the flush was submitted (the callback is always called), else returns FALSE
+*/
+BOOL TPFsyncAsync(PTPIO pIo, TPIO_CALLBACK pCallback, PVOID pvCtx)
+{
+	return SubmitIo(pIo, TPIO_FSYNC, NULL, 0, 0, pCallback, pvCtx);
+}
+
+/*
+This routine submits an async I/O request
+Accepts pointer to the bound handle, the TPIO_ operation, the buffer, its size, the file offset, the callback function and a client context as arguements
+Reads and writes on overlapped handles are issued here and complete to the I/O completion port, everything else is queued to the blocking I/O threads
+Returns TRUE if the request was submitted, else returns FALSE
+*/
+BOOL SubmitIo(PTPIO pIo, DWORD dwOp, PVOID pvBuffer, DWORD cbBuffer, ULONGLONG ullOffset, TPIO_CALLBACK pCallback, PVOID pvCtx)
+{
+	//Parameter Validation
+	if (!(pIo && pCallback) || ((dwOp != TPIO_FSYNC) && !(pvBuffer && cbBuffer)))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to submit I/O:%d", GetLastError());
+		return FALSE;
+	}
+	PTP pTP = pIo->pTP;
+	if (pTP->iShutdownMode)
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("Thread Pool is being deleted:%d", GetLastError());
+		return FALSE;
+	}
+	PTPIOREQUEST pRequest = (PTPIOREQUEST)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(TPIOREQUEST));
+	if (pRequest == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to allocate I/O request:%d", GetLastError());
+		return FALSE;
+	}
+	InitWorkItem(&(pRequest->Work), pTP, IoCallbackProc, pRequest, WORKITEM_NORMAL);
+	pRequest->Work.dwFlags |= WORKITEM_FREEONCOMPLETE | WORKITEM_RUNONCANCEL; //The client callback releases the buffer, it runs even when DeleteTPEx cancels
+	pRequest->Overlapped.Offset = (DWORD)ullOffset;
+	pRequest->Overlapped.OffsetHigh = (DWORD)(ullOffset >> 32);
+	pRequest->pIo = pIo;
+	pRequest->dwOp = dwOp;
+	pRequest->pvBuffer = pvBuffer;
+	pRequest->cbBuffer = cbBuffer;
+	pRequest->pCallback = pCallback;
+	pRequest->pvCtx = pvCtx;
+	InterlockedIncrement(&(pIo->iPending));
+	InterlockedIncrement(&(pTP->iIoPending));
+
+	if (pIo->bOverlapped && (dwOp != TPIO_FSYNC))
+	{
+		BOOL bIssued = (dwOp == TPIO_READ) ? ReadFile(pIo->hFile, pvBuffer, cbBuffer, NULL, &(pRequest->Overlapped))
+			: WriteFile(pIo->hFile, pvBuffer, cbBuffer, NULL, &(pRequest->Overlapped));
+		if (bIssued || (GetLastError() == ERROR_IO_PENDING)) //Completion is posted to hIoPort
+		{
+			return TRUE;
+		}
+		//Failed before it was issued, no completion is posted
+		pRequest->dwError = GetLastError();
+		CompleteIoRequest(pTP, pRequest);
+		return TRUE;
+	}
+
+	if (!StartIoPort(pTP, TRUE))
+	{
+		ReleaseIoHandle(pIo);
+		InterlockedDecrement(&(pTP->iIoPending));
+		HeapFree(GetProcessHeap(), 0, pRequest);
+		return FALSE;
+	}
+	//Create a blocking I/O thread when none is waiting for a request, upto TPIO_MAXBLOCKINGTHREADS
+	if (pTP->iBlockingIoIdle == 0)
+	{
+		AcquireSRWLockExclusive(&(pTP->IoLock));
+		if ((pTP->iBlockingIoIdle == 0) && (pTP->iBlockingIoThreads < TPIO_MAXBLOCKINGTHREADS))
+		{
+			HANDLE hThread = CreateThread(NULL, 0, BlockingIoThreadProc, (LPVOID)pTP, 0, 0);
+			if (hThread)
+			{
+				pTP->hBlockingIoThreads[pTP->iBlockingIoThreads] = hThread;
+				InterlockedIncrement(&(pTP->iBlockingIoThreads));
+			}
+			else
+			{
+				LOG_ERROR("Unable to Create blocking I/O Thread:%d", GetLastError());
+			}
+		}
+		ReleaseSRWLockExclusive(&(pTP->IoLock));
+	}
+	if (!PostQueuedCompletionStatus(pTP->hBlockingIoPort, 0, 0, &(pRequest->Overlapped)))
+	{
+		LOG_ERROR("Unable to queue blocking I/O request:%d", GetLastError());
+		ReleaseIoHandle(pIo);
+		InterlockedDecrement(&(pTP->iIoPending));
+		HeapFree(GetProcessHeap(), 0, pRequest);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+This routine creates the I/O completion port and the I/O Completion Thread, or the blocking I/O request port, the first time they are needed
+Accepts pointer to Thread Pool and whether the blocking I/O request port is needed as arguements
+Returns TRUE if the port exists, else returns FALSE
+*/
+BOOL StartIoPort(PTP pTP, BOOL bBlocking)
+{
+	if (bBlocking ? (pTP->hBlockingIoPort != NULL) : (pTP->hIoThread != NULL))
+	{
+		return TRUE;
+	}
+	BOOL bResult = TRUE;
+	AcquireSRWLockExclusive(&(pTP->IoLock));
+	if (bBlocking && (pTP->hBlockingIoPort == NULL))
+	{
+		pTP->hBlockingIoPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+		if (pTP->hBlockingIoPort == NULL)
+		{
+			LOG_ERROR("Unable to Create blocking I/O port:%d", GetLastError());
+			bResult = FALSE;
+		}
+	}
+	else if (!bBlocking && (pTP->hIoThread == NULL))
+	{
+		//One I/O Completion Thread only turns completions into Work Items, the callbacks run on the Worker Threads
+		pTP->hIoPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+		if (pTP->hIoPort == NULL)
+		{
+			LOG_ERROR("Unable to Create I/O completion port:%d", GetLastError());
+			bResult = FALSE;
+		}
+		else
+		{
+			HANDLE hThread = CreateThread(NULL, 0, IoCompletionThreadProc, (LPVOID)pTP, 0, 0);
+			if (hThread == NULL)
+			{
+				LOG_ERROR("Unable to Create I/O Completion Thread:%d", GetLastError());
+				CloseHandle(pTP->hIoPort);
+				pTP->hIoPort = NULL;
+				bResult = FALSE;
+			}
+			pTP->hIoThread = hThread;
+		}
+	}
+	ReleaseSRWLockExclusive(&(pTP->IoLock));
+	return bResult;
+}
+
+/*
+This routine queues the callback Work Item of a completed I/O request to the normal pri queue
+Accepts pointer to Thread Pool and pointer to the request as arguements
+While the Thread Pool is being deleted no Work Item is accepted, the callback is then run on the calling thread
+*/
+VOID CompleteIoRequest(PTP pTP, PTPIOREQUEST pRequest)
+{
+	if (!InsertWork(pTP, &(pRequest->Work)))
+	{
+		ExecuteWorkItem(pTP, &(pRequest->Work));
+	}
+}
+
+/*
+This routine is the Work Item callback of a completed I/O request, it runs the client callback
+Accepts pointer to the request as arguement, the request is freed by ExecuteWorkItem (WORKITEM_FREEONCOMPLETE)
+*/
+PVOID IoCallbackProc(PVOID pvParam)
+{
+	PTPIOREQUEST pRequest = (PTPIOREQUEST)pvParam;
+	PTPIO pIo = pRequest->pIo;
+	PTP pTP = pIo->pTP;
+	pRequest->pCallback(pIo, pRequest->pvCtx, pRequest->dwError, pRequest->cbTransferred);
+	ReleaseIoHandle(pIo); //pIo can be unbound from here on
+	InterlockedDecrement(&(pTP->iIoPending));
+	return NULL;
+}
+
+/*
+This routine drops a request, or the binding itself, from the pending count of a bound handle
+Accepts pointer to the bound handle as arguement
+The last one sets hIdleEvent, TPUnbindIoHandle frees the handle once it is set so pIo is not touched after it
+*/
+VOID ReleaseIoHandle(PTPIO pIo)
+{
+	HANDLE hIdleEvent = pIo->hIdleEvent;
+	if (InterlockedDecrement(&(pIo->iPending)) == 0)
+		SetEvent(hIdleEvent);
+}
+
+/*
+This API is the I/O Completion Thread Function. Accepts pointer to Thread Pool as arguement and returns 0 or 1 upon termination
+Dequeues up to TPIO_REAPBATCH completions at a time from the I/O completion port and queues their callback Work Items
+Terminates on a completion packet without an overlapped structure, posted by StopIoThreads
+*/
+DWORD WINAPI IoCompletionThreadProc(LPVOID pTP)
+{
+	OVERLAPPED_ENTRY Entries[TPIO_REAPBATCH];
+	while (TRUE)
+	{
+		ULONG ulRemoved = 0;
+		if (!GetQueuedCompletionStatusEx(((PTP)pTP)->hIoPort, Entries, TPIO_REAPBATCH, &ulRemoved, INFINITE, FALSE))
+		{
+			LOG_ERROR("I/O Completion Thread wait failed:%d", GetLastError());
+			return 1;
+		}
+		for (ULONG i = 0; i < ulRemoved; i++)
+		{
+			if (Entries[i].lpOverlapped == NULL) //StopIoThreads
+			{
+				LOG_INFO("I/O Completion Thread terminating due to thread pool deletion\n");
+				return 0;
+			}
+			PTPIOREQUEST pRequest = CONTAINING_RECORD(Entries[i].lpOverlapped, TPIOREQUEST, Overlapped);
+			if (!GetOverlappedResult(pRequest->pIo->hFile, &(pRequest->Overlapped), &(pRequest->cbTransferred), FALSE))
+			{
+				pRequest->dwError = GetLastError();
+			}
+			CompleteIoRequest((PTP)pTP, pRequest);
+		}
+	}
+}
+
+/*
+This API is the blocking I/O thread Function. Accepts pointer to Thread Pool as arguement and returns 0 or 1 upon termination
+Does the requests queued to the blocking I/O request port one at a time and queues their callback Work Items
+Terminates on a request without an overlapped structure, posted by StopIoThreads
+*/
+DWORD WINAPI BlockingIoThreadProc(LPVOID pTP)
+{
+	while (TRUE)
+	{
+		DWORD cbTransferred;
+		ULONG_PTR ulKey;
+		LPOVERLAPPED pOverlapped = NULL;
+		InterlockedIncrement(&(((PTP)pTP)->iBlockingIoIdle));
+		BOOL bDequeued = GetQueuedCompletionStatus(((PTP)pTP)->hBlockingIoPort, &cbTransferred, &ulKey, &pOverlapped, INFINITE);
+		InterlockedDecrement(&(((PTP)pTP)->iBlockingIoIdle));
+		if (!bDequeued)
+		{
+			LOG_ERROR("Blocking I/O Thread wait failed:%d", GetLastError());
+			return 1;
+		}
+		if (pOverlapped == NULL) //StopIoThreads
+		{
+			LOG_INFO("Blocking I/O Thread terminating due to thread pool deletion\n");
+			return 0;
+		}
+		PTPIOREQUEST pRequest = CONTAINING_RECORD(pOverlapped, TPIOREQUEST, Overlapped);
+		HANDLE hFile = pRequest->pIo->hFile;
+		BOOL bDone;
+		switch (pRequest->dwOp)
+		{
+		case TPIO_READ:
+			bDone = ReadFile(hFile, pRequest->pvBuffer, pRequest->cbBuffer, &(pRequest->cbTransferred), pOverlapped);
+			break;
+		case TPIO_WRITE:
+			bDone = WriteFile(hFile, pRequest->pvBuffer, pRequest->cbBuffer, &(pRequest->cbTransferred), pOverlapped);
+			break;
+		default:
+			bDone = FlushFileBuffers(hFile);
+			break;
+		}
+		if (!bDone && (GetLastError() == ERROR_IO_PENDING)) //Overlapped handle which could not be associated with the I/O completion port
+		{
+			bDone = GetOverlappedResult(hFile, pOverlapped, &(pRequest->cbTransferred), TRUE);
+		}
+		if (!bDone)
+		{
+			pRequest->dwError = GetLastError();
+		}
+		CompleteIoRequest((PTP)pTP, pRequest);
+	}
+}
+
+/*
+This routine stops and joins the I/O Completion Thread and the blocking I/O threads, and closes the I/O ports
+Accepts pointer to Thread Pool as arguement, called by DeleteTPEx once no I/O request is pending
+*/
+VOID StopIoThreads(PTP pTP)
+{
+	if (pTP->hIoThread)
+	{
+		PostQueuedCompletionStatus(pTP->hIoPort, 0, 0, NULL);
+		if (WaitForSingleObject(pTP->hIoThread, INFINITE) == WAIT_FAILED)
+		{
+			LOG_ERROR("Unable to join I/O Completion Thread:%d\n", GetLastError());
+		}
+		CloseHandle(pTP->hIoThread);
+		CloseHandle(pTP->hIoPort);
+		pTP->hIoThread = NULL;
+		pTP->hIoPort = NULL;
+	}
+	if (pTP->hBlockingIoPort)
+	{
+		for (int i = 0; i < pTP->iBlockingIoThreads; i++)
+		{
+			PostQueuedCompletionStatus(pTP->hBlockingIoPort, 0, 0, NULL);
+		}
+		if (pTP->iBlockingIoThreads && (WaitForMultipleObjects(pTP->iBlockingIoThreads, pTP->hBlockingIoThreads, TRUE, INFINITE) == WAIT_FAILED))
+		{
+			LOG_ERROR("Unable to join blocking I/O Threads:%d\n", GetLastError());
+		}
+		for (int i = 0; i < pTP->iBlockingIoThreads; i++)
+		{
+			CloseHandle(pTP->hBlockingIoThreads[i]);
+		}
+		pTP->iBlockingIoThreads = 0;
+		CloseHandle(pTP->hBlockingIoPort);
+		pTP->hBlockingIoPort = NULL;
+	}
+	LOG_INFO("Stopped I/O threads\n");
+}
+
+/*
+This API runs a callback on the Thread Pool when a waitable object (event, semaphore, process, waitable timer..) is signalled or the wait times out
+Accepts pointer to Thread Pool, the object handle, the timeout in milliseconds (INFINITE for none), the callback function, a client context and WAITWORK_ONESHOT or WAITWORK_REPEAT as arguements
+Waits are multiplexed onto Waiter Threads, WAITER_MAXWAITS waits per thread, so no Worker Thread is parked while waiting
+A repeating wait is re-armed (and its timeout restarted) once its callback returns, a one-shot wait stays registered until UnregisterWaitForSignal is called
+The handle must stay open until the wait is unregistered
+Returns pointer to the registration upon success, else returns NULL
+*/
+PWAITWORK RegisterWaitForSignal(PTP pTP, HANDLE hObject, DWORD dwTimeout, WAITWORK_CALLBACK pCallback, PVOID pvCtx, DWORD dwFlags)
+{
+	//Parameter Validation
+	if (!(pTP && hObject && pCallback) || (hObject == INVALID_HANDLE_VALUE) || (dwFlags > WAITWORK_REPEAT))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Register Wait:%d", GetLastError());
+		return NULL;
+	}
+	if (pTP->iShutdownMode)
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("Thread Pool is being deleted:%d", GetLastError());
+		return NULL;
+	}
+	HANDLE hDefaultHeap = GetProcessHeap();
+	PWAITWORK pWait = (PWAITWORK)HeapAlloc(hDefaultHeap, HEAP_ZERO_MEMORY, sizeof(WAITWORK));
+	if (pWait == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to allocate Wait Work:%d", GetLastError());
+		return NULL;
+	}
+	pWait->pTP = pTP;
+	pWait->hObject = hObject;
+	pWait->dwTimeout = dwTimeout;
+	pWait->dwFlags = dwFlags;
+	pWait->pCallback = pCallback;
+	pWait->pvCtx = pvCtx;
+	pWait->ullDeadline = (dwTimeout == INFINITE) ? 0 : (GetTickCount64() + dwTimeout);
+	pWait->bArmed = TRUE;
+	pWait->bRegistered = TRUE;
+
+	//Pick a Waiter Thread with a free slot, or create one
+	AcquireSRWLockExclusive(&(pTP->WaitersLock));
+	PWAITER pWaiter = NULL;
+	for (int i = 0; i < pTP->iNumWaiters; i++)
+	{
+		if (!pTP->pWaiters[i]->bDead && (pTP->pWaiters[i]->iNumWaits < WAITER_MAXWAITS)) //A Waiter Thread whose wait failed has exited, its waits never fire
+		{
+			pWaiter = pTP->pWaiters[i];
+			break;
+		}
+	}
+	if ((pWaiter == NULL) && (pTP->iNumWaiters < WAITER_MAXTHREADS))
+	{
+		pWaiter = (PWAITER)HeapAlloc(hDefaultHeap, HEAP_ZERO_MEMORY, sizeof(WAITER));
+		if (pWaiter)
+		{
+			pWaiter->pTP = pTP;
+			InitializeSRWLock(&(pWaiter->Lock));
+			pWaiter->hChangedEvent = CreateEvent(NULL, FALSE, FALSE, NULL); //Auto Reset Event, initial state is not signalled
+			pWaiter->hRebuiltEvent = CreateEvent(NULL, TRUE, FALSE, NULL); //Manual Reset Event, initial state is not signalled
+			pWaiter->hThread = (pWaiter->hChangedEvent && pWaiter->hRebuiltEvent) ? CreateThread(NULL, 0, WaiterThreadProc, (LPVOID)pWaiter, 0, 0) : NULL;
+			if (pWaiter->hThread == NULL)
+			{
+				LOG_ERROR("Unable to Create Waiter Thread:%d", GetLastError());
+				if (pWaiter->hChangedEvent)
+					CloseHandle(pWaiter->hChangedEvent);
+				if (pWaiter->hRebuiltEvent)
+					CloseHandle(pWaiter->hRebuiltEvent);
+				HeapFree(hDefaultHeap, 0, pWaiter);
+				pWaiter = NULL;
+			}
+			else
+			{
+				pTP->pWaiters[pTP->iNumWaiters] = pWaiter;
+				InterlockedIncrement(&(pTP->iNumWaiters));
+			}
+		}
+	}
+	if (pWaiter == NULL)
+	{
+		ReleaseSRWLockExclusive(&(pTP->WaitersLock));
+		SetLastError(ERROR_NOT_ENOUGH_QUOTA);
+		LOG_ERROR("Unable to find a Waiter Thread for the wait:%d", GetLastError());
+		HeapFree(hDefaultHeap, 0, pWait);
+		return NULL;
+	}
+	pWait->pWaiter = pWaiter;
+	AcquireSRWLockExclusive(&(pWaiter->Lock));
+	pWaiter->pWaits[pWaiter->iNumWaits] = pWait;
+	InterlockedIncrement(&(pWaiter->iNumWaits));
+	InterlockedIncrement(&(pWaiter->iGeneration));
+	ReleaseSRWLockExclusive(&(pWaiter->Lock));
+	ReleaseSRWLockExclusive(&(pTP->WaitersLock));
+	SetEvent(pWaiter->hChangedEvent);
+	LOG_INFO("Registered Wait\n");
+	return pWait;
+}
+
+/*
+This API cancels a wait registered with RegisterWaitForSignal and frees the registration
+Accepts pointer to the registration as arguement
+Waits until the Waiter Thread no longer waits on the object and a queued or running callback has returned, unless called from that callback
+The calling thread blocks on the hRebuiltEvent of the Waiter Thread and on an event of the registration set when its callback returns
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL UnregisterWaitForSignal(PWAITWORK pWait)
+{
+	//Parameter Validation
+	if (pWait == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Unregister Wait:%d", GetLastError());
+		return FALSE;
+	}
+	PWAITER pWaiter = pWait->pWaiter;
+	AcquireSRWLockExclusive(&(pWaiter->Lock));
+	if (!pWait->bRegistered)
+	{
+		ReleaseSRWLockExclusive(&(pWaiter->Lock));
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("Wait is not registered:%d", GetLastError());
+		return FALSE;
+	}
+	for (int i = 0; i < pWaiter->iNumWaits; i++)
+	{
+		if (pWaiter->pWaits[i] == pWait) //Move the last wait into the freed slot
+		{
+			pWaiter->pWaits[i] = pWaiter->pWaits[pWaiter->iNumWaits - 1];
+			InterlockedDecrement(&(pWaiter->iNumWaits));
+			break;
+		}
+	}
+	pWait->bRegistered = FALSE;
+	LONG iGeneration = InterlockedIncrement(&(pWaiter->iGeneration));
+	if (!pWaiter->bDead) //The Waiter Thread sets hRebuiltEvent under Lock, so only a rebuild which sees iGeneration sets it from here on
+		ResetEvent(pWaiter->hRebuiltEvent);
+	BOOL bFromCallback = (pWait->iCallbackPending && (pWait->dwCallbackThreadId == GetCurrentThreadId()));
+	ReleaseSRWLockExclusive(&(pWaiter->Lock));
+	SetEvent(pWaiter->hChangedEvent);
+
+	//Wait for the Waiter Thread to drop the object from its wait set, a Waiter Thread which already fired the wait has set iCallbackPending
+	while ((pWaiter->iWaiterGeneration - iGeneration) < 0)
+	{
+		if (WaitForSingleObject(pWaiter->hRebuiltEvent, INFINITE) == WAIT_FAILED)
+		{
+			LOG_ERROR("Unable to wait for the Waiter Thread:%d", GetLastError());
+			return FALSE;
+		}
+	}
+	if (bFromCallback) //WaitCallbackProc frees the registration once the callback returns
+	{
+		pWait->bFreeAfterCallback = TRUE;
+		return TRUE;
+	}
+	//WaitCallbackProc sets the event under Lock when it clears iCallbackPending
+	AcquireSRWLockExclusive(&(pWaiter->Lock));
+	HANDLE hCallbackDoneEvent = NULL;
+	if (pWait->iCallbackPending)
+	{
+		hCallbackDoneEvent = CreateEvent(NULL, TRUE, FALSE, NULL); //Manual Reset Event, initial state is not signalled
+		pWait->hCallbackDoneEvent = hCallbackDoneEvent;
+	}
+	ReleaseSRWLockExclusive(&(pWaiter->Lock));
+	if (hCallbackDoneEvent)
+	{
+		DWORD dwWait = WaitForSingleObject(hCallbackDoneEvent, INFINITE);
+		CloseHandle(hCallbackDoneEvent);
+		if (dwWait == WAIT_FAILED)
+		{
+			LOG_ERROR("Unable to wait for the Wait callback:%d", GetLastError());
+			return FALSE;
+		}
+	}
+	else
+	{
+		while (pWait->iCallbackPending) //Out of event handles, fall back to polling the callback
+		{
+			Sleep(HELPWAITINTERVAL);
+		}
+	}
+	if (HeapFree(GetProcessHeap(), 0, pWait) == 0)
+	{
+		LOG_ERROR("Unable to free Wait Work:%d", GetLastError());
+		return FALSE;
+	}
+	LOG_INFO("Unregistered Wait\n");
+	return TRUE;
+}
+
+/*
+This API is the Waiter Thread Function. Accepts pointer to the Waiter as arguement and returns 0 or 1 upon termination
+Waits on the armed waits of the Waiter and its change event, with a timeout of the earliest wait deadline
+The wait set is rotated on every rebuild so that a steadily signalled object cannot starve the objects after it
+*/
+DWORD WINAPI WaiterThreadProc(LPVOID pWaiter)
+{
+	HANDLE hObjects[MAXIMUM_WAIT_OBJECTS] = { ((PWAITER)pWaiter)->hChangedEvent };
+	PWAITWORK pArmed[WAITER_MAXWAITS];
+	DWORD dwRotate = 0;
+	while (!((PWAITER)pWaiter)->bStop)
+	{
+		//Build the wait set from the armed waits
+		DWORD dwArmed = 0;
+		ULONGLONG ullNow = GetTickCount64(), ullNext = 0;
+		AcquireSRWLockShared(&(((PWAITER)pWaiter)->Lock));
+		int iNumWaits = ((PWAITER)pWaiter)->iNumWaits;
+		for (int i = 0; i < iNumWaits; i++)
+		{
+			PWAITWORK pWait = ((PWAITER)pWaiter)->pWaits[(i + dwRotate) % iNumWaits];
+			if (pWait->bArmed)
+			{
+				pArmed[dwArmed] = pWait;
+				hObjects[1 + dwArmed] = pWait->hObject;
+				dwArmed++;
+				if (pWait->ullDeadline && (!ullNext || (pWait->ullDeadline < ullNext)))
+					ullNext = pWait->ullDeadline;
+			}
+		}
+		InterlockedExchange(&(((PWAITER)pWaiter)->iWaiterGeneration), ((PWAITER)pWaiter)->iGeneration);
+		SetEvent(((PWAITER)pWaiter)->hRebuiltEvent); //Under the lock, so it is never set after UnregisterWaitForSignal reset it for a later generation
+		ReleaseSRWLockShared(&(((PWAITER)pWaiter)->Lock));
+		dwRotate++;
+
+		DWORD dwTimeout = ullNext ? ((ullNext > ullNow) ? (DWORD)min(ullNext - ullNow, (ULONGLONG)(INFINITE - 1)) : 0) : INFINITE;
+		DWORD dw = WaitForMultipleObjects(1 + dwArmed, hObjects, FALSE, dwTimeout);
+		if (dw == WAIT_FAILED) //A handle was closed while it was registered
+		{
+			LOG_ERROR("Waiter Thread Wait failed:%d", GetLastError());
+			MarkWaiterDead((PWAITER)pWaiter); //Waits are no longer assigned to this thread, UnregisterWaitForSignal no longer waits for it
+			return 1;
+		}
+		if ((dw > WAIT_OBJECT_0) && (dw <= WAIT_OBJECT_0 + dwArmed))
+		{
+			FireWait((PWAITER)pWaiter, pArmed[dw - WAIT_OBJECT_0 - 1], FALSE);
+		}
+		else if ((dw > WAIT_ABANDONED_0) && (dw <= WAIT_ABANDONED_0 + dwArmed)) //Abandoned mutex, the wait is satisfied
+		{
+			FireWait((PWAITER)pWaiter, pArmed[dw - WAIT_ABANDONED_0 - 1], FALSE);
+		}
+		//Timeouts are checked on every wake up, the waits in pArmed stay allocated until the next rebuild
+		ullNow = GetTickCount64();
+		for (DWORD i = 0; i < dwArmed; i++)
+		{
+			if (pArmed[i]->ullDeadline && (pArmed[i]->ullDeadline <= ullNow))
+				FireWait((PWAITER)pWaiter, pArmed[i], TRUE);
+		}
+	}
+	LOG_INFO("Waiter Thread terminating due to thread pool deletion\n");
+	MarkWaiterDead((PWAITER)pWaiter);
+	return 0;
+}
+
+/*
+This routine records that a Waiter Thread exited, called by the Waiter Thread on its way out
+Accepts pointer to the Waiter as arguement
+RegisterWaitForSignal skips the Waiter from here on, UnregisterWaitForSignal is released and no longer waits for a rebuild
+*/
+VOID MarkWaiterDead(PWAITER pWaiter)
+{
+	AcquireSRWLockExclusive(&(pWaiter->Lock));
+	pWaiter->bDead = TRUE;
+	InterlockedExchange(&(pWaiter->iWaiterGeneration), MAXLONG);
+	SetEvent(pWaiter->hRebuiltEvent);
+	ReleaseSRWLockExclusive(&(pWaiter->Lock));
+}
+
+/*
+This routine queues the callback of a wait which was signalled or timed out as a normal pri Work Item
+Accepts pointer to the Waiter, pointer to the wait and whether it timed out as arguements
+The wait is disarmed until its callback returns, a wait unregistered after the wait set was built is skipped
+*/
+VOID FireWait(PWAITER pWaiter, PWAITWORK pWait, BOOL bTimedOut)
+{
+	AcquireSRWLockExclusive(&(pWaiter->Lock));
+	if (!(pWait->bRegistered && pWait->bArmed))
+	{
+		ReleaseSRWLockExclusive(&(pWaiter->Lock));
+		return;
+	}
+	pWait->bArmed = FALSE;
+	InterlockedExchange(&(pWait->iCallbackPending), 1);
+	ReleaseSRWLockExclusive(&(pWaiter->Lock));
+
+	PWAITFIRE pFire = (PWAITFIRE)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(WAITFIRE));
+	if (pFire == NULL)
+	{
+		LOG_ERROR("Unable to allocate Wait callback:%d", ERROR_NOT_ENOUGH_MEMORY);
+		AcquireSRWLockExclusive(&(pWaiter->Lock));
+		InterlockedExchange(&(pWait->iCallbackPending), 0);
+		if (pWait->hCallbackDoneEvent)
+			SetEvent(pWait->hCallbackDoneEvent);
+		ReleaseSRWLockExclusive(&(pWaiter->Lock));
+		return;
+	}
+	pFire->pWait = pWait;
+	pFire->bTimedOut = bTimedOut;
+	InitWorkItem(&(pFire->Work), pWait->pTP, WaitCallbackProc, pFire, WORKITEM_NORMAL);
+	pFire->Work.dwFlags |= WORKITEM_FREEONCOMPLETE | WORKITEM_RUNONCANCEL; //iCallbackPending is cleared by the callback, it runs even when DeleteTPEx cancels
+	if (!InsertWork(pWait->pTP, &(pFire->Work)))
+	{
+		ExecuteWorkItem(pWait->pTP, &(pFire->Work)); //Thread Pool is being deleted, run the callback here
+	}
+}
+
+/*
+This routine is the Work Item callback of a wait which fired, it runs the client callback and re-arms a repeating wait
+Accepts pointer to the wait callback request as arguement, the request is freed by ExecuteWorkItem (WORKITEM_FREEONCOMPLETE)
+*/
+PVOID WaitCallbackProc(PVOID pvParam)
+{
+	PWAITFIRE pFire = (PWAITFIRE)pvParam;
+	PWAITWORK pWait = pFire->pWait;
+	PWAITER pWaiter = pWait->pWaiter;
+	pWait->dwCallbackThreadId = GetCurrentThreadId();
+	pWait->pCallback(pWait, pWait->pvCtx, pFire->bTimedOut);
+	if (pWait->bFreeAfterCallback) //Callback unregistered its own wait
+	{
+		HeapFree(GetProcessHeap(), 0, pWait);
+		return NULL;
+	}
+	AcquireSRWLockExclusive(&(pWaiter->Lock));
+	if (pWait->bRegistered && (pWait->dwFlags & WAITWORK_REPEAT))
+	{
+		pWait->ullDeadline = (pWait->dwTimeout == INFINITE) ? 0 : (GetTickCount64() + pWait->dwTimeout);
+		pWait->bArmed = TRUE;
+		InterlockedIncrement(&(pWaiter->iGeneration));
+	}
+	InterlockedExchange(&(pWait->iCallbackPending), 0); //pWait can be freed by UnregisterWaitForSignal once the lock is released
+	if (pWait->hCallbackDoneEvent)
+		SetEvent(pWait->hCallbackDoneEvent);
+	ReleaseSRWLockExclusive(&(pWaiter->Lock));
+	SetEvent(pWaiter->hChangedEvent);
+	return NULL;
+}
+
+/*
+This routine stops and joins the Waiter Threads, called by DeleteTPEx before the queues are drained
+Accepts pointer to Thread Pool as arguement
+*/
+VOID StopWaiters(PTP pTP)
+{
+	AcquireSRWLockShared(&(pTP->WaitersLock));
+	for (int i = 0; i < pTP->iNumWaiters; i++)
+	{
+		InterlockedExchange(&(pTP->pWaiters[i]->bStop), TRUE);
+		SetEvent(pTP->pWaiters[i]->hChangedEvent);
+	}
+	for (int i = 0; i < pTP->iNumWaiters; i++)
+	{
+		if (WaitForSingleObject(pTP->pWaiters[i]->hThread, INFINITE) == WAIT_FAILED)
+		{
+			LOG_ERROR("Unable to join Waiter Thread:%d\n", GetLastError());
+		}
+	}
+	ReleaseSRWLockShared(&(pTP->WaitersLock));
+}
+
+/*
+This routine frees the Waiter Threads and the waits still registered, called by DeleteTPEx once no callback can run
+Accepts pointer to Thread Pool as arguement
+*/
+VOID FreeWaiters(PTP pTP)
+{
+	HANDLE hDefaultHeap = GetProcessHeap();
+	for (int i = 0; i < pTP->iNumWaiters; i++)
+	{
+		PWAITER pWaiter = pTP->pWaiters[i];
+		for (int j = 0; j < pWaiter->iNumWaits; j++)
+		{
+			HeapFree(hDefaultHeap, 0, pWaiter->pWaits[j]);
+		}
+		CloseHandle(pWaiter->hThread);
+		CloseHandle(pWaiter->hChangedEvent);
+		CloseHandle(pWaiter->hRebuiltEvent);
+		HeapFree(hDefaultHeap, 0, pWaiter);
+	}
+	pTP->iNumWaiters = 0;
+}
+
+/*
+This API creates a strand, Work Items inserted on the same strand run one at a time in the order they were inserted
+Accepts pointer to Thread Pool as arguement
+Work Items of different strands run in parallel, no lock is held while a callback runs so a callback may insert more work on its own strand
+Returns pointer to strand upon success, else returns NULL
+*/
+PSTRAND CreateStrand(PTP pTP)
+{
+	//Parameter validation
+	if (pTP == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Create Strand:%d", GetLastError());
+		return NULL;
+	}
+	MYPROC InitializeQueue = pTP->pInitializeQueue;
+	PSTRAND pStrand = (PSTRAND)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(STRAND));
+	if (pStrand == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to create Strand structure:%d", GetLastError());
+		return NULL;
+	}
+	pStrand->pQueue = InitializeQueue();
+	if (pStrand->pQueue == NULL)
+	{
+		LOG_ERROR("Unable to initialize Strand queue\n");
+		HeapFree(GetProcessHeap(), 0, pStrand);
+		return NULL;
+	}
+	InitializeSRWLock(&(pStrand->Lock));
+	pStrand->pTP = pTP;
+	pStrand->iRefs = 1; //Reference held by the client, dropped by DeleteStrand
+	InterlockedIncrement(&(pTP->lLiveObjects));
+	return pStrand;
+}
+
+/*
+This API inserts a Work Item on a strand
+Accepts pointer to strand and pointer to Work Item (created with CreateWorkItem or InitWorkItem on the Thread Pool of the strand) as arguements
+The Work Item runs after every Work Item inserted on the strand before it has completed, and never concurrently with them
+A Worker Thread runs up to STRAND_BATCHSIZE Work Items of a strand back to back before the strand is queued again behind the other work
+The strand is queued at the priority of the Work Item which finds it idle, WORKITEM_LONGRUNNING Work Items cannot be inserted on a strand
+Returns TRUE upon succesful insertion, else returns FALSE
+*/
+BOOL InsertWorkOnStrand(PSTRAND pStrand, PWORKITEM pWk)
+{
+	//Parameter validation
+	if (!(pStrand && pWk) || (pWk->iPri >= WORKITEM_NUMPRIORITIES) || (pWk->dwFlags & WORKITEM_DEDICATED))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant insert work on Strand:%d", GetLastError());
+		return FALSE;
+	}
+	PTP pTP = pStrand->pTP;
+	//Thread Pool is being deleted, no new work is accepted
+	if (pTP->iShutdownMode)
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("Cant insert work on Strand, Thread Pool is being deleted:%d", GetLastError());
+		return FALSE;
+	}
+	MYPROC1 Enqueue = pTP->pEnqueue;
+	MYPROC1 RemoveWorkItem = pTP->pRemoveEntry;
+	LARGE_INTEGER liNow;
+	QueryPerformanceCounter(&liNow);
+	pWk->llQueuedTime = liNow.QuadPart; //Queue wait on a Strand includes the wait behind earlier Work Items of the Strand
+	MarkTaggedWorkPending(pWk);
+	AcquireSRWLockExclusive(&(pStrand->Lock));
+	if (!Enqueue(pStrand->pQueue, &(pWk->list_entry)))
+	{
+		ReleaseSRWLockExclusive(&(pStrand->Lock));
+		ClearTaggedWorkPending(pWk);
+		ReleaseTaggedWork(pWk);
+		LOG_ERROR("Unable to Insert Work to Strand queue\n");
+		return FALSE;
+	}
+	InterlockedIncrement(&(pStrand->iPending));
+	//Strand is idle, queue a drain Work Item for it, under the lock so that the Work Items which follow cannot be left without one
+	if (!pStrand->bScheduled)
+	{
+		if (!ScheduleStrandDrain(pStrand, pWk->iPri))
+		{
+			RemoveWorkItem(pStrand->pQueue, &(pWk->list_entry));
+			InterlockedDecrement(&(pStrand->iPending));
+			ClearTaggedWorkPending(pWk);
+			ReleaseSRWLockExclusive(&(pStrand->Lock));
+			ReleaseTaggedWork(pWk);
+			LOG_ERROR("Unable to schedule Strand\n");
+			return FALSE;
+		}
+		pStrand->bScheduled = TRUE;
+	}
+	ReleaseSRWLockExclusive(&(pStrand->Lock));
+	InterlockedIncrement(&(pTP->iNumWorkItemsAdded[pWk->iPri]));
+	return TRUE;
+}
+
+/*
+This API deletes a strand
+Accepts pointer to strand as arguement
+Work Items still queued on the strand are run (or dropped by DeleteTPEx) as usual, the strand is freed once the last of them completes
+No Work Item may be inserted on the strand once this API is called, it must be called before the Thread Pool is deleted
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL DeleteStrand(PSTRAND pStrand)
+{
+	//Parameter validation
+	if (pStrand == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant delete Strand:%d", GetLastError());
+		return FALSE;
+	}
+	InterlockedDecrement(&(pStrand->pTP->lLiveObjects)); //Work Items still queued on the strand are drained or dropped by DeleteTPEx
+	ReleaseStrand(pStrand);
+	return TRUE;
+}
+
+/*
+This routine queues a drain Work Item which runs the next batch of Work Items of a strand
+Accepts pointer to strand and the priority to queue the drain Work Item at as arguements
+Called with the strand lock held, the drain Work Item holds a reference to the strand until it has run
+Returns TRUE if the drain Work Item is queued, else returns FALSE
+*/
+BOOL ScheduleStrandDrain(PSTRAND pStrand, DWORD iPri)
+{
+	PSTRANDDRAIN pDrain = (PSTRANDDRAIN)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(STRANDDRAIN));
+	if (pDrain == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to allocate Strand drain:%d", GetLastError());
+		return FALSE;
+	}
+	pDrain->pStrand = pStrand;
+	InitWorkItem(&(pDrain->Work), pStrand->pTP, StrandDrainProc, pDrain, iPri);
+	pDrain->Work.dwFlags |= WORKITEM_FREEONCOMPLETE | WORKITEM_RUNONCANCEL; //Queued Work Items of the strand are dropped by the drain itself when DeleteTPEx cancels
+	InterlockedIncrement(&(pStrand->iRefs));
+	if (!InsertWork(pStrand->pTP, &(pDrain->Work)))
+	{
+		InterlockedDecrement(&(pStrand->iRefs));
+		HeapFree(GetProcessHeap(), 0, pDrain);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+This routine is the Work Item callback of a strand, it runs the Work Items of the strand in FIFO order
+Accepts pointer to the strand drain request as arguement, the request is freed by ExecuteWorkItem (WORKITEM_FREEONCOMPLETE)
+After STRAND_BATCHSIZE Work Items the strand is queued again so that the other strands and Work Items get a Worker Thread, the strand lock is only held to dequeue
+Returns NULL
+*/
+PVOID StrandDrainProc(PVOID pvParam)
+{
+	PSTRANDDRAIN pDrain = (PSTRANDDRAIN)pvParam;
+	PSTRAND pStrand = pDrain->pStrand;
+	PTP pTP = pStrand->pTP;
+	DWORD iPri = pDrain->Work.iPri;
+	BOOL bCancel = (pTP->iShutdownMode == TPDELETE_CANCEL) || (pTP->iShutdownMode == TPDELETE_ABORT);
+	MYPROC2 Dequeue = pTP->pDequeue;
+	int iRun = 0;
+	while (TRUE)
+	{
+		AcquireSRWLockExclusive(&(pStrand->Lock));
+		if (pStrand->iPending == 0) //Strand is empty, the next InsertWorkOnStrand queues a new drain
+		{
+			pStrand->bScheduled = FALSE;
+			ReleaseSRWLockExclusive(&(pStrand->Lock));
+			break;
+		}
+		//Batch is done, yield to the other queued work unless the Thread Pool is being deleted (the drain then runs the strand to the end)
+		if ((iRun >= STRAND_BATCHSIZE) && !pTP->iShutdownMode && ScheduleStrandDrain(pStrand, iPri))
+		{
+			ReleaseSRWLockExclusive(&(pStrand->Lock));
+			break;
+		}
+		PLINK pTemp = Dequeue(pStrand->pQueue);
+		InterlockedDecrement(&(pStrand->iPending));
+		ReleaseSRWLockExclusive(&(pStrand->Lock));
+		if (pTemp == NULL)
+		{
+			LOG_ERROR("Strand queue is empty with %d pending\n", pStrand->iPending);
+			continue;
+		}
+		PWORKITEM pWork = ADDR_BASE(pTemp, WORKITEM, list_entry);
+		if (bCancel)
+		{
+			CancelWorkItem(pTP, pWork);
+		}
+		else
+		{
+			PWORKITEM pOuterStrandWork = g_pStrandWork; //A strand Work Item helping while it waits may run the drain of another strand
+			g_pStrandWork = pWork;
+			ExecuteWorkItem(pTP, pWork);
+			g_pStrandWork = pOuterStrandWork;
+		}
+		iRun++;
+	}
+	ReleaseStrand(pStrand);
+	return NULL;
+}
+
+/*
+This routine drops a reference to a strand, the strand is freed together with its queue when the last reference is dropped
+Accepts pointer to strand as arguement
+*/
+VOID ReleaseStrand(PSTRAND pStrand)
+{
+	if (InterlockedDecrement(&(pStrand->iRefs)) != 0)
+		return;
+	if (!pStrand->pTP->pDeleteQueue(pStrand->pQueue))
+	{
+		LOG_ERROR("Unable to delete Strand queue\n");
+	}
+	HeapFree(GetProcessHeap(), 0, pStrand);
+}
+
+/*
+This API creates a pipeline, stages added with AddPipelineStage run on the items produced by the first stage in the order they were added
+Accepts 3 arguements:
+a.Pointer to Thread Pool
+b.Max number of tokens (items) in flight, at most PIPELINE_MAXTOKENS, the first stage is not called again until a token leaves the pipeline
+c.Client context passed to every stage callback
+A Worker Thread carries a token through consecutive stages itself, a token only changes thread when it waits for a serial stage
+Returns pointer to pipeline upon success, else returns NULL
+*/
+PTPPIPELINE CreatePipeline(PTP pTP, DWORD dwMaxTokens, PVOID pvCtx)
+{
+	//Parameter validation
+	if ((pTP == NULL) || (dwMaxTokens == 0) || (dwMaxTokens > PIPELINE_MAXTOKENS))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Create Pipeline:%d", GetLastError());
+		return NULL;
+	}
+	PTPPIPELINE pPipeline = (PTPPIPELINE)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(TPPIPELINE));
+	if (pPipeline == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to create Pipeline structure:%d", GetLastError());
+		return NULL;
+	}
+	pPipeline->pTokens = (PPIPETOKEN)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, dwMaxTokens * sizeof(PIPETOKEN));
+	if (pPipeline->pTokens == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to create Pipeline tokens:%d", GetLastError());
+		HeapFree(GetProcessHeap(), 0, pPipeline);
+		return NULL;
+	}
+	pPipeline->hDoneEvent = CreateEventW(NULL, TRUE, FALSE, NULL); //Manual Reset, RunPipeline waits for it after HelpWhileWaiting
+	if (pPipeline->hDoneEvent == NULL)
+	{
+		LOG_ERROR("Unable to create Pipeline event:%d", GetLastError());
+		HeapFree(GetProcessHeap(), 0, pPipeline->pTokens);
+		HeapFree(GetProcessHeap(), 0, pPipeline);
+		return NULL;
+	}
+	for (DWORD i = 0; i < TPPIPELINE_MAXSTAGES; i++)
+	{
+		InitializeSRWLock(&(pPipeline->Stages[i].Lock));
+	}
+	InitializeSRWLock(&(pPipeline->TokenLock));
+	pPipeline->pTP = pTP;
+	pPipeline->pvCtx = pvCtx;
+	pPipeline->dwMaxTokens = dwMaxTokens;
+	InterlockedIncrement(&(pTP->lLiveObjects));
+	return pPipeline;
+}
+
+/*
+This API adds a stage at the end of a pipeline
+Accepts 3 arguements:
+a.Pointer to pipeline
+b.Kind of the stage, TPSTAGE_PARALLEL, TPSTAGE_SERIAL_INORDER or TPSTAGE_SERIAL_OUTOFORDER (the first stage must be serial, it is called with NULL and produces the items)
+c.Callback of the stage, it returns the item passed to the next stage, returning NULL drops the item from the remaining stages (its token still takes its turn in the serial in order stages)
+At most TPPIPELINE_MAXSTAGES stages can be added, and not while the pipeline runs
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL AddPipelineStage(PTPPIPELINE pPipeline, DWORD dwKind, TPSTAGE_CALLBACK pCallback)
+{
+	//Parameter validation
+	if (!(pPipeline && pCallback) || (dwKind > TPSTAGE_SERIAL_OUTOFORDER) || (pPipeline->dwStages >= TPPIPELINE_MAXSTAGES) || ((pPipeline->dwStages == 0) && (dwKind == TPSTAGE_PARALLEL)))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to add Pipeline stage:%d", GetLastError());
+		return FALSE;
+	}
+	if (pPipeline->bRunning)
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("Unable to add Pipeline stage, Pipeline is running:%d", GetLastError());
+		return FALSE;
+	}
+	PPIPESTAGE pStage = &(pPipeline->Stages[pPipeline->dwStages]);
+	pStage->pCallback = pCallback;
+	pStage->dwKind = dwKind;
+	pPipeline->dwStages++;
+	return TRUE;
+}
+
+/*
+This API runs a pipeline until the first stage returns NULL and every item it produced has left the last stage
+Accepts pointer to pipeline as arguement
+The calling thread runs stages too and helps with the other queued work while it waits, as WaitTaskGroup does
+When DeleteTPEx cancels, the stage callbacks are no longer called and the tokens in flight are dropped
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL RunPipeline(PTPPIPELINE pPipeline)
+{
+	//Parameter validation
+	if ((pPipeline == NULL) || (pPipeline->dwStages == 0))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to run Pipeline:%d", GetLastError());
+		return FALSE;
+	}
+	if (InterlockedCompareExchange(&(pPipeline->bRunning), 1, 0) != 0)
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("Unable to run Pipeline, Pipeline is already running:%d", GetLastError());
+		return FALSE;
+	}
+	for (DWORD i = 0; i < pPipeline->dwStages; i++)
+	{
+		pPipeline->Stages[i].bBusy = FALSE;
+		pPipeline->Stages[i].ullNextSequence = 0;
+		pPipeline->Stages[i].pWaiting = NULL;
+		pPipeline->Stages[i].pWaitingTail = NULL;
+	}
+	pPipeline->pFreeTokens = NULL;
+	for (DWORD i = 0; i < pPipeline->dwMaxTokens; i++)
+	{
+		pPipeline->pTokens[i].pNext = pPipeline->pFreeTokens;
+		pPipeline->pFreeTokens = &(pPipeline->pTokens[i]);
+	}
+	pPipeline->ullInputSequence = 0;
+	pPipeline->bInputDone = FALSE;
+	pPipeline->iTokens = 0;
+	pPipeline->iOutstanding = 1; //Held by the input until the first stage returns NULL
+	ResetEvent(pPipeline->hDoneEvent);
+	PumpPipelineInput(pPipeline);
+	BOOL bResult = HelpWhileWaiting(pPipeline->pTP, &(pPipeline->iOutstanding), pPipeline->hDoneEvent);
+	//The thread which dropped the count to zero still touches the pipeline until it has set the event
+	if (bResult && (WaitForSingleObject(pPipeline->hDoneEvent, INFINITE) != WAIT_OBJECT_0))
+	{
+		LOG_ERROR("Pipeline Wait failed:%d", GetLastError());
+		bResult = FALSE;
+	}
+	InterlockedExchange(&(pPipeline->bRunning), 0);
+	return bResult;
+}
+
+/*
+This API deletes a pipeline
+Accepts pointer to pipeline as arguement
+The pipeline must not be running, it must be deleted before the Thread Pool is deleted
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL DeletePipeline(PTPPIPELINE pPipeline)
+{
+	//Parameter validation
+	if (pPipeline == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant delete Pipeline:%d", GetLastError());
+		return FALSE;
+	}
+	if (pPipeline->bRunning)
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("Cant delete Pipeline, Pipeline is running:%d", GetLastError());
+		return FALSE;
+	}
+	InterlockedDecrement(&(pPipeline->pTP->lLiveObjects));
+	CloseHandle(pPipeline->hDoneEvent);
+	HeapFree(GetProcessHeap(), 0, pPipeline->pTokens);
+	HeapFree(GetProcessHeap(), 0, pPipeline);
+	return TRUE;
+}
+
+/*
+This routine runs the first stage of a pipeline on the calling thread while tokens are free, and carries each token it produces through the other stages
+Accepts pointer to pipeline as arguement
+The first stage runs on one thread at a time (lInputBusy), after producing an item the thread hands the first stage to another Worker Thread if a token is free
+A thread finding the first stage busy or every token in flight returns, the thread releasing the first stage or a token checks the input again
+*/
+VOID PumpPipelineInput(PTPPIPELINE pPipeline)
+{
+	PTP pTP = pPipeline->pTP;
+	while (!pPipeline->bInputDone && (pPipeline->iTokens < (int)pPipeline->dwMaxTokens))
+	{
+		if (InterlockedCompareExchange(&(pPipeline->lInputBusy), 1, 0) != 0)
+			return;
+		//Checked again, the input may have ended or the tokens been taken before lInputBusy was acquired (only its owner takes tokens)
+		if (pPipeline->bInputDone || (pPipeline->iTokens >= (int)pPipeline->dwMaxTokens))
+		{
+			InterlockedExchange(&(pPipeline->lInputBusy), 0);
+			continue;
+		}
+		InterlockedIncrement(&(pPipeline->iTokens));
+		InterlockedIncrement(&(pPipeline->iOutstanding));
+		AcquireSRWLockExclusive(&(pPipeline->TokenLock));
+		PPIPETOKEN pToken = pPipeline->pFreeTokens;
+		pPipeline->pFreeTokens = pToken->pNext;
+		ReleaseSRWLockExclusive(&(pPipeline->TokenLock));
+		BOOL bCancel = (pTP->iShutdownMode == TPDELETE_CANCEL) || (pTP->iShutdownMode == TPDELETE_ABORT);
+		PVOID pvItem = bCancel ? NULL : pPipeline->Stages[0].pCallback(pPipeline->pvCtx, NULL);
+		if (pvItem == NULL) //End of the input
+		{
+			InterlockedExchange(&(pPipeline->bInputDone), TRUE);
+			InterlockedExchange(&(pPipeline->lInputBusy), 0);
+			ReleasePipelineToken(pPipeline, pToken);
+			ReleasePipelineOutstanding(pPipeline); //Held by the input
+			return;
+		}
+		pToken->pvItem = pvItem;
+		pToken->ullSequence = pPipeline->ullInputSequence++;
+		pToken->iStage = 1;
+		pToken->bAdmitted = FALSE;
+		pToken->pNext = NULL;
+		InterlockedExchange(&(pPipeline->lInputBusy), 0);
+		//Another Worker Thread produces the next item while this one carries the token, a failure only leaves the input to this thread
+		if (pPipeline->iTokens < (int)pPipeline->dwMaxTokens)
+		{
+			SpawnPipelineTask(pPipeline, NULL);
+		}
+		CarryPipelineToken(pPipeline, pToken);
+	}
+}
+
+/*
+This routine runs the stages of a token one after the other on the calling thread, so that the item stays in the cache of the thread
+Accepts pointer to pipeline and pointer to token as arguements
+A token finding a serial stage busy (or not yet at its turn) is queued on the stage and the thread returns, the thread leaving the stage hands the token to another Worker Thread
+A token leaving the last stage is released, its item belongs to the client again
+*/
+VOID CarryPipelineToken(PTPPIPELINE pPipeline, PPIPETOKEN pToken)
+{
+	PTP pTP = pPipeline->pTP;
+	while (pToken->iStage < pPipeline->dwStages)
+	{
+		PPIPESTAGE pStage = &(pPipeline->Stages[pToken->iStage]);
+		BOOL bSerial = (pStage->dwKind != TPSTAGE_PARALLEL);
+		if (bSerial && !pToken->bAdmitted && !AdmitPipelineToken(pStage, pToken))
+			return;
+		pToken->bAdmitted = FALSE;
+		if ((pTP->iShutdownMode == TPDELETE_CANCEL) || (pTP->iShutdownMode == TPDELETE_ABORT))
+		{
+			pToken->pvItem = NULL; //Thread Pool is being deleted, the remaining stages are skipped
+		}
+		else if (pToken->pvItem)
+		{
+			pToken->pvItem = pStage->pCallback(pPipeline->pvCtx, pToken->pvItem);
+		}
+		pToken->iStage++;
+		if (bSerial)
+		{
+			PPIPETOKEN pNext = LeavePipelineStage(pStage);
+			//Thread Pool is being deleted, the admitted token is carried on this thread instead
+			if (pNext && !SpawnPipelineTask(pPipeline, pNext))
+			{
+				CarryPipelineToken(pPipeline, pNext);
+			}
+		}
+	}
+	ReleasePipelineToken(pPipeline, pToken);
+}
+
+/*
+This routine admits a token to a serial stage, or queues the token on the stage until the thread leaving the stage hands it over
+Accepts pointer to stage and pointer to token as arguements
+A TPSTAGE_SERIAL_INORDER stage admits the tokens in sequence, a TPSTAGE_SERIAL_OUTOFORDER stage in the order they arrive
+Returns TRUE if the token was admitted, else returns FALSE
+*/
+BOOL AdmitPipelineToken(PPIPESTAGE pStage, PPIPETOKEN pToken)
+{
+	BOOL bInOrder = (pStage->dwKind == TPSTAGE_SERIAL_INORDER);
+	AcquireSRWLockExclusive(&(pStage->Lock));
+	if (!pStage->bBusy && (!bInOrder || (pToken->ullSequence == pStage->ullNextSequence)))
+	{
+		pStage->bBusy = TRUE;
+		ReleaseSRWLockExclusive(&(pStage->Lock));
+		return TRUE;
+	}
+	pToken->pNext = NULL;
+	if (bInOrder)
+	{
+		PPIPETOKEN* ppLink = &(pStage->pWaiting);
+		while (*ppLink && ((*ppLink)->ullSequence < pToken->ullSequence))
+		{
+			ppLink = &((*ppLink)->pNext);
+		}
+		pToken->pNext = *ppLink;
+		*ppLink = pToken;
+	}
+	else
+	{
+		if (pStage->pWaitingTail)
+			pStage->pWaitingTail->pNext = pToken;
+		else
+			pStage->pWaiting = pToken;
+		pStage->pWaitingTail = pToken;
+	}
+	ReleaseSRWLockExclusive(&(pStage->Lock));
+	return FALSE;
+}
+
+/*
+This routine releases a serial stage after a token ran it
+Accepts pointer to stage as arguement
+The stage stays busy when a waiting token can run it next, the token is then admitted and returned for the caller to hand over to another thread
+Returns pointer to the admitted token, else returns NULL
+*/
+PPIPETOKEN LeavePipelineStage(PPIPESTAGE pStage)
+{
+	AcquireSRWLockExclusive(&(pStage->Lock));
+	pStage->ullNextSequence++;
+	PPIPETOKEN pNext = pStage->pWaiting;
+	if (pNext && ((pStage->dwKind != TPSTAGE_SERIAL_INORDER) || (pNext->ullSequence == pStage->ullNextSequence)))
+	{
+		pStage->pWaiting = pNext->pNext;
+		if (pStage->pWaiting == NULL)
+			pStage->pWaitingTail = NULL;
+		pNext->pNext = NULL;
+		pNext->bAdmitted = TRUE;
+	}
+	else
+	{
+		pNext = NULL;
+		pStage->bBusy = FALSE;
+	}
+	ReleaseSRWLockExclusive(&(pStage->Lock));
+	return pNext;
+}
+
+/*
+This routine queues a Work Item which carries a token through its remaining stages, or runs the first stage of a pipeline
+Accepts pointer to pipeline and pointer to token (NULL to run the first stage) as arguements
+The Work Item counts as outstanding on the pipeline until it has run, so that RunPipeline does not return while it touches the pipeline
+Returns TRUE if the Work Item is queued, else returns FALSE
+*/
+BOOL SpawnPipelineTask(PTPPIPELINE pPipeline, PPIPETOKEN pToken)
+{
+	PPIPETASK pTask = (PPIPETASK)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PIPETASK));
+	if (pTask == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to allocate Pipeline task:%d", GetLastError());
+		return FALSE;
+	}
+	pTask->pPipeline = pPipeline;
+	pTask->pToken = pToken;
+	InitWorkItem(&(pTask->Work), pPipeline->pTP, PipelineTaskProc, pTask, WORKITEM_NORMAL);
+	pTask->Work.dwFlags |= WORKITEM_FREEONCOMPLETE | WORKITEM_RUNONCANCEL; //The task still releases its token when DeleteTPEx cancels
+	InterlockedIncrement(&(pPipeline->iOutstanding));
+	if (!InsertWork(pPipeline->pTP, &(pTask->Work)))
+	{
+		InterlockedDecrement(&(pPipeline->iOutstanding)); //The caller holds a token or the input, the count does not drop to zero here
+		HeapFree(GetProcessHeap(), 0, pTask);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+This routine is the Work Item callback of a pipeline task
+Accepts pointer to the pipeline task as arguement, the task is freed by ExecuteWorkItem (WORKITEM_FREEONCOMPLETE)
+The Worker Thread carries the token, then keeps running the first stage while tokens are free
+Returns NULL
+*/
+PVOID PipelineTaskProc(PVOID pvParam)
+{
+	PPIPETASK pTask = (PPIPETASK)pvParam;
+	PTPPIPELINE pPipeline = pTask->pPipeline;
+	if (pTask->pToken)
+	{
+		CarryPipelineToken(pPipeline, pTask->pToken);
+	}
+	PumpPipelineInput(pPipeline);
+	ReleasePipelineOutstanding(pPipeline);
+	return NULL;
+}
+
+/*
+This routine returns a token which left the pipeline to the free tokens
+Accepts pointer to pipeline and pointer to token as arguements
+The thread releasing the token does not produce the next item itself, PumpPipelineInput is called by its caller
+*/
+VOID ReleasePipelineToken(PTPPIPELINE pPipeline, PPIPETOKEN pToken)
+{
+	pToken->pvItem = NULL;
+	AcquireSRWLockExclusive(&(pPipeline->TokenLock));
+	pToken->pNext = pPipeline->pFreeTokens;
+	pPipeline->pFreeTokens = pToken;
+	ReleaseSRWLockExclusive(&(pPipeline->TokenLock));
+	InterlockedDecrement(&(pPipeline->iTokens));
+	ReleasePipelineOutstanding(pPipeline);
+}
+
+/*
+This routine drops the outstanding count of a pipeline, hDoneEvent is set when it drops to zero
+Accepts pointer to pipeline as arguement
+Setting hDoneEvent is the last access to the pipeline, RunPipeline waits for it before it returns
+*/
+VOID ReleasePipelineOutstanding(PTPPIPELINE pPipeline)
+{
+	if (InterlockedDecrement(&(pPipeline->iOutstanding)) == 0)
+	{
+		SetEvent(pPipeline->hDoneEvent);
+	}
+}
+
+/*
+This API creates a completion queue, Work Items bound to it are pushed onto it once they are complete or cancelled
+Accepts pointer to Thread Pool as arguement
+Finished Work Items are then harvested in batches with GetCompletedWorkItems instead of polling every outstanding Work Item with IsWorkComplete
+Returns pointer to completion queue upon success, else returns NULL
+*/
+PCOMPLETIONQUEUE CreateCompletionQueue(PTP pTP)
+{
+	//Parameter validation
+	if (pTP == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Create Completion Queue:%d", GetLastError());
+		return NULL;
+	}
+	PCOMPLETIONQUEUE pCompletionQueue = (PCOMPLETIONQUEUE)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(COMPLETIONQUEUE));
+	if (pCompletionQueue == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to create Completion Queue structure:%d", GetLastError());
+		return NULL;
+	}
+	//Auto Reset event, a caller which finds the completion queue empty waits on it
+	pCompletionQueue->hCompletedEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (pCompletionQueue->hCompletedEvent == NULL)
+	{
+		LOG_ERROR("Unable to Create Completion Queue Event:%d", GetLastError());
+		HeapFree(GetProcessHeap(), 0, pCompletionQueue);
+		return NULL;
+	}
+	InitializeSRWLock(&(pCompletionQueue->Lock));
+	pCompletionQueue->pTP = pTP;
+	return pCompletionQueue;
+}
+
+/*
+This API binds a Work Item to a completion queue
+Accepts pointer to Work Item (created with CreateWorkItem or InitWorkItem) and pointer to completion queue (NULL unbinds it) as arguements
+Must be called before the Work Item is inserted, InitWorkItem unbinds the Work Item again
+A bound Work Item must not be deleted or reused until it has been returned by GetCompletedWorkItems
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL SetWorkItemCompletionQueue(PWORKITEM pWk, PCOMPLETIONQUEUE pCompletionQueue)
+{
+	//Parameter validation
+	if ((pWk == NULL) || pWk->pTaskGroup || (pWk->dwFlags & WORKITEM_FREEONCOMPLETE))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Set Work Item completion queue:%d", GetLastError());
+		return FALSE;
+	}
+	pWk->pCompletionQueue = pCompletionQueue;
+	return TRUE;
+}
+
+/*
+This API returns completed Work Items of a completion queue in the order they were pushed
+Accepts 4 arguments:
+a.Pointer to completion queue
+b.Pointer to an array receiving the completed Work Items
+c.Max number of Work Items to return (size of the array)
+d.Timeout in milliseconds to wait when the completion queue is empty (0 to poll, INFINITE to wait until a Work Item completes)
+The cost is proportional to the number of Work Items returned, the returned Work Items are complete (IsWorkComplete) or were cancelled by DeleteTPEx
+Returns the number of Work Items returned, 0 if the timeout expired (ERROR_TIMEOUT) or upon failure
+*/
+DWORD GetCompletedWorkItems(PCOMPLETIONQUEUE pCompletionQueue, PWORKITEM* ppWork, DWORD dwMax, DWORD dwTimeout)
+{
+	//Parameter validation
+	if (!(pCompletionQueue && ppWork && dwMax))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant get completed Work Items:%d", GetLastError());
+		return 0;
+	}
+	ULONGLONG ullDeadline = (dwTimeout == INFINITE) ? 0 : (GetTickCount64() + dwTimeout);
+	while (TRUE)
+	{
+		AcquireSRWLockExclusive(&(pCompletionQueue->Lock));
+		DWORD dwCount = PopCompletedWorkItems(pCompletionQueue, ppWork, dwMax);
+		BOOL bMore = (pCompletionQueue->pHarvestHead != NULL);
+		ReleaseSRWLockExclusive(&(pCompletionQueue->Lock));
+		if (dwCount)
+		{
+			if (bMore) //Work Items are left over, another waiting caller can take them
+				SetEvent(pCompletionQueue->hCompletedEvent);
+			return dwCount;
+		}
+		//Completion queue is empty, wait for a Worker Thread to push a Work Item
+		DWORD dwWait = INFINITE;
+		if (dwTimeout != INFINITE)
+		{
+			ULONGLONG ullNow = GetTickCount64();
+			if (ullNow >= ullDeadline)
+			{
+				SetLastError(ERROR_TIMEOUT);
+				return 0;
+			}
+			dwWait = (DWORD)(ullDeadline - ullNow);
+		}
+		if (WaitForSingleObject(pCompletionQueue->hCompletedEvent, dwWait) == WAIT_FAILED)
+		{
+			LOG_ERROR("Unable to wait for hCompletedEvent:%d", GetLastError());
+			return 0;
+		}
+	}
+}
+
+/*
+This API deletes a completion queue
+Accepts pointer to completion queue as arguement
+No Work Item bound to the completion queue may be queued or running, Work Items which were not harvested are left to the caller
+Returns TRUE if the completion queue is deleted, else returns FALSE
+*/
+BOOL DeleteCompletionQueue(PCOMPLETIONQUEUE pCompletionQueue)
+{
+	//Parameter validation
+	if (pCompletionQueue == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant delete Completion Queue:%d", GetLastError());
+		return FALSE;
+	}
+	CloseHandle(pCompletionQueue->hCompletedEvent);
+	if (HeapFree(GetProcessHeap(), 0, pCompletionQueue) == 0)
+	{
+		LOG_ERROR("Unable to free Completion Queue:%d", GetLastError());
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+This routine publishes the completion status of an executed or cancelled Work Item and pushes it onto its completion queue, if bound to one
+Accepts pointer to Work Item and WORK_COMPLETE or WORK_CANCELLED as arguements
+The owner may free or reuse the Work Item as soon as it sees the status, so the status is stored last and with an interlocked (full barrier) exchange
+A bound Work Item is pushed before its status is stored, PopCompletedWorkItems waits for the status before returning it to the harvesting caller
+*/
+VOID PublishCompletionStatus(PWORKITEM pWork, DWORD iStatus)
+{
+	PCOMPLETIONQUEUE pCompletionQueue = pWork->pCompletionQueue; //Read before the status is stored
+	if (pCompletionQueue)
+		PushCompletedWorkItem(pCompletionQueue, pWork);
+	InterlockedExchange((LONG volatile*)&(pWork->iCompletionStatus), (LONG)iStatus); //Last access to the Work Item
+}
+
+/*
+This routine pushes a complete or cancelled Work Item onto its completion queue
+Accepts pointer to completion queue and pointer to Work Item as arguements
+The push is a compare exchange on the stack head, the waiting callers are only woken when the stack was empty
+*/
+VOID PushCompletedWorkItem(PCOMPLETIONQUEUE pCompletionQueue, PWORKITEM pWork)
+{
+	PWORKITEM pHead;
+	do
+	{
+		pHead = pCompletionQueue->pPushed;
+		pWork->pNextCompleted = pHead;
+	} while (InterlockedCompareExchangePointer((PVOID volatile*)&(pCompletionQueue->pPushed), pWork, pHead) != pHead);
+	if (pHead == NULL)
+	{
+		if (!SetEvent(pCompletionQueue->hCompletedEvent))
+		{
+			LOG_ERROR("Unable to Set hCompletedEvent:%d", GetLastError());
+		}
+	}
+}
+
+/*
+This routine returns upto dwMax Work Items of a completion queue, oldest first
+Accepts pointer to completion queue, pointer to the array receiving the Work Items and its size as arguements
+Called under the completion queue lock, the whole stack is taken at once with an exchange, so there is no ABA problem, and reversed into the harvest list
+Returns the number of Work Items returned
+*/
+DWORD PopCompletedWorkItems(PCOMPLETIONQUEUE pCompletionQueue, PWORKITEM* ppWork, DWORD dwMax)
+{
+	if (pCompletionQueue->pHarvestHead == NULL)
+	{
+		PWORKITEM pPushed = (PWORKITEM)InterlockedExchangePointer((PVOID volatile*)&(pCompletionQueue->pPushed), NULL);
+		while (pPushed) //Reverse the stack, so Work Items are returned in the order they completed
+		{
+			PWORKITEM pNext = pPushed->pNextCompleted;
+			pPushed->pNextCompleted = pCompletionQueue->pHarvestHead;
+			pCompletionQueue->pHarvestHead = pPushed;
+			pPushed = pNext;
+		}
+	}
+	DWORD dwCount = 0;
+	while (pCompletionQueue->pHarvestHead && (dwCount < dwMax))
+	{
+		PWORKITEM pWork = pCompletionQueue->pHarvestHead;
+		pCompletionQueue->pHarvestHead = pWork->pNextCompleted;
+		while (*(DWORD volatile*)&(pWork->iCompletionStatus) == WORK_NOTCOMPLETE) //Pushed but the status not stored yet, PublishCompletionStatus stores it right after the push
+		{
+			SwitchToThread();
+		}
+		ppWork[dwCount++] = pWork;
+	}
+	return dwCount;
+}
+
+/*
+This API turns the per callback profiler on or off
+Accepts pointer to Thread Pool and TRUE to turn profiling on, FALSE to turn it off
+While profiling is on every callback records its run time, CPU cycles and queue wait into a hash table of the calling thread, without any lock
+The tables are kept when profiling is turned off, GetTPProfile merges them
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL SetTPProfiling(PTP pTP, BOOL bEnable)
+{
+	//Parameter validation
+	if (pTP == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Set TP Profiling:%d", GetLastError());
+		return FALSE;
+	}
+	InterlockedExchange(&(pTP->bProfiling), bEnable ? 1 : 0);
+	return TRUE;
+}
+
+/*
+This API returns the callbacks which took the most run time while profiling was on
+Accepts 4 arguments:
+a.Pointer to Thread Pool
+b.Pointer to an array receiving the profile of the top callbacks, sorted by descending total run time
+c.Max number of callbacks to return (size of the array)
+d.Pointer receiving the number of callbacks returned
+The per thread tables are merged on every call, callback addresses are resolved to module!function+offset with DbgHelp
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL GetTPProfile(PTP pTP, PTPPROFILEENTRY pEntries, DWORD dwMax, PDWORD pdwCount)
+{
+	//Parameter validation
+	if (!(pTP && pEntries && pdwCount))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Get TP Profile:%d", GetLastError());
+		return FALSE;
+	}
+	*pdwCount = 0;
+	//Copy the used slots of every table, the tables are only ever added to the list so it can be walked without a lock
+	int iSlots = 0;
+	for (PPROFILETABLE pTable = pTP->pProfileTables; pTable; pTable = pTable->pNext)
+		iSlots += PROFILE_TABLESIZE;
+	if (iSlots == 0)
+		return TRUE;
+	PTPPROFILEENTRY pMerged = (PTPPROFILEENTRY)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, iSlots * sizeof(TPPROFILEENTRY));
+	if (pMerged == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to allocate TP Profile:%d", GetLastError());
+		return FALSE;
+	}
+	int iUsed = 0;
+	for (PPROFILETABLE pTable = pTP->pProfileTables; pTable && (iUsed < iSlots); pTable = pTable->pNext)
+	{
+		for (int i = 0; (i < PROFILE_TABLESIZE) && (iUsed < iSlots); i++)
+		{
+			PPROFILEENTRY pEntry = &(pTable->Entries[i]);
+			if (pEntry->pCallback == NULL)
+				continue;
+			pMerged[iUsed].pCallback = (CALLBACK_INSTANCE)pEntry->pCallback;
+			pMerged[iUsed].iInvocations = pEntry->iInvocations;
+			pMerged[iUsed].llTotalMicroseconds = pEntry->llTotalTicks; //Converted once merged
+			pMerged[iUsed].llMaxMicroseconds = pEntry->llMaxTicks;
+			pMerged[iUsed].ullCpuCycles = pEntry->ullCpuCycles;
+			pMerged[iUsed].llQueueWaitMicroseconds = pEntry->llQueueWaitTicks;
+			iUsed++;
+		}
+	}
+	//Fold the entries of the same callback from different threads together, then keep the most expensive ones
+	qsort(pMerged, iUsed, sizeof(TPPROFILEENTRY), CompareProfileCallback);
+	int iDistinct = 0;
+	for (int i = 0; i < iUsed; i++)
+	{
+		if ((iDistinct > 0) && (pMerged[iDistinct - 1].pCallback == pMerged[i].pCallback))
+		{
+			PTPPROFILEENTRY pFolded = &(pMerged[iDistinct - 1]);
+			pFolded->iInvocations += pMerged[i].iInvocations;
+			pFolded->llTotalMicroseconds += pMerged[i].llTotalMicroseconds;
+			pFolded->llMaxMicroseconds = max(pFolded->llMaxMicroseconds, pMerged[i].llMaxMicroseconds);
+			pFolded->ullCpuCycles += pMerged[i].ullCpuCycles;
+			pFolded->llQueueWaitMicroseconds += pMerged[i].llQueueWaitMicroseconds;
+		}
+		else
+		{
+			pMerged[iDistinct++] = pMerged[i];
+		}
+	}
+	qsort(pMerged, iDistinct, sizeof(TPPROFILEENTRY), CompareProfileTotal);
+	DWORD dwCount = min((DWORD)iDistinct, dwMax);
+
+	//Resolve the callback symbols, DbgHelp is not thread safe
+	AcquireSRWLockExclusive(&gSRWLock_Symbols);
+	for (DWORD i = 0; i < dwCount; i++)
+	{
+		pEntries[i] = pMerged[i];
+		pEntries[i].llTotalMicroseconds = (pMerged[i].llTotalMicroseconds * 1000000) / pTP->llQpcFrequency;
+		pEntries[i].llMaxMicroseconds = (pMerged[i].llMaxMicroseconds * 1000000) / pTP->llQpcFrequency;
+		pEntries[i].llQueueWaitMicroseconds = (pMerged[i].llQueueWaitMicroseconds * 1000000) / pTP->llQpcFrequency;
+		ResolveCallbackSymbol((PVOID)pEntries[i].pCallback, pEntries[i].szSymbol);
+	}
+	ReleaseSRWLockExclusive(&gSRWLock_Symbols);
+	HeapFree(GetProcessHeap(), 0, pMerged);
+	*pdwCount = dwCount;
+	return TRUE;
+}
+
+/*
+This routine formats the symbol of a callback address as module!function+offset
+Accepts the callback address and a buffer of TPPROFILE_MAXSYMBOL characters as arguements, called under gSRWLock_Symbols
+DbgHelp is initialized on first use, the buffer is left empty if no symbol could be resolved
+*/
+VOID ResolveCallbackSymbol(PVOID pCallback, char* pszSymbol)
+{
+	BYTE SymbolBuffer[sizeof(SYMBOL_INFO) + TPPROFILE_MAXSYMBOL];
+	PSYMBOL_INFO pSymbol = (PSYMBOL_INFO)SymbolBuffer;
+	HANDLE hProcess = GetCurrentProcess();
+	pszSymbol[0] = '\0';
+	if (!g_bSymInitialized)
+	{
+		SymSetOptions(SymGetOptions() | SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS);
+		g_bSymInitialized = SymInitialize(hProcess, NULL, TRUE);
+		if (!g_bSymInitialized)
+			return;
+	}
+	DWORD64 dwDisplacement = 0;
+	IMAGEHLP_MODULE64 Module = { 0 };
+	Module.SizeOfStruct = sizeof(IMAGEHLP_MODULE64);
+	ZeroMemory(SymbolBuffer, sizeof(SymbolBuffer));
+	pSymbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+	pSymbol->MaxNameLen = TPPROFILE_MAXSYMBOL;
+	if (SymFromAddr(hProcess, (DWORD64)(ULONG_PTR)pCallback, &dwDisplacement, pSymbol))
+	{
+		sprintf_s(pszSymbol, TPPROFILE_MAXSYMBOL, "%s!%s+0x%llx", SymGetModuleInfo64(hProcess, pSymbol->ModBase, &Module) ? Module.ModuleName : "?", pSymbol->Name, dwDisplacement);
+	}
+}
+
+/*
+This routine calls the client callback of a Work Item while profiling is on and records it in the profile table of the calling thread
+Accepts pointer to Thread Pool and pointer to Work Item as arguements
+Only the calling thread writes its table, a slot is taken by writing its callback address last, so a merging reader sees either a free slot or a usable one
+*/
+VOID ProfileWorkItem(PTP pTP, PWORKITEM pWork)
+{
+	CALLBACK_INSTANCE pCallback = pWork->pCallback;
+	LARGE_INTEGER liStart, liEnd;
+	ULONG64 ullCyclesStart = 0, ullCyclesEnd = 0;
+	QueryPerformanceCounter(&liStart);
+	QueryThreadCycleTime(GetCurrentThread(), &ullCyclesStart);
+	pCallback(pWork->pvParam); //Call client callback function
+	QueryThreadCycleTime(GetCurrentThread(), &ullCyclesEnd);
+	QueryPerformanceCounter(&liEnd);
+
+	PPROFILETABLE pTable = ClaimProfileTable(pTP);
+	if (pTable == NULL)
+		return;
+	DWORD iSlot = (DWORD)((((ULONG_PTR)pCallback >> 4) * 2654435761UL) & (PROFILE_TABLESIZE - 1));
+	for (int i = 0; i < PROFILE_TABLESIZE; i++, iSlot = (iSlot + 1) & (PROFILE_TABLESIZE - 1))
+	{
+		PPROFILEENTRY pEntry = &(pTable->Entries[iSlot]);
+		if (pEntry->pCallback == NULL)
+			InterlockedExchangePointer(&(pEntry->pCallback), (PVOID)pCallback); //Counters of a free slot are zero
+		else if (pEntry->pCallback != (PVOID)pCallback)
+			continue;
+		LONG64 llTicks = liEnd.QuadPart - liStart.QuadPart;
+		pEntry->iInvocations++;
+		pEntry->llTotalTicks += llTicks;
+		if (llTicks > pEntry->llMaxTicks)
+			pEntry->llMaxTicks = llTicks;
+		pEntry->ullCpuCycles += ullCyclesEnd - ullCyclesStart;
+		if (pWork->llQueuedTime && (liStart.QuadPart > pWork->llQueuedTime)) //Work Items which were never queued to a Pri queue have no queue wait
+			pEntry->llQueueWaitTicks += liStart.QuadPart - pWork->llQueuedTime;
+		return;
+	}
+	pTable->iDropped++;
+}
+
+/*
+This routine returns the profile table of the calling thread for a Thread Pool
+Accepts pointer to Thread Pool as arguement
+The table is cached in thread local storage together with the id of its Thread Pool, a thread switching pools keeps its old table owned until that pool is deleted
+Returns pointer to the profile table, NULL if none could be allocated
+*/
+PPROFILETABLE ClaimProfileTable(PTP pTP)
+{
+	if (g_lProfileTableId == pTP->lProfileId)
+		return g_pProfileTable;
+	PPROFILETABLE pTable;
+	for (pTable = pTP->pProfileTables; pTable; pTable = pTable->pNext) //Reuse the table of a thread which exited
+	{
+		if ((pTable->bOwned == 0) && (InterlockedCompareExchange(&(pTable->bOwned), 1, 0) == 0))
+			break;
+	}
+	if (pTable == NULL)
+	{
+		pTable = (PPROFILETABLE)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PROFILETABLE));
+		if (pTable == NULL)
+		{
+			LOG_ERROR("Unable to allocate profile table:%d", ERROR_NOT_ENOUGH_MEMORY);
+			return NULL;
+		}
+		pTable->bOwned = 1;
+		PPROFILETABLE pHead;
+		do
+		{
+			pHead = pTP->pProfileTables;
+			pTable->pNext = pHead;
+		} while (InterlockedCompareExchangePointer((PVOID volatile*)&(pTP->pProfileTables), pTable, pHead) != pHead);
+	}
+	g_pProfileTable = pTable;
+	g_lProfileTableId = pTP->lProfileId;
+	return pTable;
+}
+
+/*
+This routine releases the profile table of the calling thread, called by the Worker and Long Running Threads when they exit
+Accepts pointer to Thread Pool as arguement
+The recorded counts stay in the table, the next thread which claims it adds to them
+*/
+VOID ReleaseProfileTable(PTP pTP)
+{
+	if (g_lProfileTableId != pTP->lProfileId)
+		return;
+	InterlockedExchange(&(g_pProfileTable->bOwned), 0);
+	g_pProfileTable = NULL;
+	g_lProfileTableId = 0;
+}
+
+int CompareProfileCallback(const void* pvLeft, const void* pvRight)
+{
+	ULONG_PTR uLeft = (ULONG_PTR)((PTPPROFILEENTRY)pvLeft)->pCallback;
+	ULONG_PTR uRight = (ULONG_PTR)((PTPPROFILEENTRY)pvRight)->pCallback;
+	return (uLeft < uRight) ? -1 : ((uLeft > uRight) ? 1 : 0);
+}
+
+int CompareProfileTotal(const void* pvLeft, const void* pvRight)
+{
+	LONG64 llLeft = ((PTPPROFILEENTRY)pvLeft)->llTotalMicroseconds;
+	LONG64 llRight = ((PTPPROFILEENTRY)pvRight)->llTotalMicroseconds;
+	return (llLeft > llRight) ? -1 : ((llLeft < llRight) ? 1 : 0);
+}
+
+/*
+This routine merges a keyed Work Item into the pending Work Item of its key and callback, or queues it and indexes it as the pending one
+Accepts pointer to Thread Pool, pointer to Work Item and the InsertHeadList function of DLL_LinkedList.dll (NULL to only merge) as arguements
+The Work Item is queued under the bucket lock, so a Worker Thread dequeuing it cannot unlink it before it is indexed
+Returns COALESCE_MERGED, COALESCE_QUEUED, COALESCE_NOTFOUND (only merging and no pending Work Item) or COALESCE_FAILED
+*/
+DWORD InsertCoalescedWorkItem(PTP pTP, PWORKITEM pWk, MYPROC1 Enqueue)
+{
+	PCOALESCEBUCKET pBucket = GetCoalesceBucket(pTP, pWk->uCoalesceKey);
+	DWORD dwResult;
+	AcquireSRWLockExclusive(&(pBucket->Lock));
+	PWORKITEM pPending = pBucket->pHead;
+	while (pPending && !((pPending->uCoalesceKey == pWk->uCoalesceKey) && (pPending->pCallback == pWk->pCallback)))
+		pPending = pPending->pNextIndexed;
+	if (pPending)
+	{
+		//A higher pri duplicate raises the pending Work Item to its priority, else it would wait behind the lower pri work it was merged into
+		//A pending Work Item which is no longer queued has been dequeued by a thread about to run it and is left alone
+		DWORD iPendingPri = pPending->iPri;
+		if ((iPendingPri < pWk->iPri) && RemoveQueuedWorkItem(pTP, pPending))
+		{
+			pPending->iPri = pWk->iPri;
+			if (EnqueueWorkItem(pTP, pPending, pTP->pEnqueue))
+			{
+				InterlockedDecrement(&(pTP->iNumWorkItemsAdded[iPendingPri])); //Counted as added at its new priority
+			}
+			else
+			{
+				pPending->iPri = iPendingPri;
+				if (!EnqueueWorkItem(pTP, pPending, pTP->pEnqueue))
+					LOG_ERROR("Unable to requeue pending pri %d Work Item\n", iPendingPri);
+				InterlockedDecrement(&(pTP->iNumWorkItemsAdded[iPendingPri]));
+			}
+		}
+		//A Work Item requeued by DeleteWorkItem brings the Work Items merged into it along
+		PWORKITEM pTail = pWk;
+		while (pTail->pNextCoalesced)
+			pTail = pTail->pNextCoalesced;
+		for (PWORKITEM pMerged = pWk; pMerged; pMerged = pMerged->pNextCoalesced)
+			MarkTaggedWorkPending(pMerged); //Work Items requeued by DeleteWorkItem are counted already
+		pTail->pNextCoalesced = pPending->pNextCoalesced;
+		pPending->pNextCoalesced = pWk;
+		InterlockedIncrement(&(pTP->iNumWorkItemsCoalesced));
+		dwResult = COALESCE_MERGED;
+	}
+	else if (Enqueue == NULL)
+	{
+		dwResult = COALESCE_NOTFOUND;
+	}
+	else if (!EnqueueWorkItem(pTP, pWk, Enqueue))
+	{
+		dwResult = COALESCE_FAILED;
+	}
+	else
+	{
+		pWk->pNextIndexed = pBucket->pHead;
+		pBucket->pHead = pWk;
+		dwResult = COALESCE_QUEUED;
+	}
+	ReleaseSRWLockExclusive(&(pBucket->Lock));
+	return dwResult;
+}
+
+/*
+This routine removes a keyed Work Item from the coalescing index
+Accepts pointer to Thread Pool and pointer to Work Item as arguements
+A pending Work Item is removed from its bucket together with the Work Items merged into it, a merged Work Item is removed from its pending Work Item
+Returns the first Work Item merged into a removed pending Work Item (linked by pNextCoalesced), else NULL
+*/
+PWORKITEM UnlinkCoalescedWorkItem(PTP pTP, PWORKITEM pWk)
+{
+	PCOALESCEBUCKET pBucket = GetCoalesceBucket(pTP, pWk->uCoalesceKey);
+	PWORKITEM pMerged = NULL;
+	AcquireSRWLockExclusive(&(pBucket->Lock));
+	for (PWORKITEM* ppPending = &(pBucket->pHead); *ppPending; ppPending = &((*ppPending)->pNextIndexed))
+	{
+		PWORKITEM pPending = *ppPending;
+		if (pPending == pWk)
+		{
+			*ppPending = pWk->pNextIndexed;
+			pWk->pNextIndexed = NULL;
+			pMerged = pWk->pNextCoalesced;
+			pWk->pNextCoalesced = NULL;
+			break;
+		}
+		if ((pPending->uCoalesceKey != pWk->uCoalesceKey) || (pPending->pCallback != pWk->pCallback))
+			continue;
+		//Only one Work Item of a key and callback is pending, pWk can only be merged into this one
+		for (PWORKITEM* ppMerged = &(pPending->pNextCoalesced); *ppMerged; ppMerged = &((*ppMerged)->pNextCoalesced))
+		{
+			if (*ppMerged == pWk)
+			{
+				*ppMerged = pWk->pNextCoalesced;
+				pWk->pNextCoalesced = NULL;
+				break;
+			}
+		}
+		break;
+	}
+	ReleaseSRWLockExclusive(&(pBucket->Lock));
+	return pMerged;
+}
+
+/*
+This routine completes the Work Items merged into an executed Work Item, or cancels those merged into a cancelled one
+Accepts pointer to the first merged Work Item (NULL for none) and WORK_COMPLETE or WORK_CANCELLED as arguements
+*/
+VOID CompleteCoalescedWorkItems(PWORKITEM pMerged, DWORD iStatus)
+{
+	while (pMerged)
+	{
+		PWORKITEM pNext = pMerged->pNextCoalesced;
+		pMerged->pNextCoalesced = NULL;
+		DWORD iMergedStatus = iStatus;
+		PTAGENTRY pTag = pMerged->pTag;
+		if (pTag)
+		{
+			ClearTaggedWorkPending(pMerged);
+			if (pMerged->lTagGeneration != pTag->lCancelGeneration) //Its own tag was cancelled, it does not take the result of the Work Item it was merged into
+				iMergedStatus = WORK_CANCELLED;
+			InterlockedIncrement((iMergedStatus == WORK_COMPLETE) ? &(pTag->iCompleted) : &(pTag->iCancelled));
+			ReleaseTaggedWork(pMerged);
+		}
+		PublishCompletionStatus(pMerged, iMergedStatus); //pMerged may be freed from here on
+		pMerged = pNext;
+	}
+}
+
+PCOALESCEBUCKET GetCoalesceBucket(PTP pTP, ULONG_PTR uKey)
+{
+	ULONG64 ullKey = (ULONG64)uKey;
+	DWORD dwHash = (DWORD)(ullKey ^ (ullKey >> 32)) * 2654435761UL; //Multiplicative hashing, the high bits are mixed best
+	return &(pTP->CoalesceBuckets[(dwHash >> 16) & (COALESCE_BUCKETS - 1)]);
+}
+
+/*
+This routine returns the bucket of the tag table of a Thread Pool a tag hashes to
+Accepts pointer to Thread Pool and the tag as arguements
+*/
+PTAGBUCKET GetTagBucket(PTP pTP, ULONG_PTR uTag)
+{
+	ULONG64 ullTag = (ULONG64)uTag;
+	DWORD dwHash = (DWORD)(ullTag ^ (ullTag >> 32)) * 2654435761UL;
+	return &(pTP->TagBuckets[(dwHash >> 16) & (TAG_BUCKETS - 1)]);
+}
+
+/*
+This routine looks up the entry of a tag in its bucket of the tag table
+Accepts pointer to the bucket and the tag as arguements, called with the bucket lock held (shared or exclusive)
+Returns pointer to the tag entry, NULL if the tag is not in the table
+*/
+PTAGENTRY FindWorkTag(PTAGBUCKET pBucket, ULONG_PTR uTag)
+{
+	for (PTAGENTRY pTag = pBucket->pHead; pTag; pTag = pTag->pNext)
+	{
+		if (pTag->uTag == uTag)
+			return pTag;
+	}
+	return NULL;
+}
+
+/*
+This routine drops a reference on a tag, the tag is unlinked from the tag table and freed when it was the last one
+Accepts pointer to tag entry as arguement
+A thread which drops the last reference takes the bucket lock and frees the tag only if it is still in the chain without references,
+SetWorkItemTag may have taken the tag again meanwhile, or another thread dropping the last reference after that may have freed it already
+*/
+VOID ReleaseTagEntry(PTAGENTRY pTag)
+{
+	if (InterlockedDecrement(&(pTag->lRefs)) != 0)
+		return;
+	PTAGBUCKET pBucket = GetTagBucket(pTag->pTP, pTag->uTag);
+	AcquireSRWLockExclusive(&(pBucket->Lock));
+	for (PTAGENTRY* ppTag = &(pBucket->pHead); *ppTag; ppTag = &((*ppTag)->pNext))
+	{
+		if (*ppTag == pTag)
+		{
+			if (pTag->lRefs == 0)
+			{
+				*ppTag = pTag->pNext;
+				HeapFree(GetProcessHeap(), 0, pTag);
+			}
+			break;
+		}
+	}
+	ReleaseSRWLockExclusive(&(pBucket->Lock));
+}
+
+/*
+This routine drops the reference a tagged Work Item took on its tag when it was inserted, once it completed, was dropped or could not be queued
+Accepts pointer to Work Item as arguement, Work Items holding no reference are left alone
+*/
+VOID ReleaseTaggedWork(PWORKITEM pWk)
+{
+	if (pWk->pTag && (InterlockedExchange(&(pWk->bTagRef), 0) == 1))
+		ReleaseTagEntry(pWk->pTag);
+}
+
+/*
+This routine counts a tagged Work Item as pending when it is queued, and records the cancel generation of its tag
+Accepts pointer to Work Item as arguement, Work Items already counted (requeued merged Work Items) and untagged Work Items are left alone
+*/
+VOID MarkTaggedWorkPending(PWORKITEM pWk)
+{
+	if (pWk->pTag && (InterlockedExchange(&(pWk->bTagPending), 1) == 0))
+	{
+		if (InterlockedExchange(&(pWk->bTagRef), 1) == 0) //The tag is not freed while the Work Item is queued or running
+			InterlockedIncrement(&(pWk->pTag->lRefs));
+		pWk->lTagGeneration = pWk->pTag->lCancelGeneration;
+		InterlockedIncrement(&(pWk->pTag->iPending));
+	}
+}
+
+/*
+This routine stops counting a tagged Work Item as pending, when it starts, is dropped, deleted or could not be queued
+Accepts pointer to Work Item as arguement
+Returns TRUE if the Work Item was counted as pending, else returns FALSE
+*/
+BOOL ClearTaggedWorkPending(PWORKITEM pWk)
+{
+	if (pWk->pTag && (InterlockedExchange(&(pWk->bTagPending), 0) == 1))
+	{
+		InterlockedDecrement(&(pWk->pTag->iPending));
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+This API turns on spilling of the spillable Work Items of a Thread Pool to a memory mapped log on disk
+Accepts 3 arguments:
+a.Pointer to Thread Pool
+b.Directory the spill log segment files are created in (NULL for the temp directory)
+c.Memory budget, the max number of spillable Work Items queued in memory (1 to MAXPENDINGWORKITEMS)
+Spillable Work Items beyond the budget are appended to the spill log and read back into the low pri queue in FIFO order as the queued ones start
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL SetTPSpill(PTP pTP, LPCWSTR pszDirectory, int iMemoryBudget)
+{
+	//Parameter validation
+	if ((pTP == NULL) || (iMemoryBudget < 1) || (iMemoryBudget > MAXPENDINGWORKITEMS) || (pszDirectory && (lstrlenW(pszDirectory) >= SPILL_MAXDIRECTORY)))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Set TP Spill:%d", GetLastError());
+		return FALSE;
+	}
+	AcquireSRWLockExclusive(&(pTP->SpillLock));
+	if (pTP->iSpillBudget) //The directory can not change under an existing spill log
+	{
+		ReleaseSRWLockExclusive(&(pTP->SpillLock));
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("TP Spill is already set:%d", GetLastError());
+		return FALSE;
+	}
+	if (pszDirectory)
+	{
+		swprintf_s(pTP->szSpillDirectory, MAX_PATH, L"%ls", pszDirectory);
+	}
+	else
+	{
+		DWORD dwLen = GetTempPathW(SPILL_MAXDIRECTORY, pTP->szSpillDirectory);
+		if ((dwLen == 0) || (dwLen >= SPILL_MAXDIRECTORY))
+		{
+			ReleaseSRWLockExclusive(&(pTP->SpillLock));
+			LOG_ERROR("Unable to get the temp directory:%d", GetLastError());
+			return FALSE;
+		}
+		pTP->szSpillDirectory[dwLen - 1] = L'\0'; //Drop the trailing backslash, SPILL_SEGMENTNAMEFORMAT adds it
+	}
+	InterlockedExchange((volatile LONG*)&(pTP->iSpillBudget), iMemoryBudget);
+	ReleaseSRWLockExclusive(&(pTP->SpillLock));
+	return TRUE;
+}
+
+/*
+This API registers the client callback of a callback id of spillable Work Items
+Accepts pointer to Thread Pool, the callback id (less than TPSPILL_MAXCALLBACKS) and the Client Callback Function as arguements
+Spillable Work Items are stored as a callback id and a parameter blob, so that they can be written to the spill log, the callback receives a pointer to the blob
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL RegisterSpillCallback(PTP pTP, DWORD dwCallbackId, CALLBACK_INSTANCE pCallback)
+{
+	//Parameter validation
+	if (!(pTP && pCallback) || (dwCallbackId >= TPSPILL_MAXCALLBACKS))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Register Spill Callback:%d", GetLastError());
+		return FALSE;
+	}
+	InterlockedExchangePointer((PVOID volatile*)&(pTP->pSpillCallbacks[dwCallbackId]), (PVOID)pCallback);
+	return TRUE;
+}
+
+/*
+This API inserts a spillable Work Item, which runs at low pri
+Accepts 4 arguments:
+a.Pointer to Thread Pool, SetTPSpill must have been called
+b.Callback id registered with RegisterSpillCallback
+c.Pointer to the parameter blob, it is copied and must not hold pointers which could dangle before the Work Item runs
+d.Size in bytes of the parameter blob (at most TPSPILL_MAXPARAM)
+The Work Item is queued in memory while the memory budget allows and nothing is waiting in the spill log, else it is appended to the spill log
+Producers are never turned away for a full queue, spillable Work Items run in the order they were inserted
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL InsertSpillableWork(PTP pTP, DWORD dwCallbackId, LPCVOID pvParam, DWORD cbParam)
+{
+	//Parameter validation
+	if ((pTP == NULL) || (dwCallbackId >= TPSPILL_MAXCALLBACKS) || (pTP->pSpillCallbacks[dwCallbackId] == NULL) || (cbParam > TPSPILL_MAXPARAM) || (cbParam && (pvParam == NULL)))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant insert spillable work:%d", GetLastError());
+		return FALSE;
+	}
+	//Spilling is off or the Thread Pool is being deleted
+	if ((pTP->iSpillBudget == 0) || pTP->iShutdownMode)
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("Cant insert spillable work:%d", GetLastError());
+		return FALSE;
+	}
+	MYPROC1 Enqueue = pTP->pEnqueue;
+	int iQueued = 0;
+	AcquireSRWLockExclusive(&(pTP->SpillLock));
+	if ((pTP->iSpillBacklog == 0) && (pTP->iSpillResident < pTP->iSpillBudget)) //Nothing older is waiting in the spill log, keep it in memory
+	{
+		if (!QueueSpillWork(pTP, dwCallbackId, pvParam, cbParam, Enqueue))
+		{
+			ReleaseSRWLockExclusive(&(pTP->SpillLock));
+			LOG_ERROR("Cant insert spillable work:%d", GetLastError());
+			return FALSE;
+		}
+		iQueued = 1;
+	}
+	else
+	{
+		if (!AppendSpillRecord(pTP, dwCallbackId, pvParam, cbParam))
+		{
+			ReleaseSRWLockExclusive(&(pTP->SpillLock));
+			LOG_ERROR("Cant spill work:%d", GetLastError());
+			return FALSE;
+		}
+		if (pTP->iSpillResident <= (pTP->iSpillBudget / SPILL_REFILLDIVISOR)) //No queued spillable Work Item is left to read the spill log back
+			iQueued = RefillSpilledWork(pTP, Enqueue);
+	}
+	ReleaseSRWLockExclusive(&(pTP->SpillLock));
+	if (iQueued)
+	{
+		if (!SetEvent(g_hWIAvailableEvent)) //Notify Worker Thread
+		{
+			LOG_ERROR("Unable to set g_hWIAvailableEvent:%d", GetLastError());
+			return FALSE;
+		}
+		SpawnWorkerOnDemand(pTP);
+	}
+	return TRUE;
+}
+
+/*
+This routine copies a spillable Work Item into a heap Work Item and queues it to the low pri queue
+Accepts pointer to Thread Pool, the callback id, pointer to the parameter blob, its size and the InsertHeadList function of DLL_LinkedList.dll as arguements
+The Work Item counts against the memory budget until it starts
+Returns TRUE if the Work Item is queued, else returns FALSE
+*/
+BOOL QueueSpillWork(PTP pTP, DWORD dwCallbackId, LPCVOID pvParam, DWORD cbParam, MYPROC1 Enqueue)
+{
+	PSPILLWORK pSpill = (PSPILLWORK)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, FIELD_OFFSET(SPILLWORK, Param) + cbParam);
+	if (pSpill == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to allocate spillable Work Item:%d", GetLastError());
+		return FALSE;
+	}
+	pSpill->pTP = pTP;
+	pSpill->pCallback = pTP->pSpillCallbacks[dwCallbackId];
+	pSpill->cbParam = cbParam;
+	if (cbParam)
+		CopyMemory(pSpill->Param, pvParam, cbParam);
+	InitWorkItem(&(pSpill->Work), pTP, SpillWorkProc, pSpill, WORKITEM_LOW);
+	pSpill->Work.dwFlags |= WORKITEM_FREEONCOMPLETE | WORKITEM_RUNONCANCEL; //The memory budget is released by the callback, it runs even when DeleteTPEx cancels
+	InterlockedIncrement(&(pTP->iSpillResident));
+	if (!EnqueueWorkItem(pTP, &(pSpill->Work), Enqueue))
+	{
+		InterlockedDecrement(&(pTP->iSpillResident));
+		HeapFree(GetProcessHeap(), 0, pSpill);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+This routine appends a spillable Work Item to the spill log, called under SpillLock
+Accepts pointer to Thread Pool, the callback id, pointer to the parameter blob and its size as arguements
+A record which does not fit the tail segment goes to a new segment, the spare segment is reused first
+Returns TRUE if the record is written, else returns FALSE
+*/
+BOOL AppendSpillRecord(PTP pTP, DWORD dwCallbackId, LPCVOID pvParam, DWORD cbParam)
+{
+	DWORD cbRecord = (sizeof(SPILLRECORD) + cbParam + SPILL_RECORDALIGN - 1) & ~(SPILL_RECORDALIGN - 1);
+	PSPILLSEGMENT pTail = pTP->pSpillTail;
+	if ((pTail == NULL) || ((pTail->dwWriteOffset + cbRecord) > SPILL_SEGMENTSIZE))
+	{
+		pTail = pTP->pSpillSpare;
+		if (pTail)
+			pTP->pSpillSpare = NULL;
+		else if ((pTail = CreateSpillSegment(pTP)) == NULL)
+			return FALSE;
+		pTail->pNext = NULL;
+		pTail->dwReadOffset = pTail->dwWriteOffset = 0;
+		if (pTP->pSpillTail)
+			pTP->pSpillTail->pNext = pTail;
+		else
+			pTP->pSpillHead = pTail;
+		pTP->pSpillTail = pTail;
+	}
+	PSPILLRECORD pRecord = (PSPILLRECORD)(pTail->pView + pTail->dwWriteOffset);
+	pRecord->dwCallbackId = dwCallbackId;
+	pRecord->cbParam = cbParam;
+	if (cbParam)
+		CopyMemory(pRecord + 1, pvParam, cbParam);
+	pTail->dwWriteOffset += cbRecord;
+	InterlockedIncrement(&(pTP->iSpillBacklog));
+	InterlockedIncrement(&(pTP->iNumWorkItemsSpilled));
+	return TRUE;
+}
+
+/*
+This routine reads spillable Work Items back from the head of the spill log into the low pri queue, called under SpillLock
+Accepts pointer to Thread Pool and the InsertHeadList function of DLL_LinkedList.dll as arguements
+Work Items are read back until the memory budget is used up or the spill log is empty, a drained segment is kept as the spare or closed
+Nothing is read back once DeleteTPEx cancels, the spill log is dropped with the Thread Pool
+Returns the number of Work Items queued
+*/
+int RefillSpilledWork(PTP pTP, MYPROC1 Enqueue)
+{
+	if ((pTP->iShutdownMode == TPDELETE_CANCEL) || (pTP->iShutdownMode == TPDELETE_ABORT))
+		return 0;
+	int iRefilled = 0;
+	PSPILLSEGMENT pHead;
+	while (((pHead = pTP->pSpillHead) != NULL) && (pTP->iSpillResident < pTP->iSpillBudget))
+	{
+		if (pHead->dwReadOffset < pHead->dwWriteOffset)
+		{
+			PSPILLRECORD pRecord = (PSPILLRECORD)(pHead->pView + pHead->dwReadOffset);
+			if (!QueueSpillWork(pTP, pRecord->dwCallbackId, pRecord + 1, pRecord->cbParam, Enqueue))
+				break; //Left in the spill log, it is read back by the next refill
+			pHead->dwReadOffset += (sizeof(SPILLRECORD) + pRecord->cbParam + SPILL_RECORDALIGN - 1) & ~(SPILL_RECORDALIGN - 1);
+			InterlockedDecrement(&(pTP->iSpillBacklog));
+			InterlockedIncrement(&(pTP->iNumWorkItemsRefilled));
+			iRefilled++;
+			continue;
+		}
+		if (pHead == pTP->pSpillTail) //Spill log is empty, the segment stays as the tail and is written from the start again
+		{
+			pHead->dwReadOffset = pHead->dwWriteOffset = 0;
+			break;
+		}
+		pTP->pSpillHead = pHead->pNext; //Sealed segment is drained
+		if (pTP->pSpillSpare == NULL)
+			pTP->pSpillSpare = pHead;
+		else
+			FreeSpillSegment(pHead);
+	}
+	return iRefilled;
+}
+
+/*
+This routine creates a spill log segment, a temporary file of SPILL_SEGMENTSIZE bytes mapped into the process
+Accepts pointer to Thread Pool as arguement
+The file is opened FILE_ATTRIBUTE_TEMPORARY, so that it stays in the file cache while memory allows, and FILE_FLAG_DELETE_ON_CLOSE
+Returns pointer to the segment, NULL upon failure
+*/
+PSPILLSEGMENT CreateSpillSegment(PTP pTP)
+{
+	PSPILLSEGMENT pSegment = (PSPILLSEGMENT)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(SPILLSEGMENT));
+	if (pSegment == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to allocate spill segment:%d", GetLastError());
+		return NULL;
+	}
+	WCHAR szFile[MAX_PATH];
+	swprintf_s(szFile, MAX_PATH, SPILL_SEGMENTNAMEFORMAT, pTP->szSpillDirectory, GetCurrentProcessId(), pTP, InterlockedIncrement(&(pTP->lSpillSegments)));
+	pSegment->hFile = CreateFileW(szFile, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+	if (pSegment->hFile == INVALID_HANDLE_VALUE)
+	{
+		LOG_ERROR("Unable to create spill segment file:%d", GetLastError());
+		HeapFree(GetProcessHeap(), 0, pSegment);
+		return NULL;
+	}
+	pSegment->hMapping = CreateFileMappingW(pSegment->hFile, NULL, PAGE_READWRITE, 0, SPILL_SEGMENTSIZE, NULL);
+	if (pSegment->hMapping == NULL)
+	{
+		LOG_ERROR("Unable to map spill segment file:%d", GetLastError());
+		CloseHandle(pSegment->hFile);
+		HeapFree(GetProcessHeap(), 0, pSegment);
+		return NULL;
+	}
+	pSegment->pView = (PBYTE)MapViewOfFile(pSegment->hMapping, FILE_MAP_ALL_ACCESS, 0, 0, SPILL_SEGMENTSIZE);
+	if (pSegment->pView == NULL)
+	{
+		LOG_ERROR("Unable to map view of spill segment:%d", GetLastError());
+		CloseHandle(pSegment->hMapping);
+		CloseHandle(pSegment->hFile);
+		HeapFree(GetProcessHeap(), 0, pSegment);
+		return NULL;
+	}
+	LOG_INFO("Created spill segment %ls\n", szFile);
+	return pSegment;
+}
+
+/*
+This routine unmaps and closes a spill log segment, its file is deleted with the last handle
+Accepts pointer to the segment as arguement
+*/
+VOID FreeSpillSegment(PSPILLSEGMENT pSegment)
+{
+	UnmapViewOfFile(pSegment->pView);
+	CloseHandle(pSegment->hMapping);
+	CloseHandle(pSegment->hFile);
+	HeapFree(GetProcessHeap(), 0, pSegment);
+}
+
+/*
+This routine is the Work Item callback of a spillable Work Item
+Accepts pointer to the spillable Work Item as arguement, it is freed by ExecuteWorkItem (WORKITEM_FREEONCOMPLETE)
+The Work Item stops counting against the memory budget, the spill log is read back once the queued spillable Work Items fall below the refill mark
+The client callback is skipped when DeleteTPEx cancels
+Returns NULL
+*/
+PVOID SpillWorkProc(PVOID pvParam)
+{
+	PSPILLWORK pSpill = (PSPILLWORK)pvParam;
+	PTP pTP = pSpill->pTP;
+	int iResident = InterlockedDecrement(&(pTP->iSpillResident));
+	if ((pTP->iSpillBacklog > 0) && (iResident <= (pTP->iSpillBudget / SPILL_REFILLDIVISOR)))
+	{
+		AcquireSRWLockExclusive(&(pTP->SpillLock));
+		int iRefilled = RefillSpilledWork(pTP, pTP->pEnqueue);
+		ReleaseSRWLockExclusive(&(pTP->SpillLock));
+		if (iRefilled)
+		{
+			SetEvent(g_hWIAvailableEvent);
+			SpawnWorkerOnDemand(pTP);
+		}
+	}
+	if ((pTP->iShutdownMode == TPDELETE_CANCEL) || (pTP->iShutdownMode == TPDELETE_ABORT))
+		return NULL;
+	pSpill->pCallback(pSpill->Param);
+	return NULL;
+}
+
+/*
+This API creates a submission ring, a named shared memory ring through which the other processes of the host run work on the Thread Pool
+Accepts 3 arguments:
+a.Pointer to Thread Pool
+b.Name of the ring (less than TPRING_MAXNAME characters), the segment is named TPRING_NAMEFORMAT with it
+c.Number of slots, a power of 2 upto TPRING_MAXSLOTS, it bounds the number of submissions in flight
+A Ring Thread moves published submissions to the Thread Pool as normal pri Work Items, the callback runs on the payload in place and its result is written back to the slot
+The submitting processes and the Ring Thread only sleep on events when there is nothing to do, a flag in the segment tells the other side whether it has to set one
+Must be deleted with DeleteTPRing before the Thread Pool is deleted
+Returns pointer to the ring upon success, else returns NULL
+*/
+PTPRING CreateTPRing(PTP pTP, LPCWSTR pszName, DWORD dwSlots)
+{
+	//Parameter validation
+	if (!(pTP && pszName && pszName[0]) || (lstrlenW(pszName) >= TPRING_MAXNAME) || (dwSlots < 2) || (dwSlots > TPRING_MAXSLOTS) || (dwSlots & (dwSlots - 1)))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Create TP Ring:%d", GetLastError());
+		return NULL;
+	}
+	PTPRING pRing = (PTPRING)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(TPRING));
+	if (pRing == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to allocate TP Ring:%d", GetLastError());
+		return NULL;
+	}
+	pRing->pTP = pTP;
+	pRing->dwSlots = dwSlots;
+	lstrcpynW(pRing->szName, pszName, TPRING_MAXNAME);
+	pRing->phDoneEvents = (PHANDLE)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, dwSlots * sizeof(HANDLE));
+	if (pRing->phDoneEvents == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to allocate TP Ring slot events:%d", GetLastError());
+		HeapFree(GetProcessHeap(), 0, pRing);
+		return NULL;
+	}
+	InterlockedIncrement(&(pTP->lLiveObjects)); //Dropped by DeleteTPRing, which also cleans up a ring that could not be created
+	WCHAR szObject[MAX_PATH];
+	DWORD cbSegment = FIELD_OFFSET(TPRINGSEGMENT, Slots) + (dwSlots * sizeof(TPRINGSLOT));
+	swprintf_s(szObject, MAX_PATH, TPRING_NAMEFORMAT, pszName);
+	pRing->hMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, cbSegment, szObject);
+	if ((pRing->hMapping == NULL) || (GetLastError() == ERROR_ALREADY_EXISTS)) //Another Thread Pool of the host serves the name
+	{
+		if (pRing->hMapping)
+			SetLastError(ERROR_ALREADY_EXISTS);
+		LOG_ERROR("Unable to create ring segment:%d", GetLastError());
+		DeleteTPRing(pRing);
+		return NULL;
+	}
+	pRing->pSegment = (PTPRINGSEGMENT)MapViewOfFile(pRing->hMapping, FILE_MAP_WRITE, 0, 0, cbSegment);
+	swprintf_s(szObject, MAX_PATH, TPRING_SUBMITEVENTFORMAT, pszName);
+	pRing->hSubmitEvent = CreateEventW(NULL, FALSE, FALSE, szObject);
+	if (!(pRing->pSegment && pRing->hSubmitEvent))
+	{
+		LOG_ERROR("Unable to map ring segment or create its submit event:%d", GetLastError());
+		DeleteTPRing(pRing);
+		return NULL;
+	}
+	pRing->pSegment->dwVersion = TPRING_VERSION;
+	pRing->pSegment->dwSlots = dwSlots;
+	pRing->pSegment->dwServerProcessId = GetCurrentProcessId();
+	for (DWORD i = 0; i < dwSlots; i++)
+	{
+		swprintf_s(szObject, MAX_PATH, TPRING_DONEEVENTFORMAT, pszName, i);
+		pRing->phDoneEvents[i] = CreateEventW(NULL, FALSE, FALSE, szObject);
+		if (pRing->phDoneEvents[i] == NULL)
+		{
+			LOG_ERROR("Unable to create ring slot event:%d", GetLastError());
+			DeleteTPRing(pRing);
+			return NULL;
+		}
+		pRing->pSegment->Slots[i].lSequence = (LONG)i; //Slot i is free for ticket i
+	}
+	pRing->hIdleEvent = CreateEventW(NULL, TRUE, FALSE, NULL); //Manual Reset Event, initial state is not signalled
+	if (pRing->hIdleEvent == NULL)
+	{
+		LOG_ERROR("Unable to create ring idle event:%d", GetLastError());
+		DeleteTPRing(pRing);
+		return NULL;
+	}
+	pRing->iInFlight = 1; //Held by the Ring Thread, DeleteTPRing drops it once the thread is stopped
+	pRing->hThread = CreateThread(NULL, 0, RingThreadProc, pRing, 0, NULL);
+	if (pRing->hThread == NULL)
+	{
+		LOG_ERROR("Unable to create Ring Thread:%d", GetLastError());
+		DeleteTPRing(pRing);
+		return NULL;
+	}
+	InterlockedExchange((volatile LONG*)&(pRing->pSegment->dwMagic), TPRING_MAGIC); //Submitting processes check the magic, the ring is ready once it is set
+	return pRing;
+}
+
+/*
+This API registers the callback of a callback id of a submission ring
+Accepts pointer to the ring, the callback id (less than TPRING_MAXCALLBACKS) and the callback as arguements
+Submissions of an id with no callback complete with ERROR_NOT_FOUND
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL RegisterRingCallback(PTPRING pRing, DWORD dwCallbackId, TPRING_CALLBACK pCallback)
+{
+	//Parameter validation
+	if (!(pRing && pCallback) || (dwCallbackId >= TPRING_MAXCALLBACKS))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Register Ring Callback:%d", GetLastError());
+		return FALSE;
+	}
+	InterlockedExchangePointer((PVOID volatile*)&(pRing->pCallbacks[dwCallbackId]), (PVOID)pCallback);
+	return TRUE;
+}
+
+/*
+This API deletes a submission ring
+Accepts pointer to the ring as arguement
+The Ring Thread is stopped, the dispatched submissions are waited for (on hIdleEvent) and the published ones which were not dispatched complete with ERROR_CANCELLED
+Submitting processes can still take the results of their slots until they close the ring, new submissions fail
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL DeleteTPRing(PTPRING pRing)
+{
+	//Parameter validation
+	if (pRing == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant delete TP Ring:%d", GetLastError());
+		return FALSE;
+	}
+	PTPRINGSEGMENT pSegment = pRing->pSegment;
+	if (pSegment)
+		InterlockedExchange((volatile LONG*)&(pSegment->dwMagic), 0); //No new submissions
+	if (pRing->hThread)
+	{
+		InterlockedExchange(&(pRing->bStop), 1);
+		SetEvent(pRing->hSubmitEvent);
+		WaitForSingleObject(pRing->hThread, INFINITE);
+		CloseHandle(pRing->hThread);
+		if (InterlockedDecrement(&(pRing->iInFlight)) != 0) //Callbacks of dispatched submissions write to the slots, the last one sets hIdleEvent
+		{
+			if (WaitForSingleObject(pRing->hIdleEvent, INFINITE) == WAIT_FAILED)
+			{
+				LOG_ERROR("Unable to wait for the ring submissions:%d", GetLastError());
+			}
+		}
+		LONG lPos = pSegment->lHead;
+		for (DWORD i = 0; (i < pRing->dwSlots) && (pSegment->Slots[lPos & (pRing->dwSlots - 1)].lSequence == (lPos + 1)); i++, lPos++) //At most a lap of published submissions
+		{
+			CompleteRingSlot(pRing, lPos & (pRing->dwSlots - 1), 0, ERROR_CANCELLED);
+		}
+	}
+	for (DWORD i = 0; i < pRing->dwSlots; i++)
+	{
+		if (pRing->phDoneEvents[i])
+			CloseHandle(pRing->phDoneEvents[i]);
+	}
+	if (pRing->hSubmitEvent)
+		CloseHandle(pRing->hSubmitEvent);
+	if (pRing->hIdleEvent)
+		CloseHandle(pRing->hIdleEvent);
+	if (pSegment)
+		UnmapViewOfFile(pSegment);
+	if (pRing->hMapping)
+		CloseHandle(pRing->hMapping);
+	InterlockedDecrement(&(pRing->pTP->lLiveObjects));
+	HeapFree(GetProcessHeap(), 0, pRing->phDoneEvents);
+	HeapFree(GetProcessHeap(), 0, pRing);
+	return TRUE;
+}
+
+/*
+This API opens a submission ring created by a Thread Pool of another (or the same) process of the host
+Accepts the name passed to CreateTPRing as arguement
+The ring segment is mapped into the calling process, no Thread Pool is needed to submit
+Returns pointer to the opened ring upon success, else returns NULL
+*/
+PTPRINGCLIENT OpenTPRing(LPCWSTR pszName)
+{
+	//Parameter validation
+	if (!(pszName && pszName[0]) || (lstrlenW(pszName) >= TPRING_MAXNAME))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Open TP Ring:%d", GetLastError());
+		return NULL;
+	}
+	PTPRINGCLIENT pClient = (PTPRINGCLIENT)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(TPRINGCLIENT));
+	if (pClient == NULL)
+	{
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to allocate TP Ring client:%d", GetLastError());
+		return NULL;
+	}
+	lstrcpynW(pClient->szName, pszName, TPRING_MAXNAME);
+	WCHAR szObject[MAX_PATH];
+	swprintf_s(szObject, MAX_PATH, TPRING_NAMEFORMAT, pszName);
+	pClient->hMapping = OpenFileMappingW(FILE_MAP_WRITE, FALSE, szObject);
+	if (pClient->hMapping)
+		pClient->pSegment = (PTPRINGSEGMENT)MapViewOfFile(pClient->hMapping, FILE_MAP_WRITE, 0, 0, 0);
+	PTPRINGSEGMENT pSegment = pClient->pSegment;
+	if ((pSegment == NULL) || (pSegment->dwMagic != TPRING_MAGIC) || (pSegment->dwVersion != TPRING_VERSION))
+	{
+		if (pSegment)
+			SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("Unable to open ring segment:%d", GetLastError());
+		CloseTPRing(pClient);
+		return NULL;
+	}
+	pClient->dwSlots = pSegment->dwSlots;
+	swprintf_s(szObject, MAX_PATH, TPRING_SUBMITEVENTFORMAT, pszName);
+	pClient->hSubmitEvent = OpenEventW(EVENT_MODIFY_STATE, FALSE, szObject);
+	pClient->phDoneEvents = (PHANDLE)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, pClient->dwSlots * sizeof(HANDLE));
+	if (!(pClient->hSubmitEvent && pClient->phDoneEvents))
+	{
+		LOG_ERROR("Unable to open ring submit event:%d", GetLastError());
+		CloseTPRing(pClient);
+		return NULL;
+	}
+	return pClient;
+}
+
+/*
+This API submits work to a submission ring
+Accepts 5 arguments:
+a.Pointer to the opened ring
+b.Callback id registered by the Thread Pool process with RegisterRingCallback
+c.Pointer to the payload, copied into the ring slot
+d.Size in bytes of the payload (at most TPRING_MAXPAYLOAD)
+e.Pointer receiving the ticket of the submission, passed to WaitTPRing
+The slot is claimed with one interlocked compare exchange on the tail, the Ring Thread is only woken with an event when it sleeps
+Every submission must be waited for with WaitTPRing, the slot is not reused until then
+Returns TRUE upon success, else returns FALSE (ERROR_BUSY when every slot is in use)
+*/
+BOOL SubmitTPRing(PTPRINGCLIENT pClient, DWORD dwCallbackId, LPCVOID pvPayload, DWORD cbPayload, PDWORD pdwTicket)
+{
+	//Parameter validation
+	if (!(pClient && pdwTicket) || (dwCallbackId >= TPRING_MAXCALLBACKS) || (cbPayload > TPRING_MAXPAYLOAD) || (cbPayload && (pvPayload == NULL)))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant submit to TP Ring:%d", GetLastError());
+		return FALSE;
+	}
+	PTPRINGSEGMENT pSegment = pClient->pSegment;
+	if (pSegment->dwMagic != TPRING_MAGIC) //Ring was deleted
+	{
+		SetLastError(ERROR_INVALID_STATE);
+		return FALSE;
+	}
+	PTPRINGSLOT pSlot;
+	LONG lPos = pSegment->lTail;
+	while (TRUE)
+	{
+		pSlot = &(pSegment->Slots[lPos & (pClient->dwSlots - 1)]);
+		LONG lDiff = pSlot->lSequence - lPos;
+		if (lDiff == 0) //Slot is free for this ticket
+		{
+			LONG lSeen = InterlockedCompareExchange(&(pSegment->lTail), lPos + 1, lPos);
+			if (lSeen == lPos)
+				break;
+			lPos = lSeen; //Another process took the ticket
+		}
+		else if (lDiff < 0) //Slot still holds the submission of the previous lap
+		{
+			SetLastError(ERROR_BUSY);
+			return FALSE;
+		}
+		else
+		{
+			lPos = pSegment->lTail;
+		}
+	}
+	pSlot->dwCallbackId = dwCallbackId;
+	pSlot->cbPayload = cbPayload;
+	pSlot->dwResult = 0;
+	pSlot->dwError = ERROR_SUCCESS;
+	pSlot->lState = TPRINGSLOT_PENDING;
+	pSlot->bWaiter = 0;
+	if (cbPayload)
+		CopyMemory(pSlot->Payload, pvPayload, cbPayload);
+	InterlockedExchange(&(pSlot->lSequence), lPos + 1); //Publish the submission
+	if (InterlockedCompareExchange(&(pSegment->bServerSleeping), 0, 1) == 1) //Ring Thread sleeps, wake it
+	{
+		if (!SetEvent(pClient->hSubmitEvent))
+		{
+			LOG_ERROR("Unable to Set ring submit event:%d", GetLastError());
+		}
+	}
+	*pdwTicket = (DWORD)lPos;
+	return TRUE;
+}
+
+/*
+This API waits for a submission to a ring to complete and takes its result
+Accepts 4 arguments:
+a.Pointer to the opened ring
+b.Ticket returned by SubmitTPRing
+c.Timeout in milliseconds (0 to poll, INFINITE to wait until the submission completes)
+d.Pointer receiving the value the callback returned
+The slot is polled TPRING_SPINCOUNT times before the calling thread sleeps on the event of the slot, which is only set when a waiter sleeps
+Once the result is taken the slot is free for the next submission, a timed out wait can be repeated
+Returns TRUE upon success, else returns FALSE (ERROR_TIMEOUT, or the error of the submission: ERROR_NOT_FOUND for an unregistered callback id, ERROR_CANCELLED)
+*/
+BOOL WaitTPRing(PTPRINGCLIENT pClient, DWORD dwTicket, DWORD dwTimeout, PDWORD pdwResult)
+{
+	//Parameter validation
+	if (!(pClient && pdwResult) || (pClient->pSegment->Slots[dwTicket & (pClient->dwSlots - 1)].lSequence != (LONG)(dwTicket + 1)))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant wait on TP Ring:%d", GetLastError());
+		return FALSE;
+	}
+	DWORD iSlot = dwTicket & (pClient->dwSlots - 1);
+	PTPRINGSLOT pSlot = &(pClient->pSegment->Slots[iSlot]);
+	for (int i = 0; (i < TPRING_SPINCOUNT) && (pSlot->lState != TPRINGSLOT_COMPLETE) && dwTimeout; i++)
+	{
+		YieldProcessor();
+	}
+	if (pSlot->lState != TPRINGSLOT_COMPLETE)
+	{
+		if (pClient->phDoneEvents[iSlot] == NULL)
+		{
+			WCHAR szObject[MAX_PATH];
+			swprintf_s(szObject, MAX_PATH, TPRING_DONEEVENTFORMAT, pClient->szName, iSlot);
+			pClient->phDoneEvents[iSlot] = OpenEventW(SYNCHRONIZE, FALSE, szObject);
+			if (pClient->phDoneEvents[iSlot] == NULL)
+			{
+				LOG_ERROR("Unable to open ring slot event:%d", GetLastError());
+				return FALSE;
+			}
+		}
+		ULONGLONG ullDeadline = (dwTimeout == INFINITE) ? 0 : (GetTickCount64() + dwTimeout);
+		while (TRUE)
+		{
+			InterlockedExchange(&(pSlot->bWaiter), 1); //Checked by the Ring Thread side after it completes the slot
+			if (pSlot->lState == TPRINGSLOT_COMPLETE)
+				break;
+			DWORD dwWait = INFINITE;
+			if (ullDeadline)
+			{
+				ULONGLONG ullNow = GetTickCount64();
+				dwWait = (ullNow >= ullDeadline) ? 0 : (DWORD)(ullDeadline - ullNow);
+			}
+			DWORD dwResult = WaitForSingleObject(pClient->phDoneEvents[iSlot], dwWait); //A set left over from the previous submission of the slot only costs a loop
+			if ((dwResult == WAIT_TIMEOUT) && (pSlot->lState != TPRINGSLOT_COMPLETE))
+			{
+				SetLastError(ERROR_TIMEOUT);
+				return FALSE;
+			}
+			if (dwResult == WAIT_FAILED)
+			{
+				LOG_ERROR("Ring slot wait failed:%d", GetLastError());
+				return FALSE;
+			}
+		}
+	}
+	*pdwResult = pSlot->dwResult;
+	DWORD dwError = pSlot->dwError;
+	InterlockedExchange(&(pSlot->lSequence), (LONG)(dwTicket + pClient->dwSlots)); //Slot is free for the ticket a lap ahead
+	if (dwError != ERROR_SUCCESS)
+	{
+		SetLastError(dwError);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+This API closes a submission ring opened with OpenTPRing
+Accepts pointer to the opened ring as arguement
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL CloseTPRing(PTPRINGCLIENT pClient)
+{
+	//Parameter validation
+	if (pClient == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Cant close TP Ring:%d", GetLastError());
+		return FALSE;
+	}
+	for (DWORD i = 0; pClient->phDoneEvents && (i < pClient->dwSlots); i++)
+	{
+		if (pClient->phDoneEvents[i])
+			CloseHandle(pClient->phDoneEvents[i]);
+	}
+	if (pClient->phDoneEvents)
+		HeapFree(GetProcessHeap(), 0, pClient->phDoneEvents);
+	if (pClient->hSubmitEvent)
+		CloseHandle(pClient->hSubmitEvent);
+	if (pClient->pSegment)
+		UnmapViewOfFile(pClient->pSegment);
+	if (pClient->hMapping)
+		CloseHandle(pClient->hMapping);
+	HeapFree(GetProcessHeap(), 0, pClient);
+	return TRUE;
+}
+
+/*
+This is the Ring Thread procedure, it moves the submissions published in a ring to the Thread Pool
+Accepts pointer to the ring as arguement
+Before it sleeps the thread sets bServerSleeping and checks the ring once more, so that a submission published meanwhile is not missed
+*/
+DWORD WINAPI RingThreadProc(LPVOID pRing)
+{
+	PTPRINGSEGMENT pSegment = ((PTPRING)pRing)->pSegment;
+	MYPROC1 Enqueue = ((PTPRING)pRing)->pTP->pEnqueue;
+	LOG_INFO("Starting Ring Thread \n");
+	while (!((PTPRING)pRing)->bStop)
+	{
+		if (DispatchRing((PTPRING)pRing, Enqueue))
+			continue;
+		InterlockedExchange(&(pSegment->bServerSleeping), 1);
+		if (DispatchRing((PTPRING)pRing, Enqueue) || ((PTPRING)pRing)->bStop)
+		{
+			InterlockedExchange(&(pSegment->bServerSleeping), 0);
+			continue;
+		}
+		if (WaitForSingleObject(((PTPRING)pRing)->hSubmitEvent, INFINITE) == WAIT_FAILED)
+		{
+			LOG_ERROR("Ring Thread wait failed:%d", GetLastError());
+			return 1;
+		}
+		InterlockedExchange(&(pSegment->bServerSleeping), 0);
+	}
+	LOG_INFO("Ring Thread exiting\n");
+	return 0;
+}
+
+/*
+This routine queues the submissions published in a ring as normal pri Work Items, called by the Ring Thread
+Accepts pointer to the ring and the InsertHeadList function of DLL_LinkedList.dll as arguements
+A submission which can not be queued completes with the error right away, it is run on the Ring Thread while DeleteTPEx drains the Thread Pool
+Returns the number of submissions taken from the ring
+*/
+int DispatchRing(PTPRING pRing, MYPROC1 Enqueue)
+{
+	PTPRINGSEGMENT pSegment = pRing->pSegment;
+	PTP pTP = pRing->pTP;
+	int iDispatched = 0;
+	while (TRUE)
+	{
+		LONG lPos = pSegment->lHead;
+		DWORD iSlot = lPos & (pRing->dwSlots - 1);
+		if (pSegment->Slots[iSlot].lSequence != (lPos + 1)) //Not published yet
+			break;
+		pSegment->lHead = lPos + 1;
+		iDispatched++;
+		PRINGWORK pRingWork = (PRINGWORK)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(RINGWORK));
+		if (pRingWork == NULL)
+		{
+			CompleteRingSlot(pRing, iSlot, 0, ERROR_NOT_ENOUGH_MEMORY);
+			continue;
+		}
+		pRingWork->pRing = pRing;
+		pRingWork->iSlot = iSlot;
+		InitWorkItem(&(pRingWork->Work), pTP, RingWorkProc, pRingWork, WORKITEM_NORMAL);
+		pRingWork->Work.dwFlags |= WORKITEM_FREEONCOMPLETE | WORKITEM_RUNONCANCEL; //The submitting process waits on the slot, it is completed even when DeleteTPEx cancels
+		InterlockedIncrement(&(pRing->iInFlight));
+		if (pTP->iShutdownMode || !EnqueueWorkItem(pTP, &(pRingWork->Work), Enqueue))
+			ExecuteWorkItem(pTP, &(pRingWork->Work));
+	}
+	if (iDispatched)
+	{
+		if (!SetEvent(g_hWIAvailableEvent)) //Notify Worker Thread
+		{
+			LOG_ERROR("Unable to set g_hWIAvailableEvent:%d", GetLastError());
+		}
+		SpawnWorkerOnDemand(pTP);
+	}
+	return iDispatched;
+}
+
+/*
+This routine is the Work Item callback of a ring submission
+Accepts pointer to the ring submission as arguement, it is freed by ExecuteWorkItem (WORKITEM_FREEONCOMPLETE)
+The callback is called on the payload in the shared slot, it is skipped when DeleteTPEx cancels or the Thread Pool no longer takes work
+Returns NULL
+*/
+PVOID RingWorkProc(PVOID pvParam)
+{
+	PRINGWORK pRingWork = (PRINGWORK)pvParam;
+	PTPRING pRing = pRingWork->pRing;
+	PTPRINGSLOT pSlot = &(pRing->pSegment->Slots[pRingWork->iSlot]);
+	DWORD dwCallbackId = pSlot->dwCallbackId; //The slot is writable by the submitting processes, its fields are read once and checked
+	DWORD cbPayload = pSlot->cbPayload;
+	TPRING_CALLBACK pCallback = (dwCallbackId < TPRING_MAXCALLBACKS) ? pRing->pCallbacks[dwCallbackId] : NULL;
+	if (pRing->pTP->iShutdownMode && (pRing->pTP->iShutdownMode != TPDELETE_DRAIN))
+		CompleteRingSlot(pRing, pRingWork->iSlot, 0, ERROR_CANCELLED);
+	else if (cbPayload > TPRING_MAXPAYLOAD)
+		CompleteRingSlot(pRing, pRingWork->iSlot, 0, ERROR_INVALID_PARAMETER);
+	else if (pCallback == NULL)
+		CompleteRingSlot(pRing, pRingWork->iSlot, 0, ERROR_NOT_FOUND);
+	else
+		CompleteRingSlot(pRing, pRingWork->iSlot, pCallback(pSlot->Payload, cbPayload), ERROR_SUCCESS);
+	HANDLE hIdleEvent = pRing->hIdleEvent; //pRing can be freed by DeleteTPRing once iInFlight drops to zero
+	if (InterlockedDecrement(&(pRing->iInFlight)) == 0)
+		SetEvent(hIdleEvent);
+	return NULL;
+}
+
+/*
+This routine publishes the result of a ring submission
+Accepts pointer to the ring, the slot (below the dwSlots of the ring), the value returned by the callback and the Win32 error code as arguements
+The slot event is only set when the submitting process announced that it sleeps
+*/
+VOID CompleteRingSlot(PTPRING pRing, DWORD iSlot, DWORD dwResult, DWORD dwError)
+{
+	PTPRINGSLOT pSlot = &(pRing->pSegment->Slots[iSlot]);
+	pSlot->dwResult = dwResult;
+	pSlot->dwError = dwError;
+	InterlockedExchange(&(pSlot->lState), TPRINGSLOT_COMPLETE);
+	if (InterlockedExchange(&(pSlot->bWaiter), 0) == 1)
+	{
+		if (!SetEvent(pRing->phDoneEvents[iSlot]))
+		{
+			LOG_ERROR("Unable to Set ring slot event:%d", GetLastError());
+		}
+	}
+}
+
+/*
+This API starts or stops recording the workload of a Thread Pool
+Accepts pointer to Thread Pool and the path of the recording file (NULL to stop the recording)
+While recording, every executed Work Item appends its submission time, priority, callback id and run time to the file (see TPRECORDHEADER)
+The records are buffered and written RECORD_BUFFERRECORDS at a time outside RecordLock, the callback table and the final header are written when the recording stops
+DeleteTPEx stops a recording which is still running
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL SetTPRecording(PTP pTP, LPCWSTR pszFile)
+{
+	//Parameter validation
+	if (pTP == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		LOG_ERROR("Unable to Set TP Recording:%d", GetLastError());
+		return FALSE;
+	}
+	AcquireSRWLockExclusive(&(pTP->RecordLock));
+	if (pszFile == NULL)
+	{
+		if (pTP->hRecordFile == NULL)
+		{
+			ReleaseSRWLockExclusive(&(pTP->RecordLock));
+			SetLastError(ERROR_INVALID_STATE);
+			LOG_ERROR("TP is not recording:%d", GetLastError());
+			return FALSE;
+		}
+		BOOL bStopped = StopRecording(pTP);
+		ReleaseSRWLockExclusive(&(pTP->RecordLock));
+		return bStopped;
+	}
+	if (pTP->hRecordFile) //One recording at a time
+	{
+		ReleaseSRWLockExclusive(&(pTP->RecordLock));
+		SetLastError(ERROR_INVALID_STATE);
+		LOG_ERROR("TP is already recording:%d", GetLastError());
+		return FALSE;
+	}
+	if (pTP->pRecordBuffer == NULL)
+		pTP->pRecordBuffer = (PTPRECORD)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, RECORD_BUFFERRECORDS * sizeof(TPRECORD));
+	if (pTP->pRecordSpare == NULL)
+		pTP->pRecordSpare = (PTPRECORD)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, RECORD_BUFFERRECORDS * sizeof(TPRECORD));
+	if ((pTP->pRecordBuffer == NULL) || (pTP->pRecordSpare == NULL)) //The buffer allocated is kept for the next SetTPRecording, DeleteTPEx frees it
+	{
+		ReleaseSRWLockExclusive(&(pTP->RecordLock));
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		LOG_ERROR("Unable to allocate recording buffers:%d", GetLastError());
+		return FALSE;
+	}
+	HANDLE hFile = CreateFileW(pszFile, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		ReleaseSRWLockExclusive(&(pTP->RecordLock));
+		LOG_ERROR("Unable to create recording file:%d", GetLastError());
+		return FALSE;
+	}
+	//The header is written with zero counts first, so that a recording which is never stopped is recognized
+	PTPRECORDHEADER pHeader = &(pTP->RecordHeader);
+	ZeroMemory(pHeader, sizeof(TPRECORDHEADER));
+	pHeader->dwMagic = TPRECORD_MAGIC;
+	pHeader->dwVersion = TPRECORD_VERSION;
+	pHeader->cbHeader = sizeof(TPRECORDHEADER);
+	pHeader->cbRecord = sizeof(TPRECORD);
+	pHeader->dwIdealThreads = pTP->iIdealThreads;
+	pHeader->dwMaxThreads = pTP->iMaxThreads;
+	pHeader->dwMaxPending = pTP->iMaxPending;
+	GetSystemTimeAsFileTime(&(pHeader->ftStart));
+	DWORD cbWritten = 0;
+	if (!WriteFile(hFile, pHeader, sizeof(TPRECORDHEADER), &cbWritten, NULL))
+	{
+		ReleaseSRWLockExclusive(&(pTP->RecordLock));
+		LOG_ERROR("Unable to write recording header:%d", GetLastError());
+		CloseHandle(hFile);
+		DeleteFileW(pszFile);
+		return FALSE;
+	}
+	pTP->iRecordBuffered = 0;
+	ZeroMemory(pTP->pRecordCallbacks, sizeof(pTP->pRecordCallbacks));
+	ZeroMemory(pTP->wRecordSlots, sizeof(pTP->wRecordSlots));
+	LARGE_INTEGER liNow;
+	QueryPerformanceCounter(&liNow);
+	pTP->llRecordStart = liNow.QuadPart;
+	pTP->hRecordFile = hFile;
+	InterlockedExchange(&(pTP->bRecording), 1);
+	ReleaseSRWLockExclusive(&(pTP->RecordLock));
+	LOG_INFO("Recording TP workload to %ls\n", pszFile);
+	return TRUE;
+}
+
+/*
+This routine appends a record of an executed Work Item to the recording buffer and writes the buffer once it is full
+Accepts pointer to Thread Pool, pointer to Work Item and the QueryPerformanceCounter values of its submission, of the start and of the end of its callback as arguements
+Work Items queued before the recording started are not recorded, the recording would start with a burst which never happened
+A full buffer is swapped with the spare one under RecordLock and written after RecordLock is released, so the other recording threads only wait for the swap
+*/
+VOID RecordWorkItem(PTP pTP, PWORKITEM pWork, LONGLONG llSubmit, LONGLONG llStart, LONGLONG llEnd)
+{
+	AcquireSRWLockExclusive(&(pTP->RecordLock));
+	if ((pTP->hRecordFile == NULL) || (llSubmit < pTP->llRecordStart)) //Recording stopped while the callback ran, or the Work Item predates it
+	{
+		ReleaseSRWLockExclusive(&(pTP->RecordLock));
+		return;
+	}
+	PTPRECORD pRecord = &(pTP->pRecordBuffer[pTP->iRecordBuffered++]);
+	ULONGLONG ullRunMicroseconds = (ULONGLONG)(llEnd - llStart) * 1000000 / pTP->llQpcFrequency;
+	pRecord->ullSubmitMicroseconds = (ULONGLONG)(llSubmit - pTP->llRecordStart) * 1000000 / pTP->llQpcFrequency;
+	pRecord->dwRunMicroseconds = (DWORD)min(ullRunMicroseconds, MAXDWORD);
+	pRecord->wCallbackId = GetRecordCallbackId(pTP, (PVOID)pWork->pCallback);
+	pRecord->bPriority = (BYTE)pWork->iPri;
+	pRecord->bFlags = (pWork->dwFlags & WORKITEM_DEDICATED) ? TPRECORD_LONGRUNNING : 0;
+	if (pTP->iRecordBuffered < RECORD_BUFFERRECORDS)
+	{
+		ReleaseSRWLockExclusive(&(pTP->RecordLock));
+		return;
+	}
+	//Taken before RecordLock is released, the spare buffer is free once the previous write finished and the records reach the file in buffer order
+	AcquireSRWLockExclusive(&(pTP->RecordWriteLock));
+	PTPRECORD pFull = pTP->pRecordBuffer;
+	pTP->pRecordBuffer = pTP->pRecordSpare;
+	pTP->pRecordSpare = pFull;
+	pTP->iRecordBuffered = 0;
+	ReleaseSRWLockExclusive(&(pTP->RecordLock));
+	WriteRecordBuffer(pTP, pFull, RECORD_BUFFERRECORDS);
+	ReleaseSRWLockExclusive(&(pTP->RecordWriteLock));
+}
+
+/*
+This routine returns the callback id of a callback in the recording, called under RecordLock
+Accepts pointer to Thread Pool and the callback address as arguements
+Callback ids are handed out in the order the callbacks are first seen, the address is looked up in an open addressing hash table of the ids
+Returns the callback id, TPRECORD_OTHERCALLBACK once the callback table is full
+*/
+WORD GetRecordCallbackId(PTP pTP, PVOID pCallback)
+{
+	DWORD iSlot = (DWORD)((((ULONG_PTR)pCallback >> 4) * 2654435761UL) & (RECORD_CALLBACKSLOTS - 1));
+	for (int i = 0; i < RECORD_CALLBACKSLOTS; i++, iSlot = (iSlot + 1) & (RECORD_CALLBACKSLOTS - 1))
+	{
+		WORD wId = pTP->wRecordSlots[iSlot];
+		if (wId == 0) //Callback is new
+		{
+			DWORD dwCallbacks = pTP->RecordHeader.dwCallbacks;
+			if (dwCallbacks == TPRECORD_MAXCALLBACKS)
+				return TPRECORD_OTHERCALLBACK;
+			pTP->pRecordCallbacks[dwCallbacks] = pCallback;
+			pTP->wRecordSlots[iSlot] = (WORD)(dwCallbacks + 1);
+			pTP->RecordHeader.dwCallbacks++;
+			return (WORD)dwCallbacks;
+		}
+		if (pTP->pRecordCallbacks[wId - 1] == pCallback)
+			return (WORD)(wId - 1);
+	}
+	return TPRECORD_OTHERCALLBACK;
+}
+
+/*
+This routine writes a buffer of records to the recording file, called under RecordWriteLock
+Accepts pointer to Thread Pool, pointer to the records and the number of records as arguements
+Only the records written are counted in the header, records which could not be written are dropped so that the header stays consistent with the file
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL WriteRecordBuffer(PTP pTP, PTPRECORD pRecords, int iRecords)
+{
+	DWORD cbBuffered = iRecords * sizeof(TPRECORD);
+	DWORD cbWritten = 0;
+	BOOL bWritten = (cbBuffered == 0) || (WriteFile(pTP->hRecordFile, pRecords, cbBuffered, &cbWritten, NULL) && (cbWritten == cbBuffered));
+	if (bWritten)
+	{
+		pTP->RecordHeader.ullRecords += iRecords;
+	}
+	else
+	{
+		LOG_ERROR("Unable to write %d records to the recording file:%d", iRecords, GetLastError());
+		if (cbWritten) //Cut a partial write off, the callback table follows the last whole record
+		{
+			LARGE_INTEGER liBack;
+			liBack.QuadPart = -(LONGLONG)cbWritten;
+			SetFilePointerEx(pTP->hRecordFile, liBack, NULL, FILE_CURRENT);
+		}
+	}
+	return bWritten;
+}
 
+/*
+This routine finishes the recording file and closes it, called under RecordLock
+Accepts pointer to Thread Pool as arguement
+RecordWriteLock is taken to wait for a buffer still being written by RecordWorkItem, then the partial buffer is written
+The callback table is written after the records with the callback symbols resolved, then the header is rewritten with the counts and the duration
+Returns TRUE upon success, else returns FALSE
+*/
+BOOL StopRecording(PTP pTP)
+{
+	InterlockedExchange(&(pTP->bRecording), 0);
+	PTPRECORDHEADER pHeader = &(pTP->RecordHeader);
+	AcquireSRWLockExclusive(&(pTP->RecordWriteLock));
+	BOOL bResult = WriteRecordBuffer(pTP, pTP->pRecordBuffer, pTP->iRecordBuffered);
+	pTP->iRecordBuffered = 0;
+	LARGE_INTEGER liNow;
+	QueryPerformanceCounter(&liNow);
+	pHeader->ullDurationMicroseconds = (ULONGLONG)(liNow.QuadPart - pTP->llRecordStart) * 1000000 / pTP->llQpcFrequency;
+	DWORD cbWritten = 0;
+	AcquireSRWLockExclusive(&gSRWLock_Symbols);
+	for (DWORD i = 0; (i < pHeader->dwCallbacks) && bResult; i++)
+	{
+		TPRECORDCALLBACK Callback;
+		Callback.ullAddress = (ULONGLONG)(ULONG_PTR)pTP->pRecordCallbacks[i];
+		ResolveCallbackSymbol(pTP->pRecordCallbacks[i], Callback.szSymbol);
+		bResult = WriteFile(pTP->hRecordFile, &Callback, sizeof(Callback), &cbWritten, NULL);
+	}
+	ReleaseSRWLockExclusive(&gSRWLock_Symbols);
+	LARGE_INTEGER liStart = { 0 };
+	bResult = bResult && SetFilePointerEx(pTP->hRecordFile, liStart, NULL, FILE_BEGIN) && WriteFile(pTP->hRecordFile, pHeader, sizeof(TPRECORDHEADER), &cbWritten, NULL);
+	if (!bResult)
+	{
+		LOG_ERROR("Unable to finish the recording file:%d", GetLastError());
+	}
+	CloseHandle(pTP->hRecordFile);
+	pTP->hRecordFile = NULL;
+	ReleaseSRWLockExclusive(&(pTP->RecordWriteLock));
+	LOG_INFO("Recorded %llu TP Work Items\n", pHeader->ullRecords);
+	return bResult;
+}
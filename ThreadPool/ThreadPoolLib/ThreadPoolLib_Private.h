@@ -1,6 +1,9 @@
 #pragma once
+#include<WinSock2.h>
 #include<Windows.h>
 #include<stdio.h>
+#include<stdlib.h>
+#include<DbgHelp.h>
 #include"ThreadPoolLib.h"
 #include"c:\Users\ashokh\source\repos\Dll_LinkedList\Dll_LinkedList\Dll_LinkedList.h"
 
@@ -11,6 +14,58 @@
 #define MAXPENDINGWORKITEMS 500 //Max number of pending work items in queue, post which client is asked to stop sending more work items
 #define WORK_NOTCOMPLETE 0 //Work Item Not Complete Status
 #define WORK_COMPLETE 1 //Work Item Complete Status
+#define WORKITEM_CALLEROWNED 0x1 //Work Item storage is owned by the caller (InitWorkItem), the Thread Pool never frees it
+#define WORKITEM_RUNONCANCEL 0x2 //Internal Work Item a caller waits on, DeleteTPEx runs it instead of dropping it
+#define WORKITEM_FREEONCOMPLETE 0x4 //Internal Work Item at the start of a heap block owned by the Thread Pool, the block is freed once the Work Item is executed
+#define WORKITEM_DEDICATED 0x8 //Work Item was created with WORKITEM_LONGRUNNING, it is queued to the Long Running Threads instead of the Pri queues
+#define WORKITEM_COALESCE 0x10 //Work Item has a coalescing key (SetWorkItemCoalesceKey), it is merged into a pending Work Item with the same key and callback
+#define TAG_BUCKETS 256 //Number of buckets of the tag table of a Thread Pool, a power of 2
+#define COALESCE_BUCKETS 64 //Number of buckets of the coalescing index of a Thread Pool, a power of 2, each bucket has its own SRWLock
+#define COALESCE_MERGED 0 //Work Item was merged into a pending Work Item with the same key
+#define COALESCE_QUEUED 1 //Work Item was queued and indexed as the pending Work Item of its key
+#define COALESCE_NOTFOUND 2 //No pending Work Item with the same key, the Work Item was left alone
+#define COALESCE_FAILED 3 //Work Item could not be queued
+#define LONGRUNNING_MAXTHREADS 64 //Max number of Long Running Threads, dedicated threads running WORKITEM_LONGRUNNING Work Items outside the Worker Threads
+#define LONGRUNNINGTHREADIDLETIMEOUT 6000 //Number of milliseconds an idle Long Running Thread waits for a Work Item before it terminates
+#define PARALLELFOR_PROBEITERATIONS 16 //Number of iterations the calling thread times to estimate the per iteration cost when no grain size is supplied
+#define PARALLELFOR_TARGETCHUNKTIME 50 //Number of microseconds of work a ParallelFor chunk should take when the grain size is picked automatically
+#define PARALLELFOR_CHUNKSPERTHREAD 4 //Min number of chunks per participating thread, so that uneven iterations can still be load balanced
+#define PARALLELFOR_HARVESTBATCH 16 //Max number of helper Work Items the calling thread takes off the completion queue of a range at a time
+#define HELPWAITINTERVAL 1 //Number of milliseconds a helping thread waits for its outstanding work before checking the queues again
+#define CACHELINESIZE 64 //Size of a cache line, used to pad per thread data which is written concurrently
+#define TPIO_REAPBATCH 64 //Max number of I/O completions the I/O Completion Thread dequeues at a time
+#define TPIO_MAXBLOCKINGTHREADS 8 //Max number of threads doing blocking I/O for handles the I/O completion port does not service
+#define TPIO_READ 0 //Async read request
+#define TPIO_WRITE 1 //Async write request
+#define TPIO_FSYNC 2 //Async flush request
+#define WAITER_MAXWAITS (MAXIMUM_WAIT_OBJECTS - 1) //Max number of waits multiplexed by one Waiter Thread, it also waits on its change event
+#define WAITER_MAXTHREADS 64 //Max number of Waiter Threads of a Thread Pool, at most WAITER_MAXWAITS * WAITER_MAXTHREADS waits can be registered
+#define QUEUEWAIT_BUCKETS 32 //Number of queue wait histogram buckets per priority, bucket n counts waits below 2^n microseconds
+#define PRILIMIT_UNRESERVED 0x1 //Running Work Item counts against the Worker Threads not reserved by SetTPReservedThreads
+#define PRILIMIT_CAPPED 0x2 //Running Work Item counts against the cap set by SetTPPriorityCap
+#define RESERVED_PACK(iThreads, iPri) (((LONG)(iThreads) << 8) | (LONG)(iPri)) //Packs the reserved Worker Threads and their lowest priority into lReserved
+#define RESERVED_THREADS(lReserved) ((int)((lReserved) >> 8)) //Number of reserved Worker Threads of a lReserved value
+#define RESERVED_PRI(lReserved) ((int)((lReserved) & 0xFF)) //Lowest priority the reserved Worker Threads take of a lReserved value
+#define WATCHDOG_CHECKSPERBUDGET 4 //Number of times per watchdog budget the Control Thread scans the running Work Items
+#define SPILL_SEGMENTSIZE (4 << 20) //Size in bytes of a spill log segment file, a full segment is sealed and the next records go to a new one
+#define SPILL_RECORDALIGN 8 //Alignment in bytes of the records of a spill log segment
+#define SPILL_SEGMENTNAMEFORMAT L"%ls\\ThreadPool.%lu.%p.%ld.spill" //Name of a spill log segment file, formatted with the spill directory, the process id, the Thread Pool and the segment number
+#define SPILL_MAXDIRECTORY (MAX_PATH - 64) //Max number of characters of the spill directory, leaving room for the segment file name
+#define SPILL_REFILLDIVISOR 2 //The spill log is read back once the spillable Work Items in memory fall to the memory budget divided by this
+#define TPRING_MAGIC 0x474E5254 //First DWORD of a submission ring segment ("TRNG"), cleared by DeleteTPRing
+#define TPRING_VERSION 1 //Layout version of TPRINGSEGMENT, incremented whenever TPRINGSEGMENT or TPRINGSLOT change
+#define TPRING_SUBMITEVENTFORMAT L"Local\\ThreadPool.Ring.%ls.Submit" //Name of the event a submitting process sets to wake the Ring Thread
+#define TPRING_DONEEVENTFORMAT L"Local\\ThreadPool.Ring.%ls.Done.%lu" //Name of the event of a ring slot, set when its callback returns and the submitting process sleeps on it
+#define TPRING_SPINCOUNT 4000 //Number of times WaitTPRing checks the slot before it sleeps on the slot event
+#define TPRINGSLOT_PENDING 0 //Ring submission is queued or running
+#define TPRINGSLOT_COMPLETE 1 //Ring submission is complete, dwResult and dwError are valid
+#define TPSTATS_PUBLISHINTERVAL 1000 //Default number of milliseconds between two updates of the stats segment
+#define RECORD_BUFFERRECORDS 4096 //Number of records of a workload recording buffered in memory before they are written to the recording file
+#define RECORD_CALLBACKSLOTS (2 * TPRECORD_MAXCALLBACKS) //Number of slots of the hash table mapping callback addresses to callback ids of a recording, a power of 2
+#define PROFILE_TABLESIZE 256 //Number of slots of a per thread profile hash table, a power of 2, callbacks which do not fit are counted as dropped
+#define PIPELINE_MAXTOKENS 1024 //Max number of tokens of a pipeline in flight at once
+#define STRAND_BATCHSIZE 16 //Max number of Work Items a Worker Thread runs from one strand before it yields to the other queued work
+#define SOCKETWORK_MAX (MAXIMUM_WAIT_OBJECTS - 3) //Max number of sockets registered with a Thread Pool, the leader Worker Thread waits on them together with 3 Thread Pool events
 
 //Typedefs for importing functions from Dll_LinkedList.dll
 typedef PLINK(*MYPROC)();
@@ -18,6 +73,10 @@ typedef BOOL(*MYPROC1)(PLINK, PLINK);
 typedef PLINK(*MYPROC2)(PLINK);
 typedef BOOL(*MYPROC3)(PLINK);
 
+//Tag entry typedefs
+typedef struct _TAGENTRY TAGENTRY;
+typedef struct _TAGENTRY* PTAGENTRY;
+
 //WorkItem Structure
 struct _WORKITEM {
 	CALLBACK_INSTANCE pCallback; //Client supplied callback function
@@ -25,38 +84,618 @@ struct _WORKITEM {
 	DWORD iPri; //Client supplied Priority of the Work Item
 	DWORD iCompletionStatus; //Internal Completion Status of the Work Item
 	LINK list_entry; //Internal Linked List entry member
+	PTASKGROUP pTaskGroup; //Task Group the Work Item belongs to, such Work Items are owned and freed by the Thread Pool (NULL otherwise)
+	DWORD dwFlags; //Internal Work Item flags (WORKITEM_CALLEROWNED, WORKITEM_RUNONCANCEL)
+	LONGLONG llQueuedTime; //QueryPerformanceCounter value when the Work Item was queued, used for the queue wait histogram
+	PCOMPLETIONQUEUE pCompletionQueue; //Completion queue the Work Item is pushed to once it is complete or cancelled (NULL for none)
+	PWORKITEM pNextCompleted; //Next Work Item on the completion queue
+	ULONG_PTR uCoalesceKey; //Client supplied coalescing key, valid with WORKITEM_COALESCE
+	PWORKITEM pNextCoalesced; //Pending Work Item: first Work Item merged into it, merged Work Item: next Work Item merged into the same one
+	PWORKITEM pNextIndexed; //Next pending Work Item in the same bucket of the coalescing index
+	PTAGENTRY pTag; //Tag the Work Item is accounted to (NULL for none)
+	LONG lTagGeneration; //Cancel generation of the tag when the Work Item was inserted, the Work Item is dropped once they differ
+	volatile LONG bTagPending; //Set while the Work Item is counted as pending for its tag, cleared exactly once when it starts or is dropped
+	volatile LONG bTagRef; //Set while the Work Item holds a reference on its tag, from its insertion until it completes or is dropped
+	ULONGLONG InlineParam[WORKITEM_INLINEPARAM_SIZE / sizeof(ULONGLONG)]; //Inline parameter buffer for tiny payloads, pvParam points here when used
+};
+
+//Tag of a Thread Pool, created by the first SetWorkItemTag with its value and freed once it is released and none of its Work Items is queued or running
+struct _TAGENTRY {
+	ULONG_PTR uTag; //Client supplied tag value
+	PTAGENTRY pNext; //Next tag in the same bucket of the tag table
+	PTP pTP; //Thread Pool whose tag table holds the tag
+	volatile LONG lRefs; //One reference held by the client until ReleaseWorkTag, plus one per queued or running Work Item
+	BOOL bHeld; //Set while the client holds its reference, cleared by ReleaseWorkTag, under the bucket lock
+	volatile LONG lCancelGeneration; //Incremented by CancelWorkByTag, queued Work Items inserted before are dropped when a thread reaches them
+	volatile int iPending; //Number of Work Items inserted and not yet started or dropped
+	volatile int iRunning; //Number of Work Items whose callback is running
+	volatile int iCompleted; //Number of Work Items completed
+	volatile int iCancelled; //Number of Work Items dropped without calling their callback
+};
+
+//Running Work Item slot of a Worker or Long Running Thread, written only by its thread and read with a seqlock by EnumerateRunningWork and the watchdog
+struct _RUNNINGSLOT {
+	volatile LONG bInUse; //Set while a thread owns the slot, claimed when the thread starts and released when it exits
+	volatile LONG lSequence; //Incremented when a callback starts and when it returns, odd while a callback runs
+	PWORKITEM volatile pWork; //Running Work Item
+	CALLBACK_INSTANCE volatile pCallback; //Running callback function
+	volatile ULONGLONG ullStartTick; //GetTickCount64 value when the callback started
+	DWORD dwThreadId; //Thread owning the slot
+	BOOL bLongRunning; //Owned by a Long Running Thread
+	LONG lReportedSequence; //lSequence of the last run the watchdog reported, written only by the Control Thread
+	BYTE Padding[CACHELINESIZE - (2 * sizeof(LONG)) - (2 * sizeof(PVOID)) - sizeof(ULONGLONG) - sizeof(DWORD) - sizeof(BOOL) - sizeof(LONG)]; //Keeps the slots on separate cache lines
+};
+typedef struct _RUNNINGSLOT RUNNINGSLOT;
+typedef struct _RUNNINGSLOT* PRUNNINGSLOT;
+
+//Spillable Work Item, a registered callback id and a copy of its parameter blob, allocated when it is queued in memory and freed once it is executed
+struct _SPILLWORK {
+	WORKITEM Work; //Work Item which runs the client callback, must be the first member (WORKITEM_FREEONCOMPLETE)
+	PTP pTP; //Thread Pool the Work Item was inserted into
+	CALLBACK_INSTANCE pCallback; //Client callback registered for the callback id
+	DWORD cbParam; //Size in bytes of the parameter blob
+	BYTE Param[ANYSIZE_ARRAY]; //Parameter blob passed to the client callback, cbParam bytes
+};
+typedef struct _SPILLWORK SPILLWORK;
+typedef struct _SPILLWORK* PSPILLWORK;
+
+//Header of a spillable Work Item record in a spill log segment, followed by the parameter blob
+struct _SPILLRECORD {
+	DWORD dwCallbackId; //Callback id passed to InsertSpillableWork
+	DWORD cbParam; //Size in bytes of the parameter blob following the header
+};
+typedef struct _SPILLRECORD SPILLRECORD;
+typedef struct _SPILLRECORD* PSPILLRECORD;
+
+//Spill log segment, a memory mapped file of SPILL_SEGMENTSIZE bytes written at the tail and read at the head of the log
+typedef struct _SPILLSEGMENT SPILLSEGMENT;
+typedef struct _SPILLSEGMENT* PSPILLSEGMENT;
+struct _SPILLSEGMENT {
+	PSPILLSEGMENT pNext; //Next (newer) segment of the spill log
+	HANDLE hFile; //Segment file, FILE_FLAG_DELETE_ON_CLOSE removes it once it is closed
+	HANDLE hMapping; //File mapping of the segment file
+	PBYTE pView; //View of the whole segment
+	DWORD dwWriteOffset; //Offset the next record is appended at
+	DWORD dwReadOffset; //Offset of the oldest record not yet read back
+};
+
+//Slot of a submission ring, in the shared memory segment
+struct _TPRINGSLOT {
+	volatile LONG lSequence; //Ticket the slot is free for, the ticket plus 1 once it is submitted, moved a lap ahead once the submitting process took the result
+	volatile LONG lState; //TPRINGSLOT_PENDING or TPRINGSLOT_COMPLETE
+	volatile LONG bWaiter; //Set while the submitting process sleeps on the slot event
+	DWORD dwCallbackId; //Callback id passed to SubmitTPRing
+	DWORD cbPayload; //Size in bytes of the payload
+	DWORD dwResult; //Value returned by the callback
+	DWORD dwError; //Win32 error code of the submission, ERROR_SUCCESS if the callback ran
+	DWORD dwReserved; //Pads the slot header to 32 bytes
+	BYTE Payload[TPRING_MAXPAYLOAD]; //Inline payload, the callback is called on it in place
+};
+typedef struct _TPRINGSLOT TPRINGSLOT;
+typedef struct _TPRINGSLOT* PTPRINGSLOT;
+
+//Submission ring segment, a header followed by dwSlots slots, shared by the Thread Pool process and the submitting processes
+struct _TPRINGSEGMENT {
+	volatile DWORD dwMagic; //TPRING_MAGIC once the segment is initialized
+	DWORD dwVersion; //TPRING_VERSION
+	DWORD dwSlots; //Number of slots, a power of 2
+	DWORD dwServerProcessId; //Process running the Thread Pool
+	volatile LONG bServerSleeping; //Set while the Ring Thread sleeps on the submit event, a submitting process which clears it sets the event
+	BYTE Padding1[CACHELINESIZE - (5 * sizeof(DWORD))]; //Keeps the tail and head on their own cache lines
+	volatile LONG lTail; //Next ticket handed out to a submitting process
+	BYTE Padding2[CACHELINESIZE - sizeof(LONG)];
+	volatile LONG lHead; //Next ticket the Ring Thread dispatches, only written by the Ring Thread
+	BYTE Padding3[CACHELINESIZE - sizeof(LONG)];
+	TPRINGSLOT Slots[ANYSIZE_ARRAY]; //Ring slots, ticket n uses slot n & (dwSlots - 1)
+};
+typedef struct _TPRINGSEGMENT TPRINGSEGMENT;
+typedef struct _TPRINGSEGMENT* PTPRINGSEGMENT;
+
+//Submission ring of a Thread Pool, created by CreateTPRing in the Thread Pool process
+struct _TPRING {
+	PTP pTP; //Thread Pool the submissions run on
+	WCHAR szName[TPRING_MAXNAME]; //Name passed to CreateTPRing
+	HANDLE hMapping; //File mapping of the ring segment
+	PTPRINGSEGMENT pSegment; //View of the ring segment
+	DWORD dwSlots; //Number of slots, copied at CreateTPRing, the copy in the shared segment is never trusted
+	HANDLE hSubmitEvent; //Auto reset event set by a submitting process when the Ring Thread sleeps
+	PHANDLE phDoneEvents; //Auto reset event of every slot
+	HANDLE hThread; //Ring Thread, moves submissions from the ring to the Thread Pool
+	volatile LONG bStop; //Set by DeleteTPRing to stop the Ring Thread
+	volatile int iInFlight; //Number of submissions dispatched to the Thread Pool whose callback has not returned, plus one held by the Ring Thread until DeleteTPRing
+	HANDLE hIdleEvent; //Manual Reset event set when iInFlight drops to zero, DeleteTPRing waits on it
+	TPRING_CALLBACK volatile pCallbacks[TPRING_MAXCALLBACKS]; //Callbacks indexed by callback id (NULL for unregistered ids)
+};
+
+//Submission ring opened by a submitting process with OpenTPRing
+struct _TPRINGCLIENT {
+	WCHAR szName[TPRING_MAXNAME]; //Name passed to OpenTPRing
+	HANDLE hMapping; //File mapping of the ring segment
+	PTPRINGSEGMENT pSegment; //View of the ring segment
+	DWORD dwSlots; //Number of slots, read once when the ring is opened
+	HANDLE hSubmitEvent; //Submit event of the ring
+	PHANDLE phDoneEvents; //Slot events, opened the first time a wait on the slot sleeps (NULL until then)
+};
+
+//Ring submission dispatched to the Thread Pool, allocated per submission and freed once its Work Item is executed
+struct _RINGWORK {
+	WORKITEM Work; //Work Item which runs the callback, must be the first member (WORKITEM_FREEONCOMPLETE)
+	PTPRING pRing; //Ring the submission came from
+	DWORD iSlot; //Slot holding the submission
+};
+typedef struct _RINGWORK RINGWORK;
+typedef struct _RINGWORK* PRINGWORK;
+
+//Bucket of the coalescing index, holds the pending Work Items whose key hashes to it
+struct _COALESCEBUCKET {
+	SRWLOCK Lock; //SRWLock to sync access to the bucket and the merged Work Items of its pending Work Items
+	PWORKITEM pHead; //First pending Work Item of the bucket
+	BYTE Padding[CACHELINESIZE - sizeof(SRWLOCK) - sizeof(PWORKITEM)]; //Keeps the buckets on separate cache lines
+};
+typedef struct _COALESCEBUCKET COALESCEBUCKET;
+typedef struct _COALESCEBUCKET* PCOALESCEBUCKET;
+
+//Bucket of the tag table of a Thread Pool
+struct _TAGBUCKET {
+	SRWLOCK Lock; //SRWLock to sync access to the chain, taken shared for lookups and exclusive to add or remove a tag
+	PTAGENTRY pHead; //First tag of the bucket
+};
+typedef struct _TAGBUCKET TAGBUCKET;
+typedef struct _TAGBUCKET* PTAGBUCKET;
+
+//Profile of one callback function on one thread, only written by the thread owning the table
+struct _PROFILEENTRY {
+	PVOID volatile pCallback; //Callback function, written last when the slot is taken (NULL for a free slot)
+	volatile LONG64 iInvocations; //Number of calls
+	volatile LONG64 llTotalTicks; //Total run time in QueryPerformanceCounter ticks
+	volatile LONG64 llMaxTicks; //Longest run time in QueryPerformanceCounter ticks
+	volatile ULONG64 ullCpuCycles; //Total CPU cycles of the thread spent in the callback
+	volatile LONG64 llQueueWaitTicks; //Total queue wait in QueryPerformanceCounter ticks
+};
+typedef struct _PROFILEENTRY PROFILEENTRY;
+typedef struct _PROFILEENTRY* PPROFILEENTRY;
+
+//Per thread profile hash table, tables are linked to the Thread Pool and merged by GetTPProfile
+struct _PROFILETABLE {
+	struct _PROFILETABLE* pNext; //Next table of the Thread Pool
+	volatile LONG bOwned; //Set while a thread records into the table, a table released by an exiting thread is reused
+	volatile LONG64 iDropped; //Number of calls not recorded because the table was full
+	PROFILEENTRY Entries[PROFILE_TABLESIZE]; //Open addressing hash table keyed by callback address
 };
+typedef struct _PROFILETABLE PROFILETABLE;
+typedef struct _PROFILETABLE* PPROFILETABLE;
+
+//Waiter Thread structure typedefs
+typedef struct _WAITER WAITER;
+typedef struct _WAITER* PWAITER;
 
 //Thread Pool Structure
 struct _TP {
-	PTPQ pTPQ_low; //Low Pri queue  (Circular Linked List)
-	PTPQ pTPQ_normal; //Normal Pri queue (Circular Linked List)
-	PTPQ pTPQ_high; //High Pri queue (Circular Linked List)
+	PTPQ pTPQ[WORKITEM_NUMPRIORITIES]; //Pri queues indexed by Work Item priority (Circular Linked Lists)
 	volatile int iIdealThreads; //Ideal Worker threads is NumofProcs
 	volatile int iMaxThreads; //Max Worker threads is obtained from the MAXTHREADS macro(can be modified)
 	volatile int iCRWThreads; //Current Running Worker Threads is 0
-	volatile int iCWWThreads; //Current Waiting Worker Threads is Ideal Threads
-	volatile int iNumWorkItemsAdded_low; //Number of Work Items Added to the Low Priority queue
-	volatile int iNumWorkItemsPending_low; //Number of Work Items Pending in the Low Priority queue
-	volatile int iNumWorkItemsHandled_low; //Number of Work Items Handled in the Low Priority queue
-	volatile int iNumWorkItemsAdded_normal; //Number of Work Items Added to the Normal Priority queue
-	volatile int iNumWorkItemsPending_normal; //Number of Work Items Pending in the Normal Priority queue
-	volatile int iNumWorkItemsHandled_normal; //Number of Work Items Handled in the Normal Priority queue
-	volatile int iNumWorkItemsAdded_high; //Number of Work Items Added to the High Priority queue
-	volatile int iNumWorkItemsPending_high; //Number of Work Items Pending in the High Priority queue
-	volatile int iNumWorkItemsHandled_high; //Number of Work Items Handled in the High Priority queue
-};
-
-//SRWlocks to sync access to the 3 Pri queues
-SRWLOCK gSRWLock_TPQlow; 
-SRWLOCK gSRWLock_TPQnormal;
-SRWLOCK gSRWLock_TPQhigh;
+	volatile int iCWWThreads; //Current Waiting Worker Threads, Worker Threads are created on demand
+	volatile int iWorkerThreads; //Number of Worker Threads created and not yet terminated
+	volatile int iCHWThreads; //Current Helping Threads, threads executing queued work items while they wait for a Task Group or ParallelFor
+	volatile int iNumWorkItemsAdded[WORKITEM_NUMPRIORITIES]; //Number of Work Items Added to each Pri queue
+	volatile int iNumWorkItemsPending[WORKITEM_NUMPRIORITIES]; //Number of Work Items Pending in each Pri queue
+	volatile int iNumWorkItemsHandled[WORKITEM_NUMPRIORITIES]; //Number of Work Items Handled from each Pri queue
+	volatile int iNumWorkItemsPendingTotal; //Number of Work Items Pending across all Pri queues
+	volatile LONG lReadyMask; //Bit n is set while the Pri queue n may hold Work Items, Worker Threads scan it for the highest non empty queue
+	volatile LONG iQueueWaitHistogram[WORKITEM_NUMPRIORITIES][QUEUEWAIT_BUCKETS]; //Number of Work Items dequeued per priority and queue wait bucket
+	LONGLONG llQpcFrequency; //QueryPerformanceFrequency, to convert queue waits to microseconds
+	volatile LONG lReserved; //Number of Worker Threads kept for high pri Work Items (0 for none) and the lowest priority they take, packed by RESERVED_PACK so both are published in one store
+	volatile int iRunningUnreserved; //Number of Worker Threads running Work Items below the reserved priority
+	volatile int iCappedPri; //Work Items of this priority or below are capped to iMaxCappedThreads Worker Threads (-1 for none)
+	volatile int iMaxCappedThreads; //Max number of Worker Threads running capped Work Items at once
+	volatile int iRunningCapped; //Number of Worker Threads running capped Work Items
+	volatile int iBlockedThreads; //Number of Worker Threads between TPEnterBlocking and TPLeaveBlocking, they do not count against iIdealThreads
+	volatile int iCompensatingThreads; //Number of Worker Threads created by TPEnterBlocking, retired once the blocked Worker Threads leave
+	PTPQ pLongRunningQ; //Long running Work Items queue (Circular Linked List), run in FIFO order
+	SRWLOCK LongRunningLock; //SRWLock to sync access to pLongRunningQ and hLongRunningThreads
+	HANDLE hLongRunningSemaphore; //Released once per queued long running Work Item, Long Running Threads wait on it
+	HANDLE hLongRunningThreads[LONGRUNNING_MAXTHREADS]; //Long Running Thread handles, joined by DeleteTPEx (NULL slots are free)
+	volatile int iLongRunningThreads; //Number of Long Running Threads created and not yet terminated
+	volatile int iLongRunningIdle; //Number of Long Running Threads waiting for a Work Item
+	volatile int iLongRunningActive; //Number of long running Work Items being executed
+	volatile int iNumLongRunningAdded; //Number of long running Work Items Added
+	volatile int iNumLongRunningPending; //Number of long running Work Items Pending
+	volatile int iNumLongRunningHandled; //Number of long running Work Items Handled
+	volatile LONG64 llLongRunningTotalMs; //Total run time of the handled long running Work Items in milliseconds
+	volatile LONG64 llLongRunningMaxMs; //Longest run time of a handled long running Work Item in milliseconds
+	volatile int iNumWorkItemsAllocated; //Number of Work Items allocated from the heap by the Thread Pool
+	volatile LONG iShutdownMode; //0 while the Thread Pool accepts work, else the TPDELETE_ mode DeleteTPEx was called with
+	volatile LONG bDeleteTimedOut; //Set when TPDELETE_ABORT timed out, the next DeleteTPEx call resumes the teardown
+	volatile LONG lLiveObjects; //Number of strands, pipelines and submission rings not yet deleted, DeleteTPEx fails with ERROR_INVALID_STATE while any is left
+	HANDLE hWorkerIdleEvent; //Set by Worker Threads when they finish a batch of work items while the Thread Pool is being deleted
+	HANDLE hControlThread; //Control Thread handle, joined by DeleteTPEx
+	PHANDLE phWorkerThreads; //Worker Thread handles, joined by DeleteTPEx (NULL slots are free)
+	int iWorkerThreadSlots; //Number of slots in phWorkerThreads
+	SRWLOCK WorkerThreadsLock; //SRWLock to sync access to phWorkerThreads
+	HMODULE hDll_LinkedList; //DLL_LinkedList.dll, kept loaded for the lifetime of the TP
+	MYPROC pInitializeQueue; //InitializeListHead of DLL_LinkedList.dll, the list functions are resolved once by CreateTP
+	MYPROC1 pEnqueue; //InsertHeadList of DLL_LinkedList.dll
+	MYPROC2 pDequeue; //RemoveTailList of DLL_LinkedList.dll
+	MYPROC1 pFindEntry; //FindEntry of DLL_LinkedList.dll
+	MYPROC1 pRemoveEntry; //RemoveEntry of DLL_LinkedList.dll
+	MYPROC3 pDeleteQueue; //DeleteList of DLL_LinkedList.dll
+	PSOCKETWORK pSocketWork[SOCKETWORK_MAX]; //Registered sockets, the first iNumSocketWork slots are used
+	volatile int iNumSocketWork; //Number of registered sockets
+	SRWLOCK SocketWorkLock; //SRWLock to sync access to pSocketWork
+	HANDLE hSocketChangedEvent; //Set when a socket is registered, re-armed or unregistered, the leader Worker Thread rebuilds its wait set
+	HANDLE hSocketPromoteEvent; //Set when the leader Worker Thread hands the sockets over, wakes one waiting Worker Thread to become the leader
+	volatile LONG iSocketLeader; //1 while a Worker Thread waits on the registered sockets, else 0
+	volatile LONG iSocketGeneration; //Incremented on every change to the registered sockets
+	volatile LONG iSocketLeaderGeneration; //iSocketGeneration the leader Worker Thread built its wait set from
+	HANDLE hSocketRebuiltEvent; //Manual Reset, reset by UnregisterSocketWork and set under SocketWorkLock when the leader rebuilt its wait set or handed the sockets over
+	HANDLE hIoPort; //I/O completion port the bound overlapped handles complete to (NULL until first needed)
+	HANDLE hIoThread; //I/O Completion Thread, turns completions into normal pri Work Items
+	HANDLE hBlockingIoPort; //Completion port used as the request queue of the blocking I/O threads (NULL until first needed)
+	HANDLE hBlockingIoThreads[TPIO_MAXBLOCKINGTHREADS]; //Blocking I/O thread handles, joined by DeleteTPEx
+	volatile int iBlockingIoThreads; //Number of blocking I/O threads created
+	volatile int iBlockingIoIdle; //Number of blocking I/O threads waiting for a request
+	volatile int iIoPending; //Number of async I/O requests whose callback has not completed
+	SRWLOCK IoLock; //SRWLock to sync the creation of the I/O ports and threads
+	PWAITER pWaiters[WAITER_MAXTHREADS]; //Waiter Threads, created as waits are registered
+	volatile int iNumWaiters; //Number of Waiter Threads
+	SRWLOCK WaitersLock; //SRWLock to sync access to pWaiters
+	HANDLE hStatsMapping; //File mapping of the stats segment (NULL until PublishTPStats is called)
+	PTPSTATSSEGMENT pStatsSegment; //View of the stats segment, refreshed by the Control Thread
+	HANDLE hStatsPublishEvent; //Set by PublishTPStats and SetTPWatchdog, the Control Thread recomputes its wait timeout
+	volatile LONG bProfiling; //Set by SetTPProfiling, ExecuteWorkItem records every callback into the profile table of the calling thread
+	PPROFILETABLE volatile pProfileTables; //Profile tables of the threads which ran callbacks while profiling, freed by DeleteTPEx
+	LONG lProfileId; //Process wide unique id of the Thread Pool, identifies the Thread Pool of the table cached by a thread
+	volatile int iNumWorkItemsCoalesced; //Number of Work Items merged into a pending Work Item instead of being queued
+	TPTHREAD_HOOK pThreadStartHook; //Called by every Worker and Long Running Thread before it runs its first Work Item (NULL for none)
+	TPTHREAD_HOOK pThreadExitHook; //Called by every Worker and Long Running Thread when it exits (NULL for none)
+	PVOID pvThreadHookCtx; //Client context passed to the thread hooks
+	PRUNNINGSLOT pRunningSlots; //Running Work Item slots, one per Worker and Long Running Thread the pool can have at a time
+	int iRunningSlots; //Number of slots in pRunningSlots
+	volatile DWORD dwWatchdogBudget; //Number of milliseconds a callback may run before the watchdog reports it (0 while the watchdog is off)
+	TPWATCHDOG_CALLBACK pWatchdogCallback; //Called by the Control Thread once per callback run over the budget (NULL for none)
+	PVOID pvWatchdogCtx; //Client context passed to the watchdog callback
+	DWORD dwWatchdogFlags; //TPWATCHDOG_ flags
+	volatile int iStuckThreads; //Number of Worker Threads running a callback over the budget, recounted by every watchdog scan (TPWATCHDOG_INJECTWORKER only)
+	SRWLOCK SpillLock; //SRWLock to sync the spill log and the decision to queue a spillable Work Item in memory or spill it, so that they run in FIFO order
+	volatile int iSpillBudget; //Max number of spillable Work Items kept in memory before they are spilled (0 while spilling is off)
+	WCHAR szSpillDirectory[MAX_PATH]; //Directory the spill log segment files are created in
+	CALLBACK_INSTANCE pSpillCallbacks[TPSPILL_MAXCALLBACKS]; //Client callbacks of the spillable Work Items indexed by callback id (NULL for unregistered ids)
+	PSPILLSEGMENT pSpillHead; //Oldest segment of the spill log, read back first (NULL while the spill log is empty)
+	PSPILLSEGMENT pSpillTail; //Newest segment of the spill log, records are appended to it
+	PSPILLSEGMENT pSpillSpare; //Drained segment kept mapped for the next spill, so that sustained spilling does not create a file per segment
+	volatile LONG lSpillSegments; //Number of spill log segments created, numbers the segment files
+	volatile int iSpillResident; //Number of spillable Work Items queued in memory and not yet started
+	volatile int iSpillBacklog; //Number of spillable Work Items in the spill log
+	volatile int iNumWorkItemsSpilled; //Number of spillable Work Items written to the spill log
+	volatile int iNumWorkItemsRefilled; //Number of spillable Work Items read back from the spill log
+	volatile int iMaxPending; //Max number of pending Work Items per Pri queue, MAXPENDINGWORKITEMS unless changed by SetTPLimits
+	SRWLOCK RecordLock; //SRWLock to sync the recording file, its buffer and its callback table
+	volatile LONG bRecording; //Set by SetTPRecording, ExecuteWorkItem times every callback and appends a record of it
+	HANDLE hRecordFile; //Workload recording file (NULL while not recording)
+	SRWLOCK RecordWriteLock; //SRWLock to serialize the writes of the record buffers to the recording file, taken under RecordLock and held while a full buffer is written outside it
+	PTPRECORD pRecordBuffer; //Records not yet written to the recording file, allocated by the first SetTPRecording and freed by DeleteTPEx
+	PTPRECORD pRecordSpare; //Record buffer swapped in when pRecordBuffer is full, it holds the records being written until the next swap
+	int iRecordBuffered; //Number of records in pRecordBuffer
+	LONGLONG llRecordStart; //QueryPerformanceCounter value when the recording started, Work Items queued before are not recorded
+	TPRECORDHEADER RecordHeader; //Header of the recording file, rewritten with the counts when the recording stops
+	PVOID pRecordCallbacks[TPRECORD_MAXCALLBACKS]; //Callback table of the recording, indexed by callback id
+	WORD wRecordSlots[RECORD_CALLBACKSLOTS]; //Hash table of the callback table, callback id + 1 (0 for a free slot)
+	COALESCEBUCKET CoalesceBuckets[COALESCE_BUCKETS]; //Coalescing index of the pending Work Items with a coalescing key
+	TAGBUCKET TagBuckets[TAG_BUCKETS]; //Tag table, chains of TAGENTRY
+};
+
+//Async I/O handle, a file handle bound to the Thread Pool
+struct _TPIO {
+	PTP pTP; //Thread Pool the handle is bound to
+	HANDLE hFile; //Client supplied file handle
+	BOOL bOverlapped; //TRUE if reads and writes complete to hIoPort, FALSE if they are done by the blocking I/O threads
+	volatile int iPending; //Number of requests on the handle whose callback has not completed, plus one held by the binding until TPUnbindIoHandle
+	HANDLE hIdleEvent; //Manual Reset event set when iPending drops to zero, TPUnbindIoHandle waits on it
+};
+
+//Async I/O request, allocated per request and freed once its callback Work Item is executed
+struct _TPIOREQUEST {
+	WORKITEM Work; //Work Item which runs the client callback, must be the first member (WORKITEM_FREEONCOMPLETE)
+	OVERLAPPED Overlapped; //Overlapped structure holding the file offset
+	PTPIO pIo; //Handle the request was submitted on
+	DWORD dwOp; //TPIO_READ, TPIO_WRITE or TPIO_FSYNC
+	PVOID pvBuffer; //Client supplied buffer
+	DWORD cbBuffer; //Number of bytes to transfer
+	TPIO_CALLBACK pCallback; //Client supplied callback function
+	PVOID pvCtx; //Client supplied context passed to the callback function
+	DWORD dwError; //Win32 error code of the request
+	DWORD cbTransferred; //Number of bytes transferred
+};
+typedef struct _TPIOREQUEST TPIOREQUEST;
+typedef struct _TPIOREQUEST* PTPIOREQUEST;
+
+//Waiter Thread, multiplexes up to WAITER_MAXWAITS waits onto one WaitForMultipleObjects
+struct _WAITER {
+	PTP pTP; //Thread Pool the Waiter Thread belongs to
+	HANDLE hThread; //Waiter Thread handle, joined by DeleteTPEx
+	HANDLE hChangedEvent; //Set when a wait is registered, re-armed or unregistered, or the Waiter Thread has to stop
+	HANDLE hRebuiltEvent; //Manual Reset, reset by UnregisterWaitForSignal and set by the Waiter Thread under Lock once it rebuilt its wait set or exited
+	PWAITWORK pWaits[WAITER_MAXWAITS]; //Registered waits, the first iNumWaits slots are used
+	volatile int iNumWaits; //Number of registered waits
+	SRWLOCK Lock; //SRWLock to sync access to pWaits and the state of the waits
+	volatile LONG iGeneration; //Incremented on every change to the registered waits
+	volatile LONG iWaiterGeneration; //iGeneration the Waiter Thread built its wait set from
+	volatile LONG bStop; //Set by DeleteTPEx to stop the Waiter Thread
+	BOOL bDead; //Set under Lock when the Waiter Thread exited, RegisterWaitForSignal no longer assigns waits to it
+};
+
+//Wait Work structure, a wait on a waitable object whose callback is run on the Thread Pool
+struct _WAITWORK {
+	PTP pTP; //Thread Pool the callback is run on
+	PWAITER pWaiter; //Waiter Thread the wait is multiplexed on
+	HANDLE hObject; //Client supplied waitable object
+	DWORD dwTimeout; //Client supplied timeout in milliseconds (INFINITE for none)
+	DWORD dwFlags; //WAITWORK_ONESHOT or WAITWORK_REPEAT
+	WAITWORK_CALLBACK pCallback; //Client supplied callback function
+	PVOID pvCtx; //Client supplied context passed to the callback function
+	ULONGLONG ullDeadline; //GetTickCount64 value the wait times out at (0 for none)
+	BOOL bArmed; //Waited on by the Waiter Thread, cleared while the callback is queued or running and after a one-shot callback
+	BOOL bRegistered; //Cleared by UnregisterWaitForSignal
+	volatile LONG iCallbackPending; //1 while the callback is queued or running
+	DWORD dwCallbackThreadId; //Worker Thread running the callback
+	BOOL bFreeAfterCallback; //Set when the callback unregistered its own wait, the registration is freed once the callback returns
+	HANDLE hCallbackDoneEvent; //Created by UnregisterWaitForSignal while the callback is pending, set once it returns
+};
+
+//Wait callback request, allocated per callback and freed once its Work Item is executed
+struct _WAITFIRE {
+	WORKITEM Work; //Work Item which runs the client callback, must be the first member (WORKITEM_FREEONCOMPLETE)
+	PWAITWORK pWait; //Wait which fired
+	BOOL bTimedOut; //TRUE if the wait timed out
+};
+typedef struct _WAITFIRE WAITFIRE;
+typedef struct _WAITFIRE* PWAITFIRE;
+
+//Socket Work structure, a socket whose readiness is dispatched on the Thread Pool
+struct _SOCKETWORK {
+	PTP pTP; //Thread Pool the socket is registered with
+	SOCKET s; //Client supplied socket
+	LONG lNetworkEvents; //Client supplied FD_ network events of interest
+	SOCKETWORK_CALLBACK pCallback; //Client supplied callback function
+	PVOID pvCtx; //Client supplied context passed to the callback function
+	WSAEVENT hEvent; //Event associated with the socket by WSAEventSelect
+	volatile LONG bArmed; //One-shot, cleared when the callback is dispatched and set again by ReArmSocketWork
+	BOOL bRegistered; //Cleared by UnregisterSocketWork, under SocketWorkLock
+	volatile LONG iCallbackRunning; //1 while a Worker Thread runs the callback
+	HANDLE hCallbackDoneEvent; //Created by UnregisterSocketWork while the callback runs, set once it returns
+	DWORD dwCallbackThreadId; //Worker Thread running the callback
+	BOOL bFreeAfterCallback; //Set when the callback unregistered its own socket, the Worker Thread frees it once the callback returns
+};
+
+//ParallelFor/ParallelReduce range, shared between the calling thread and its helper work items
+struct _PFRANGE {
+	volatile LONG64 iNext; //Next unclaimed index of the range, chunks are claimed by atomically adding the grain size
+	LONG64 iEnd; //End of the range (exclusive)
+	LONG64 iGrain; //Number of iterations claimed at a time
+	PARALLELFOR_BODY pBody; //Client supplied ParallelFor loop body (NULL for ParallelReduce)
+	PARALLELREDUCE_BODY pReduceBody; //Client supplied ParallelReduce loop body (NULL for ParallelFor)
+	PVOID pvCtx; //Client supplied context passed to the loop body
+	PBYTE pbAccum; //Per participant accumulators for ParallelReduce, slot 0 belongs to the calling thread
+	SIZE_T cbAccumStride; //Size of one accumulator slot, rounded up to a cache line to avoid false sharing
+	volatile int iOutstandingHelpers; //Number of helper work items which have not yet finished or been retracted, plus one held by the calling thread
+	HANDLE hHelpersDoneEvent; //Signalled when the last outstanding helper finishes
+};
+typedef struct _PFRANGE PFRANGE;
+typedef struct _PFRANGE* PPFRANGE;
+
+//ParallelFor/ParallelReduce helper, one per work item submitted to the pool on behalf of the calling thread
+struct _PFHELPER {
+	PPFRANGE pRange; //Range shared with the calling thread
+	DWORD iSlot; //Accumulator slot used by this helper
+	WORKITEM Work; //Embedded Work Item which runs this helper
+};
+typedef struct _PFHELPER PFHELPER;
+typedef struct _PFHELPER* PPFHELPER;
+
+//Task Group structure
+struct _TASKGROUP {
+	PTP pTP; //Thread Pool the tasks of the group are submitted to
+	volatile int iPendingTasks; //Number of tasks submitted to the group which have not yet completed
+	HANDLE hTasksDoneEvent; //Signalled when the last pending task of the group completes
+};
+
+//Strand structure, Work Items inserted on a strand run one at a time in FIFO order
+struct _STRAND {
+	PTP pTP; //Thread Pool the Work Items of the strand run on
+	PTPQ pQueue; //Work Items of the strand not yet run (Circular Linked List), run in FIFO order
+	SRWLOCK Lock; //SRWLock to sync access to pQueue and bScheduled, never held while a callback runs
+	volatile int iPending; //Number of Work Items queued on the strand
+	BOOL bScheduled; //Set while a drain Work Item of the strand is queued or running, at most one exists at a time
+	volatile int iRefs; //References held by the client (until DeleteStrand) and by the drain Work Item, the strand is freed when the last one is released
+};
+
+//Strand drain request, allocated whenever a strand is scheduled and freed once its Work Item is executed
+struct _STRANDDRAIN {
+	WORKITEM Work; //Work Item which runs a batch of the strand, must be the first member (WORKITEM_FREEONCOMPLETE)
+	PSTRAND pStrand; //Strand to run
+};
+typedef struct _STRANDDRAIN STRANDDRAIN;
+typedef struct _STRANDDRAIN* PSTRANDDRAIN;
+
+//Pipeline token, carries one item produced by the first stage through the other stages
+struct _PIPETOKEN {
+	PVOID pvItem; //Item returned by the last stage run on the token, once a stage returns NULL the remaining stages are skipped for the token
+	ULONGLONG ullSequence; //Order in which the first stage produced the item
+	DWORD iStage; //Next stage to run on the token
+	BOOL bAdmitted; //Set when the thread leaving a serial stage handed the stage over to this token
+	struct _PIPETOKEN* pNext; //Next token waiting for the same serial stage, or next free token
+};
+typedef struct _PIPETOKEN PIPETOKEN;
+typedef struct _PIPETOKEN* PPIPETOKEN;
+
+//Pipeline stage
+struct _PIPESTAGE {
+	TPSTAGE_CALLBACK pCallback; //Client callback of the stage
+	DWORD dwKind; //TPSTAGE_ kind of the stage
+	SRWLOCK Lock; //SRWLock to sync access to bBusy, ullNextSequence and the waiting tokens of a serial stage, never held while a callback runs
+	BOOL bBusy; //Set while a token runs the serial stage
+	ULONGLONG ullNextSequence; //Sequence of the token a TPSTAGE_SERIAL_INORDER stage runs next
+	PPIPETOKEN pWaiting; //Tokens waiting for the serial stage, sorted by sequence for TPSTAGE_SERIAL_INORDER, FIFO for TPSTAGE_SERIAL_OUTOFORDER
+	PPIPETOKEN pWaitingTail; //Last token waiting for a TPSTAGE_SERIAL_OUTOFORDER stage
+};
+typedef struct _PIPESTAGE PIPESTAGE;
+typedef struct _PIPESTAGE* PPIPESTAGE;
+
+//Pipeline structure, items produced by the first stage run through the stages in the order they were added with at most dwMaxTokens in flight
+struct _TPPIPELINE {
+	PTP pTP; //Thread Pool the stages run on
+	PVOID pvCtx; //Client context passed to every stage callback
+	DWORD dwMaxTokens; //Max number of tokens in flight, the first stage is not called while all of them are
+	DWORD dwStages; //Number of stages added
+	PIPESTAGE Stages[TPPIPELINE_MAXSTAGES]; //Stages of the pipeline, in the order they were added
+	PPIPETOKEN pTokens; //dwMaxTokens tokens allocated by CreatePipeline
+	PPIPETOKEN pFreeTokens; //Tokens not in flight
+	SRWLOCK TokenLock; //SRWLock to sync access to pFreeTokens
+	volatile LONG bRunning; //Set while RunPipeline runs
+	volatile LONG lInputBusy; //Set while a thread runs the first stage, the first stage never runs concurrently
+	volatile LONG bInputDone; //Set once the first stage returned NULL
+	ULONGLONG ullInputSequence; //Sequence of the next item produced, only accessed by the thread running the first stage
+	volatile int iTokens; //Number of tokens in flight
+	volatile int iOutstanding; //Tokens in flight, queued pipeline Work Items and one for the input until it ends, RunPipeline returns once it drops to zero
+	HANDLE hDoneEvent; //Manual Reset event set when iOutstanding drops to zero
+};
+
+//Pipeline task, allocated whenever a token (or the first stage) is handed to another thread and freed once its Work Item is executed
+struct _PIPETASK {
+	WORKITEM Work; //Work Item which runs the task, must be the first member (WORKITEM_FREEONCOMPLETE)
+	PTPPIPELINE pPipeline; //Pipeline the task belongs to
+	PPIPETOKEN pToken; //Token admitted to its next serial stage, NULL to run the first stage
+};
+typedef struct _PIPETASK PIPETASK;
+typedef struct _PIPETASK* PPIPETASK;
+
+//Completion queue structure, completed Work Items bound to it are harvested in batches
+struct _COMPLETIONQUEUE {
+	PTP pTP; //Thread Pool the Work Items bound to the completion queue run on
+	PWORKITEM volatile pPushed; //Lock free stack of Work Items pushed by the Worker Threads, newest first
+	PWORKITEM pHarvestHead; //Work Items taken off pPushed but not yet returned, oldest first
+	SRWLOCK Lock; //SRWLock to sync the callers of GetCompletedWorkItems, the Worker Threads never take it
+	HANDLE hCompletedEvent; //Auto Reset event set when a Work Item is pushed onto an empty stack
+};
+
+//SRWlocks to sync access to the Pri queues
+SRWLOCK gSRWLock_TPQ[WORKITEM_NUMPRIORITIES];
 
 HANDLE g_hControlThreadEvent; //ControlThread Notification Event
 HANDLE g_hWIAvailableEvent; //Worker Thread notification Event 
 HANDLE g_hKillWorkerThreadTimer; //Handle to Worker Thread idle timeout timer 
 HANDLE g_hDeleteTPEvent; //Delete Thread Pool Event
+volatile LONG g_lTimedOutTPs; //Number of Thread Pools whose TPDELETE_ABORT timed out, their threads may still wait on the events above so CreateTP does not replace them
 LARGE_INTEGER liKillWorkerThreadTime; //Worker Thread idle timeout timer
+__declspec(thread) PTP g_pWorkerTP; //Thread Pool of the calling Worker Thread (NULL on other threads)
+__declspec(thread) PTP g_pPoolThreadTP; //Thread Pool of the calling Worker or Long Running Thread, set once its start hook ran (NULL on other threads)
+__declspec(thread) PVOID g_pvWorkerLocal[TPWORKERLOCAL_SLOTS]; //Per thread storage of the calling Worker or Long Running Thread, see TPGetWorkerLocal
+__declspec(thread) PRUNNINGSLOT g_pRunningSlot; //Running Work Item slot of the calling Worker or Long Running Thread (NULL on other threads)
+__declspec(thread) int g_iRunningDepth; //Nesting depth of ExecuteWorkItem on the calling thread, only the outermost callback is recorded in its slot
+__declspec(thread) PWORKITEM g_pRunningWork; //Work Item whose callback the calling thread runs, the innermost one when it helps while waiting (NULL outside callbacks), see TPShouldYield
+__declspec(thread) PTP g_pRunningTP; //Thread Pool g_pRunningWork was dequeued from
+__declspec(thread) DWORD g_dwHeldClaims; //Reservation and cap slots (PRILIMIT_ flags) held by the Work Items the calling thread runs in g_pRunningTP, see GetHeldClaims
+__declspec(thread) PWORKITEM g_pStrandWork; //Work Item of a strand whose callback the calling thread runs from StrandDrainProc, TPYield refuses it
+__declspec(thread) int g_iBlockingDepth; //Nesting depth of TPEnterBlocking on the calling thread
+__declspec(thread) PTP g_pBlockedTP; //Thread Pool whose iBlockedThreads counts the calling thread, NULL outside blocking regions and on Long Running Threads
+__declspec(thread) PPROFILETABLE g_pProfileTable; //Profile table the calling thread records into
+__declspec(thread) LONG g_lProfileTableId; //lProfileId of the Thread Pool g_pProfileTable belongs to (0 for none)
+volatile LONG g_lProfileIds; //Last lProfileId handed out by CreateTP
+SRWLOCK gSRWLock_Symbols = SRWLOCK_INIT; //SRWLock to serialize the DbgHelp calls of GetTPProfile and SetTPRecording, DbgHelp is single threaded
+BOOL g_bSymInitialized; //Set once SymInitialize succeeded, under gSRWLock_Symbols
 
 DWORD WINAPI WorkerThreadProc(LPVOID pvParam); //WorkerThread procedure declaration
-DWORD WINAPI ControlThreadProc(LPVOID pvParam); //ControlThread procedure declaration
\ No newline at end of file
+DWORD WINAPI ControlThreadProc(LPVOID pvParam); //ControlThread procedure declaration
+VOID UpdateStatsSegment(PTP pTP); //Copies the Thread Pool Statistics into the stats segment under its seqlock
+BOOL RemoveQueuedWorkItem(PTP pTP, PWORKITEM pWk); //Removes a Work Item which has not yet been picked by a Worker Thread from its Pri queue
+BOOL RunParallelRange(PTP pTP, PPFRANGE pRange, LONG64 iBegin, LONG64 iEnd); //Runs a ParallelFor/ParallelReduce range on the pool with the calling thread participating
+VOID ExecuteParallelChunks(PPFRANGE pRange, DWORD iSlot); //Claims and executes chunks of a ParallelFor/ParallelReduce range until it is exhausted
+PVOID ParallelHelperProc(PVOID pvParam); //Work Item callback for ParallelFor/ParallelReduce helpers
+VOID ExecuteWorkItem(PTP pTP, PWORKITEM pWork); //Calls the client callback of a dequeued Work Item and completes it
+BOOL EnqueueWorkItem(PTP pTP, PWORKITEM pWk, MYPROC1 Enqueue); //Queues a Work Item to its Pri queue and marks the queue ready
+PWORKITEM DequeueWorkItem(PTP pTP, DWORD iPri, MYPROC2 Dequeue); //Dequeues a Work Item from a Pri queue, clearing its ready bit once it is empty
+PWORKITEM DequeueHighestWorkItem(PTP pTP, MYPROC2 Dequeue); //Dequeues a Work Item from the highest priority non empty Pri queue
+LONG GetAdmittedMask(PTP pTP); //Returns the Pri queues a Worker Thread may start a Work Item from under the reservation and cap
+DWORD GetHeldClaims(PTP pTP); //Returns the reservation and cap slots the calling thread holds in the Thread Pool
+PWORKITEM DequeueAdmittedWorkItem(PTP pTP, MYPROC2 Dequeue, PDWORD pdwClaims); //Dequeues the highest priority Work Item a Worker Thread may start and claims its reservation and cap slots
+VOID LeaveBlockingRegion(); //Stops counting the calling thread in iBlockedThreads once its outermost blocking region is closed
+BOOL RetireCompensatingWorker(PTP pTP); //Takes one surplus compensating Worker Thread off the count once blocked Worker Threads left their blocking region
+VOID ReleasePriorityLimits(PTP pTP, DWORD dwClaims); //Releases the reservation and cap slots claimed by DequeueAdmittedWorkItem
+VOID RecordQueueWait(PTP pTP, PWORKITEM pWork); //Adds the queue wait of a dequeued Work Item to the histogram of its priority
+DWORD QueueWaitPercentile(PTP pTP, DWORD iPri, DWORD dwPercentile); //Returns the upper bound in microseconds of a queue wait percentile (0 if no Work Item was dequeued)
+BOOL ExecutePendingWorkItem(PTP pTP, MYPROC2 Dequeue); //Dequeues and executes the highest priority pending Work Item admitted by the reservation and cap, if any
+BOOL HelpWhileWaiting(PTP pTP, volatile int* piOutstanding, HANDLE hDoneEvent); //Executes pending Work Items until the outstanding count drops to zero
+BOOL CreateWorkerThread(PTP pTP, int iMaxWorkers); //Creates a Worker Thread, unless the pool has iMaxWorkers, and records its handle for DeleteTPEx
+BOOL SpawnWorkerOnDemand(PTP pTP); //Creates a Worker Thread when queued work (and registered sockets without a leader) outnumbers the waiting Worker Threads, upto iIdealThreads
+DWORD LeadSocketWait(PTP pTP); //Waits on the registered sockets as the leader Worker Thread and runs a ready callback
+VOID ReleaseSocketLeadership(PTP pTP); //Hands the registered sockets over to another waiting Worker Thread
+VOID FreeSocketWork(PSOCKETWORK pSocketWork); //Detaches the event from the socket and frees the registration
+VOID EndSocketCallback(PTP pTP, PSOCKETWORK pSocketWork); //Clears iCallbackRunning and wakes UnregisterSocketWork waiting for the callback
+BOOL SubmitIo(PTPIO pIo, DWORD dwOp, PVOID pvBuffer, DWORD cbBuffer, ULONGLONG ullOffset, TPIO_CALLBACK pCallback, PVOID pvCtx); //Submits an async I/O request to the I/O completion port or to the blocking I/O threads
+BOOL StartIoPort(PTP pTP, BOOL bBlocking); //Creates the I/O completion port and its thread, or the blocking I/O request port, on first use
+VOID CompleteIoRequest(PTP pTP, PTPIOREQUEST pRequest); //Queues the callback Work Item of a completed I/O request
+VOID ReleaseIoHandle(PTPIO pIo); //Drops a request (or the binding) from the pending count of a bound handle and wakes TPUnbindIoHandle on the last one
+PVOID IoCallbackProc(PVOID pvParam); //Work Item callback running the client callback of a completed I/O request
+DWORD WINAPI IoCompletionThreadProc(LPVOID pvParam); //I/O Completion Thread procedure declaration
+DWORD WINAPI BlockingIoThreadProc(LPVOID pvParam); //Blocking I/O thread procedure declaration
+VOID StopIoThreads(PTP pTP); //Stops and joins the I/O threads and closes the I/O ports
+DWORD WINAPI WaiterThreadProc(LPVOID pvParam); //Waiter Thread procedure declaration
+VOID MarkWaiterDead(PWAITER pWaiter); //Records that a Waiter Thread exited, so no wait is assigned to it or waits for it
+VOID FireWait(PWAITER pWaiter, PWAITWORK pWait, BOOL bTimedOut); //Queues the callback of a wait which was signalled or timed out
+PVOID WaitCallbackProc(PVOID pvParam); //Work Item callback running the client callback of a wait
+VOID StopWaiters(PTP pTP); //Stops and joins the Waiter Threads
+VOID FreeWaiters(PTP pTP); //Frees the Waiter Threads and the waits still registered
+BOOL InsertLongRunningWork(PTP pTP, PWORKITEM pWk, MYPROC1 Enqueue); //Queues a long running Work Item and creates a Long Running Thread unless one is idle
+BOOL CreateLongRunningThread(PTP pTP); //Creates a Long Running Thread, unless the pool has LONGRUNNING_MAXTHREADS, and records its handle for DeleteTPEx
+DWORD WINAPI LongRunningThreadProc(LPVOID pvParam); //Long Running Thread procedure declaration
+int CancelQueuedWorkItems(PTP pTP, MYPROC2 Dequeue); //Drops every queued Work Item
+VOID CancelWorkItem(PTP pTP, PWORKITEM pWork); //Completes a dequeued Work Item without calling its client callback
+BOOL ScheduleStrandDrain(PSTRAND pStrand, DWORD iPri); //Queues a drain Work Item which runs the next batch of a strand, called under the strand lock
+PVOID StrandDrainProc(PVOID pvParam); //Work Item callback running up to STRAND_BATCHSIZE Work Items of a strand
+VOID ReleaseStrand(PSTRAND pStrand); //Drops a reference to a strand and frees it with the last one
+VOID PumpPipelineInput(PTPPIPELINE pPipeline); //Runs the first stage of a pipeline while tokens are free and carries the tokens it produces through the other stages
+VOID CarryPipelineToken(PTPPIPELINE pPipeline, PPIPETOKEN pToken); //Runs the stages of a token on the calling thread until it waits for a serial stage or leaves the pipeline
+BOOL AdmitPipelineToken(PPIPESTAGE pStage, PPIPETOKEN pToken); //Admits a token to a serial stage, or queues it on the stage until its turn
+PPIPETOKEN LeavePipelineStage(PPIPESTAGE pStage); //Releases a serial stage, returns the waiting token it was handed over to (NULL if none)
+BOOL SpawnPipelineTask(PTPPIPELINE pPipeline, PPIPETOKEN pToken); //Queues a Work Item which carries a token (or runs the first stage) on another thread
+PVOID PipelineTaskProc(PVOID pvParam); //Work Item callback of a pipeline task
+VOID ReleasePipelineToken(PTPPIPELINE pPipeline, PPIPETOKEN pToken); //Returns a token which left the pipeline to the free tokens
+VOID ReleasePipelineOutstanding(PTPPIPELINE pPipeline); //Drops the outstanding count of a pipeline and sets hDoneEvent when it reaches zero
+DWORD InsertCoalescedWorkItem(PTP pTP, PWORKITEM pWk, MYPROC1 Enqueue); //Merges a keyed Work Item into the pending Work Item of its key, or queues and indexes it
+PWORKITEM UnlinkCoalescedWorkItem(PTP pTP, PWORKITEM pWk); //Removes a keyed Work Item from the coalescing index, returns the Work Items merged into it
+VOID CompleteCoalescedWorkItems(PWORKITEM pMerged, DWORD iStatus); //Completes (or cancels) the Work Items merged into an executed (or cancelled) Work Item
+PCOALESCEBUCKET GetCoalesceBucket(PTP pTP, ULONG_PTR uKey); //Returns the bucket of the coalescing index a key hashes to
+PTAGBUCKET GetTagBucket(PTP pTP, ULONG_PTR uTag); //Returns the bucket of the tag table a tag value hashes to
+PTAGENTRY FindWorkTag(PTAGBUCKET pBucket, ULONG_PTR uTag); //Returns the tag entry of a tag value, called under the bucket lock
+VOID ReleaseTagEntry(PTAGENTRY pTag); //Drops a reference on a tag, the last one unlinks and frees it
+VOID ReleaseTaggedWork(PWORKITEM pWk); //Drops the reference a completed or dropped Work Item holds on its tag
+VOID MarkTaggedWorkPending(PWORKITEM pWk); //Counts a tagged Work Item as pending and records the cancel generation it was inserted under
+BOOL ClearTaggedWorkPending(PWORKITEM pWk); //Stops counting a tagged Work Item as pending, returns TRUE if it was counted
+BOOL QueueSpillWork(PTP pTP, DWORD dwCallbackId, LPCVOID pvParam, DWORD cbParam, MYPROC1 Enqueue); //Copies a spillable Work Item into a heap Work Item and queues it to the low pri queue
+BOOL AppendSpillRecord(PTP pTP, DWORD dwCallbackId, LPCVOID pvParam, DWORD cbParam); //Appends a spillable Work Item to the tail segment of the spill log, called under SpillLock
+int RefillSpilledWork(PTP pTP, MYPROC1 Enqueue); //Moves spillable Work Items from the head of the spill log to the low pri queue upto the memory budget, called under SpillLock
+PSPILLSEGMENT CreateSpillSegment(PTP pTP); //Creates and maps a spill log segment file
+VOID FreeSpillSegment(PSPILLSEGMENT pSegment); //Unmaps and closes a spill log segment, its file is deleted
+DWORD WINAPI RingThreadProc(LPVOID pvParam); //Ring Thread procedure declaration
+int DispatchRing(PTPRING pRing, MYPROC1 Enqueue); //Queues the submissions published in the ring as Work Items, returns the number queued
+PVOID RingWorkProc(PVOID pvParam); //Work Item callback running the callback of a ring submission in place in its slot
+VOID CompleteRingSlot(PTPRING pRing, DWORD iSlot, DWORD dwResult, DWORD dwError); //Publishes the result of a ring submission and wakes the submitting process if it sleeps
+PVOID SpillWorkProc(PVOID pvParam); //Work Item callback of a spillable Work Item, refills the low pri queue from the spill log and runs the client callback
+VOID ProfileWorkItem(PTP pTP, PWORKITEM pWork); //Calls the client callback of a Work Item and records it in the profile table of the calling thread
+VOID ResolveCallbackSymbol(PVOID pCallback, char* pszSymbol); //Formats the module!function+offset of a callback address with DbgHelp, called under gSRWLock_Symbols
+VOID RecordWorkItem(PTP pTP, PWORKITEM pWork, LONGLONG llSubmit, LONGLONG llStart, LONGLONG llEnd); //Appends a record of an executed Work Item to the recording buffer
+WORD GetRecordCallbackId(PTP pTP, PVOID pCallback); //Returns the callback id of a callback in the recording, adding it to the callback table, called under RecordLock
+BOOL WriteRecordBuffer(PTP pTP, PTPRECORD pRecords, int iRecords); //Writes a buffer of records to the recording file, called under RecordWriteLock
+BOOL StopRecording(PTP pTP); //Writes the callback table and the final header and closes the recording file, called under RecordLock
+PPROFILETABLE ClaimProfileTable(PTP pTP); //Returns the profile table of the calling thread, reusing a released table or allocating one
+VOID StartPoolThread(PTP pTP); //Runs the thread start hook on a new Worker or Long Running Thread
+VOID ExitPoolThread(PTP pTP); //Runs the thread exit hook and releases the per thread state of an exiting Worker or Long Running Thread
+BOOL ReadRunningSlot(PRUNNINGSLOT pSlot, ULONGLONG ullNow, PTPRUNNINGWORK pRunning, PLONG plSequence); //Copies the running Work Item of a slot with a seqlock read
+VOID RunWatchdog(PTP pTP); //Reports the callbacks running over the watchdog budget and compensates for their Worker Threads
+VOID ReleaseProfileTable(PTP pTP); //Releases the profile table of the calling thread when it exits, so that another thread can reuse it
+int CompareProfileCallback(const void* pvLeft, const void* pvRight); //qsort comparison by callback address
+int CompareProfileTotal(const void* pvLeft, const void* pvRight); //qsort comparison by descending total run time
+VOID PublishCompletionStatus(PWORKITEM pWork, DWORD iStatus); //Stores the completion status of a Work Item as the last access to it, after pushing it onto its completion queue
+VOID PushCompletedWorkItem(PCOMPLETIONQUEUE pCompletionQueue, PWORKITEM pWork); //Pushes a complete or cancelled Work Item onto its completion queue without taking a lock
+DWORD PopCompletedWorkItems(PCOMPLETIONQUEUE pCompletionQueue, PWORKITEM* ppWork, DWORD dwMax); //Returns upto dwMax Work Items of a completion queue, oldest first, called under the completion queue lock
\ No newline at end of file
@@ -0,0 +1,391 @@
+/*
+ThreadPoolReplay.C - Replays a workload recorded by SetTPRecording against different Thread Pool configurations, for capacity planning
+Usage: ThreadPoolReplay <recording> [rate scale] [configuration ...]
+The rate scale multiplies the recorded arrival rate (1 by default, 0 submits every Work Item at once)
+A configuration is a comma separated list of maxthreads=N, maxpending=N, reserve=PRI:N, cap=PRI:N and prewarm=N, the recorded configuration is always replayed first
+Replayed callbacks spin for the recorded wall clock run time, callbacks which blocked in the recording burn CPU in the replay, so I/O bound workloads replay pessimistically
+Compiled using "cl ThreadPoolReplay.c /O2 /Zi"
+*/
+
+#include"ThreadPoolReplay.h"
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		printf("Usage: ThreadPoolReplay <recording> [rate scale] [maxthreads=N,maxpending=N,reserve=PRI:N,cap=PRI:N,prewarm=N ...]\n");
+		return 1;
+	}
+	double dRateScale = (argc > 2) ? atof(argv[2]) : 1.0;
+	REPLAYCONFIG Configs[REPLAY_MAXCONFIGS];
+	int iConfigs = 0;
+	ParseConfig("recorded", &Configs[iConfigs++]);
+	for (int i = 3; i < argc; i++)
+	{
+		if ((iConfigs == REPLAY_MAXCONFIGS) || !ParseConfig(argv[i], &Configs[iConfigs]))
+		{
+			printf("Invalid or too many pool configurations at %s\n", argv[i]);
+			return 1;
+		}
+		iConfigs++;
+	}
+	if (dRateScale < 0)
+	{
+		printf("Invalid rate scale %s\n", argv[2]);
+		return 1;
+	}
+
+	//Loading ThreadPoolLib.dll explicitly and getting the relevant function pointers
+	HMODULE hThreadPoolLib = LoadLibraryExW(L"ThreadPoolLib.dll", NULL, 0);
+	if (hThreadPoolLib == NULL)
+	{
+		printf("Unable to load ThreadPoolLib.dll:%d", GetLastError());
+		return 1;
+	}
+	_CreateTP = (MYPROC)GetProcAddress(hThreadPoolLib, "CreateTP");
+	_InitWorkItem = (MYPROC1)GetProcAddress(hThreadPoolLib, "InitWorkItem");
+	_TryInsertWork = (MYPROC2)GetProcAddress(hThreadPoolLib, "TryInsertWork");
+	_DeleteTPEx = (MYPROC3)GetProcAddress(hThreadPoolLib, "DeleteTPEx");
+	_SetTPLimits = (MYPROC4)GetProcAddress(hThreadPoolLib, "SetTPLimits");
+	_SetTPReservedThreads = (MYPROC5)GetProcAddress(hThreadPoolLib, "SetTPReservedThreads");
+	_SetTPPriorityCap = (MYPROC5)GetProcAddress(hThreadPoolLib, "SetTPPriorityCap");
+	_TPPrewarm = (MYPROC6)GetProcAddress(hThreadPoolLib, "TPPrewarm");
+	if (!(_CreateTP && _InitWorkItem && _TryInsertWork && _DeleteTPEx && _SetTPLimits && _SetTPReservedThreads && _SetTPPriorityCap && _TPPrewarm))
+	{
+		printf("Unable to GetProcAddress:%d", GetLastError());
+		FreeLibrary(hThreadPoolLib);
+		return 1;
+	}
+
+	TPRECORDHEADER Header;
+	PTPRECORD pRecords = NULL;
+	PTPRECORDCALLBACK pCallbacks = NULL;
+	if (!LoadRecording(argv[1], &Header, &pRecords, &pCallbacks))
+	{
+		FreeLibrary(hThreadPoolLib);
+		return 1;
+	}
+	PrintRecording(&Header, pRecords, pCallbacks);
+
+	LARGE_INTEGER liFrequency;
+	QueryPerformanceFrequency(&liFrequency);
+	g_llQpcFrequency = liFrequency.QuadPart;
+	g_hReplayDoneEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+	PREPLAYITEM pItems = (PREPLAYITEM)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, (SIZE_T)Header.ullRecords * sizeof(REPLAYITEM));
+	if ((g_hReplayDoneEvent == NULL) || (pItems == NULL))
+	{
+		printf("Unable to allocate %llu replayed Work Items:%d\n", Header.ullRecords, GetLastError());
+		FreeLibrary(hThreadPoolLib);
+		return 1;
+	}
+
+	//Every configuration gets a fresh Thread Pool, so that threads created by an earlier replay do not count
+	int iResult = 0;
+	printf("\nReplaying at %.2fx the recorded arrival rate\n", dRateScale);
+	printf("%-40s %12s %9s %9s %9s %9s %11s %10s\n", "configuration", "items/s", "p50 ms", "p99 ms", "p99.9 ms", "max ms", "wait p99 ms", "queue full");
+	for (int i = 0; i < iConfigs; i++)
+	{
+		REPLAYRESULT Result = { 0 };
+		if (!ReplayWorkload(&Header, pRecords, dRateScale, &Configs[i], pItems, &Result))
+		{
+			printf("%-40s replay failed\n", Configs[i].pszName);
+			iResult = 1;
+			continue;
+		}
+		printf("%-40s %12.0f %9.3f %9.3f %9.3f %9.3f %11.3f %10d\n", Configs[i].pszName, Result.dThroughput, Result.dLatency[0], Result.dLatency[1], Result.dLatency[2], Result.dLatency[3],
+			Result.dWaitP99, Result.iQueueFull);
+	}
+	HeapFree(GetProcessHeap(), 0, pItems);
+	HeapFree(GetProcessHeap(), 0, pRecords);
+	HeapFree(GetProcessHeap(), 0, pCallbacks);
+	CloseHandle(g_hReplayDoneEvent);
+	FreeLibrary(hThreadPoolLib);
+	return iResult;
+}
+
+/*
+Reads a recording file into memory and sorts its records by submission time, they are written in completion order
+Returns FALSE if the file is not a complete recording of this version
+*/
+BOOL LoadRecording(const char* pszFile, PTPRECORDHEADER pHeader, PTPRECORD* ppRecords, PTPRECORDCALLBACK* ppCallbacks)
+{
+	HANDLE hFile = CreateFileA(pszFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		printf("Unable to open recording %s:%d\n", pszFile, GetLastError());
+		return FALSE;
+	}
+	BOOL bResult = FALSE;
+	DWORD cbRead = 0;
+	LARGE_INTEGER liSize = { 0 };
+	*ppRecords = NULL;
+	*ppCallbacks = NULL;
+	if (!(ReadFile(hFile, pHeader, sizeof(TPRECORDHEADER), &cbRead, NULL) && (cbRead == sizeof(TPRECORDHEADER)) && GetFileSizeEx(hFile, &liSize)))
+	{
+		printf("Unable to read recording header:%d\n", GetLastError());
+		goto LOADRECORDINGCLEANUP;
+	}
+	if ((pHeader->dwMagic != TPRECORD_MAGIC) || (pHeader->dwVersion != TPRECORD_VERSION) || (pHeader->cbHeader != sizeof(TPRECORDHEADER)) || (pHeader->cbRecord != sizeof(TPRECORD)))
+	{
+		printf("Recording version %u is not supported, expected version %u\n", pHeader->dwVersion, TPRECORD_VERSION);
+		goto LOADRECORDINGCLEANUP;
+	}
+	ULONGLONG cbRecords = pHeader->ullRecords * sizeof(TPRECORD);
+	ULONGLONG cbCallbacks = (ULONGLONG)pHeader->dwCallbacks * sizeof(TPRECORDCALLBACK);
+	if ((pHeader->ullRecords == 0) || (cbRecords > MAXDWORD) || ((ULONGLONG)liSize.QuadPart != sizeof(TPRECORDHEADER) + cbRecords + cbCallbacks))
+	{
+		printf("Recording is empty or was not stopped cleanly\n");
+		goto LOADRECORDINGCLEANUP;
+	}
+	*ppRecords = (PTPRECORD)HeapAlloc(GetProcessHeap(), 0, (SIZE_T)cbRecords);
+	*ppCallbacks = (PTPRECORDCALLBACK)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, (SIZE_T)cbCallbacks + sizeof(TPRECORDCALLBACK));
+	if (!(*ppRecords && *ppCallbacks))
+	{
+		printf("Unable to allocate %llu records\n", pHeader->ullRecords);
+		goto LOADRECORDINGCLEANUP;
+	}
+	if (!(ReadFile(hFile, *ppRecords, (DWORD)cbRecords, &cbRead, NULL) && (cbRead == cbRecords)
+		&& ((cbCallbacks == 0) || (ReadFile(hFile, *ppCallbacks, (DWORD)cbCallbacks, &cbRead, NULL) && (cbRead == cbCallbacks)))))
+	{
+		printf("Unable to read recording:%d\n", GetLastError());
+		goto LOADRECORDINGCLEANUP;
+	}
+	qsort(*ppRecords, (size_t)pHeader->ullRecords, sizeof(TPRECORD), CompareSubmit);
+	bResult = TRUE;
+
+LOADRECORDINGCLEANUP:
+	CloseHandle(hFile);
+	if (!bResult)
+	{
+		if (*ppRecords)
+			HeapFree(GetProcessHeap(), 0, *ppRecords);
+		if (*ppCallbacks)
+			HeapFree(GetProcessHeap(), 0, *ppCallbacks);
+	}
+	return bResult;
+}
+
+//Prints the recorded arrival rate and the REPLAY_TOPCALLBACKS callbacks which took the most run time
+VOID PrintRecording(PTPRECORDHEADER pHeader, PTPRECORD pRecords, PTPRECORDCALLBACK pCallbacks)
+{
+	double dSeconds = (double)pHeader->ullDurationMicroseconds / 1000000.0;
+	printf("Recorded %llu Work Items over %.1f s (%.0f items/s), %u callbacks\n", pHeader->ullRecords, dSeconds, (dSeconds > 0) ? (pHeader->ullRecords / dSeconds) : 0.0, pHeader->dwCallbacks);
+	printf("Recorded Thread Pool: %u ideal Worker Threads, maxthreads=%u, maxpending=%u\n", pHeader->dwIdealThreads, pHeader->dwMaxThreads, pHeader->dwMaxPending);
+
+	//Per callback totals, the last entry collects TPRECORD_OTHERCALLBACK
+	DWORD dwEntries = pHeader->dwCallbacks + 1;
+	ULONGLONG* pTotals = (ULONGLONG*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, dwEntries * 3 * sizeof(ULONGLONG));
+	if (pTotals == NULL)
+		return;
+	for (ULONGLONG i = 0; i < pHeader->ullRecords; i++)
+	{
+		DWORD iEntry = (pRecords[i].wCallbackId < pHeader->dwCallbacks) ? pRecords[i].wCallbackId : pHeader->dwCallbacks;
+		pTotals[iEntry * 3] += pRecords[i].dwRunMicroseconds; //Total run time first, CompareRunTime sorts on it
+		pTotals[iEntry * 3 + 1]++;
+		pTotals[iEntry * 3 + 2] = iEntry;
+	}
+	qsort(pTotals, dwEntries, 3 * sizeof(ULONGLONG), CompareRunTime);
+	printf("%-60s %10s %12s %12s\n", "callback", "items", "avg run us", "total run ms");
+	for (DWORD i = 0; (i < dwEntries) && (i < REPLAY_TOPCALLBACKS) && pTotals[i * 3 + 1]; i++)
+	{
+		DWORD iEntry = (DWORD)pTotals[i * 3 + 2];
+		const char* pszSymbol = (iEntry == pHeader->dwCallbacks) ? "(other callbacks)" : pCallbacks[iEntry].szSymbol;
+		char szAddress[32];
+		if (pszSymbol[0] == '\0')
+		{
+			sprintf_s(szAddress, sizeof(szAddress), "0x%llx", pCallbacks[iEntry].ullAddress);
+			pszSymbol = szAddress;
+		}
+		printf("%-60s %10llu %12.1f %12.1f\n", pszSymbol, pTotals[i * 3 + 1], (double)pTotals[i * 3] / pTotals[i * 3 + 1], pTotals[i * 3] / 1000.0);
+	}
+	HeapFree(GetProcessHeap(), 0, pTotals);
+}
+
+//Parses maxthreads=N,maxpending=N,reserve=PRI:N,cap=PRI:N,prewarm=N, "recorded" keeps every recorded setting
+BOOL ParseConfig(const char* pszConfig, PREPLAYCONFIG pConfig)
+{
+	ZeroMemory(pConfig, sizeof(REPLAYCONFIG));
+	pConfig->pszName = pszConfig;
+	pConfig->iMaxThreads = -1;
+	pConfig->iMaxPending = -1;
+	if (!strcmp(pszConfig, "recorded"))
+		return TRUE;
+	char szOptions[REPLAY_MAXCONFIGLEN];
+	if (strcpy_s(szOptions, sizeof(szOptions), pszConfig) != 0)
+		return FALSE;
+	char* pszContext = NULL;
+	for (char* pszOption = strtok_s(szOptions, ",", &pszContext); pszOption; pszOption = strtok_s(NULL, ",", &pszContext))
+	{
+		char* pszValue = strchr(pszOption, '=');
+		if (pszValue == NULL)
+			return FALSE;
+		*pszValue++ = '\0';
+		char* pszEnd = NULL;
+		int iValue = (int)strtol(pszValue, &pszEnd, 10);
+		int iThreads = -1; //Second value of the PRI:N options
+		if (*pszEnd == ':')
+			iThreads = (int)strtol(pszEnd + 1, &pszEnd, 10);
+		if ((pszEnd == pszValue) || (*pszEnd != '\0') || (iValue < 0))
+			return FALSE;
+		if (!strcmp(pszOption, "maxthreads") && (iThreads < 0))
+			pConfig->iMaxThreads = iValue;
+		else if (!strcmp(pszOption, "maxpending") && (iThreads < 0))
+			pConfig->iMaxPending = iValue;
+		else if (!strcmp(pszOption, "prewarm") && (iThreads < 0))
+			pConfig->iPrewarm = iValue;
+		else if (!strcmp(pszOption, "reserve") && (iThreads >= 0) && (iValue < WORKITEM_NUMPRIORITIES))
+		{
+			pConfig->iReservePri = iValue;
+			pConfig->iReserveThreads = iThreads;
+		}
+		else if (!strcmp(pszOption, "cap") && (iThreads >= 0) && (iValue < WORKITEM_NUMPRIORITIES))
+		{
+			pConfig->iCapPri = iValue;
+			pConfig->iCapThreads = iThreads;
+		}
+		else
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+Creates a Thread Pool with the configuration and submits a spinning Work Item per record at its recorded arrival time divided by the rate scale
+A Work Item the queue refuses is retried until it is taken, the time it waited for the queue counts in its latency like the time it waited in the queue
+Reports the throughput, the latency percentiles from arrival to completion and the p99 wait from arrival to start
+*/
+BOOL ReplayWorkload(PTPRECORDHEADER pHeader, PTPRECORD pRecords, double dRateScale, PREPLAYCONFIG pConfig, PREPLAYITEM pItems, PREPLAYRESULT pResult)
+{
+	ULONGLONG ullItems = pHeader->ullRecords;
+	LONGLONG* pllLatency = (LONGLONG*)HeapAlloc(GetProcessHeap(), 0, (SIZE_T)ullItems * sizeof(LONGLONG));
+	PTP pTP = _CreateTP();
+	if (!(pllLatency && pTP))
+	{
+		printf("Unable to create Thread Pool:%d\n", GetLastError());
+		if (pllLatency)
+			HeapFree(GetProcessHeap(), 0, pllLatency);
+		return FALSE;
+	}
+	BOOL bResult = _SetTPLimits(pTP, (pConfig->iMaxThreads >= 0) ? pConfig->iMaxThreads : (int)pHeader->dwMaxThreads, (pConfig->iMaxPending >= 0) ? pConfig->iMaxPending : (int)pHeader->dwMaxPending)
+		&& ((pConfig->iReserveThreads == 0) || _SetTPReservedThreads(pTP, pConfig->iReservePri, pConfig->iReserveThreads))
+		&& ((pConfig->iCapThreads == 0) || _SetTPPriorityCap(pTP, pConfig->iCapPri, pConfig->iCapThreads))
+		&& ((pConfig->iPrewarm == 0) || _TPPrewarm(pTP, pConfig->iPrewarm));
+	if (!bResult)
+	{
+		printf("Unable to apply configuration %s:%d\n", pConfig->pszName, GetLastError());
+		_DeleteTPEx(pTP, TPDELETE_DRAIN, INFINITE);
+		HeapFree(GetProcessHeap(), 0, pllLatency);
+		return FALSE;
+	}
+
+	g_iOutstanding = (LONG)ullItems;
+	LONGLONG llSleepTicks = (REPLAY_SLEEPMICROSECONDS * g_llQpcFrequency) / 1000000;
+	LARGE_INTEGER liBase, liNow;
+	QueryPerformanceCounter(&liBase);
+	for (ULONGLONG i = 0; i < ullItems; i++)
+	{
+		PREPLAYITEM pItem = &(pItems[i]);
+		LONGLONG llOffset = (LONGLONG)(pRecords[i].ullSubmitMicroseconds * g_llQpcFrequency / 1000000);
+		pItem->llArrival = liBase.QuadPart + ((dRateScale > 0) ? (LONGLONG)(llOffset / dRateScale) : 0);
+		pItem->llRunTicks = ((LONGLONG)pRecords[i].dwRunMicroseconds * g_llQpcFrequency) / 1000000;
+		//Wait for the arrival time, sleeping while it is far away
+		QueryPerformanceCounter(&liNow);
+		while (liNow.QuadPart < pItem->llArrival)
+		{
+			if ((pItem->llArrival - liNow.QuadPart) > llSleepTicks)
+				Sleep(1);
+			else
+				YieldProcessor();
+			QueryPerformanceCounter(&liNow);
+		}
+		DWORD iPri = pRecords[i].bPriority | ((pRecords[i].bFlags & TPRECORD_LONGRUNNING) ? WORKITEM_LONGRUNNING : 0);
+		if (!_InitWorkItem((PWORKITEM)&(pItem->Storage), pTP, ReplayWork, pItem, iPri))
+		{
+			printf("Unable to init replayed Work Item:%d\n", GetLastError());
+			bResult = FALSE;
+			break;
+		}
+		if (!_TryInsertWork(pTP, (PWORKITEM)&(pItem->Storage)))
+		{
+			pResult->iQueueFull++;
+			while (!_TryInsertWork(pTP, (PWORKITEM)&(pItem->Storage)))
+			{
+				SwitchToThread();
+			}
+		}
+	}
+	if (bResult)
+	{
+		WaitForSingleObject(g_hReplayDoneEvent, INFINITE);
+	}
+	_DeleteTPEx(pTP, TPDELETE_DRAIN, INFINITE);
+	if (!bResult)
+	{
+		HeapFree(GetProcessHeap(), 0, pllLatency);
+		return FALSE;
+	}
+
+	LONGLONG llLastEnd = 0;
+	for (ULONGLONG i = 0; i < ullItems; i++)
+	{
+		pllLatency[i] = pItems[i].llEnd - pItems[i].llArrival;
+		llLastEnd = max(llLastEnd, pItems[i].llEnd);
+	}
+	pResult->dThroughput = (double)ullItems * g_llQpcFrequency / (double)max(llLastEnd - pItems[0].llArrival, 1);
+	qsort(pllLatency, (size_t)ullItems, sizeof(LONGLONG), CompareLongLong);
+	pResult->dLatency[0] = Percentile(pllLatency, ullItems, 500);
+	pResult->dLatency[1] = Percentile(pllLatency, ullItems, 990);
+	pResult->dLatency[2] = Percentile(pllLatency, ullItems, 999);
+	pResult->dLatency[3] = Percentile(pllLatency, ullItems, 1000);
+	for (ULONGLONG i = 0; i < ullItems; i++)
+		pllLatency[i] = pItems[i].llStart - pItems[i].llArrival;
+	qsort(pllLatency, (size_t)ullItems, sizeof(LONGLONG), CompareLongLong);
+	pResult->dWaitP99 = Percentile(pllLatency, ullItems, 990);
+	HeapFree(GetProcessHeap(), 0, pllLatency);
+	return TRUE;
+}
+
+//Spins on the Worker Thread for the recorded run time of the Work Item and timestamps it
+PVOID ReplayWork(PVOID pvParam)
+{
+	PREPLAYITEM pItem = (PREPLAYITEM)pvParam;
+	LARGE_INTEGER liNow;
+	QueryPerformanceCounter(&liNow);
+	pItem->llStart = liNow.QuadPart;
+	while ((liNow.QuadPart - pItem->llStart) < pItem->llRunTicks)
+	{
+		YieldProcessor();
+		QueryPerformanceCounter(&liNow);
+	}
+	pItem->llEnd = liNow.QuadPart;
+	if (InterlockedDecrement(&g_iOutstanding) == 0)
+		SetEvent(g_hReplayDoneEvent);
+	return NULL;
+}
+
+double Percentile(LONGLONG* pllSorted, ULONGLONG ullCount, DWORD dwPermille)
+{
+	ULONGLONG ullRank = min((ullCount * dwPermille) / 1000, ullCount - 1);
+	return (double)pllSorted[ullRank] * 1000.0 / (double)g_llQpcFrequency;
+}
+
+int CompareSubmit(const void* pvLeft, const void* pvRight)
+{
+	ULONGLONG ullLeft = ((PTPRECORD)pvLeft)->ullSubmitMicroseconds;
+	ULONGLONG ullRight = ((PTPRECORD)pvRight)->ullSubmitMicroseconds;
+	return (ullLeft > ullRight) - (ullLeft < ullRight);
+}
+
+int CompareRunTime(const void* pvLeft, const void* pvRight)
+{
+	ULONGLONG ullLeft = *(const ULONGLONG*)pvLeft;
+	ULONGLONG ullRight = *(const ULONGLONG*)pvRight;
+	return (ullLeft < ullRight) - (ullLeft > ullRight);
+}
+
+int CompareLongLong(const void* pvLeft, const void* pvRight)
+{
+	LONGLONG llLeft = *(const LONGLONG*)pvLeft;
+	LONGLONG llRight = *(const LONGLONG*)pvRight;
+	return (llLeft > llRight) - (llLeft < llRight);
+}
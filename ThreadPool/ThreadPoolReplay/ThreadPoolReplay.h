@@ -0,0 +1,79 @@
+#pragma once
+#include<Windows.h>
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include"..\ThreadPoolLib\ThreadPoolLib.h"
+
+#define REPLAY_MAXCONFIGS 16 //max number of pool configurations replayed in one run, the recorded one included
+#define REPLAY_MAXCONFIGLEN 256 //max number of characters of a pool configuration on the command line
+#define REPLAY_SLEEPMICROSECONDS 2000 //the submitting thread sleeps while the next arrival is further away than this, and spins closer to it
+#define REPLAY_TOPCALLBACKS 10 //number of callbacks of the recording printed, by descending total run time
+
+//Pool configuration a recording is replayed under, parsed from maxthreads=N,maxpending=N,reserve=PRI:N,cap=PRI:N,prewarm=N
+struct _REPLAYCONFIG {
+	const char* pszName; //configuration as written on the command line
+	int iMaxThreads; //SetTPLimits max number of additional Worker Threads (-1 for the recorded one)
+	int iMaxPending; //SetTPLimits max number of pending Work Items per priority (-1 for the recorded one)
+	DWORD iReservePri; //SetTPReservedThreads priority
+	int iReserveThreads; //SetTPReservedThreads number of Worker Threads (0 for none)
+	DWORD iCapPri; //SetTPPriorityCap priority
+	int iCapThreads; //SetTPPriorityCap number of Worker Threads (0 for none)
+	int iPrewarm; //TPPrewarm number of Worker Threads (0 for none)
+};
+typedef struct _REPLAYCONFIG REPLAYCONFIG;
+typedef struct _REPLAYCONFIG* PREPLAYCONFIG;
+
+//Replayed Work Item, one per record of the recording
+struct _REPLAYITEM {
+	WORKITEM_STORAGE Storage; //Work Item of the record, prepared with InitWorkItem for every replay
+	LONGLONG llArrival; //QueryPerformanceCounter value the Work Item is due to be submitted at
+	LONGLONG llRunTicks; //recorded run time of the callback in QueryPerformanceCounter ticks
+	LONGLONG llStart; //QueryPerformanceCounter value its callback started
+	LONGLONG llEnd; //QueryPerformanceCounter value its callback returned
+};
+typedef struct _REPLAYITEM REPLAYITEM;
+typedef struct _REPLAYITEM* PREPLAYITEM;
+
+//Results of one replay
+struct _REPLAYRESULT {
+	double dThroughput; //Work Items completed per second, from the first arrival to the last completion
+	double dLatency[4]; //p50, p99, p99.9 and max of the time from the arrival of a Work Item to the end of its callback, in milliseconds
+	double dWaitP99; //p99 of the time from the arrival of a Work Item to the start of its callback, in milliseconds
+	int iQueueFull; //number of Work Items TryInsertWork refused at least once, they are retried until the queue takes them
+};
+typedef struct _REPLAYRESULT REPLAYRESULT;
+typedef struct _REPLAYRESULT* PREPLAYRESULT;
+
+//Function declarations
+BOOL LoadRecording(const char*, PTPRECORDHEADER, PTPRECORD*, PTPRECORDCALLBACK*); //Reads and validates a recording file written by SetTPRecording
+VOID PrintRecording(PTPRECORDHEADER, PTPRECORD, PTPRECORDCALLBACK); //Prints the recorded rate and the callbacks which took the most run time
+BOOL ParseConfig(const char*, PREPLAYCONFIG); //Parses a pool configuration from the command line
+BOOL ReplayWorkload(PTPRECORDHEADER, PTPRECORD, double, PREPLAYCONFIG, PREPLAYITEM, PREPLAYRESULT); //Re-drives a fresh Thread Pool with the recorded Work Items
+PVOID ReplayWork(PVOID); //Work Item callback of a replayed Work Item, spins for the recorded run time
+double Percentile(LONGLONG*, ULONGLONG, DWORD); //Returns a percentile (in tenths of a percent) of sorted QueryPerformanceCounter intervals in milliseconds
+int CompareSubmit(const void*, const void*); //qsort comparison of records by submission time
+int CompareRunTime(const void*, const void*); //qsort comparison of callback totals by descending run time
+int CompareLongLong(const void*, const void*); //qsort comparison of QueryPerformanceCounter intervals
+
+//Typedefs for importing functions from ThreadPoolLib.dll
+typedef PTP(*MYPROC)();
+typedef BOOL(*MYPROC1)(PWORKITEM, PTP, CALLBACK_INSTANCE, PVOID, DWORD);
+typedef BOOL(*MYPROC2)(PTP, PWORKITEM);
+typedef BOOL(*MYPROC3)(PTP, DWORD, DWORD);
+typedef BOOL(*MYPROC4)(PTP, int, int);
+typedef BOOL(*MYPROC5)(PTP, DWORD, int);
+typedef BOOL(*MYPROC6)(PTP, int);
+
+MYPROC _CreateTP;
+MYPROC1 _InitWorkItem;
+MYPROC2 _TryInsertWork;
+MYPROC3 _DeleteTPEx;
+MYPROC4 _SetTPLimits;
+MYPROC5 _SetTPReservedThreads;
+MYPROC5 _SetTPPriorityCap;
+MYPROC6 _TPPrewarm;
+
+LONGLONG g_llQpcFrequency; //QueryPerformanceCounter ticks per second
+volatile LONG g_iOutstanding; //Number of replayed Work Items whose callback has not returned
+HANDLE g_hReplayDoneEvent; //Set by the callback of the last outstanding replayed Work Item
@@ -0,0 +1,309 @@
+/*
+ThreadPoolStats.C - Reads the stats segment published by PublishTPStats in another process and reports it in the Prometheus text format
+Usage: ThreadPoolStats <pid> <name> [port [address]], prints the metrics once per publish interval, or serves them over HTTP on the port
+The metrics are served on the loopback address unless another address (0.0.0.0 for every interface) is passed
+Compiled using "cl ThreadPoolStats.c /O2 /Zi"
+*/
+
+#include"ThreadPoolStats.h"
+#pragma comment(lib, "Ws2_32.lib")
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3)
+	{
+		printf("Usage: ThreadPoolStats <pid> <name> [port [address]]\n");
+		return 1;
+	}
+	DWORD dwProcessId = strtoul(argv[1], NULL, 10);
+	WCHAR szName[TPSTATS_SEGMENT_MAXNAME] = { 0 };
+	WCHAR szMapping[MAX_PATH];
+	if (MultiByteToWideChar(CP_ACP, 0, argv[2], -1, szName, TPSTATS_SEGMENT_MAXNAME) == 0)
+	{
+		printf("Invalid Thread Pool name:%d\n", GetLastError());
+		return 1;
+	}
+	swprintf_s(szMapping, MAX_PATH, TPSTATS_SEGMENT_NAMEFORMAT, dwProcessId, szName);
+
+	//The segment is mapped read only, reading it costs the Thread Pool nothing
+	HANDLE hMapping = OpenFileMappingW(FILE_MAP_READ, FALSE, szMapping);
+	if (hMapping == NULL)
+	{
+		printf("Unable to open stats segment %ls:%d\n", szMapping, GetLastError());
+		return 1;
+	}
+	STATSVIEW View = { 0 };
+	View.pSegment = (PTPSTATSSEGMENT)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, sizeof(TPSTATSSEGMENT));
+	if (View.pSegment == NULL)
+	{
+		printf("Unable to map stats segment:%d\n", GetLastError());
+		CloseHandle(hMapping);
+		return 1;
+	}
+	if ((View.pSegment->dwMagic != TPSTATS_SEGMENT_MAGIC) || (View.pSegment->dwVersion != TPSTATS_SEGMENT_VERSION) || (View.pSegment->cbSize < sizeof(TPSTATSSEGMENT)))
+	{
+		printf("Stats segment version %u is not supported, expected version %u\n", View.pSegment->dwVersion, TPSTATS_SEGMENT_VERSION);
+		UnmapViewOfFile(View.pSegment);
+		CloseHandle(hMapping);
+		return 1;
+	}
+	char szPool[TPSTATS_SEGMENT_MAXNAME * 2] = { 0 };
+	WideCharToMultiByte(CP_UTF8, 0, szName, -1, szPool, sizeof(szPool), NULL, NULL);
+	sprintf_s(View.szLabels, sizeof(View.szLabels), "pid=\"%lu\",pool=\"%s\"", dwProcessId, szPool);
+
+	BOOL bResult;
+	if (argc > 3)
+	{
+		bResult = ServeMetrics(&View, (USHORT)atoi(argv[3]), (argc > 4) ? argv[4] : STATS_DEFAULTADDRESS);
+	}
+	else
+	{
+		//Printing stops once the Thread Pool process exits, a handle to it is only used to wait
+		HANDLE hProcess = OpenProcess(SYNCHRONIZE, FALSE, dwProcessId);
+		bResult = PrintMetrics(&View, hProcess);
+		if (hProcess)
+			CloseHandle(hProcess);
+	}
+	UnmapViewOfFile(View.pSegment);
+	CloseHandle(hMapping);
+	return bResult ? 0 : 1;
+}
+
+/*
+Copies the stats segment while its sequence is even and unchanged, the Control Thread of the Thread Pool never waits for readers
+A torn read is retried right away STATS_READSPINS times, then every STATS_READBACKOFF ms so that a preempted Control Thread can finish the update
+Returns FALSE if no consistent copy could be taken (the writer died half way through an update)
+*/
+BOOL ReadSegment(PTPSTATSSEGMENT pSegment, PTPSTATSSEGMENT pSnapshot)
+{
+	for (int i = 0; i < STATS_READSPINS + STATS_READRETRIES; i++)
+	{
+		if (i >= STATS_READSPINS)
+			Sleep(STATS_READBACKOFF);
+		LONG lBefore = pSegment->lSequence;
+		if (lBefore & 1) //Update in progress
+		{
+			YieldProcessor();
+			continue;
+		}
+		MemoryBarrier();
+		CopyMemory(pSnapshot, pSegment, sizeof(TPSTATSSEGMENT));
+		MemoryBarrier();
+		if (pSegment->lSequence == lBefore)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+//Keeps the latest update and the one before it, reading the same update twice leaves the rates as they are
+//Returns FALSE if no consistent copy could be read, the callers skip the sample and try again
+BOOL TakeSample(PSTATSVIEW pView)
+{
+	TPSTATSSEGMENT Next;
+	if (!ReadSegment(pView->pSegment, &Next))
+	{
+		printf("Unable to read a consistent stats segment, sample skipped\n");
+		return FALSE;
+	}
+	if (Next.ullUpdates != pView->Cur.ullUpdates)
+	{
+		pView->Prev = pView->Cur;
+		pView->Cur = Next;
+		pView->bHavePrev = (pView->Prev.ullUpdates != 0);
+	}
+	return TRUE;
+}
+
+int AppendText(char* pszBuffer, int cbBuffer, int iLen, const char* pszFormat, ...)
+{
+	va_list Args;
+	va_start(Args, pszFormat);
+	int iWritten = _vsnprintf_s(pszBuffer + iLen, cbBuffer - iLen, _TRUNCATE, pszFormat, Args);
+	va_end(Args);
+	return (iWritten < 0) ? (cbBuffer - 1) : (iLen + iWritten); //Truncated text stays null terminated
+}
+
+int AppendHeader(char* pszBuffer, int cbBuffer, int iLen, const char* pszMetric, const char* pszType, const char* pszHelp)
+{
+	return AppendText(pszBuffer, cbBuffer, iLen, "# HELP %s %s\n# TYPE %s %s\n", pszMetric, pszHelp, pszMetric, pszType);
+}
+
+double PerSecond(LONG64 iPrev, LONG64 iCur, PSTATSVIEW pView)
+{
+	double dSeconds = (double)(pView->Cur.ullTimestamp - pView->Prev.ullTimestamp) / 1000.0;
+	return (dSeconds > 0.0) ? ((double)(iCur - iPrev) / dSeconds) : 0.0;
+}
+
+/*
+Formats the latest sample, the per priority series are only reported for priorities which had Work Items
+The per second rates are computed from the last two updates of the segment, using the timestamps written by the Thread Pool
+*/
+int FormatMetrics(PSTATSVIEW pView, char* pszBuffer, int cbBuffer)
+{
+	PTPSTATS pCur = &(pView->Cur.Stats);
+	PTPSTATS pPrev = &(pView->Prev.Stats);
+	const char* pszLabels = pView->szLabels;
+	int iLen = 0;
+	pszBuffer[0] = '\0';
+
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_threads", "gauge", "Number of Worker Threads by state");
+	iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_threads{%s,state=\"running\"} %d\n", pszLabels, pCur->iCurrentRunningThreads);
+	iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_threads{%s,state=\"waiting\"} %d\n", pszLabels, pCur->iCurrentWaitingThreads);
+	iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_threads{%s,state=\"blocked\"} %d\n", pszLabels, pCur->iCurrentBlockedThreads);
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_workitems_added_total", "counter", "Number of Work Items added");
+	for (int i = 0; i < WORKITEM_NUMPRIORITIES; i++)
+	{
+		if (pCur->iNumWorkItemsAdded[i])
+			iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_workitems_added_total{%s,priority=\"%d\"} %d\n", pszLabels, i, pCur->iNumWorkItemsAdded[i]);
+	}
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_workitems_handled_total", "counter", "Number of Work Items handled");
+	for (int i = 0; i < WORKITEM_NUMPRIORITIES; i++)
+	{
+		if (pCur->iNumWorkItemsAdded[i])
+			iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_workitems_handled_total{%s,priority=\"%d\"} %d\n", pszLabels, i, pCur->iNumWorkItemsHandled[i]);
+	}
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_workitems_pending", "gauge", "Number of Work Items waiting in the Pri queues");
+	for (int i = 0; i < WORKITEM_NUMPRIORITIES; i++)
+	{
+		if (pCur->iNumWorkItemsAdded[i])
+			iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_workitems_pending{%s,priority=\"%d\"} %d\n", pszLabels, i, pCur->iNumWorkItemsPending[i]);
+	}
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_queue_wait_p99_microseconds", "gauge", "99th percentile of the queue wait, upper bound of a power of 2 bucket");
+	for (int i = 0; i < WORKITEM_NUMPRIORITIES; i++)
+	{
+		if (pCur->iNumWorkItemsAdded[i])
+			iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_queue_wait_p99_microseconds{%s,priority=\"%d\"} %lu\n", pszLabels, i, pCur->dwQueueWaitP99[i]);
+	}
+	if (pView->bHavePrev)
+	{
+		iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_workitems_added_per_second", "gauge", "Work Items added per second between the last two updates");
+		for (int i = 0; i < WORKITEM_NUMPRIORITIES; i++)
+		{
+			if (pCur->iNumWorkItemsAdded[i])
+				iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_workitems_added_per_second{%s,priority=\"%d\"} %.2f\n", pszLabels, i, PerSecond(pPrev->iNumWorkItemsAdded[i], pCur->iNumWorkItemsAdded[i], pView));
+		}
+		iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_workitems_handled_per_second", "gauge", "Work Items handled per second between the last two updates");
+		for (int i = 0; i < WORKITEM_NUMPRIORITIES; i++)
+		{
+			if (pCur->iNumWorkItemsAdded[i])
+				iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_workitems_handled_per_second{%s,priority=\"%d\"} %.2f\n", pszLabels, i, PerSecond(pPrev->iNumWorkItemsHandled[i], pCur->iNumWorkItemsHandled[i], pView));
+		}
+		iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_longrunning_handled_per_second", "gauge", "Long running Work Items handled per second between the last two updates");
+		iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_longrunning_handled_per_second{%s} %.2f\n", pszLabels, PerSecond(pPrev->iNumLongRunningHandled, pCur->iNumLongRunningHandled, pView));
+	}
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_workitems_allocated", "gauge", "Number of Work Items allocated from the heap by the Thread Pool");
+	iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_workitems_allocated{%s} %d\n", pszLabels, pCur->iNumWorkItemsAllocated);
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_workitems_coalesced_total", "counter", "Number of Work Items merged into a pending Work Item with the same coalescing key");
+	iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_workitems_coalesced_total{%s} %d\n", pszLabels, pCur->iNumWorkItemsCoalesced);
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_workitems_spilled_total", "counter", "Number of spillable Work Items written to the spill log");
+	iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_workitems_spilled_total{%s} %d\n", pszLabels, pCur->iNumWorkItemsSpilled);
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_workitems_refilled_total", "counter", "Number of spillable Work Items read back from the spill log");
+	iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_workitems_refilled_total{%s} %d\n", pszLabels, pCur->iNumWorkItemsRefilled);
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_spill_backlog", "gauge", "Number of spillable Work Items in the spill log waiting to be read back");
+	iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_spill_backlog{%s} %d\n", pszLabels, pCur->iNumSpillBacklog);
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_io_pending", "gauge", "Number of async I/O requests whose callback has not completed");
+	iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_io_pending{%s} %d\n", pszLabels, pCur->iNumIoPending);
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_io_threads", "gauge", "Number of I/O Completion and blocking I/O threads");
+	iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_io_threads{%s} %d\n", pszLabels, pCur->iNumIoThreads);
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_longrunning_threads", "gauge", "Number of Long Running Threads");
+	iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_longrunning_threads{%s} %d\n", pszLabels, pCur->iNumLongRunningThreads);
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_longrunning_active", "gauge", "Number of long running Work Items running");
+	iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_longrunning_active{%s} %d\n", pszLabels, pCur->iNumLongRunningActive);
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_longrunning_pending", "gauge", "Number of long running Work Items waiting for a Long Running Thread");
+	iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_longrunning_pending{%s} %d\n", pszLabels, pCur->iNumLongRunningPending);
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_longrunning_handled_total", "counter", "Number of long running Work Items handled");
+	iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_longrunning_handled_total{%s} %d\n", pszLabels, pCur->iNumLongRunningHandled);
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_longrunning_run_seconds_total", "counter", "Total run time of the handled long running Work Items");
+	iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_longrunning_run_seconds_total{%s} %.3f\n", pszLabels, pCur->llLongRunningTotalMs / 1000.0);
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_longrunning_max_run_seconds", "gauge", "Longest run time of a handled long running Work Item");
+	iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_longrunning_max_run_seconds{%s} %.3f\n", pszLabels, pCur->llLongRunningMaxMs / 1000.0);
+	iLen = AppendHeader(pszBuffer, cbBuffer, iLen, "threadpool_stats_age_seconds", "gauge", "Time since the Thread Pool last updated the stats segment");
+	iLen = AppendText(pszBuffer, cbBuffer, iLen, "threadpool_stats_age_seconds{%s} %.3f\n", pszLabels, (GetTickCount64() - pView->Cur.ullTimestamp) / 1000.0);
+	return iLen;
+}
+
+//Prints the metrics once per publish interval, stops when the Thread Pool process exits (or runs until killed if it could not be opened)
+//A sample which could not be read is skipped, the next interval tries again
+BOOL PrintMetrics(PSTATSVIEW pView, HANDLE hProcess)
+{
+	char* pszBuffer = (char*)HeapAlloc(GetProcessHeap(), 0, STATS_BUFFERSIZE);
+	if (pszBuffer == NULL)
+	{
+		printf("Unable to allocate metrics buffer\n");
+		return FALSE;
+	}
+	while (TRUE)
+	{
+		if (TakeSample(pView))
+		{
+			FormatMetrics(pView, pszBuffer, STATS_BUFFERSIZE);
+			printf("%s\n", pszBuffer);
+		}
+		DWORD dwInterval = pView->pSegment->dwPublishInterval;
+		if (hProcess == NULL)
+		{
+			Sleep(dwInterval);
+		}
+		else if (WaitForSingleObject(hProcess, dwInterval) != WAIT_TIMEOUT)
+		{
+			printf("Thread Pool process exited\n");
+			break;
+		}
+	}
+	HeapFree(GetProcessHeap(), 0, pszBuffer);
+	return TRUE;
+}
+
+//Serves the metrics over HTTP on the address and port, any request is answered with a fresh sample (for example GET /metrics)
+//A sample which could not be read is answered with 503, the next request tries again
+BOOL ServeMetrics(PSTATSVIEW pView, USHORT usPort, const char* pszAddress)
+{
+	WSADATA WsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &WsaData) != 0)
+	{
+		printf("Unable to start Winsock\n");
+		return FALSE;
+	}
+	char* pszBuffer = (char*)HeapAlloc(GetProcessHeap(), 0, STATS_BUFFERSIZE);
+	SOCKET sListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	struct sockaddr_in Addr = { 0 };
+	Addr.sin_family = AF_INET;
+	Addr.sin_port = htons(usPort);
+	if ((pszBuffer == NULL) || (sListen == INVALID_SOCKET) || (InetPtonA(AF_INET, pszAddress, &(Addr.sin_addr)) != 1)
+		|| (bind(sListen, (struct sockaddr*)&Addr, sizeof(Addr)) != 0) || (listen(sListen, SOMAXCONN) != 0))
+	{
+		printf("Unable to listen on %s port %u:%d\n", pszAddress, usPort, WSAGetLastError());
+		if (sListen != INVALID_SOCKET)
+			closesocket(sListen);
+		if (pszBuffer)
+			HeapFree(GetProcessHeap(), 0, pszBuffer);
+		WSACleanup();
+		return FALSE;
+	}
+	printf("Serving Prometheus metrics on %s port %u\n", pszAddress, usPort);
+	BOOL bResult = TRUE;
+	while (TRUE)
+	{
+		SOCKET s = accept(sListen, NULL, NULL);
+		if (s == INVALID_SOCKET)
+		{
+			printf("Unable to accept:%d\n", WSAGetLastError());
+			bResult = FALSE;
+			break;
+		}
+		char szRequest[STATS_REQUESTSIZE];
+		recv(s, szRequest, sizeof(szRequest), 0);
+		BOOL bSample = TakeSample(pView);
+		int iBody = bSample ? FormatMetrics(pView, pszBuffer, STATS_BUFFERSIZE) : 0;
+		char szHeader[128];
+		int iHeader = sprintf_s(szHeader, sizeof(szHeader), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", bSample ? "200 OK" : "503 Service Unavailable", iBody);
+		send(s, szHeader, iHeader, 0);
+		send(s, pszBuffer, iBody, 0);
+		shutdown(s, SD_SEND);
+		closesocket(s);
+	}
+	closesocket(sListen);
+	HeapFree(GetProcessHeap(), 0, pszBuffer);
+	WSACleanup();
+	return bResult;
+}
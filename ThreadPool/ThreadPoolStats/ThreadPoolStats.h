@@ -0,0 +1,36 @@
+#pragma once
+#include<WinSock2.h>
+#include<WS2tcpip.h>
+#include<Windows.h>
+#include<stdio.h>
+#include<stdarg.h>
+#include<stdlib.h>
+#include"..\ThreadPoolLib\ThreadPoolLib.h"
+
+#define STATS_BUFFERSIZE 65536 //size in bytes of the buffer the Prometheus text is formatted into
+#define STATS_READSPINS 1000 //number of times a torn read of the stats segment is retried right away, the Control Thread is mostly done by then
+#define STATS_READRETRIES 100 //number of times a torn read is retried after the spins, STATS_READBACKOFF ms apart, before the sample is skipped
+#define STATS_READBACKOFF 10 //milliseconds slept between the retries, the Control Thread may have been preempted half way through an update
+#define STATS_DEFAULTADDRESS "127.0.0.1" //address the metrics are served on unless another one is passed, the pool internals are not exposed to the network by default
+#define STATS_REQUESTSIZE 1024 //size in bytes of the buffer an HTTP request is received into, the request itself is ignored
+
+//Stats segment snapshots the per second rates are computed from
+struct _STATSVIEW {
+	PTPSTATSSEGMENT pSegment; //Mapped stats segment of the Thread Pool
+	char szLabels[2 * TPSTATS_SEGMENT_MAXNAME + 32]; //pid and pool labels added to every sample
+	TPSTATSSEGMENT Prev; //Previous update of the segment
+	TPSTATSSEGMENT Cur; //Latest update of the segment
+	BOOL bHavePrev; //Set once two different updates were read, the rates are only reported then
+};
+typedef struct _STATSVIEW STATSVIEW;
+typedef struct _STATSVIEW* PSTATSVIEW;
+
+//Function declarations
+BOOL ReadSegment(PTPSTATSSEGMENT, PTPSTATSSEGMENT); //Copies a consistent snapshot of the stats segment
+BOOL TakeSample(PSTATSVIEW); //Reads the stats segment and keeps the last two different updates
+int FormatMetrics(PSTATSVIEW, char*, int); //Formats the latest sample in the Prometheus text format, returns its length
+int AppendText(char*, int, int, const char*, ...); //Appends formatted text to the buffer, returns the new length
+int AppendHeader(char*, int, int, const char*, const char*, const char*); //Appends the HELP and TYPE lines of a metric
+double PerSecond(LONG64, LONG64, PSTATSVIEW); //Rate of a counter between the two samples
+BOOL PrintMetrics(PSTATSVIEW, HANDLE); //Prints the metrics once per publish interval until the process exits
+BOOL ServeMetrics(PSTATSVIEW, USHORT, const char*); //Serves the metrics over HTTP on the address and port, every request gets a fresh sample